@@ -0,0 +1,309 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "affine.h"
+#include "crop.h"
+#include "pixelformat.h"
+#include "rotate.h"
+
+// Allowance for rounding in composed steps, so exact halvings take two
+// samples along an axis rather than three.
+const double stepTolerance = 1e-9;
+
+/* A resample shared out in bands of rows */
+typedef struct AffineJob {
+    const AffinePlan* plan;
+    ResampleKernel kernel;
+    PixelBuffer source;
+    PixelBuffer output;
+} AffineJob;
+
+/* compose()
+ * ---------
+ * Private helper function that follows a map by the map of the operation
+ *      after it, so points of the operation's output map straight to the
+ *      source.
+ */
+static void compose(AffineMap* map, AffineMap next)
+{
+    AffineMap composed = {
+            map->xx * next.xx + map->xy * next.yx,
+            map->xx * next.xy + map->xy * next.yy,
+            map->xx * next.x0 + map->xy * next.y0 + map->x0,
+            map->yx * next.xx + map->yy * next.yx,
+            map->yx * next.xy + map->yy * next.yy,
+            map->yx * next.x0 + map->yy * next.y0 + map->y0};
+    *map = composed;
+}
+
+/* rotation_map()
+ * --------------
+ * Private helper function that maps the canvas of an anticlockwise
+ *      rotation back to the canvas rotated, growing width and height to
+ *      the rotated canvas as FreeImage_Rotate() does.
+ *
+ * returns: the map, and whether the rotation resamples.
+ */
+static AffineMap rotation_map(int angle, int* width, int* height,
+        bool* resamples)
+{
+    double sine, cosine;
+    angle_sine_cosine(angle, &sine, &cosine);
+    *resamples = sine != 0 && cosine != 0; // Right angles are exact.
+    double oldWidth = *width;
+    double oldHeight = *height;
+    int newWidth = floor(
+            oldWidth * fabs(cosine) + oldHeight * fabs(sine) + 0.5);
+    int newHeight = floor(
+            oldWidth * fabs(sine) + oldHeight * fabs(cosine) + 0.5);
+    *width = newWidth > 0 ? newWidth : 1;
+    *height = newHeight > 0 ? newHeight : 1;
+
+    // Undo the rotation about the new centre, landing on the old one.
+    double centreX = *width / 2.0;
+    double centreY = *height / 2.0;
+    double shiftX = oldWidth / 2.0 - cosine * centreX - sine * centreY;
+    double shiftY = oldHeight / 2.0 + sine * centreX - cosine * centreY;
+    AffineMap map = {cosine, sine, shiftX, -sine, cosine, shiftY};
+    return map;
+}
+
+bool plan_affine(CommandBuffer cmdBuffer, int start, int width, int height,
+        AffinePlan* plan)
+{
+    AffineMap identity = {1, 0, 0, 0, 1, 0};
+    plan->map = identity;
+    plan->numOps = 0;
+    int resamples = 0;
+    int i = start;
+    while (i < cmdBuffer.numCmds) {
+        int* cmd = &(cmdBuffer.buffer[i]);
+        if (cmd[0] == CMD_ROTATE) {
+            bool resampled;
+            compose(&(plan->map),
+                    rotation_map(cmd[1], &width, &height, &resampled));
+            resamples += resampled;
+            i += 2;
+        } else if (cmd[0] == CMD_FLIP) {
+            bool horizontal = cmd[1] == FLIP_HORIZONTAL;
+            AffineMap flip = {horizontal ? -1 : 1, 0, horizontal ? width : 0,
+                    0, horizontal ? 1 : -1, horizontal ? 0 : height};
+            compose(&(plan->map), flip);
+            i += 2;
+        } else if (cmd[0] == CMD_SCALE) {
+            AffineMap scale = {(double)width / cmd[1], 0, 0,
+                    0, (double)height / cmd[2], 0};
+            compose(&(plan->map), scale);
+            width = cmd[1];
+            height = cmd[2];
+            resamples++;
+            i += 3;
+        } else if (cmd[0] == CMD_CROP && plan->numOps) {
+            // Only the pixels kept are resampled, and the run ends there.
+            CropRect rect;
+            if (!clip_crop(cmd, width, height, &rect)) {
+                break;
+            }
+            AffineMap crop = {1, 0, rect.left,
+                    0, 1, height - rect.top - rect.height};
+            compose(&(plan->map), crop);
+            width = rect.width;
+            height = rect.height;
+            i += 5;
+            plan->numOps++;
+            break;
+        } else {
+            break;
+        }
+        plan->numOps++;
+    }
+    plan->width = width;
+    plan->height = height;
+    plan->length = i - start;
+
+    // Source pixels crossed per output pixel along each output axis.
+    double stepX = hypot(plan->map.xx, plan->map.yx);
+    double stepY = hypot(plan->map.xy, plan->map.yy);
+    plan->bicubic = stepX < 1.0 && stepY < 1.0;
+    plan->samplesX = stepX > 1.0 ? (int)ceil(stepX - stepTolerance) : 1;
+    plan->samplesY = stepY > 1.0 ? (int)ceil(stepY - stepTolerance) : 1;
+    return resamples && plan->numOps > 1;
+}
+
+/* clamp()
+ * -------
+ * Private helper function that limits a pixel index to [0, size).
+ */
+static inline int clamp(int index, int size)
+{
+    return index < 0 ? 0 : (index >= size ? size - 1 : index);
+}
+
+/* add_bilinear()
+ * --------------
+ * Private helper function that adds the source's colour at a point,
+ *      blended from the four nearest pixels, to sum.
+ */
+static inline void add_bilinear(const PixelBuffer* source, double x,
+        double y, float* sum, const int channels)
+{
+    x -= 0.5; // To pixel centres.
+    y -= 0.5;
+    int left = floor(x);
+    int bottom = floor(y);
+    float fractionX = x - left;
+    float fractionY = y - bottom;
+    const BYTE* lower = source->bits
+            + (long)clamp(bottom, source->height) * source->pitch;
+    const BYTE* upper = source->bits
+            + (long)clamp(bottom + 1, source->height) * source->pitch;
+    int x0 = clamp(left, source->width) * channels;
+    int x1 = clamp(left + 1, source->width) * channels;
+    for (int c = 0; c < channels; c++) {
+        float below = lower[x0 + c]
+                + fractionX * (lower[x1 + c] - lower[x0 + c]);
+        float above = upper[x0 + c]
+                + fractionX * (upper[x1 + c] - upper[x0 + c]);
+        sum[c] += below + fractionY * (above - below);
+    }
+}
+
+/* cubic_weights()
+ * ---------------
+ * Private helper function that fills the Catmull-Rom weights of the four
+ *      pixels around a point a fraction t past the second.
+ */
+static inline void cubic_weights(float t, float* weights)
+{
+    weights[0] = ((-0.5f * t + 1.0f) * t - 0.5f) * t;
+    weights[1] = (1.5f * t - 2.5f) * t * t + 1.0f;
+    weights[2] = ((-1.5f * t + 2.0f) * t + 0.5f) * t;
+    weights[3] = (0.5f * t - 0.5f) * t * t;
+}
+
+/* add_bicubic()
+ * -------------
+ * Private helper function that adds the source's colour at a point,
+ *      interpolated from the sixteen nearest pixels, to sum.
+ */
+static inline void add_bicubic(const PixelBuffer* source, double x,
+        double y, float* sum, const int channels)
+{
+    x -= 0.5;
+    y -= 0.5;
+    int left = floor(x);
+    int bottom = floor(y);
+    float weightsX[4], weightsY[4];
+    cubic_weights(x - left, weightsX);
+    cubic_weights(y - bottom, weightsY);
+    int columns[4];
+    for (int k = 0; k < 4; k++) {
+        columns[k] = clamp(left - 1 + k, source->width) * channels;
+    }
+    for (int j = 0; j < 4; j++) {
+        const BYTE* row = source->bits
+                + (long)clamp(bottom - 1 + j, source->height) * source->pitch;
+        for (int c = 0; c < channels; c++) {
+            float across = 0;
+            for (int k = 0; k < 4; k++) {
+                across += weightsX[k] * row[columns[k] + c];
+            }
+            sum[c] += weightsY[j] * across;
+        }
+    }
+}
+
+/* resample_rows()
+ * ---------------
+ * Private helper function that fills a band of output rows, averaging a
+ *      grid of samples per pixel spaced about a source pixel apart, so
+ *      shrinking takes in every source pixel as FreeImage's filters do.
+ *      Samples falling outside the source are black, as FreeImage leaves
+ *      the corners of rotations. Inlined once per layout so the channel
+ *      loops are unrolled.
+ */
+static inline void resample_rows(const AffinePlan* plan,
+        const PixelBuffer* source, const PixelBuffer* output, int firstRow,
+        int endRow, const int channels)
+{
+    const AffineMap* map = &(plan->map);
+    int samplesX = plan->samplesX;
+    int samplesY = plan->samplesY;
+    float share = 1.0f / (samplesX * samplesY);
+    for (int y = firstRow; y < endRow; y++) {
+        BYTE* out = output->bits + (long)y * output->pitch;
+        for (int x = 0; x < output->width; x++) {
+            float sum[4] = {0};
+            for (int v = 0; v < samplesY; v++) {
+                double pointY = y + (v + 0.5) / samplesY;
+                for (int u = 0; u < samplesX; u++) {
+                    double pointX = x + (u + 0.5) / samplesX;
+                    double sourceX
+                            = map->xx * pointX + map->xy * pointY + map->x0;
+                    double sourceY
+                            = map->yx * pointX + map->yy * pointY + map->y0;
+                    if (sourceX < 0 || sourceX > source->width
+                            || sourceY < 0 || sourceY > source->height) {
+                        continue;
+                    }
+                    if (plan->bicubic) {
+                        add_bicubic(source, sourceX, sourceY, sum, channels);
+                    } else {
+                        add_bilinear(source, sourceX, sourceY, sum, channels);
+                    }
+                }
+            }
+            for (int c = 0; c < channels; c++) {
+                float value = sum[c] * share + 0.5f;
+                out[x * channels + c]
+                        = value < 0 ? 0 : (value > 255 ? 255 : value);
+            }
+        }
+    }
+}
+
+// One resampling kernel per layout.
+#define RESAMPLE_KERNEL(layout, channels) \
+    static void resample_##layout(const AffinePlan* plan, \
+            const PixelBuffer* source, const PixelBuffer* output, \
+            int firstRow, int endRow) \
+    { \
+        resample_rows(plan, source, output, firstRow, endRow, channels); \
+    }
+FOR_EACH_LAYOUT(RESAMPLE_KERNEL)
+
+#define RESAMPLE_ENTRY(layout, channels) resample_##layout,
+const ResampleKernel resampleKernels[NUM_LAYOUTS]
+        = {FOR_EACH_LAYOUT(RESAMPLE_ENTRY)};
+
+/* resample_band()
+ * ---------------
+ * Private helper function that resamples one band of an AffineJob's rows.
+ */
+static void resample_band(void* job, int firstRow, int endRow)
+{
+    AffineJob* affine = (AffineJob*)job;
+    affine->kernel(affine->plan, &(affine->source), &(affine->output),
+            firstRow, endRow);
+}
+
+FIBITMAP* apply_affine(FIBITMAP* source, const AffinePlan* plan,
+        const PixelKernels* kernels)
+{
+    if (!kernels || layout_of(source) != kernels->layout) {
+        return NULL;
+    }
+    FIBITMAP* output
+            = allocate_layout(kernels->layout, plan->width, plan->height);
+    if (!output) {
+        return NULL;
+    }
+    AffineJob job = {plan, kernels->resample, pixel_buffer(source),
+            pixel_buffer(output)};
+    run_in_bands(plan->height, resample_band, &job);
+    return output;
+}
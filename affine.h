@@ -0,0 +1,74 @@
+#ifndef AFFINE_H
+#define AFFINE_H
+
+#include <stdbool.h>
+
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "pixelformat.h"
+
+/* Fuses a run of rotations, flips and scales into one affine transform, so
+ * a chain like /rotate,37/scale,800,600 is resampled once, straight from
+ * the decoded image, rather than through an intermediate bitmap per
+ * operation. The geometry of each operation matches FreeImage's: rotations
+ * turn anticlockwise about the centre onto a canvas grown to fit, leaving
+ * the uncovered corners black, and scales stretch the whole canvas. A crop
+ * ends a run, so only the pixels it keeps are resampled. */
+
+/* Maps a point of the output back to the point of the source it shows.
+ * Coordinates are in pixels from the first pixel's outer corner, with y
+ * counting scanlines in the order FreeImage stores them. */
+typedef struct AffineMap {
+    double xx, xy, x0; // Source x is xx * x + xy * y + x0.
+    double yx, yy, y0; // Source y is yx * x + yy * y + y0.
+} AffineMap;
+
+/* A run of operations to be done as one resample */
+typedef struct AffinePlan {
+    AffineMap map;
+    int width; // Of the output.
+    int height;
+    int numOps; // Operations fused.
+    int length; // Command buffer entries they take up.
+    bool bicubic; // Enlarging, where the sharper filter is worth its cost.
+    int samplesX; // Per output pixel along each axis, averaged when
+    int samplesY; // shrinking.
+} AffinePlan;
+
+/* plan_affine()
+ * -------------
+ * Composes the run of operations starting at a command into one transform,
+ *      if doing so is worthwhile: the run must resample at least once and
+ *      hold more than one operation.
+ *
+ * cmdBuffer: the parsed operations.
+ * start: the index of the run's first command.
+ * width: the width of the bitmap the run starts from.
+ * height: its height.
+ * plan: populated with the fused transform.
+ *
+ * returns: true if the run should be fused as planned.
+ */
+bool plan_affine(CommandBuffer cmdBuffer, int start, int width, int height,
+        AffinePlan* plan);
+
+/* apply_affine()
+ * --------------
+ * Resamples a bitmap through a plan in a single pass, the rows of the
+ *      output shared between up to one thread per CPU.
+ *
+ * source: the bitmap the run starts from, which is left untouched.
+ * plan: the fused transform.
+ * kernels: the request's kernels, or NULL if its image is not canonical.
+ *
+ * returns: the new bitmap, or NULL if the source is not in the kernels'
+ *      layout, in which case the operations must be applied one by one.
+ */
+FIBITMAP* apply_affine(FIBITMAP* source, const AffinePlan* plan,
+        const PixelKernels* kernels);
+
+// The resampling kernels, indexed by PixelLayout.
+extern const ResampleKernel resampleKernels[];
+
+#endif // AFFINE_H
@@ -7,9 +7,12 @@
 #include "argparsing.h"
 #include "ioutils.h"
 
+#include <csse2310a4.h>
+
 // Possible command line options which share a similar format.
-const char* const cmdOptions[] = {"--input", "--out", "--rotate", "--flip"};
-const int optionsCount = 4;
+const char* const cmdOptions[] = {"--input", "--out", "--rotate", "--flip",
+        "--batch", "--connections", "--depth", "--renditions", "--pack"};
+const int optionsCount = 9;
 
 // Sentinal value for an error response in an integer function.
 const int intSentinal = -1000000;
@@ -23,6 +26,14 @@ const char* const invalidOutputFormat
         = "uqimageclient: unable to open file \"%s\" for writing\n";
 const int invalidOutputCode = 15;
 
+// Server connection timeout options, their defaults in milliseconds and the
+// largest accepted value (one day).
+const char* const timeoutOptions[] = {"--header-timeout", "--body-timeout",
+        "--idle-timeout", "--write-timeout"};
+const int timeoutDefaults[] = {10000, 30000, 60000, 30000};
+const int timeoutOptionsCount = 4;
+const int timeoutMax = 86400000;
+
 // Inclusive bounds for rotation value.
 const int rotationMin = -359;
 const int rotationMax = 359;
@@ -31,9 +42,55 @@ const int rotationMax = 359;
 const int scalingMin = 1;
 const int scalingMax = 10000;
 
+// Inclusive bound for a crop's position and size, which are at least 1.
+const int cropMax = 1000000;
+
+// Inclusive bounds and defaults for the batch mode connection count and
+// per-connection pipeline depth.
+const int batchConnectionsMax = 64;
+const int batchDepthMax = 64;
+const int batchConnectionsDefault = 4;
+const int batchDepthDefault = 8;
+
+// Most images the client packs into one batch request.
+const int batchPackMax = 1024;
+
 // Maximum value for server --max option.
 const int maxConnectionsMax = 10000;
 
+// Bounds and default for the server --cache-size option, in MiB.
+const int cacheSizeMin = 1;
+const int cacheSizeMax = 1048576;
+const int cacheSizeDefault = 1024;
+
+// Bounds and defaults for the server --store-size option, in MiB, and the
+// --store-ttl option, in seconds.
+const int storeSizeMin = 1;
+const int storeSizeMax = 1048576;
+const int storeSizeDefault = 256;
+const int storeTtlMin = 1;
+const int storeTtlMax = 86400;
+const int storeTtlDefault = 600;
+
+// Bounds and defaults for the server --max-upload and --memory-ceiling
+// options, in MiB, the smallest upload limit being maxImageSize, and the
+// default --scratch-dir.
+const int maxUploadMin = 8;
+const int maxUploadMax = 1048576;
+const int maxUploadDefault = 8;
+const int memoryCeilingMin = 128;
+const int memoryCeilingMax = 1048576;
+const int memoryCeilingDefault = 1024;
+const char* const scratchDirDefault = "/tmp";
+
+// Values of the server --affinity option, indexed by Affinity, and bounds
+// and default for --numa-nodes, 0 reading the nodes from sysfs.
+const char* const affinityNames[] = {"off", "node", "core"};
+const int numAffinities = 3;
+const int numaNodesMin = 0;
+const int numaNodesMax = 256;
+const int numaNodesDefault = 0;
+
 // Standard base for integer conversion to formatted units.
 const int intBase = 10;
 
@@ -44,6 +101,7 @@ const int cmdBufferDefaultSize = 100;
 const int numRotateArgs = 2;
 const int numFlipArgs = 2;
 const int numScalingArgs = 3;
+const int numCropArgs = 5;
 
 /* Private struct that holds string addresses to parsed but
  * unformatted client program inputs */
@@ -56,6 +114,12 @@ typedef struct ClientInputsRaw {
     char* flipAxis;
     char* scaleWidth;
     char* scaleHeight;
+    char* batchPath;
+    char* batchConnections;
+    char* batchDepth;
+    char* renditions;
+    char* batchPack;
+    bool isLocal;
 } ClientInputsRaw;
 
 /* parse_raw_client_inputs()
@@ -74,14 +138,21 @@ ClientInputsRaw parse_raw_client_inputs(int argc, char** argv)
 {
     ClientInputsRaw argsRaw = {0};
     char** argPointers[] = {&argsRaw.inputFilePath, &argsRaw.outputFilePath,
-            &argsRaw.rotationAngle, &argsRaw.flipAxis};
+            &argsRaw.rotationAngle, &argsRaw.flipAxis, &argsRaw.batchPath,
+            &argsRaw.batchConnections, &argsRaw.batchDepth,
+            &argsRaw.renditions, &argsRaw.batchPack};
 
     // Ensure that first argument is a portNumber.
     if (argc < 2 || !strcmp(argv[1], "--") || !strcmp(argv[1], "")) {
         argsRaw.error = true;
         return argsRaw;
     }
-    argsRaw.portNumber = argv[1];
+    // --local stands in for the port and runs without a server.
+    if (!strcmp(argv[1], "--local")) {
+        argsRaw.isLocal = true;
+    } else {
+        argsRaw.portNumber = argv[1];
+    }
 
     for (int i = 2; i < argc; i++) {
         // Attempt to find option within valid options.
@@ -167,6 +238,31 @@ int get_rotation(char* rotationAngle)
     return rotationAngleInt;
 }
 
+/* get_bounded_int()
+ * -----------------
+ * Private helper function that formats a string into an integer within
+ * inclusive bounds.
+ *
+ * value: string holding the integer.
+ * min: smallest permitted value.
+ * max: largest permitted value.
+ *
+ * Returns: the integer if valid and in bounds, otherwise intSentinal.
+ */
+int get_bounded_int(char* value, int min, int max)
+{
+    char* endPtr;
+    int valueInt = strtol(value, &endPtr, intBase);
+    // Reject empty values and trailing garbage.
+    if (endPtr == value || *endPtr != '\0') {
+        return intSentinal;
+    }
+    if (valueInt < min || valueInt > max) {
+        return intSentinal;
+    }
+    return valueInt;
+}
+
 /* Private struct that holds a width and a height */
 typedef struct Extent {
     int width;
@@ -233,6 +329,13 @@ ClientInputs copy_from_raw(ClientInputsRaw argsRaw)
     args.hasRotation = argsRaw.rotationAngle;
     args.hasFlipAxis = argsRaw.flipAxis;
     args.hasScale = argsRaw.scaleWidth;
+    args.isLocal = argsRaw.isLocal;
+    args.batchPath = argsRaw.batchPath;
+    args.hasBatch = argsRaw.batchPath;
+    args.renditions = argsRaw.renditions;
+    args.hasRenditions = argsRaw.renditions;
+    args.batchConnections = batchConnectionsDefault;
+    args.batchDepth = batchDepthDefault;
     return args;
 }
 
@@ -246,6 +349,19 @@ ClientInputs parse_client_inputs(int argc, char** argv)
     }
     args = copy_from_raw(argsRaw);
 
+    // A comma separated list of endpoints shards requests over servers.
+    if (args.portNumber) {
+        args.endpoints
+                = split_by_char(copy_string(args.portNumber), ',', 0);
+        while (args.endpoints[args.numEndpoints]) {
+            if (!strlen(args.endpoints[args.numEndpoints])) {
+                args.error = true;
+                return args;
+            }
+            args.numEndpoints++;
+        }
+    }
+
     // Retrieve flip axis if available.
     if (args.hasFlipAxis) {
         char axis = get_axis(argsRaw.flipAxis);
@@ -277,6 +393,48 @@ ClientInputs parse_client_inputs(int argc, char** argv)
         args.scaleHeight = extent.height;
     }
 
+    // Retrieve batch mode tuning, only meaningful alongside --batch.
+    if (args.hasBatch) {
+        if (args.inputFilePath || args.isLocal) { // Inputs come from batch.
+            args.error = true;
+            return args;
+        }
+        if (argsRaw.batchConnections) {
+            args.batchConnections = get_bounded_int(
+                    argsRaw.batchConnections, 1, batchConnectionsMax);
+        }
+        if (argsRaw.batchDepth) {
+            args.batchDepth
+                    = get_bounded_int(argsRaw.batchDepth, 1, batchDepthMax);
+        }
+        if (argsRaw.batchPack) {
+            args.batchPack
+                    = get_bounded_int(argsRaw.batchPack, 1, batchPackMax);
+        }
+        // Packs go to a single server.
+        if (args.batchConnections == intSentinal
+                || args.batchDepth == intSentinal
+                || args.batchPack == intSentinal
+                || (args.batchPack && args.numEndpoints > 1)) {
+            args.error = true;
+            return args;
+        }
+    } else if (argsRaw.batchConnections || argsRaw.batchDepth
+            || argsRaw.batchPack) {
+        args.error = true;
+        return args;
+    }
+
+    // Renditions carry their own operations and are written into the
+    // --out directory, from a single server.
+    if (args.hasRenditions
+            && (args.hasFlipAxis || args.hasRotation || args.hasScale
+                    || args.hasBatch || args.isLocal || !args.outputFilePath
+                    || args.numEndpoints > 1)) {
+        args.error = true;
+        return args;
+    }
+
     // Check if total number of rotation, flip, scale set is more than 1.
     if ((int)args.hasFlipAxis + (int)args.hasRotation + (int)args.hasScale
             > 1) {
@@ -293,7 +451,15 @@ int check_client_inputs_validity(ClientInputs args)
             return invalidInputCode;
         }
     }
-    if (args.outputFilePath) {
+    if (args.batchPath) {
+        if (!file_is_valid(args.batchPath, "r")) {
+            fprintf(stderr, invalidInputFormat, args.batchPath);
+            return invalidInputCode;
+        }
+    }
+    // In batch and renditions modes the output is a directory, checked when
+    // it is used.
+    if (args.outputFilePath && !args.hasBatch && !args.hasRenditions) {
         if (!file_is_valid(args.outputFilePath, "w")) {
             fprintf(stderr, invalidOutputFormat, args.outputFilePath);
             return invalidOutputCode;
@@ -302,9 +468,43 @@ int check_client_inputs_validity(ClientInputs args)
     return 0;
 }
 
+/* parse_timeout_option()
+ * ----------------------
+ * Private helper function that parses a server timeout option.
+ *
+ * args: the server inputs to set the timeout in.
+ * seen: which timeout options have already been given.
+ * option: the option string.
+ * value: the option's parameter.
+ *
+ * returns: 1 if option is not a timeout option, -1 if its parameter is
+ *      invalid or repeated, otherwise 0.
+ */
+int parse_timeout_option(
+        ServerInputs* args, bool* seen, char* option, char* value)
+{
+    int* timeouts[] = {&args->headerTimeoutMs, &args->bodyTimeoutMs,
+            &args->idleTimeoutMs, &args->writeTimeoutMs};
+    for (int i = 0; i < timeoutOptionsCount; i++) {
+        if (strcmp(option, timeoutOptions[i])) {
+            continue;
+        }
+        *timeouts[i] = get_bounded_int(value, 0, timeoutMax);
+        if (seen[i] || *timeouts[i] == intSentinal) {
+            return -1;
+        }
+        seen[i] = true;
+        return 0;
+    }
+    return 1;
+}
+
 ServerInputs parse_server_inputs(int argc, char** argv)
 {
-    ServerInputs args = {false, -1, NULL};
+    ServerInputs args = {false, -1, NULL, NULL, timeoutDefaults[0],
+            timeoutDefaults[1], timeoutDefaults[2], timeoutDefaults[3], NULL,
+            -1, -1, -1, -1, -1, NULL, -1, -1};
+    bool seenTimeouts[] = {false, false, false, false};
     for (int i = 1; i < argc; i++) {
         if (i + 1 >= argc) { // All arguments must have a parameter.
             args.error = true;
@@ -332,7 +532,122 @@ ServerInputs parse_server_inputs(int argc, char** argv)
             }
             args.port = argv[i + 1];
             i++;
-        } else { // Option unrecognized, must be --max or --port.
+        } else if (!strcmp(argv[i], "--socket")) {
+            // Parsing error if value already set or string is empty.
+            if (args.socketPath || !strlen(argv[i + 1])) {
+                args.error = true;
+                return args;
+            }
+            args.socketPath = argv[i + 1];
+            i++;
+        } else if (!strcmp(argv[i], "--cache-dir")) {
+            // Parsing error if value already set or string is empty.
+            if (args.cacheDir || !strlen(argv[i + 1])) {
+                args.error = true;
+                return args;
+            }
+            args.cacheDir = argv[i + 1];
+            i++;
+        } else if (!strcmp(argv[i], "--cache-size")) {
+            // Parsing error if value already set or out of bounds.
+            if (args.cacheSizeMb != -1) {
+                args.error = true;
+                return args;
+            }
+            args.cacheSizeMb
+                    = get_bounded_int(argv[++i], cacheSizeMin, cacheSizeMax);
+            if (args.cacheSizeMb == intSentinal) {
+                args.error = true;
+                return args;
+            }
+        } else if (!strcmp(argv[i], "--store-size")) {
+            // Parsing error if value already set or out of bounds.
+            if (args.storeSizeMb != -1) {
+                args.error = true;
+                return args;
+            }
+            args.storeSizeMb
+                    = get_bounded_int(argv[++i], storeSizeMin, storeSizeMax);
+            if (args.storeSizeMb == intSentinal) {
+                args.error = true;
+                return args;
+            }
+        } else if (!strcmp(argv[i], "--store-ttl")) {
+            // Parsing error if value already set or out of bounds.
+            if (args.storeTtlSeconds != -1) {
+                args.error = true;
+                return args;
+            }
+            args.storeTtlSeconds
+                    = get_bounded_int(argv[++i], storeTtlMin, storeTtlMax);
+            if (args.storeTtlSeconds == intSentinal) {
+                args.error = true;
+                return args;
+            }
+        } else if (!strcmp(argv[i], "--max-upload")) {
+            // Parsing error if value already set or out of bounds.
+            if (args.maxUploadMb != -1) {
+                args.error = true;
+                return args;
+            }
+            args.maxUploadMb
+                    = get_bounded_int(argv[++i], maxUploadMin, maxUploadMax);
+            if (args.maxUploadMb == intSentinal) {
+                args.error = true;
+                return args;
+            }
+        } else if (!strcmp(argv[i], "--memory-ceiling")) {
+            // Parsing error if value already set or out of bounds.
+            if (args.memoryCeilingMb != -1) {
+                args.error = true;
+                return args;
+            }
+            args.memoryCeilingMb = get_bounded_int(
+                    argv[++i], memoryCeilingMin, memoryCeilingMax);
+            if (args.memoryCeilingMb == intSentinal) {
+                args.error = true;
+                return args;
+            }
+        } else if (!strcmp(argv[i], "--scratch-dir")) {
+            // Parsing error if value already set or string is empty.
+            if (args.scratchDir || !strlen(argv[i + 1])) {
+                args.error = true;
+                return args;
+            }
+            args.scratchDir = argv[i + 1];
+            i++;
+        } else if (!strcmp(argv[i], "--affinity")) {
+            // Parsing error if value already set or not a known placement.
+            if (args.affinity != -1) {
+                args.error = true;
+                return args;
+            }
+            i++;
+            for (int j = 0; j < numAffinities; j++) {
+                if (!strcmp(argv[i], affinityNames[j])) {
+                    args.affinity = j;
+                }
+            }
+            if (args.affinity == -1) {
+                args.error = true;
+                return args;
+            }
+        } else if (!strcmp(argv[i], "--numa-nodes")) {
+            // Parsing error if value already set or out of bounds.
+            if (args.numaNodes != -1) {
+                args.error = true;
+                return args;
+            }
+            args.numaNodes
+                    = get_bounded_int(argv[++i], numaNodesMin, numaNodesMax);
+            if (args.numaNodes == intSentinal) {
+                args.error = true;
+                return args;
+            }
+        } else if (!parse_timeout_option(
+                           &args, seenTimeouts, argv[i], argv[i + 1])) {
+            i++;
+        } else { // Option unrecognized or its timeout invalid.
             args.error = true;
             return args;
         }
@@ -343,7 +658,59 @@ ServerInputs parse_server_inputs(int argc, char** argv)
     if (args.maxConnections > maxConnectionsMax) {
         args.error = true;
     }
+    if (args.cacheSizeMb == -1) {
+        args.cacheSizeMb = cacheSizeDefault;
+    }
+    if (args.storeSizeMb == -1) {
+        args.storeSizeMb = storeSizeDefault;
+    }
+    if (args.storeTtlSeconds == -1) {
+        args.storeTtlSeconds = storeTtlDefault;
+    }
+    if (args.maxUploadMb == -1) {
+        args.maxUploadMb = maxUploadDefault;
+    }
+    if (args.memoryCeilingMb == -1) {
+        args.memoryCeilingMb = memoryCeilingDefault;
+    }
+    if (!args.scratchDir) {
+        args.scratchDir = (char*)scratchDirDefault;
+    }
+    if (args.affinity == -1) {
+        args.affinity = AFFINITY_OFF;
+    }
+    if (args.numaNodes == -1) {
+        args.numaNodes = numaNodesDefault;
+    }
+
+    return args;
+}
+
+BalancerInputs parse_balancer_inputs(int argc, char** argv)
+{
+    BalancerInputs args = {false, NULL, NULL, 0};
+    int i = 1;
+    if (i < argc && !strcmp(argv[i], "--port")) {
+        // Parsing error if the port is missing or empty.
+        if (i + 1 >= argc || !strlen(argv[i + 1])) {
+            args.error = true;
+            return args;
+        }
+        args.port = argv[i + 1];
+        i += 2;
+    }
 
+    // Every remaining argument is a backend, and there must be at least one.
+    args.backends = &argv[i];
+    args.numBackends = argc - i;
+    if (!args.numBackends) {
+        args.error = true;
+    }
+    for (; i < argc; i++) {
+        if (!strlen(argv[i]) || !strncmp(argv[i], "--", 2)) {
+            args.error = true;
+        }
+    }
     return args;
 }
 
@@ -458,6 +825,41 @@ int parse_scaling_cmd(CommandBuffer* cmdBuffer, char** arg, int argSize)
     return 0;
 }
 
+/* parse_crop_cmd()
+ * ------------------
+ * Private helper function that parses a crop option and its four
+ *      parameters, the position and size of the rectangle kept, into a
+ *      command buffer pointed to by cmdBuffer.
+ *
+ * cmdBuffer: pointer to the command buffer to populate.
+ * arg: the list of arg strings to parse.
+ * argSize: length of the arg list.
+ *
+ * returns: 0 if successfull, 1 otherwise.
+ */
+int parse_crop_cmd(CommandBuffer* cmdBuffer, char** arg, int argSize)
+{
+    if (argSize != numCropArgs) {
+        return 1;
+    }
+    cmdBuffer->buffer[cmdBuffer->numCmds] = CMD_CROP;
+    cmdBuffer->numCmds++;
+    for (int i = 1; i < numCropArgs; i++) {
+        char* endPtr;
+        int value = strtol(arg[i], &endPtr, intBase);
+        if (endPtr - arg[i] == 0) {
+            return 1;
+        }
+        // The position may be 0 but the width and height may not.
+        if (value < (i <= 2 ? 0 : 1) || value > cropMax) {
+            return 1;
+        }
+        cmdBuffer->buffer[cmdBuffer->numCmds] = value;
+        cmdBuffer->numCmds++;
+    }
+    return 0;
+}
+
 CommandBuffer create_image_processing_command_buffer(char* address)
 {
     // Split address into list of strings based on delimiter '/'.
@@ -465,8 +867,15 @@ CommandBuffer create_image_processing_command_buffer(char* address)
 
     CommandBuffer cmdBuffer
             = {false, malloc(sizeof(int) * cmdBufferDefaultSize), 0};
+    int capacity = cmdBufferDefaultSize;
     int i = 1;
     while (args[i] != NULL) {
+        // Long chains outgrow the buffer, so leave room for any command.
+        if (cmdBuffer.numCmds + MAX_COMMAND_LENGTH > capacity) {
+            capacity *= 2;
+            cmdBuffer.buffer
+                    = realloc(cmdBuffer.buffer, sizeof(int) * capacity);
+        }
         // Futher split string into list of string arguments based on
         // delimiter ','.
         char** arg = split_by_char(args[i], ',', 0);
@@ -475,29 +884,36 @@ CommandBuffer create_image_processing_command_buffer(char* address)
         while (arg[argSize] != NULL) {
             argSize++;
         }
+        int error = 1;
         if (!strcmp(arg[0], "rotate")) {
-            int error = parse_rotation_cmd(&cmdBuffer, arg, argSize);
-            if (error) {
-                cmdBuffer.parseError = true;
-                return cmdBuffer;
-            }
+            error = parse_rotation_cmd(&cmdBuffer, arg, argSize);
         } else if (!strcmp(arg[0], "flip")) {
-            int error = parse_flip_cmd(&cmdBuffer, arg, argSize);
-            if (error) {
-                cmdBuffer.parseError = true;
-                return cmdBuffer;
-            }
+            error = parse_flip_cmd(&cmdBuffer, arg, argSize);
         } else if (!strcmp(arg[0], "scale")) {
-            int error = parse_scaling_cmd(&cmdBuffer, arg, argSize);
-            if (error) {
-                cmdBuffer.parseError = true;
-                return cmdBuffer;
-            }
-        } else {
+            error = parse_scaling_cmd(&cmdBuffer, arg, argSize);
+        } else if (!strcmp(arg[0], "crop")) {
+            error = parse_crop_cmd(&cmdBuffer, arg, argSize);
+        }
+        // split_by_char() splits in place, so only the arrays are freed.
+        free(arg);
+        if (error) {
             cmdBuffer.parseError = true;
-            return cmdBuffer;
+            break;
         }
         i++;
     }
+    free(args);
     return cmdBuffer;
 }
+
+int command_length(const int* cmd)
+{
+    if (cmd[0] == CMD_SCALE) {
+        return numScalingArgs;
+    }
+    if (cmd[0] == CMD_CROP) {
+        return numCropArgs;
+    }
+    // Rotations and flips each take a single parameter.
+    return numRotateArgs;
+}
@@ -6,7 +6,9 @@
 /* Holds values of parsed and formatted client program inputs */
 typedef struct ClientInputs {
     bool error;
-    char* portNumber;
+    char* portNumber; // Port number, or unix socket path if it has a '/'.
+    char** endpoints; // portNumber split on ',' to shard over servers.
+    int numEndpoints;
     char* inputFilePath;
     char* outputFilePath;
     int rotationAngle;
@@ -16,8 +18,24 @@ typedef struct ClientInputs {
     bool hasRotation;
     bool hasFlipAxis;
     bool hasScale;
+    bool isLocal; // Process in-process with libuqimage, no server.
+    char* batchPath; // Manifest file or input directory for batch mode.
+    int batchConnections;
+    int batchDepth;
+    int batchPack; // Images per packed batch request, 0 to send singly.
+    bool hasBatch;
+    char* renditions; // ';' separated chains, each written to its own file.
+    bool hasRenditions;
 } ClientInputs;
 
+// Reported when an input file or directory cannot be read.
+extern const char* const invalidInputFormat;
+extern const int invalidInputCode;
+
+// Reported when an output file cannot be opened for writing.
+extern const char* const invalidOutputFormat;
+extern const int invalidOutputCode;
+
 /* parse_client_inputs()
  * ---------------------
  * Parses a command line into formatted client input, checking for validity.
@@ -40,12 +58,34 @@ ClientInputs parse_client_inputs(int argc, char** argv);
  */
 int check_client_inputs_validity(ClientInputs args);
 
+/* How the server places its threads on the machine's CPUs */
+typedef enum Affinity {
+    AFFINITY_OFF, // Left to the kernel.
+    AFFINITY_NODE, // Threads kept to a NUMA node's CPUs.
+    AFFINITY_CORE // As for AFFINITY_NODE, pool workers to one CPU each.
+} Affinity;
+
 /* Holds the possible command line inputs to the server application.
  * A positive error value indicates a parsing error. */
 typedef struct ServerInputs {
     bool error;
     int maxConnections;
     char* port;
+    char* socketPath;
+    // Connection timeouts in milliseconds, 0 to disable.
+    int headerTimeoutMs; // From a request's first byte to its blank line.
+    int bodyTimeoutMs; // Longest wait between reads of a request body.
+    int idleTimeoutMs; // Longest wait for the next request on a connection.
+    int writeTimeoutMs; // Longest a response may take to send.
+    char* cacheDir; // Where encoded results are cached, or NULL for none.
+    int cacheSizeMb; // Bound on the cache directory's size.
+    int storeSizeMb; // Bound on the images uploaded to be transformed by ID.
+    int storeTtlSeconds; // How long an uploaded image may go unused.
+    int maxUploadMb; // Largest image accepted, tiled beyond maxImageSize.
+    int memoryCeilingMb; // Bound on memory held by tiled transforms.
+    char* scratchDir; // Where large uploads and tiles are kept.
+    int affinity; // An Affinity, -1 until parsed.
+    int numaNodes; // Nodes to split the CPUs into, 0 to read them from sysfs.
 } ServerInputs;
 
 /* parse_server_inputs()
@@ -60,6 +100,27 @@ typedef struct ServerInputs {
  */
 ServerInputs parse_server_inputs(int argc, char** argv);
 
+/* Holds the possible command line inputs to the load balancer. A positive
+ * error value indicates a parsing error. */
+typedef struct BalancerInputs {
+    bool error;
+    char* port;
+    char** backends; // Port numbers or unix socket paths of the servers.
+    int numBackends;
+} BalancerInputs;
+
+/* parse_balancer_inputs()
+ * -----------------------
+ * Parses load balancer inputs of the form "[--port port] backend ...".
+ *
+ * argc: the number of arguments in argv.
+ * argv: the command line arguments.
+ *
+ * returns: A BalancerInputs struct that holds the parsed inputs. backends
+ *      points into argv.
+ */
+BalancerInputs parse_balancer_inputs(int argc, char** argv);
+
 /* Holds a series of commands for image manipulation */
 typedef struct CommandBuffer {
     bool parseError;
@@ -69,7 +130,10 @@ typedef struct CommandBuffer {
 
 /* Constants that describe values inside the command buffer */
 /* REF: based on ed lesson's lesson on enums */
-enum CommandTypes { CMD_ROTATE, CMD_FLIP, CMD_SCALE };
+enum CommandTypes { CMD_ROTATE, CMD_FLIP, CMD_SCALE, CMD_CROP };
+
+// Most ints a command takes in a command buffer, a crop's five.
+#define MAX_COMMAND_LENGTH 5
 
 /* Constants that map cmd buffer values to real flip parameters */
 /* REF: based on ed lesson's lesson on enums */
@@ -89,4 +153,14 @@ enum FlipTypes { FLIP_HORIZONTAL, FLIP_VERTICAL };
  */
 CommandBuffer create_image_processing_command_buffer(char* address);
 
+/* command_length()
+ * ----------------
+ * Finds how many ints a command takes in a command buffer.
+ *
+ * cmd: the command, pointing at its type.
+ *
+ * returns: the length of the command and its parameters.
+ */
+int command_length(const int* cmd);
+
 #endif // ARGPARSING_H
@@ -0,0 +1,792 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stringutils.h"
+#include "argparsing.h"
+#include "ioutils.h"
+#include "socketutils.h"
+#include "httputils.h"
+#include "batchutils.h"
+#include "uqclient.h"
+#include "packutils.h"
+
+// Error status constants.
+const char* const invalidManifestFormat
+        = "uqimageclient: invalid batch manifest line %i\n";
+const int invalidManifestCode = 2;
+
+const char* const missingOutDirMessage
+        = "uqimageclient: --out directory required for batch directories\n";
+const int missingOutDirCode = 15;
+
+const char* const batchFailedFormat
+        = "uqimageclient: %i of %i batch images failed\n";
+const int batchFailedCode = 9;
+
+const char* const batchJobFailedFormat = "uqimageclient: batch image \"%s\" "
+                                         "failed\n";
+
+// Initial capacity of the job list, doubled as needed.
+const int jobListDefaultSize = 64;
+
+// Longest manifest line accepted.
+#define MANIFEST_LINE_SIZE 4096
+
+// Marks the end of a connection's in-flight queue.
+const int endOfJobs = -1;
+
+// Times a job is retried after the server reports being too busy for it,
+// and how often a writer with nothing to send checks for due retries.
+const int maxBusyRetries = 30;
+const int retryPollUs = 20000;
+
+/* State shared by every connection in a batch. The nextJob lock also
+ * guards the retry queue and the unresolved count. */
+typedef struct BatchState {
+    BatchJobList jobList;
+    Mutex nextJob;
+    Mutex failedJobs;
+    int unresolved; // Claimed jobs neither finished nor queued to retry.
+    int* retryJobs; // Jobs refused as busy, in the order they were.
+    int numRetries;
+    int* busyRetries; // Per job, times it has been queued to retry.
+    struct timespec* retryAt; // Per job, when it may next be sent.
+} BatchState;
+
+/* One keep-alive connection and the ids of the jobs it has sent but not yet
+ * received responses for. The writer and reader threads are the single
+ * producer and consumer of the queue, so the semaphores alone order it. */
+typedef struct BatchConnection {
+    BatchState* state;
+    SocketData socketData;
+    int* inFlight;
+    int capacity;
+    int head;
+    int tail;
+    sem_t freeSlots; // Starts at the pipeline depth.
+    sem_t queuedJobs;
+    Mutex broken;
+} BatchConnection;
+
+/* A run of consecutive jobs sharing operations, sent as one request */
+typedef struct JobPack {
+    int first;
+    int count;
+} JobPack;
+
+/* State shared by every connection sending packs */
+typedef struct PackState {
+    BatchJobList jobList;
+    JobPack* packs;
+    int numPacks;
+    Mutex nextPack;
+    Mutex failedJobs;
+} PackState;
+
+/* One connection sending packs, one at a time */
+typedef struct PackConnection {
+    PackState* state;
+    SocketData socketData;
+} PackConnection;
+
+/* A job submitted to a sharding client, and the image it holds in memory
+ * until its response arrives. */
+typedef struct ShardedJob {
+    BatchJob* job;
+    BinaryData image;
+    int* failedJobs;
+} ShardedJob;
+
+/* add_job()
+ * ---------
+ * Private helper function that appends a job to a job list, taking
+ * ownership of the strings.
+ */
+void add_job(BatchJobList* jobList, int* capacity, char* inputPath,
+        char* outputPath, char* address)
+{
+    if (jobList->numJobs == *capacity) {
+        *capacity *= 2;
+        jobList->jobs = realloc(jobList->jobs, sizeof(BatchJob) * *capacity);
+    }
+    BatchJob job = {inputPath, outputPath, address};
+    jobList->jobs[jobList->numJobs] = job;
+    jobList->numJobs++;
+}
+
+/* load_directory_jobs()
+ * ---------------------
+ * Private helper function that creates one job per regular file in a
+ * directory, all sharing the command line operations.
+ *
+ * returns: 0 if successfull, otherwise the error code.
+ */
+int load_directory_jobs(ClientInputs args, BatchJobList* jobList)
+{
+    if (!args.outputFilePath) {
+        fprintf(stderr, missingOutDirMessage);
+        return missingOutDirCode;
+    }
+    // Checked when the arguments were, but it may have gone since.
+    DIR* directory = opendir(args.batchPath);
+    if (!directory) {
+        fprintf(stderr, invalidInputFormat, args.batchPath);
+        return invalidInputCode;
+    }
+    int capacity = jobListDefaultSize;
+    jobList->jobs = malloc(sizeof(BatchJob) * capacity);
+    jobList->numJobs = 0;
+    char* address = construct_operations_address(args);
+
+    struct dirent* entry;
+    while ((entry = readdir(directory))) {
+        char* inputPath = malloc(strlen(args.batchPath) + strlen(entry->d_name)
+                + 2);
+        sprintf(inputPath, "%s/%s", args.batchPath, entry->d_name);
+        struct stat fileInfo;
+        if (stat(inputPath, &fileInfo) || !S_ISREG(fileInfo.st_mode)) {
+            free(inputPath);
+            continue;
+        }
+        // Output keeps the input name with its extension swapped for .png.
+        char* name = copy_string(entry->d_name);
+        char* extension = strrchr(name, '.');
+        if (extension && extension != name) {
+            *extension = '\0';
+        }
+        char* outputPath
+                = malloc(strlen(args.outputFilePath) + strlen(name) + 6);
+        sprintf(outputPath, "%s/%s.png", args.outputFilePath, name);
+        free(name);
+        add_job(jobList, &capacity, inputPath, outputPath,
+                copy_string(address));
+    }
+    closedir(directory);
+    free(address);
+    return 0;
+}
+
+/* load_manifest_jobs()
+ * --------------------
+ * Private helper function that creates one job per manifest line.
+ *
+ * returns: 0 if successfull, otherwise the error code.
+ */
+int load_manifest_jobs(ClientInputs args, BatchJobList* jobList)
+{
+    FILE* manifest = fopen(args.batchPath, "r");
+    if (!manifest) {
+        fprintf(stderr, invalidInputFormat, args.batchPath);
+        return invalidInputCode;
+    }
+    int capacity = jobListDefaultSize;
+    jobList->jobs = malloc(sizeof(BatchJob) * capacity);
+    jobList->numJobs = 0;
+
+    char line[MANIFEST_LINE_SIZE];
+    int lineNumber = 0;
+    while (fgets(line, MANIFEST_LINE_SIZE, manifest)) {
+        lineNumber++;
+        char* savePtr;
+        char* inputPath = strtok_r(line, " \t\r\n", &savePtr);
+        if (!inputPath || inputPath[0] == '#') { // Blank or comment.
+            continue;
+        }
+        char* outputPath = strtok_r(NULL, " \t\r\n", &savePtr);
+        char* address = strtok_r(NULL, " \t\r\n", &savePtr);
+        if (!outputPath || !address || address[0] != '/'
+                || strtok_r(NULL, " \t\r\n", &savePtr)) {
+            fprintf(stderr, invalidManifestFormat, lineNumber);
+            fclose(manifest);
+            return invalidManifestCode;
+        }
+        add_job(jobList, &capacity, copy_string(inputPath),
+                copy_string(outputPath), copy_string(address));
+    }
+    fclose(manifest);
+    return 0;
+}
+
+int load_batch_jobs(ClientInputs args, BatchJobList* jobList)
+{
+    struct stat pathInfo;
+    if (!stat(args.batchPath, &pathInfo) && S_ISDIR(pathInfo.st_mode)) {
+        return load_directory_jobs(args, jobList);
+    }
+    return load_manifest_jobs(args, jobList);
+}
+
+/* take_due_retry()
+ * ----------------
+ * Private helper function that removes the first job in the retry queue
+ * whose Retry-After has passed. The nextJob lock must be held.
+ *
+ * returns: the job index, or endOfJobs if none are due.
+ */
+int take_due_retry(BatchState* state)
+{
+    for (int i = 0; i < state->numRetries; i++) {
+        if (elapsed_ms(state->retryAt[state->retryJobs[i]]) >= 0) {
+            int job = state->retryJobs[i];
+            memmove(&(state->retryJobs[i]), &(state->retryJobs[i + 1]),
+                    sizeof(int) * (state->numRetries - i - 1));
+            state->numRetries--;
+            return job;
+        }
+    }
+    return endOfJobs;
+}
+
+/* claim_job()
+ * -----------
+ * Private helper function that takes the next job to send: a retry that
+ * has come due, otherwise the next unclaimed job. While jobs are waiting
+ * to retry or may yet be refused, it waits for one rather than ending.
+ *
+ * returns: the job index, or endOfJobs once every job is resolved.
+ */
+int claim_job(BatchState* state)
+{
+    while (1) {
+        sem_wait(&(state->nextJob.lock));
+        int job = take_due_retry(state);
+        if (job == endOfJobs
+                && state->nextJob.value < state->jobList.numJobs) {
+            job = state->nextJob.value++;
+        }
+        bool finished = job == endOfJobs && !state->numRetries
+                && !state->unresolved;
+        if (job != endOfJobs) {
+            state->unresolved++;
+        }
+        sem_post(&(state->nextJob.lock));
+        if (job != endOfJobs || finished) {
+            return job;
+        }
+        usleep(retryPollUs);
+    }
+}
+
+/* resolve_job()
+ * -------------
+ * Private helper function that marks a claimed job finished, whether it
+ * succeeded or failed.
+ */
+void resolve_job(BatchState* state)
+{
+    sem_wait(&(state->nextJob.lock));
+    state->unresolved--;
+    sem_post(&(state->nextJob.lock));
+}
+
+/* retry_job()
+ * -----------
+ * Private helper function that queues a job the server was too busy for,
+ * to be sent again once its Retry-After has passed.
+ *
+ * returns: true if queued, false if the job has used up its retries.
+ */
+bool retry_job(BatchState* state, int job, long retryAfterMs)
+{
+    sem_wait(&(state->nextJob.lock));
+    bool queued = state->busyRetries[job] < maxBusyRetries;
+    if (queued) {
+        state->busyRetries[job]++;
+        state->retryAt[job] = ms_from_now(retryAfterMs);
+        state->retryJobs[state->numRetries++] = job;
+        state->unresolved--;
+    }
+    sem_post(&(state->nextJob.lock));
+    return queued;
+}
+
+/* push_in_flight()
+ * ----------------
+ * Private helper function that records a job id as sent on a connection.
+ */
+void push_in_flight(BatchConnection* connection, int job)
+{
+    connection->inFlight[connection->tail] = job;
+    connection->tail = (connection->tail + 1) % connection->capacity;
+    sem_post(&(connection->queuedJobs));
+}
+
+/* pop_in_flight()
+ * ---------------
+ * Private helper function that blocks until a sent job id is available and
+ * removes it.
+ */
+int pop_in_flight(BatchConnection* connection)
+{
+    sem_wait(&(connection->queuedJobs));
+    int job = connection->inFlight[connection->head];
+    connection->head = (connection->head + 1) % connection->capacity;
+    return job;
+}
+
+/* batch_writer()
+ * --------------
+ * Private thread function that keeps sending requests on one connection
+ * while it has free pipeline slots, until the jobs run out or the
+ * connection breaks.
+ *
+ * data: the BatchConnection to send on.
+ *
+ * returns: NULL upon exit.
+ */
+void* batch_writer(void* data)
+{
+    BatchConnection* connection = (BatchConnection*)data;
+    BatchState* state = connection->state;
+    while (1) {
+        sem_wait(&(connection->freeSlots));
+        if (read_mutex(&(connection->broken))) {
+            break;
+        }
+        int job = claim_job(state);
+        if (job == endOfJobs) {
+            break;
+        }
+        BatchJob* batchJob = &(state->jobList.jobs[job]);
+        FILE* input = fopen(batchJob->inputPath, "r");
+        if (!input) {
+            fprintf(stderr, batchJobFailedFormat, batchJob->inputPath);
+            modify_mutex(&(state->failedJobs), 1);
+            resolve_job(state);
+            sem_post(&(connection->freeSlots));
+            continue;
+        }
+        int error = send_image_request(
+                connection->socketData, batchJob->address, input);
+        fclose(input);
+        if (error) { // Nothing was sent, so there is nothing to wait for.
+            fprintf(stderr, batchJobFailedFormat, batchJob->inputPath);
+            modify_mutex(&(state->failedJobs), 1);
+            resolve_job(state);
+            sem_post(&(connection->freeSlots));
+            continue;
+        }
+        // The response waits in the socket until the reader pops the job,
+        // so recording it after sending is safe.
+        push_in_flight(connection, job);
+    }
+    push_in_flight(connection, endOfJobs);
+    return NULL;
+}
+
+/* batch_reader()
+ * --------------
+ * Private thread function that reads responses on one connection in the
+ * order their requests were sent, writing each output as it arrives. Jobs
+ * the server was too busy for are queued to be sent again.
+ *
+ * data: the BatchConnection to read from.
+ *
+ * returns: NULL upon exit.
+ */
+void* batch_reader(void* data)
+{
+    BatchConnection* connection = (BatchConnection*)data;
+    BatchState* state = connection->state;
+    int job;
+    while ((job = pop_in_flight(connection)) != endOfJobs) {
+        BatchJob* batchJob = &(state->jobList.jobs[job]);
+        int error = 1;
+        long retryAfterMs = -1;
+        if (!read_mutex(&(connection->broken))) {
+            // The response must be consumed even if it cannot be saved, or
+            // every later response on the connection would be mismatched.
+            FILE* output = fopen(batchJob->outputPath, "w");
+            bool opened = output;
+            if (!opened) {
+                output = fopen("/dev/null", "w");
+            }
+            error = write_operations_response(
+                    connection->socketData, output, &retryAfterMs);
+            fclose(output);
+            if (!opened && !error) {
+                error = 1;
+            }
+            if (error == noResponseCode) { // Server dropped the connection.
+                modify_mutex(&(connection->broken), 1);
+            }
+            if (error) {
+                unlink(batchJob->outputPath);
+            }
+        }
+        if (error && retryAfterMs >= 0 && retry_job(state, job, retryAfterMs)) {
+            sem_post(&(connection->freeSlots));
+            continue;
+        }
+        if (error) {
+            fprintf(stderr, batchJobFailedFormat, batchJob->inputPath);
+            modify_mutex(&(state->failedJobs), 1);
+        }
+        resolve_job(state);
+        sem_post(&(connection->freeSlots));
+    }
+    return NULL;
+}
+
+int run_batch(ClientInputs args, BatchJobList jobList, SocketData* connections)
+{
+    // A dropped connection must fail its jobs, not kill the client.
+    signal(SIGPIPE, SIG_IGN);
+
+    BatchState state = {jobList, {0}, {0}, 0,
+            malloc(sizeof(int) * jobList.numJobs), 0,
+            calloc(jobList.numJobs, sizeof(int)),
+            calloc(jobList.numJobs, sizeof(struct timespec))};
+    sem_init(&(state.nextJob.lock), 0, 1);
+    sem_init(&(state.failedJobs.lock), 0, 1);
+
+    int numConnections = args.batchConnections;
+    BatchConnection* batchConnections
+            = calloc(numConnections, sizeof(BatchConnection));
+    pthread_t* threadIDs = malloc(sizeof(pthread_t) * numConnections * 2);
+    for (int i = 0; i < numConnections; i++) {
+        BatchConnection* connection = &(batchConnections[i]);
+        connection->state = &state;
+        connection->socketData = connections[i];
+        // One spare slot holds the end of jobs marker.
+        connection->capacity = args.batchDepth + 1;
+        connection->inFlight = malloc(sizeof(int) * connection->capacity);
+        sem_init(&(connection->freeSlots), 0, args.batchDepth);
+        sem_init(&(connection->queuedJobs), 0, 0);
+        sem_init(&(connection->broken.lock), 0, 1);
+        pthread_create(&threadIDs[2 * i], NULL, batch_writer, connection);
+        pthread_create(&threadIDs[2 * i + 1], NULL, batch_reader, connection);
+    }
+    for (int i = 0; i < numConnections * 2; i++) {
+        pthread_join(threadIDs[i], NULL);
+    }
+    for (int i = 0; i < numConnections; i++) {
+        free(batchConnections[i].inFlight);
+    }
+    free(batchConnections);
+    free(threadIDs);
+    free(state.retryJobs);
+    free(state.busyRetries);
+    free(state.retryAt);
+
+    // Jobs never claimed or left to retry because every connection broke
+    // count as failed.
+    int failed = state.failedJobs.value + jobList.numJobs
+            - state.nextJob.value + state.numRetries;
+    if (failed) {
+        fprintf(stderr, batchFailedFormat, failed, jobList.numJobs);
+        return batchFailedCode;
+    }
+    return 0;
+}
+
+/* make_packs()
+ * ------------
+ * Private helper function that groups consecutive jobs sharing operations
+ * into packs of at most args.batchPack images and, past the first image,
+ * maxImageSize bytes.
+ *
+ * returns: the heap allocated packs.
+ */
+JobPack* make_packs(ClientInputs args, BatchJobList jobList, int* numPacks)
+{
+    JobPack* packs = malloc(sizeof(JobPack) * (jobList.numJobs + 1));
+    *numPacks = 0;
+    long unsigned int packBytes = 0;
+    for (int i = 0; i < jobList.numJobs; i++) {
+        struct stat fileInfo;
+        long unsigned int size = stat(jobList.jobs[i].inputPath, &fileInfo)
+                ? 0
+                : fileInfo.st_size;
+        JobPack* last = *numPacks ? &(packs[*numPacks - 1]) : NULL;
+        if (last && last->count < args.batchPack
+                && packBytes + size <= maxImageSize
+                && !strcmp(jobList.jobs[last->first].address,
+                        jobList.jobs[i].address)) {
+            last->count++;
+            packBytes += size;
+        } else {
+            JobPack pack = {i, 1};
+            packs[(*numPacks)++] = pack;
+            packBytes = size;
+        }
+    }
+    return packs;
+}
+
+/* send_pack()
+ * -----------
+ * Private helper function that reads the images of a pack and sends them
+ * in one request. Jobs whose image cannot be read are failed and left out.
+ *
+ * included: populated with the jobs sent, in order.
+ *
+ * returns: the number of jobs sent, or -1 if sending failed.
+ */
+int send_pack(PackConnection* connection, JobPack pack, int* included)
+{
+    PackState* state = connection->state;
+    PackedItem* items = calloc(pack.count, sizeof(PackedItem));
+    BinaryData* images = calloc(pack.count, sizeof(BinaryData));
+    int numItems = 0;
+    for (int i = 0; i < pack.count; i++) {
+        BatchJob* job = &(state->jobList.jobs[pack.first + i]);
+        FILE* input = fopen(job->inputPath, "r");
+        if (input) {
+            images[i] = read_binary_file(input);
+            fclose(input);
+        }
+        if (!images[i].length) {
+            fprintf(stderr, batchJobFailedFormat, job->inputPath);
+            modify_mutex(&(state->failedJobs), 1);
+            continue;
+        }
+        items[numItems].data = images[i].data;
+        items[numItems].length = images[i].length;
+        included[numItems++] = pack.first + i;
+    }
+    int error = 0;
+    if (numItems) {
+        BinaryData packed = pack_items(items, numItems, false);
+        char* operations = state->jobList.jobs[pack.first].address;
+        char* address
+                = malloc(strlen(batchAddress) + strlen(operations) + 1);
+        sprintf(address, "%s%s", batchAddress, operations);
+        FILE* body = fmemopen(packed.data, packed.length, "r");
+        error = send_image_request(connection->socketData, address, body);
+        fclose(body);
+        free(address);
+        free(packed.data);
+    }
+    for (int i = 0; i < pack.count; i++) {
+        free(images[i].data);
+    }
+    free(images);
+    free(items);
+    return error ? -1 : numItems;
+}
+
+/* write_pack_outputs()
+ * --------------------
+ * Private helper function that writes each image of a packed response to
+ * its job's output, failing jobs whose image failed.
+ *
+ * response: the packed response body.
+ * included: the jobs that were sent, in order.
+ * numIncluded: the number of jobs sent.
+ */
+void write_pack_outputs(PackState* state, BinaryData response,
+        int* included, int numIncluded)
+{
+    PackedItem* items = NULL;
+    int numItems = unpack_items(
+            response.data, response.length, true, numIncluded, &items);
+    for (int i = 0; i < numIncluded; i++) {
+        BatchJob* job = &(state->jobList.jobs[included[i]]);
+        bool failed = numItems != numIncluded || items[i].status != HTTP_OK;
+        if (!failed) {
+            FILE* output = fopen(job->outputPath, "w");
+            failed = !output
+                    || fwrite(items[i].data, sizeof(char), items[i].length,
+                               output)
+                            != items[i].length;
+            if (output) {
+                fclose(output);
+            }
+        } else if (numItems == numIncluded) { // The server said why.
+            fwrite(items[i].data, sizeof(char), items[i].length, stderr);
+        }
+        if (failed) {
+            unlink(job->outputPath);
+            fprintf(stderr, batchJobFailedFormat, job->inputPath);
+            modify_mutex(&(state->failedJobs), 1);
+        }
+    }
+    if (numItems >= 0) {
+        free(items);
+    }
+}
+
+/* pack_sender()
+ * -------------
+ * Private thread function that sends packs on one connection and writes
+ * their outputs, until the packs run out or the connection breaks. Packs
+ * the server is too busy for are sent again once their Retry-After passes.
+ *
+ * data: the PackConnection to send on.
+ *
+ * returns: NULL upon exit.
+ */
+void* pack_sender(void* data)
+{
+    PackConnection* connection = (PackConnection*)data;
+    PackState* state = connection->state;
+    while (1) {
+        sem_wait(&(state->nextPack.lock));
+        int next = state->nextPack.value++;
+        sem_post(&(state->nextPack.lock));
+        if (next >= state->numPacks) {
+            return NULL;
+        }
+        JobPack pack = state->packs[next];
+        int* included = malloc(sizeof(int) * pack.count);
+        int error = 0;
+        int numIncluded = 0;
+        for (int tries = 0; tries <= maxBusyRetries; tries++) {
+            numIncluded = send_pack(connection, pack, included);
+            if (numIncluded <= 0) {
+                error = numIncluded ? noResponseCode : 0;
+                break;
+            }
+            BinaryData response = {0};
+            FILE* output = open_memstream(
+                    (char**)&response.data, &response.length);
+            long retryAfterMs = -1;
+            error = write_operations_response(
+                    connection->socketData, output, &retryAfterMs);
+            fclose(output);
+            if (!error) {
+                write_pack_outputs(state, response, included, numIncluded);
+            }
+            free(response.data);
+            if (!error || retryAfterMs < 0) {
+                break;
+            }
+            usleep(retryAfterMs * 1000);
+        }
+        if (error) { // Every image sent in the pack failed with it.
+            for (int i = 0; i < numIncluded; i++) {
+                fprintf(stderr, batchJobFailedFormat,
+                        state->jobList.jobs[included[i]].inputPath);
+            }
+            modify_mutex(&(state->failedJobs), numIncluded);
+        }
+        free(included);
+        if (error == noResponseCode) { // Leave the rest to other connections.
+            return NULL;
+        }
+    }
+}
+
+int run_packed_batch(
+        ClientInputs args, BatchJobList jobList, SocketData* connections)
+{
+    signal(SIGPIPE, SIG_IGN);
+    PackState state = {jobList, NULL, 0, {0}, {0}};
+    state.packs = make_packs(args, jobList, &state.numPacks);
+    sem_init(&(state.nextPack.lock), 0, 1);
+    sem_init(&(state.failedJobs.lock), 0, 1);
+
+    int numConnections = args.batchConnections;
+    PackConnection* packConnections
+            = malloc(sizeof(PackConnection) * numConnections);
+    pthread_t* threadIDs = malloc(sizeof(pthread_t) * numConnections);
+    for (int i = 0; i < numConnections; i++) {
+        PackConnection connection = {&state, connections[i]};
+        packConnections[i] = connection;
+        pthread_create(&threadIDs[i], NULL, pack_sender, &packConnections[i]);
+    }
+    for (int i = 0; i < numConnections; i++) {
+        pthread_join(threadIDs[i], NULL);
+    }
+
+    // Packs never claimed because every connection broke count as failed.
+    int failed = state.failedJobs.value;
+    for (int i = state.nextPack.value; i < state.numPacks; i++) {
+        failed += state.packs[i].count;
+    }
+    free(packConnections);
+    free(threadIDs);
+    free(state.packs);
+    if (failed) {
+        fprintf(stderr, batchFailedFormat, failed, jobList.numJobs);
+        return batchFailedCode;
+    }
+    return 0;
+}
+
+/* sharded_job_done()
+ * ------------------
+ * Private completion callback for run_sharded_batch(). Writes the job's
+ * output, or counts it as failed, then releases the job.
+ */
+void sharded_job_done(UqRequest* request, void* userData)
+{
+    ShardedJob* shardedJob = (ShardedJob*)userData;
+    const UqClientResult* result = uqclient_request_result(request);
+    bool failed = true;
+    if (result->status == 200) {
+        FILE* output = fopen(shardedJob->job->outputPath, "w");
+        if (output) {
+            failed = fwrite(result->body, sizeof(char), result->bodyLen,
+                    output) != result->bodyLen;
+            fclose(output);
+        }
+    }
+    if (failed) {
+        unlink(shardedJob->job->outputPath);
+        fprintf(stderr, batchJobFailedFormat, shardedJob->job->inputPath);
+        (*shardedJob->failedJobs)++;
+    }
+    free(shardedJob->image.data);
+    free(shardedJob);
+    uqclient_request_free(request);
+}
+
+int run_sharded_batch(ClientInputs args, BatchJobList jobList)
+{
+    signal(SIGPIPE, SIG_IGN);
+    UqClient* client = uqclient_create_multi(
+            (const char* const*)args.endpoints, args.numEndpoints,
+            args.batchConnections, args.batchDepth);
+    if (!client) {
+        return -1;
+    }
+
+    // Only read images in as fast as the servers can take them.
+    int maxOutstanding
+            = args.numEndpoints * args.batchConnections * args.batchDepth;
+    int failed = 0;
+    int nextJob = 0;
+    while (nextJob < jobList.numJobs || uqclient_outstanding(client)) {
+        while (nextJob < jobList.numJobs
+                && uqclient_outstanding(client) < maxOutstanding) {
+            BatchJob* job = &(jobList.jobs[nextJob++]);
+            FILE* input = fopen(job->inputPath, "r");
+            BinaryData image = {0};
+            if (input) {
+                image = read_binary_file(input);
+                fclose(input);
+            }
+            if (!image.length) {
+                free(image.data);
+                fprintf(stderr, batchJobFailedFormat, job->inputPath);
+                failed++;
+                continue;
+            }
+            ShardedJob* shardedJob = malloc(sizeof(ShardedJob));
+            shardedJob->job = job;
+            shardedJob->image = image;
+            shardedJob->failedJobs = &failed;
+            uqclient_submit(client, image.data, image.length, job->address,
+                    sharded_job_done, shardedJob);
+        }
+        uqclient_poll(client, -1);
+    }
+    uqclient_destroy(client);
+
+    if (failed) {
+        fprintf(stderr, batchFailedFormat, failed, jobList.numJobs);
+        return batchFailedCode;
+    }
+    return 0;
+}
@@ -0,0 +1,83 @@
+#ifndef BATCHUTILS_H
+#define BATCHUTILS_H
+
+#include "argparsing.h"
+#include "socketutils.h"
+
+/* A single image to transform in batch mode */
+typedef struct BatchJob {
+    char* inputPath;
+    char* outputPath;
+    char* address; // '/' deliminated operation chain, e.g. "/rotate,90".
+} BatchJob;
+
+/* A list of batch jobs */
+typedef struct BatchJobList {
+    BatchJob* jobs;
+    int numJobs;
+} BatchJobList;
+
+/* load_batch_jobs()
+ * -----------------
+ * Builds the job list for batch mode. If args.batchPath is a directory,
+ *      every regular file in it is transformed with the operations given on
+ *      the command line and written to args.outputFilePath as <name>.png.
+ *      Otherwise batchPath is a manifest with one job per line in the form
+ *      "infile outfile /op,param/op,param". Blank lines and lines starting
+ *      with '#' are ignored.
+ *
+ * args: the parsed client inputs.
+ * jobList: populated with the heap allocated jobs.
+ *
+ * returns: 0 if successfull, otherwise the error code.
+ */
+int load_batch_jobs(ClientInputs args, BatchJobList* jobList);
+
+/* run_batch()
+ * -----------
+ * Transforms every job over the given keep-alive connections. Each
+ *      connection keeps up to args.batchDepth requests in flight, and outputs
+ *      are written as their responses arrive. Jobs are handed out from a
+ *      shared list, so a connection that fails leaves its remaining work to
+ *      the others.
+ *
+ * args: the parsed client inputs.
+ * jobList: the jobs to run.
+ * connections: args.batchConnections open connections to the server.
+ *
+ * returns: 0 if every job succeeded, otherwise the error code.
+ */
+int run_batch(ClientInputs args, BatchJobList jobList, SocketData* connections);
+
+/* run_packed_batch()
+ * ------------------
+ * Transforms every job in packed batch requests, as suits many small
+ *      images. Consecutive jobs sharing operations are packed up to
+ *      args.batchPack at a time, and each connection sends one pack at a
+ *      time, writing its outputs before taking the next.
+ *
+ * args: the parsed client inputs.
+ * jobList: the jobs to run.
+ * connections: args.batchConnections open connections to the server.
+ *
+ * returns: 0 if every job succeeded, otherwise the error code.
+ */
+int run_packed_batch(
+        ClientInputs args, BatchJobList jobList, SocketData* connections);
+
+/* run_sharded_batch()
+ * -------------------
+ * Transforms every job over several servers with libuqclient. Each job is
+ *      routed by consistent hashing of its image and operations, with up to
+ *      args.batchConnections pipelined connections per server. Jobs on a
+ *      server that fails are retried on the next server on the ring.
+ *
+ * args: the parsed client inputs, holding the endpoints.
+ * jobList: the jobs to run.
+ *
+ * returns: 0 if every job succeeded, -1 if an endpoint is invalid,
+ *      otherwise the error code.
+ */
+int run_sharded_batch(ClientInputs args, BatchJobList jobList);
+
+#endif // BATCHUTILS_H
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <semaphore.h>
+
+#include "bufferpool.h"
+#include "topology.h"
+
+// Powers of two bounding the pooled size classes, 64 KiB to 64 MiB.
+#define MIN_POOLED_SHIFT 16
+#define MAX_POOLED_SHIFT 26
+#define NUM_SIZE_CLASSES (MAX_POOLED_SHIFT - MIN_POOLED_SHIFT + 1)
+
+/* The head of a pooled buffer, ahead of the bytes handed out. The union
+ * keeps those as aligned as malloc() leaves them. */
+typedef union BufferHead {
+    struct {
+        union BufferHead* next; // The next unused buffer of its class.
+        int node; // The node it was taken on, and is handed back to.
+    } held;
+    long double align;
+} BufferHead;
+
+/* One node's unused buffers */
+typedef struct NodePool {
+    BufferHead* free[NUM_SIZE_CLASSES];
+    long unsigned int bytes; // Held in free.
+    sem_t lock;
+} NodePool;
+
+struct BufferPools {
+    Topology* topology;
+    long unsigned int bytesPerNode;
+    NodePool* nodes;
+};
+
+BufferPools* create_buffer_pools(Topology* topology,
+        long unsigned int bytesPerNode)
+{
+    BufferPools* pools = malloc(sizeof(BufferPools));
+    pools->topology = topology;
+    pools->bytesPerNode = bytesPerNode;
+    pools->nodes = calloc(topology->numNodes, sizeof(NodePool));
+    for (int i = 0; i < topology->numNodes; i++) {
+        sem_init(&(pools->nodes[i].lock), 0, 1);
+    }
+    return pools;
+}
+
+/* size_class()
+ * ------------
+ * Private helper function that finds the class a size is pooled in.
+ *
+ * returns: the index of the smallest class holding bytes, or -1 if bytes
+ *      are not pooled.
+ */
+static int size_class(size_t bytes)
+{
+    // Anything under half the smallest class is cheap enough to malloc().
+    if (bytes <= (size_t)1 << (MIN_POOLED_SHIFT - 1)) {
+        return -1;
+    }
+    for (int shift = MIN_POOLED_SHIFT; shift <= MAX_POOLED_SHIFT; shift++) {
+        if (bytes <= (size_t)1 << shift) {
+            return shift - MIN_POOLED_SHIFT;
+        }
+    }
+    return -1;
+}
+
+void* take_buffer(BufferPools* pools, size_t bytes)
+{
+    int sizeClass = pools ? size_class(bytes) : -1;
+    if (sizeClass == -1) {
+        return malloc(bytes ? bytes : 1);
+    }
+    int nodeIndex = current_node(pools->topology);
+    NodePool* node = &(pools->nodes[nodeIndex]);
+    sem_wait(&(node->lock));
+    BufferHead* head = node->free[sizeClass];
+    if (head) {
+        node->free[sizeClass] = head->held.next;
+        node->bytes -= (size_t)1 << (sizeClass + MIN_POOLED_SHIFT);
+    }
+    sem_post(&(node->lock));
+    if (!head) {
+        head = malloc(sizeof(BufferHead)
+                + ((size_t)1 << (sizeClass + MIN_POOLED_SHIFT)));
+        if (!head) {
+            return NULL;
+        }
+        head->held.node = nodeIndex;
+    }
+    return head + 1;
+}
+
+void give_buffer(BufferPools* pools, void* buffer, size_t bytes)
+{
+    int sizeClass = pools && buffer ? size_class(bytes) : -1;
+    if (sizeClass == -1) {
+        free(buffer);
+        return;
+    }
+    size_t classBytes = (size_t)1 << (sizeClass + MIN_POOLED_SHIFT);
+    // Back to the node it was first touched on, wherever it is given back.
+    BufferHead* head = (BufferHead*)buffer - 1;
+    NodePool* node = &(pools->nodes[head->held.node]);
+    sem_wait(&(node->lock));
+    bool kept = node->bytes + classBytes <= pools->bytesPerNode;
+    if (kept) {
+        head->held.next = node->free[sizeClass];
+        node->free[sizeClass] = head;
+        node->bytes += classBytes;
+    }
+    sem_post(&(node->lock));
+    if (!kept) {
+        free(head);
+    }
+}
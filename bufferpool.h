@@ -0,0 +1,50 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stddef.h>
+
+#include "topology.h"
+
+/* Large buffers kept for reuse, a pool per NUMA node. A buffer is handed
+ * back to the pool of the node it was first taken on, whichever thread
+ * gives it back, and only handed out again to threads on that node, so a
+ * buffer first touched on a node, and so placed there by the kernel, keeps
+ * being used there. Reuse also spares
+ * the page faults of mapping fresh memory for every request. Buffers are
+ * pooled in power of two size classes from 64 KiB to 64 MiB. Smaller and
+ * larger ones come straight from malloc(). */
+
+typedef struct BufferPools BufferPools;
+
+/* create_buffer_pools()
+ * ---------------------
+ * topology: the machine's topology, kept for the life of the pools.
+ * bytesPerNode: the most each node's pool keeps while unused.
+ *
+ * returns: the new pools.
+ */
+BufferPools* create_buffer_pools(Topology* topology,
+        long unsigned int bytesPerNode);
+
+/* take_buffer()
+ * -------------
+ * pools: the pools to take from. May be NULL, meaning malloc().
+ * bytes: the size wanted.
+ *
+ * returns: a buffer of at least bytes, released with give_buffer(), or
+ *      NULL if none could be allocated.
+ */
+void* take_buffer(BufferPools* pools, size_t bytes);
+
+/* give_buffer()
+ * -------------
+ * Hands a buffer back to the node it was first taken on, or frees it if
+ *      that pool is full.
+ *
+ * pools: the pools it was taken from.
+ * buffer: the buffer. May be NULL.
+ * bytes: the size it was taken with.
+ */
+void give_buffer(BufferPools* pools, void* buffer, size_t bytes);
+
+#endif // BUFFERPOOL_H
@@ -11,18 +11,223 @@
 #include "argparsing.h"
 #include "ioutils.h"
 #include "socketutils.h"
+#include "shmutils.h"
 #include "httputils.h"
+#include "uqimage.h"
+#include "batchutils.h"
+#include "hashutils.h"
 
 // Error status constants.
 const char* const invalidCmdMessage
-        = "Usage: uqimageclient portnumber [--input infile] [--out "
-          "outfilename] [--scale w h | --flip dirn | --rotate angle]\n";
+        = "Usage: uqimageclient portnumber|socketpath[,...]|--local "
+          "[--input infile] "
+          "[--out outfilename] [--scale w h | --flip dirn | --rotate angle] "
+          "[--batch manifest|dir [--connections k] [--depth n] "
+          "[--pack n]] "
+          "[--renditions chain;chain... --out dir]\n";
 const int invalidCmdCode = 7;
 
 const char* const invalidPortFormat
         = "uqimageclient: unable to establish connection to port \"%s\"\n";
 const int invalidPortCode = 17;
 
+const char* const localEmptyImageMessage
+        = "uqimageclient: no data read for input image\n";
+const int localEmptyImageCode = 13;
+
+// Matches the exit status used when the server rejects a request.
+const int localProcessingFailedCode = 9;
+
+/* process_locally()
+ * -----------------
+ * Applies the requested operations in-process with libuqimage, writing the
+ *      encoded result to output without contacting a server.
+ *
+ * args: the operations to apply.
+ * input: a file stream to read the binary image off of.
+ * output: the output file stream to write the transformed image to.
+ *
+ * returns: 0 if successfull, otherwise the error code.
+ */
+int process_locally(ClientInputs args, FILE* input, FILE* output)
+{
+    BinaryData image = read_binary_file(input);
+    if (image.length == 0) {
+        fprintf(stderr, localEmptyImageMessage);
+        return localEmptyImageCode;
+    }
+    char* operations = construct_operations_address(args);
+    UqImageResult result;
+    uqimage_process(image.data, image.length, operations, &result);
+    free(operations);
+    free(image.data);
+    if (result.status != UQIMAGE_OK) {
+        fprintf(stderr, "%s", uqimage_status_message(result.status));
+        return localProcessingFailedCode;
+    }
+    fwrite(result.data, sizeof(char), result.length, output);
+    uqimage_free_result(&result);
+    return 0;
+}
+
+/* open_connection()
+ * -----------------
+ * Opens a connection to a server endpoint, passing images by memfd when the
+ *      endpoint is a local unix socket.
+ *
+ * endpoint: a port number, or unix socket path if it has a '/'.
+ *
+ * returns: the open connection, or a socket fd of -1 upon error.
+ */
+SocketData open_connection(const char* endpoint)
+{
+    // Open a socket to the specified port, or unix socket path.
+    SocketData socketData = connect_to_endpoint((char*)endpoint);
+    if (socketData.handle == -1) {
+        return socketData;
+    }
+    // A unix socket means the server is local, so images can be handed over
+    // in shared memory rather than copied through the socket.
+    if (strchr(endpoint, '/')) {
+        enable_fd_passing(&socketData);
+    }
+    return socketData;
+}
+
+/* close_connection()
+ * ------------------
+ * Closes a connection opened with open_connection().
+ *
+ * socketData: the connection to close.
+ */
+void close_connection(SocketData socketData)
+{
+    fclose(socketData.post);
+    fclose(socketData.get);
+    close(socketData.handle);
+}
+
+/* process_sharded()
+ * -----------------
+ * Sends a single image to one of several servers, chosen by consistent
+ *      hashing of the image and its operations so that repeats of a request
+ *      reach the same server. If that server cannot be reached or drops the
+ *      connection, the next server on the ring is tried.
+ *
+ * args: the parsed client inputs, holding the endpoints.
+ * input: a file stream to read the binary image off of.
+ * output: the output file stream to write the transformed image to.
+ *
+ * returns: 0 if successfull, otherwise the error code.
+ */
+int process_sharded(ClientInputs args, FILE* input, FILE* output)
+{
+    BinaryData image = read_binary_file(input);
+    if (image.length == 0) {
+        fprintf(stderr, localEmptyImageMessage);
+        return localEmptyImageCode;
+    }
+    char* address = construct_operations_address(args);
+    HashRing ring = create_hash_ring((const char* const*)args.endpoints,
+            args.numEndpoints, hashRingDefaultPoints);
+    int* order = malloc(sizeof(int) * args.numEndpoints);
+    hash_ring_preference(&ring,
+            hash_image_request(address, image.data, image.length), order);
+
+    int error = invalidPortCode;
+    for (int i = 0; i < args.numEndpoints; i++) {
+        SocketData socketData = open_connection(args.endpoints[order[i]]);
+        if (socketData.handle == -1) {
+            continue;
+        }
+        FILE* imageStream = fmemopen(image.data, image.length, "r");
+        error = send_image_request(socketData, address, imageStream);
+        fclose(imageStream);
+        if (!error) {
+            error = write_operations_response(socketData, output, NULL);
+        }
+        close_connection(socketData);
+        // Any answer from the server, even an error, is final.
+        if (error != noResponseCode) {
+            break;
+        }
+    }
+    if (error == invalidPortCode) {
+        fprintf(stderr, invalidPortFormat, args.portNumber);
+    }
+    free(order);
+    free_hash_ring(&ring);
+    free(address);
+    free(image.data);
+    return error;
+}
+
+/* process_renditions()
+ * --------------------
+ * Sends a single image with several ';' separated operation chains, which
+ *      the server decodes once, and writes each rendition to its own file
+ *      in the --out directory.
+ *
+ * args: the parsed client inputs, holding the chains.
+ * input: a file stream to read the binary image off of.
+ *
+ * returns: 0 if every rendition was written, otherwise the error code.
+ */
+int process_renditions(ClientInputs args, FILE* input)
+{
+    SocketData socketData = open_connection(args.portNumber);
+    if (socketData.handle == -1) {
+        fprintf(stderr, invalidPortFormat, args.portNumber);
+        return invalidPortCode;
+    }
+    int error = send_image_request(socketData, args.renditions, input);
+    if (!error) {
+        error = write_renditions_response(socketData, args.outputFilePath);
+    }
+    close_connection(socketData);
+    return error;
+}
+
+/* process_batch()
+ * ---------------
+ * Runs batch mode: loads the job list then transforms every job over
+ *      args.batchConnections pipelined keep-alive connections, per server
+ *      when sharding over several.
+ *
+ * args: the parsed client inputs.
+ *
+ * returns: 0 if every job succeeded, otherwise the error code.
+ */
+int process_batch(ClientInputs args)
+{
+    BatchJobList jobList;
+    int error = load_batch_jobs(args, &jobList);
+    if (error) {
+        return error;
+    }
+    if (args.numEndpoints > 1) {
+        error = run_sharded_batch(args, jobList);
+        if (error == -1) {
+            fprintf(stderr, invalidPortFormat, args.portNumber);
+            return invalidPortCode;
+        }
+        return error;
+    }
+    SocketData* connections
+            = malloc(sizeof(SocketData) * args.batchConnections);
+    for (int i = 0; i < args.batchConnections; i++) {
+        connections[i] = open_connection(args.portNumber);
+        if (connections[i].handle == -1) {
+            fprintf(stderr, invalidPortFormat, args.portNumber);
+            return invalidPortCode;
+        }
+    }
+    error = args.batchPack ? run_packed_batch(args, jobList, connections)
+                           : run_batch(args, jobList, connections);
+    free(connections);
+    return error;
+}
+
 /* Entry point for the client prgram */
 int main(int argc, char** argv)
 {
@@ -37,6 +242,11 @@ int main(int argc, char** argv)
         return error;
     }
 
+    // Batch mode reads its own inputs and writes its own outputs.
+    if (args.hasBatch) {
+        return process_batch(args);
+    }
+
     // Open input and output to source if path present and valid.
     FILE* inputSource = stdin;
     FILE* outputSource = stdout;
@@ -47,12 +257,26 @@ int main(int argc, char** argv)
     if (args.inputFilePath) {
         inputSource = fopen(args.inputFilePath, "r");
     }
+
+    // Each rendition goes to its own file in the --out directory.
+    if (args.hasRenditions) {
+        return process_renditions(args, inputSource);
+    }
     if (args.outputFilePath) {
         outputSource = fopen(args.outputFilePath, "w");
     }
 
-    // Open a socket to the specified port, returning error if not possible.
-    SocketData socketData = connect_to_port(args.portNumber);
+    // No server needed, transform the image in this process.
+    if (args.isLocal) {
+        return process_locally(args, inputSource, outputSource);
+    }
+
+    // Several servers were given, so shard over them.
+    if (args.numEndpoints > 1) {
+        return process_sharded(args, inputSource, outputSource);
+    }
+
+    SocketData socketData = open_connection(args.portNumber);
     if (socketData.handle == -1) {
         fprintf(stderr, invalidPortFormat, args.portNumber);
         return invalidPortCode;
@@ -60,14 +284,14 @@ int main(int argc, char** argv)
 
     // Attempt to send a http request to apply the operations specified in
     // argv to the image specified in the input source.
-    error = send_operations_request(socketData.post, args, inputSource);
+    error = send_operations_request(socketData, args, inputSource);
     if (error) {
         return error;
     }
 
     // Attempt to write the server response to the previous request into
     // the file stream specified in the output source.
-    error = write_operations_response(socketData.get, outputSource);
+    error = write_operations_response(socketData, outputSource, NULL);
     if (error) {
         return error;
     }
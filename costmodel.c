@@ -0,0 +1,242 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "argparsing.h"
+#include "costmodel.h"
+#include "crop.h"
+#include "prescale.h"
+
+// Pixels assumed per encoded byte when the header cannot be read. Typical
+// JPEGs hold 3 to 10 pixels per byte, so this leans towards overestimating.
+const long unsigned int pixelsPerByteGuess = 4;
+
+// Relative cost per pixel of each stage. Decoding and right angle rotations
+// and flips move each pixel once, resampling interpolates several source
+// pixels per output pixel and PNG encoding filters then deflates each one.
+const long unsigned int decodeCost = 1;
+const long unsigned int rightAngleRotateCost = 1;
+const long unsigned int resampleRotateCost = 4;
+const long unsigned int flipCost = 1;
+const long unsigned int scaleCost = 2;
+const long unsigned int encodeCost = 3;
+
+// Longest side a header may claim, as FreeImage will not decode a larger
+// image. Checking it first keeps every product of sides in range.
+const long maxPeekedSide = 65535;
+
+// Costs saturate here rather than wrap, so no chain can look cheap by
+// overflowing. Far past anything a real request costs.
+const long unsigned int maxRequestCost = 1UL << 62;
+
+// Sides are held to this as they are followed through the chain, so
+// repeated rotations cannot grow them without bound.
+const long maxTrackedSide = 1L << 30;
+
+const int rightAngle = 90;
+const double degreesPerRadian = 57.29577951308232;
+
+/* read_big_endian()
+ * -----------------
+ * Private helper function that reads an unsigned big endian integer.
+ */
+static long read_big_endian(const unsigned char* bytes, int size)
+{
+    long value = 0;
+    for (int i = 0; i < size; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/* read_little_endian()
+ * --------------------
+ * Private helper function that reads an unsigned little endian integer.
+ */
+static long read_little_endian(const unsigned char* bytes, int size)
+{
+    long value = 0;
+    for (int i = size - 1; i >= 0; i--) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/* peek_jpeg_dimensions()
+ * ----------------------
+ * Private helper function that walks JPEG marker segments to the start of
+ * frame, which holds the image dimensions.
+ */
+static bool peek_jpeg_dimensions(const unsigned char* image,
+        long unsigned int length, long* width, long* height)
+{
+    long unsigned int offset = 2; // Skip the start of image marker.
+    while (offset + 9 <= length) {
+        if (image[offset] != 0xFF) {
+            return false;
+        }
+        unsigned char marker = image[offset + 1];
+        if (marker == 0xFF) { // Fill byte before a marker.
+            offset++;
+            continue;
+        }
+        // Start of frame markers, excluding DHT, JPG and DAC.
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4
+                && marker != 0xC8 && marker != 0xCC) {
+            *height = read_big_endian(&image[offset + 5], 2);
+            *width = read_big_endian(&image[offset + 7], 2);
+            return true;
+        }
+        offset += 2 + read_big_endian(&image[offset + 2], 2);
+    }
+    return false;
+}
+
+/* read_bmp_side()
+ * ---------------
+ * Private helper function that reads a signed little endian 32 bit side
+ *      from a BMP header, giving its magnitude. Negative heights mark
+ *      top-down bitmaps.
+ */
+static long read_bmp_side(const unsigned char* bytes)
+{
+    long side = read_little_endian(bytes, 4);
+    return side >= 0x80000000L ? 0x100000000L - side : side;
+}
+
+/* peek_any_dimensions()
+ * ---------------------
+ * Private helper function that reads the dimensions from whichever header
+ *      an image has, as peek_image_dimensions() does, before they are
+ *      checked.
+ */
+static bool peek_any_dimensions(const unsigned char* image,
+        long unsigned int length, long* width, long* height)
+{
+    if (length >= 24 && !memcmp(image, "\x89PNG\r\n\x1a\n", 8)) {
+        *width = read_big_endian(&image[16], 4);
+        *height = read_big_endian(&image[20], 4);
+        return true;
+    }
+    if (length >= 10 && !memcmp(image, "GIF8", 4)) {
+        *width = read_little_endian(&image[6], 2);
+        *height = read_little_endian(&image[8], 2);
+        return true;
+    }
+    if (length >= 26 && !memcmp(image, "BM", 2)) {
+        *width = read_bmp_side(&image[18]);
+        *height = read_bmp_side(&image[22]);
+        return true;
+    }
+    if (length >= 4 && image[0] == 0xFF && image[1] == 0xD8) {
+        return peek_jpeg_dimensions(image, length, width, height);
+    }
+    return false;
+}
+
+bool peek_image_dimensions(const unsigned char* image,
+        long unsigned int length, long* width, long* height)
+{
+    // The header is the client's to write, so sides FreeImage would never
+    // decode are treated as unreadable.
+    long peekedWidth;
+    long peekedHeight;
+    if (!peek_any_dimensions(image, length, &peekedWidth, &peekedHeight)
+            || peekedWidth > maxPeekedSide || peekedHeight > maxPeekedSide) {
+        return false;
+    }
+    *width = peekedWidth;
+    *height = peekedHeight;
+    return true;
+}
+
+/* add_cost()
+ * ----------
+ * Private helper function that adds the cost of visiting some pixels to a
+ *      running cost, saturating at maxRequestCost.
+ *
+ * cost: the cost so far.
+ * perPixel: the relative cost of each pixel.
+ * width: the width of the pixels visited.
+ * height: their height.
+ *
+ * returns: the new cost.
+ */
+static long unsigned int add_cost(long unsigned int cost,
+        long unsigned int perPixel, long width, long height)
+{
+    double total = cost + (double)perPixel * width * height;
+    return total >= maxRequestCost ? maxRequestCost
+                                   : (long unsigned int)total;
+}
+
+/* limit_side()
+ * ------------
+ * Private helper function that holds a side followed through the chain to
+ *      maxTrackedSide.
+ */
+static long limit_side(double side)
+{
+    return side > maxTrackedSide ? maxTrackedSide : side;
+}
+
+long unsigned int estimate_request_cost(const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer)
+{
+    long width;
+    long height;
+    if (!peek_image_dimensions(image, length, &width, &height)) {
+        width = sqrt(length * pixelsPerByteGuess);
+        height = width;
+    }
+    long unsigned int cost = add_cost(0, decodeCost, width, height);
+    // Operations start from a smaller bitmap when decoded at reduced size.
+    int shrink = plan_decode_shrink(image, length, cmdBuffer);
+    width = (width + shrink - 1) / shrink;
+    height = (height + shrink - 1) / shrink;
+
+    // Follow the image size through the chain, as each operation works on
+    // the output of the last, in the order crops are hoisted to.
+    cmdBuffer = hoist_crops(cmdBuffer, width, height);
+    for (int i = 0; i < cmdBuffer.numCmds; i++) {
+        if (cmdBuffer.buffer[i] == CMD_ROTATE) {
+            int angle = cmdBuffer.buffer[++i];
+            if (angle % rightAngle == 0) {
+                cost = add_cost(cost, rightAngleRotateCost, width, height);
+                if (angle % (2 * rightAngle)) {
+                    long swap = width;
+                    width = height;
+                    height = swap;
+                }
+            } else { // Resampled into the rotated bounding box.
+                double radians = angle / degreesPerRadian;
+                double cosine = fabs(cos(radians));
+                double sine = fabs(sin(radians));
+                long rotatedWidth = limit_side(width * cosine + height * sine);
+                height = limit_side(width * sine + height * cosine);
+                width = rotatedWidth;
+                cost = add_cost(cost, resampleRotateCost, width, height);
+            }
+        } else if (cmdBuffer.buffer[i] == CMD_FLIP) {
+            cost = add_cost(cost, flipCost, width, height);
+            i++;
+        } else if (cmdBuffer.buffer[i] == CMD_SCALE) {
+            cost = add_cost(cost, scaleCost, width, height);
+            width = cmdBuffer.buffer[i + 1];
+            height = cmdBuffer.buffer[i + 2];
+            cost = add_cost(cost, scaleCost, width, height);
+            i += 2;
+        } else if (cmdBuffer.buffer[i] == CMD_CROP) {
+            // Taken as a view, so only the smaller size costs anything.
+            CropRect rect;
+            if (clip_crop(&(cmdBuffer.buffer[i]), width, height, &rect)) {
+                width = rect.width;
+                height = rect.height;
+            }
+            i += 4;
+        }
+    }
+    free(cmdBuffer.buffer);
+    return add_cost(cost, encodeCost, width, height);
+}
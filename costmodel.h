@@ -0,0 +1,43 @@
+#ifndef COSTMODEL_H
+#define COSTMODEL_H
+
+#include <stdbool.h>
+
+#include "argparsing.h"
+
+/* peek_image_dimensions()
+ * -----------------------
+ * Reads the width and height of an encoded image from its header without
+ *      decoding it. PNG, GIF, BMP and JPEG headers are understood. Sides
+ *      over 65535, which FreeImage will not decode, count as not found.
+ *
+ * image: the encoded image.
+ * length: the number of bytes in image.
+ * width: populated with the width if found.
+ * height: populated with the height if found.
+ *
+ * returns: true if the dimensions were found.
+ */
+bool peek_image_dimensions(const unsigned char* image,
+        long unsigned int length, long* width, long* height);
+
+/* estimate_request_cost()
+ * -----------------------
+ * Estimates the work a transform request will take, in units of roughly
+ *      one pixel visit. Dimensions are taken from the image header, or
+ *      guessed from the encoded size if it cannot be read, then followed
+ *      through each operation: arbitrary rotations resample into a larger
+ *      bounding box, scales cost both their source and target size, and
+ *      the final image is encoded.
+ *
+ * image: the encoded image.
+ * length: the number of bytes in image.
+ * cmdBuffer: the parsed operations.
+ *
+ * returns: the estimated cost, saturating rather than wrapping for chains
+ *      of absurd size.
+ */
+long unsigned int estimate_request_cost(const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer);
+
+#endif // COSTMODEL_H
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "crop.h"
+#include "rotate.h"
+
+// Degrees in the right angles crops are moved past.
+const int turnDegrees = 90;
+
+/* A command of a chain being reordered, and the size of the image it
+ * applies to there */
+typedef struct ChainCommand {
+    int cmd[MAX_COMMAND_LENGTH];
+    int width;
+    int height;
+} ChainCommand;
+
+bool clip_crop(const int* cmd, int width, int height, CropRect* rect)
+{
+    rect->left = cmd[1];
+    rect->top = cmd[2];
+    rect->width = (cmd[1] + cmd[3] < width ? cmd[1] + cmd[3] : width) - cmd[1];
+    rect->height
+            = (cmd[2] + cmd[4] < height ? cmd[2] + cmd[4] : height) - cmd[2];
+    return rect->width > 0 && rect->height > 0;
+}
+
+/* follow_sizes()
+ * --------------
+ * Private helper function that records the size of the image each command
+ *      of a chain applies to, as FreeImage and the engines size their
+ *      outputs.
+ */
+static void follow_sizes(ChainCommand* chain, int length, int width,
+        int height)
+{
+    for (int i = 0; i < length; i++) {
+        const int* cmd = chain[i].cmd;
+        chain[i].width = width;
+        chain[i].height = height;
+        CropRect rect;
+        if (cmd[0] == CMD_ROTATE) {
+            double sine, cosine;
+            angle_sine_cosine(cmd[1], &sine, &cosine);
+            int rotatedWidth = floor(
+                    width * fabs(cosine) + height * fabs(sine) + 0.5);
+            int rotatedHeight = floor(
+                    width * fabs(sine) + height * fabs(cosine) + 0.5);
+            width = rotatedWidth > 0 ? rotatedWidth : 1;
+            height = rotatedHeight > 0 ? rotatedHeight : 1;
+        } else if (cmd[0] == CMD_SCALE) {
+            width = cmd[1];
+            height = cmd[2];
+        } else if (cmd[0] == CMD_CROP && clip_crop(cmd, width, height, &rect)) {
+            width = rect.width;
+            height = rect.height;
+        }
+    }
+}
+
+/* rearranges()
+ * ------------
+ * Private helper function that checks whether a command only moves pixels
+ *      about, which a crop can be moved ahead of.
+ */
+static bool rearranges(const int* cmd)
+{
+    return cmd[0] == CMD_FLIP
+            || (cmd[0] == CMD_ROTATE && cmd[1] % turnDegrees == 0);
+}
+
+/* undo_rearrangement()
+ * --------------------
+ * Private helper function that finds the rectangle of a command's input
+ *      that lands on a rectangle of its output.
+ */
+static CropRect undo_rearrangement(const ChainCommand* before, CropRect rect)
+{
+    int width = before->width;
+    int height = before->height;
+    CropRect undone = rect;
+    if (before->cmd[0] == CMD_FLIP && before->cmd[1] == FLIP_HORIZONTAL) {
+        undone.left = width - rect.left - rect.width;
+    } else if (before->cmd[0] == CMD_FLIP) {
+        undone.top = height - rect.top - rect.height;
+    } else {
+        // Anticlockwise quarter turns, the top right corner going to the
+        // top left with each.
+        int turns = (before->cmd[1] / turnDegrees % 4 + 4) % 4;
+        if (turns == 1) {
+            CropRect turned = {width - rect.top - rect.height, rect.left,
+                    rect.height, rect.width};
+            undone = turned;
+        } else if (turns == 2) {
+            CropRect turned = {width - rect.left - rect.width,
+                    height - rect.top - rect.height, rect.width,
+                    rect.height};
+            undone = turned;
+        } else if (turns == 3) {
+            CropRect turned = {rect.top, height - rect.left - rect.width,
+                    rect.height, rect.width};
+            undone = turned;
+        }
+    }
+    return undone;
+}
+
+/* hoist_last()
+ * ------------
+ * Private helper function that moves the crop ending a chain as early as it
+ *      can go, merging it into any crop it reaches.
+ *
+ * returns: the chain's new length.
+ */
+static int hoist_last(ChainCommand* chain, int length, int width, int height)
+{
+    follow_sizes(chain, length, width, height);
+    int at = length - 1;
+    CropRect rect;
+    if (!clip_crop(chain[at].cmd, chain[at].width, chain[at].height, &rect)) {
+        return length;
+    }
+    while (at > 0 && rearranges(chain[at - 1].cmd)) {
+        rect = undo_rearrangement(&chain[at - 1], rect);
+        chain[at] = chain[at - 1];
+        at--;
+    }
+    CropRect outer;
+    if (at > 0 && chain[at - 1].cmd[0] == CMD_CROP
+            && clip_crop(chain[at - 1].cmd, chain[at - 1].width,
+                    chain[at - 1].height, &outer)) {
+        rect.left += outer.left;
+        rect.top += outer.top;
+        memmove(&chain[at], &chain[at + 1],
+                sizeof(ChainCommand) * (length - at - 1));
+        length--;
+        at--;
+    }
+    int crop[] = {CMD_CROP, rect.left, rect.top, rect.width, rect.height};
+    memcpy(chain[at].cmd, crop, sizeof(crop));
+    return length;
+}
+
+CommandBuffer hoist_crops(CommandBuffer cmdBuffer, int width, int height)
+{
+    // Every command takes at least two ints, so this is room to spare.
+    ChainCommand* chain
+            = malloc(sizeof(ChainCommand) * (cmdBuffer.numCmds + 1));
+    int length = 0;
+    for (int i = 0; i < cmdBuffer.numCmds;
+            i += command_length(&(cmdBuffer.buffer[i]))) {
+        const int* cmd = &(cmdBuffer.buffer[i]);
+        memcpy(chain[length].cmd, cmd, sizeof(int) * command_length(cmd));
+        length++;
+        if (cmd[0] == CMD_CROP) {
+            length = hoist_last(chain, length, width, height);
+        }
+    }
+
+    CommandBuffer hoisted = {cmdBuffer.parseError,
+            malloc(sizeof(int) * (cmdBuffer.numCmds + 1)), 0};
+    for (int i = 0; i < length; i++) {
+        int cmdLength = command_length(chain[i].cmd);
+        memcpy(&(hoisted.buffer[hoisted.numCmds]), chain[i].cmd,
+                sizeof(int) * cmdLength);
+        hoisted.numCmds += cmdLength;
+    }
+    free(chain);
+    return hoisted;
+}
+
+FIBITMAP* crop_view(FIBITMAP* bitmap, const int* cmd)
+{
+    CropRect rect;
+    if (!clip_crop(cmd, FreeImage_GetWidth(bitmap),
+                FreeImage_GetHeight(bitmap), &rect)) {
+        return NULL;
+    }
+    return FreeImage_CreateView(bitmap, rect.left, rect.top,
+            rect.left + rect.width, rect.top + rect.height);
+}
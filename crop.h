@@ -0,0 +1,67 @@
+#ifndef CROP_H
+#define CROP_H
+
+#include <stdbool.h>
+
+#include <FreeImage.h>
+
+#include "argparsing.h"
+
+/* Crops keep a rectangle of an image, measured in pixels from its top left
+ * corner and clipped to the image. They are taken as views that share the
+ * pixels of the bitmap they crop rather than copying them. Before a chain
+ * runs, each crop is moved ahead of the right-angle rotations and flips
+ * before it, which only rearrange pixels, so those work on the pixels kept
+ * alone. Crops that follow a scale or any other rotation cannot be moved
+ * past it, and plan_affine() instead ends the resample at the crop, so
+ * only the pixels kept are ever resampled. */
+
+/* A crop's rectangle once clipped to the image it applies to */
+typedef struct CropRect {
+    int left;
+    int top; // Counted down from the top row.
+    int width;
+    int height;
+} CropRect;
+
+/* clip_crop()
+ * -----------
+ * Clips a crop to the image it applies to.
+ *
+ * cmd: the crop's command, CMD_CROP then x, y, width and height.
+ * width: the width of the image.
+ * height: its height.
+ * rect: populated with the clipped rectangle.
+ *
+ * returns: false if the crop misses the image entirely.
+ */
+bool clip_crop(const int* cmd, int width, int height, CropRect* rect);
+
+/* hoist_crops()
+ * -------------
+ * Reorders a chain so each crop comes as early as it can without changing
+ *      the result. A crop is moved ahead of right-angle rotations and flips,
+ *      its rectangle turned to match, and merged into a crop it reaches.
+ *      Crops that miss the image are left where they are, to fail there.
+ *
+ * cmdBuffer: the parsed operations, left untouched.
+ * width: the width of the image the chain starts from.
+ * height: its height.
+ *
+ * returns: the reordered chain, whose buffer the caller must free.
+ */
+CommandBuffer hoist_crops(CommandBuffer cmdBuffer, int width, int height);
+
+/* crop_view()
+ * -----------
+ * Crops a bitmap without copying it.
+ *
+ * bitmap: the bitmap to crop, which must outlive the view.
+ * cmd: the crop's command.
+ *
+ * returns: a view sharing bitmap's pixels, to be unloaded before bitmap,
+ *      or NULL if the crop misses the bitmap.
+ */
+FIBITMAP* crop_view(FIBITMAP* bitmap, const int* cmd);
+
+#endif // CROP_H
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include <csse2310_freeimage.h>
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "ioutils.h"
+#include "prescale.h"
+#include "stringutils.h"
+
+/* decodebench
+ * -----------
+ * Compares decoding an image in full with decoding it at the reduced size
+ * the planner picks for an operation chain. Each path decodes, transforms
+ * and encodes the image in a child process of its own, so the peak
+ * resident set size the kernel reports for the child is that path's alone.
+ * The decoded size, decode and total times and peak RSS of each are printed.
+ *
+ * Usage: decodebench image operations, e.g. decodebench photo.jpg
+ *      /scale,300,200
+ */
+
+const char* const decodeUsageMessage
+        = "Usage: decodebench image operations\n";
+
+const char* const decodeHeaderFormat = "%-8s %6s %11s %10s %10s %10s\n";
+const char* const decodeRowFormat = "%-8s %6i %5ix%-5i %10.2f %10.2f %10.1f\n";
+
+const double kibPerMib = 1024.0;
+
+/* What a child reports back about its path */
+typedef struct DecodeRun {
+    int width; // Of the decoded bitmap.
+    int height;
+    double decodeMs;
+    double totalMs;
+} DecodeRun;
+
+/* run_path()
+ * ----------
+ * Private helper function that decodes, transforms and encodes an image in
+ *      this process, as a child does.
+ *
+ * returns: the decoded size and times, with width 0 if decoding failed.
+ */
+static DecodeRun run_path(BinaryData image, CommandBuffer cmdBuffer,
+        int shrink)
+{
+    DecodeRun run = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FIBITMAP* bitmap = load_image_shrunk(image.data, image.length, shrink);
+    run.decodeMs = elapsed_ms(start);
+    if (!bitmap) {
+        return run;
+    }
+    run.width = FreeImage_GetWidth(bitmap);
+    run.height = FreeImage_GetHeight(bitmap);
+    if (!apply_cmd_buffer_to_image(&bitmap, cmdBuffer, NULL, NULL)) {
+        long unsigned int length;
+        free(fi_save_png_image_to_buffer(bitmap, &length));
+    }
+    FreeImage_Unload(bitmap);
+    run.totalMs = elapsed_ms(start);
+    return run;
+}
+
+/* report_path()
+ * -------------
+ * Private helper function that runs one path in a child process and prints
+ *      its row.
+ *
+ * returns: false if the child could not be run or failed to decode.
+ */
+static bool report_path(const char* name, BinaryData image,
+        CommandBuffer cmdBuffer, int shrink)
+{
+    int fds[2];
+    if (pipe(fds)) {
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        DecodeRun run = run_path(image, cmdBuffer, shrink);
+        _exit(write(fds[1], &run, sizeof(run)) != sizeof(run));
+    }
+    close(fds[1]);
+    DecodeRun run = {0};
+    bool reported = pid > 0 && read(fds[0], &run, sizeof(run)) == sizeof(run);
+    close(fds[0]);
+    struct rusage usage = {0};
+    int status;
+    if (pid > 0) {
+        wait4(pid, &status, 0, &usage);
+    }
+    if (!reported || !run.width) {
+        return false;
+    }
+    printf(decodeRowFormat, name, shrink, run.width, run.height,
+            run.decodeMs, run.totalMs, usage.ru_maxrss / kibPerMib);
+    return true;
+}
+
+/* Entry point for the reduced resolution decode benchmark */
+int main(int argc, char** argv)
+{
+    FILE* file = argc == 3 ? fopen(argv[1], "r") : NULL;
+    if (!file) {
+        fprintf(stderr, decodeUsageMessage);
+        return 1;
+    }
+    BinaryData image = read_binary_file(file);
+    fclose(file);
+    char* address = copy_string(argv[2]);
+    CommandBuffer cmdBuffer = create_image_processing_command_buffer(address);
+    if (cmdBuffer.parseError || !cmdBuffer.numCmds) {
+        fprintf(stderr, decodeUsageMessage);
+        return 1;
+    }
+    int shrink = plan_decode_shrink(image.data, image.length, cmdBuffer);
+    printf(decodeHeaderFormat, "path", "shrink", "decoded", "decode ms",
+            "total ms", "peak MiB");
+    bool ok = report_path("full", image, cmdBuffer, 1);
+    ok = report_path("reduced", image, cmdBuffer, shrink) && ok;
+    free(cmdBuffer.buffer);
+    free(address);
+    free(image.data);
+    return ok ? 0 : 2;
+}
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "hashutils.h"
+#include "diskcache.h"
+
+// Slots in the index. Kept at most three quarters full, so probes stay
+// short, by evicting the least recently used result.
+#define CACHE_INDEX_SLOTS 16384
+
+const uint64_t cacheIndexMagic = 0x5551494d47434958; // "UQIMGCIX"
+const uint32_t cacheIndexVersion = 1;
+const char* const cacheIndexName = "index";
+const char* const cacheTempPrefix = "tmp-";
+const char* const cacheResultFormat = "%016" PRIx64 "%016" PRIx64 ".png";
+
+// Length of a result file name: two 16 digit hashes and ".png".
+#define RESULT_NAME_LENGTH 36
+
+// Most bytes of results waiting to be written before more are dropped.
+const long unsigned int maxPendingBytes = 64 * 1024 * 1024;
+
+// Seed of the second, independent hash stored alongside each key, so a
+// collision in one hash cannot serve the wrong result.
+const uint64_t cacheCheckSeed = 0x9e3779b97f4a7c15;
+
+/* One cached result. Slots with a size of 0 are empty, as encoded results
+ * never are. lastUsed is a tick of the index clock. */
+typedef struct CacheEntry {
+    uint64_t key;
+    uint64_t check;
+    uint64_t size;
+    uint64_t lastUsed;
+} CacheEntry;
+
+/* Layout of the memory mapped index file */
+typedef struct CacheIndex {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slots;
+    uint64_t clock; // Ticks on every store and hit, ordering last use.
+    CacheEntry entries[CACHE_INDEX_SLOTS];
+} CacheIndex;
+
+/* A result copied for the writer thread to store */
+typedef struct PendingResult {
+    uint64_t key;
+    uint64_t check;
+    unsigned char* data;
+    long unsigned int length;
+    struct PendingResult* next;
+} PendingResult;
+
+struct DiskCache {
+    int dirHandle;
+    CacheIndex* index;
+    sem_t lock; // Guards everything below.
+    long unsigned int maxBytes;
+    long unsigned int usedBytes;
+    int numEntries;
+    unsigned int nextTemp; // Numbers temporary files.
+    PendingResult* pendingHead;
+    PendingResult* pendingTail;
+    long unsigned int pendingBytes;
+    sem_t pending; // Counts queued results.
+};
+
+/* find_entry()
+ * ------------
+ * Private helper function that finds a result's slot by linear probing.
+ *
+ * returns: the slot index, or -1 if the result is not in entries.
+ */
+static int find_entry(CacheEntry* entries, uint64_t key, uint64_t check)
+{
+    for (int i = key % CACHE_INDEX_SLOTS; entries[i].size;
+            i = (i + 1) % CACHE_INDEX_SLOTS) {
+        if (entries[i].key == key && entries[i].check == check) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* remove_entry()
+ * --------------
+ * Private helper function that empties a slot, shifting back any entries
+ * after it that probed past it so none become unreachable. The cache must
+ * be locked.
+ */
+static void remove_entry(DiskCache* cache, int slot)
+{
+    CacheEntry* entries = cache->index->entries;
+    cache->usedBytes -= entries[slot].size;
+    cache->numEntries--;
+    int hole = slot;
+    for (int i = (slot + 1) % CACHE_INDEX_SLOTS; entries[i].size;
+            i = (i + 1) % CACHE_INDEX_SLOTS) {
+        // Distance probed from its home slot, against that to the hole.
+        int home = entries[i].key % CACHE_INDEX_SLOTS;
+        int probed = (i - home + CACHE_INDEX_SLOTS) % CACHE_INDEX_SLOTS;
+        int toHole = (i - hole + CACHE_INDEX_SLOTS) % CACHE_INDEX_SLOTS;
+        if (probed >= toHole) {
+            entries[hole] = entries[i];
+            hole = i;
+        }
+    }
+    memset(&entries[hole], 0, sizeof(CacheEntry));
+}
+
+/* insert_entry()
+ * --------------
+ * Private helper function that places an entry in its first free slot,
+ * or over the same result's slot. The cache must be locked and the index
+ * must have room.
+ */
+static void insert_entry(DiskCache* cache, CacheEntry entry)
+{
+    CacheEntry* entries = cache->index->entries;
+    int i = entry.key % CACHE_INDEX_SLOTS;
+    while (entries[i].size
+            && (entries[i].key != entry.key
+                    || entries[i].check != entry.check)) {
+        i = (i + 1) % CACHE_INDEX_SLOTS;
+    }
+    if (entries[i].size) {
+        cache->usedBytes -= entries[i].size;
+    } else {
+        cache->numEntries++;
+    }
+    cache->usedBytes += entry.size;
+    entries[i] = entry;
+}
+
+/* evict_oldest()
+ * --------------
+ * Private helper function that deletes the least recently used result.
+ * The index entry goes first, so a crash can only leave a file that is
+ * adopted again on the next open. The cache must be locked.
+ */
+static void evict_oldest(DiskCache* cache)
+{
+    CacheEntry* entries = cache->index->entries;
+    int oldest = -1;
+    for (int i = 0; i < CACHE_INDEX_SLOTS; i++) {
+        if (entries[i].size
+                && (oldest == -1
+                        || entries[i].lastUsed < entries[oldest].lastUsed)) {
+            oldest = i;
+        }
+    }
+    if (oldest == -1) {
+        return;
+    }
+    char name[RESULT_NAME_LENGTH + 1];
+    sprintf(name, cacheResultFormat, entries[oldest].key,
+            entries[oldest].check);
+    remove_entry(cache, oldest);
+    unlinkat(cache->dirHandle, name, 0);
+}
+
+/* make_room()
+ * -----------
+ * Private helper function that evicts results until one of the given size
+ * fits. The cache must be locked.
+ */
+static void make_room(DiskCache* cache, long unsigned int size)
+{
+    while (cache->numEntries
+            && (cache->usedBytes + size > cache->maxBytes
+                    || cache->numEntries >= CACHE_INDEX_SLOTS * 3 / 4)) {
+        evict_oldest(cache);
+    }
+}
+
+/* parse_result_name()
+ * -------------------
+ * Private helper function that recovers the hashes from a result file
+ * name.
+ *
+ * returns: true if name is a result file name.
+ */
+static bool parse_result_name(const char* name, uint64_t* key, uint64_t* check)
+{
+    if (strlen(name) != RESULT_NAME_LENGTH
+            || strcmp(name + RESULT_NAME_LENGTH - 4, ".png")) {
+        return false;
+    }
+    char digits[17] = {0};
+    for (int i = 0; i < 32; i++) {
+        if (!strchr("0123456789abcdef", name[i])) {
+            return false;
+        }
+    }
+    memcpy(digits, name, 16);
+    *key = strtoull(digits, NULL, 16);
+    memcpy(digits, name + 16, 16);
+    *check = strtoull(digits, NULL, 16);
+    return true;
+}
+
+/* warm_index()
+ * ------------
+ * Private helper function that rebuilds the index from the result files
+ * present, taking each size from the directory entry rather than reading
+ * the file. Last use is carried over from the old index where it knew the
+ * result, and files it did not know, left by a crash between renaming and
+ * indexing, count as least recently used. Temporary files are deleted.
+ *
+ * returns: 0 on success, or -1 if the directory cannot be read.
+ */
+static int warm_index(DiskCache* cache)
+{
+    CacheIndex* index = cache->index;
+    CacheEntry* previous = NULL;
+    if (index->magic == cacheIndexMagic && index->version == cacheIndexVersion
+            && index->slots == CACHE_INDEX_SLOTS) {
+        previous = malloc(sizeof(index->entries));
+        memcpy(previous, index->entries, sizeof(index->entries));
+    } else {
+        index->clock = 0;
+    }
+    memset(index->entries, 0, sizeof(index->entries));
+    index->magic = cacheIndexMagic;
+    index->version = cacheIndexVersion;
+    index->slots = CACHE_INDEX_SLOTS;
+
+    DIR* dir = fdopendir(dup(cache->dirHandle));
+    if (!dir) {
+        free(previous);
+        return -1;
+    }
+    struct dirent* file;
+    while ((file = readdir(dir))) {
+        uint64_t key;
+        uint64_t check;
+        struct stat info;
+        if (!strncmp(file->d_name, cacheTempPrefix, strlen(cacheTempPrefix))) {
+            unlinkat(cache->dirHandle, file->d_name, 0);
+            continue;
+        }
+        if (!parse_result_name(file->d_name, &key, &check)
+                || fstatat(cache->dirHandle, file->d_name, &info, 0)
+                || !S_ISREG(info.st_mode)) {
+            continue;
+        }
+        if (!info.st_size) { // Cannot be a result, nor be indexed.
+            unlinkat(cache->dirHandle, file->d_name, 0);
+            continue;
+        }
+        CacheEntry entry = {key, check, info.st_size, 0};
+        int known = previous ? find_entry(previous, key, check) : -1;
+        if (known != -1) {
+            entry.lastUsed = previous[known].lastUsed;
+        }
+        make_room(cache, 0);
+        insert_entry(cache, entry);
+    }
+    closedir(dir);
+    free(previous);
+    make_room(cache, 0);
+    return 0;
+}
+
+/* result_hashes()
+ * ---------------
+ * Private helper function that hashes a transform's parsed operations and
+ * image twice, with independent seeds, into its key and check.
+ */
+static void result_hashes(const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer, uint64_t* key,
+        uint64_t* check)
+{
+    long unsigned int opsLength = sizeof(int) * cmdBuffer.numCmds;
+    *key = hash_bytes(cmdBuffer.buffer, opsLength, hashInitialSeed);
+    *key = hash_bytes(image, length, *key);
+    *check = hash_bytes(cmdBuffer.buffer, opsLength, cacheCheckSeed);
+    *check = hash_bytes(image, length, *check);
+}
+
+int disk_cache_lookup(DiskCache* cache, const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer,
+        long unsigned int* size)
+{
+    if (!cache) {
+        return -1;
+    }
+    uint64_t key;
+    uint64_t check;
+    result_hashes(image, length, cmdBuffer, &key, &check);
+    char name[RESULT_NAME_LENGTH + 1];
+    sprintf(name, cacheResultFormat, key, check);
+
+    sem_wait(&(cache->lock));
+    int slot = find_entry(cache->index->entries, key, check);
+    int handle = -1;
+    struct stat info;
+    if (slot != -1) {
+        handle = openat(cache->dirHandle, name, O_RDONLY);
+        if (handle != -1 && !fstat(handle, &info)
+                && (uint64_t)info.st_size == cache->index->entries[slot].size) {
+            cache->index->entries[slot].lastUsed = ++cache->index->clock;
+            *size = info.st_size;
+        } else { // Removed or damaged behind the cache's back.
+            if (handle != -1) {
+                close(handle);
+                handle = -1;
+            }
+            remove_entry(cache, slot);
+        }
+    }
+    sem_post(&(cache->lock));
+    return handle;
+}
+
+/* write_temp_result()
+ * -------------------
+ * Private helper function that writes a result to a new temporary file in
+ * the cache directory and flushes it to disk.
+ *
+ * name: populated with the temporary file's name.
+ *
+ * returns: 0 on success, otherwise -1 with no file left behind.
+ */
+static int write_temp_result(DiskCache* cache, const unsigned char* data,
+        long unsigned int dataLen, char* name)
+{
+    sem_wait(&(cache->lock));
+    unsigned int number = cache->nextTemp++;
+    sem_post(&(cache->lock));
+    sprintf(name, "%s%i-%u", cacheTempPrefix, (int)getpid(), number);
+    int handle = openat(cache->dirHandle, name,
+            O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (handle == -1) {
+        return -1;
+    }
+    long unsigned int written = 0;
+    while (written < dataLen) {
+        ssize_t chunk = write(handle, data + written, dataLen - written);
+        if (chunk == -1 && errno != EINTR) {
+            break;
+        }
+        written += chunk > 0 ? chunk : 0;
+    }
+    // Only a result fully on disk may be renamed into place.
+    if (written < dataLen || fsync(handle)) {
+        close(handle);
+        unlinkat(cache->dirHandle, name, 0);
+        return -1;
+    }
+    close(handle);
+    return 0;
+}
+
+/* store_result()
+ * --------------
+ * Private helper function that writes a result to a temporary file, then
+ * renames it into place and indexes it, evicting as needed. Results that
+ * cannot be written are dropped.
+ */
+static void store_result(DiskCache* cache, PendingResult* result)
+{
+    char name[RESULT_NAME_LENGTH + 1];
+    sprintf(name, cacheResultFormat, result->key, result->check);
+    char tempName[RESULT_NAME_LENGTH + 1];
+    if (write_temp_result(cache, result->data, result->length, tempName)) {
+        return;
+    }
+    sem_wait(&(cache->lock));
+    if (find_entry(cache->index->entries, result->key, result->check) == -1) {
+        make_room(cache, result->length);
+    }
+    if (renameat(cache->dirHandle, tempName, cache->dirHandle, name)) {
+        unlinkat(cache->dirHandle, tempName, 0);
+    } else {
+        CacheEntry entry = {result->key, result->check, result->length,
+                ++cache->index->clock};
+        insert_entry(cache, entry);
+    }
+    sem_post(&(cache->lock));
+}
+
+/* write_results()
+ * ---------------
+ * Private thread function that stores queued results one at a time, so
+ * no request waits on the disk.
+ *
+ * data: the DiskCache to store in.
+ *
+ * returns: never returns.
+ */
+static void* write_results(void* data)
+{
+    DiskCache* cache = (DiskCache*)data;
+    while (1) {
+        sem_wait(&(cache->pending));
+        sem_wait(&(cache->lock));
+        PendingResult* result = cache->pendingHead;
+        cache->pendingHead = result->next;
+        if (!cache->pendingHead) {
+            cache->pendingTail = NULL;
+        }
+        sem_post(&(cache->lock));
+
+        store_result(cache, result);
+
+        sem_wait(&(cache->lock));
+        cache->pendingBytes -= result->length;
+        sem_post(&(cache->lock));
+        free(result->data);
+        free(result);
+    }
+    return NULL;
+}
+
+void disk_cache_store(DiskCache* cache, const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer,
+        const unsigned char* data, long unsigned int dataLen)
+{
+    if (!cache || !dataLen || dataLen > cache->maxBytes) {
+        return;
+    }
+    PendingResult* result = malloc(sizeof(PendingResult));
+    result_hashes(image, length, cmdBuffer, &result->key, &result->check);
+    result->length = dataLen;
+    result->next = NULL;
+
+    sem_wait(&(cache->lock));
+    bool queued = cache->pendingBytes + dataLen <= maxPendingBytes;
+    if (queued) { // Otherwise the disk is behind, so skip this result.
+        cache->pendingBytes += dataLen;
+        result->data = malloc(dataLen);
+        memcpy(result->data, data, dataLen);
+        if (cache->pendingTail) {
+            cache->pendingTail->next = result;
+        } else {
+            cache->pendingHead = result;
+        }
+        cache->pendingTail = result;
+    }
+    sem_post(&(cache->lock));
+    if (queued) {
+        sem_post(&(cache->pending));
+    } else {
+        free(result);
+    }
+}
+
+DiskCache* open_disk_cache(const char* dir, long unsigned int maxBytes)
+{
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        return NULL;
+    }
+    int dirHandle = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirHandle == -1) {
+        return NULL;
+    }
+    int indexHandle
+            = openat(dirHandle, cacheIndexName, O_RDWR | O_CREAT, 0644);
+    if (indexHandle == -1 || ftruncate(indexHandle, sizeof(CacheIndex))) {
+        close(dirHandle);
+        if (indexHandle != -1) {
+            close(indexHandle);
+        }
+        return NULL;
+    }
+    CacheIndex* index = mmap(NULL, sizeof(CacheIndex),
+            PROT_READ | PROT_WRITE, MAP_SHARED, indexHandle, 0);
+    close(indexHandle); // The mapping keeps the file open.
+    if (index == MAP_FAILED) {
+        close(dirHandle);
+        return NULL;
+    }
+
+    DiskCache* cache = calloc(1, sizeof(DiskCache));
+    cache->dirHandle = dirHandle;
+    cache->index = index;
+    cache->maxBytes = maxBytes;
+    sem_init(&(cache->lock), 0, 1);
+    sem_init(&(cache->pending), 0, 0);
+    if (warm_index(cache)) {
+        munmap(index, sizeof(CacheIndex));
+        close(dirHandle);
+        free(cache);
+        return NULL;
+    }
+    pthread_t writerID;
+    pthread_create(&writerID, NULL, write_results, cache);
+    pthread_detach(writerID);
+    return cache;
+}
@@ -0,0 +1,69 @@
+#ifndef DISKCACHE_H
+#define DISKCACHE_H
+
+#include "argparsing.h"
+
+/* On-disk cache of encoded transform results, kept across restarts. Each
+ * result lives in its own file named by the hash of the image and parsed
+ * operations that produced it. A fixed size index of file sizes and last
+ * use, memory mapped from the same directory, keeps lookups and least
+ * recently used eviction off the filesystem. Results are written to a
+ * temporary file and renamed into place, so a crash never leaves a partial
+ * result under a real name, and the index is rebuilt from file names and
+ * sizes on open, so one torn by a crash costs nothing but a few misses.
+ * Results are written by a background thread, so no request waits on the
+ * disk. A cache directory must only be used by one server at a time. */
+
+typedef struct DiskCache DiskCache;
+
+/* open_disk_cache()
+ * -----------------
+ * Opens, or creates, a cache directory and warms its index from the files
+ *      present, without reading any payloads. Stray temporary files from an
+ *      earlier crash are removed and the cache is trimmed to its bound.
+ *      Starts the thread that writes results, so must be called with the
+ *      signal mask that thread should have.
+ *
+ * dir: the cache directory, created if missing.
+ * maxBytes: the most the cached results may take up.
+ *
+ * returns: the cache, or NULL if the directory or index cannot be used.
+ */
+DiskCache* open_disk_cache(const char* dir, long unsigned int maxBytes);
+
+/* disk_cache_lookup()
+ * -------------------
+ * Looks for the cached result of a transform, marking it recently used.
+ *
+ * cache: the cache to look in. May be NULL.
+ * image: the encoded source image.
+ * length: the number of bytes in image.
+ * cmdBuffer: the parsed operations.
+ * size: set to the size of the cached result if found.
+ *
+ * returns: a read only descriptor for the cached result, which the caller
+ *      must close, or -1 if not cached.
+ */
+int disk_cache_lookup(DiskCache* cache, const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer,
+        long unsigned int* size);
+
+/* disk_cache_store()
+ * ------------------
+ * Queues a copy of a transform's result to be cached, evicting the least
+ *      recently used results as needed to stay within bounds. Results are
+ *      dropped if the disk falls too far behind, and failures leave the
+ *      cache as it was.
+ *
+ * cache: the cache to store in. May be NULL.
+ * image: the encoded source image.
+ * length: the number of bytes in image.
+ * cmdBuffer: the parsed operations.
+ * data: the encoded result.
+ * dataLen: the number of bytes in data.
+ */
+void disk_cache_store(DiskCache* cache, const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer,
+        const unsigned char* data, long unsigned int dataLen);
+
+#endif // DISKCACHE_H
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "forkjoin.h"
+#include "ioutils.h"
+
+/* forkbench
+ * ---------
+ * Benchmarks the shared work-stealing pool against every request starting
+ * threads of its own, as kernels once did. Each simulated request fills the
+ * rows of an image with a resampling-like kernel, split into bands. For one
+ * request, as many as there are CPUs and four times as many, all running at
+ * once, the median and worst request latency and the total throughput are
+ * printed for each way of splitting the work.
+ *
+ * Usage: forkbench [width height], defaulting to 3000 by 2000.
+ */
+
+const char* const forkUsageMessage = "Usage: forkbench [width height]\n";
+
+const char* const forkHeaderFormat = "%-8s %8s %10s %10s %12s\n";
+const char* const forkRowFormat = "%-8s %8i %10.2f %10.2f %12.1f\n";
+
+const int defaultForkWidth = 3000;
+const int defaultForkHeight = 2000;
+
+// Requests each simulated client makes, and fewest rows to a band.
+#define FORK_REQUESTS 8
+const int forkMinRows = 32;
+
+/* One simulated request's image */
+typedef struct ForkImage {
+    unsigned char* pixels;
+    int width;
+    int height;
+    int numBands;
+} ForkImage;
+
+/* A simulated client, making requests one after another */
+typedef struct ForkClient {
+    bool pooled;
+    int width;
+    int height;
+    double latenciesMs[FORK_REQUESTS];
+} ForkClient;
+
+/* A band of rows for a spawned thread */
+typedef struct ForkBand {
+    ForkImage* image;
+    int band;
+} ForkBand;
+
+/* fill_rows()
+ * -----------
+ * Private task function that fills one band of an image, blending a few
+ *      samples per pixel as a bilinear resample would.
+ */
+static void fill_rows(void* job, int band)
+{
+    ForkImage* image = (ForkImage*)job;
+    int first = (long)image->height * band / image->numBands;
+    int end = (long)image->height * (band + 1) / image->numBands;
+    for (int y = first; y < end; y++) {
+        unsigned char* row = image->pixels + (long)y * image->width;
+        for (int x = 0; x < image->width; x++) {
+            unsigned sum = 0;
+            for (int s = 0; s < 4; s++) {
+                sum += ((x + s) * 7 + (y + s) * 13) & 0xFF;
+            }
+            row[x] = sum / 4;
+        }
+    }
+}
+
+/* fill_spawned_band()
+ * -------------------
+ * Private thread function that fills a band on a thread of its own.
+ */
+static void* fill_spawned_band(void* data)
+{
+    ForkBand* band = (ForkBand*)data;
+    fill_rows(band->image, band->band);
+    return NULL;
+}
+
+/* fill_spawned()
+ * --------------
+ * Private helper function that fills an image as kernels did before the
+ *      pool, starting a thread per band, a band per CPU.
+ */
+static void fill_spawned(ForkImage* image)
+{
+    ForkBand* bands = malloc(sizeof(ForkBand) * image->numBands);
+    pthread_t* threads = malloc(sizeof(pthread_t) * image->numBands);
+    for (int i = 0; i < image->numBands; i++) {
+        ForkBand band = {image, i};
+        bands[i] = band;
+        if (i) {
+            pthread_create(&threads[i], NULL, fill_spawned_band, &bands[i]);
+        }
+    }
+    fill_rows(image, 0);
+    for (int i = 1; i < image->numBands; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    free(bands);
+}
+
+/* run_client()
+ * ------------
+ * Private thread function that makes a client's requests, timing each.
+ */
+static void* run_client(void* data)
+{
+    ForkClient* client = (ForkClient*)data;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int numBands = client->height / forkMinRows;
+    int most = client->pooled ? fork_join_threads() * 4 : cpus;
+    ForkImage image = {malloc((long)client->width * client->height),
+            client->width, client->height, numBands < most ? numBands : most};
+    for (int i = 0; i < FORK_REQUESTS; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (client->pooled) {
+            fork_join(image.numBands, fill_rows, &image);
+        } else {
+            fill_spawned(&image);
+        }
+        client->latenciesMs[i] = elapsed_ms(start);
+    }
+    free(image.pixels);
+    return NULL;
+}
+
+/* compare_latencies()
+ * -------------------
+ * Private qsort comparison function for ascending doubles.
+ */
+static int compare_latencies(const void* a, const void* b)
+{
+    double difference = *(const double*)a - *(const double*)b;
+    return (difference > 0) - (difference < 0);
+}
+
+/* run_clients()
+ * -------------
+ * Private helper function that runs clients all at once and prints their
+ *      latencies and throughput.
+ */
+static void run_clients(bool pooled, int numClients, int width, int height)
+{
+    ForkClient* clients = calloc(numClients, sizeof(ForkClient));
+    pthread_t* threads = malloc(sizeof(pthread_t) * numClients);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < numClients; i++) {
+        ForkClient client = {pooled, width, height, {0}};
+        clients[i] = client;
+        pthread_create(&threads[i], NULL, run_client, &clients[i]);
+    }
+    for (int i = 0; i < numClients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    double totalMs = elapsed_ms(start);
+    int numLatencies = numClients * FORK_REQUESTS;
+    double* latenciesMs = malloc(sizeof(double) * numLatencies);
+    for (int i = 0; i < numLatencies; i++) {
+        latenciesMs[i] = clients[i / FORK_REQUESTS]
+                                 .latenciesMs[i % FORK_REQUESTS];
+    }
+    qsort(latenciesMs, numLatencies, sizeof(double), compare_latencies);
+    printf(forkRowFormat, pooled ? "pool" : "spawn", numClients,
+            latenciesMs[numLatencies / 2], latenciesMs[numLatencies - 1],
+            numLatencies * 1000.0 / totalMs);
+    free(latenciesMs);
+    free(threads);
+    free(clients);
+}
+
+/* Entry point for the fork/join benchmark */
+int main(int argc, char** argv)
+{
+    int width = defaultForkWidth;
+    int height = defaultForkHeight;
+    if (argc == 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if ((argc != 1 && argc != 3) || width <= 0 || height <= 0) {
+        fprintf(stderr, forkUsageMessage);
+        return 1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%ix%i, %li CPUs, %i requests per client, latency in ms\n", width,
+            height, cpus, FORK_REQUESTS);
+    printf(forkHeaderFormat, "mode", "clients", "p50", "max", "requests/s");
+    int clientCounts[] = {1, cpus, 4 * cpus};
+    for (int i = 0; i < 3; i++) {
+        if (i && clientCounts[i] == clientCounts[i - 1]) {
+            continue; // A single CPU.
+        }
+        run_clients(false, clientCounts[i], width, height);
+        run_clients(true, clientCounts[i], width, height);
+    }
+    return 0;
+}
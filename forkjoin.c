@@ -0,0 +1,343 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+
+#include "forkjoin.h"
+
+// Tasks a deque holds before it first grows.
+const int initialDequeSize = 64;
+
+/* The tasks forked by one fork_join(), and how many are yet to finish */
+typedef struct Join {
+    void (*run)(void* job, int task);
+    void* job;
+    int pending;
+    sem_t lock; // Guards pending.
+    sem_t done; // Posted once pending reaches 0.
+} Join;
+
+/* A forked task, waiting in a deque */
+typedef struct Task {
+    Join* join;
+    int index;
+} Task;
+
+/* A ring of tasks. The owner pushes and pops at the bottom, and thieves
+ * take from the top. */
+typedef struct Deque {
+    Task* tasks;
+    int size;
+    int top; // Index of the oldest task.
+    int count;
+    sem_t lock;
+    int node; // Index of the node the deque's worker runs on.
+    int* victims; // The other deques, those on the same node first.
+} Deque;
+
+/* The pool, started on first use */
+typedef struct ForkJoinPool {
+    Topology* topology; // NULL if unplaced.
+    bool pinCores;
+    int numWorkers;
+    int numDeques; // One per worker, then one per node for outside threads.
+    Deque* deques;
+    sem_t work; // Posted for each task forked, waking an idle worker.
+    int numNodes;
+    int* nextHome; // Per node, the deque the next outside thread is given.
+    sem_t homeLock;
+} ForkJoinPool;
+
+/* Where a worker runs */
+typedef struct Worker {
+    int index; // Also its deque's.
+    int cpu; // -1 if unplaced.
+} Worker;
+
+static ForkJoinPool pool;
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+
+// The deque this thread pushes to, -1 until it first forks.
+static __thread int homeDeque = -1;
+// Whether this thread is one of the pool's workers.
+static __thread bool poolWorker = false;
+
+/* push_task()
+ * -----------
+ * Private helper function that adds a task to the bottom of a deque,
+ *      growing it if full.
+ */
+static void push_task(Deque* deque, Task task)
+{
+    sem_wait(&(deque->lock));
+    if (deque->count == deque->size) {
+        Task* grown = malloc(sizeof(Task) * deque->size * 2);
+        for (int i = 0; i < deque->count; i++) {
+            grown[i] = deque->tasks[(deque->top + i) % deque->size];
+        }
+        free(deque->tasks);
+        deque->tasks = grown;
+        deque->top = 0;
+        deque->size *= 2;
+    }
+    deque->tasks[(deque->top + deque->count) % deque->size] = task;
+    deque->count++;
+    sem_post(&(deque->lock));
+}
+
+/* take_task()
+ * -----------
+ * Private helper function that removes a task from a deque, the newest
+ *      from the bottom for its owner, or the oldest from the top for a
+ *      thief. An owner may ask for the newest only if it belongs to a
+ *      given join.
+ *
+ * returns: false if the deque was empty, or its newest task was another
+ *      join's.
+ */
+static bool take_task(Deque* deque, bool newest, Join* of, Task* task)
+{
+    sem_wait(&(deque->lock));
+    bool taken = deque->count > 0;
+    if (taken && newest) {
+        Task bottom
+                = deque->tasks[(deque->top + deque->count - 1) % deque->size];
+        taken = !of || bottom.join == of;
+        if (taken) {
+            *task = bottom;
+            deque->count--;
+        }
+    } else if (taken) {
+        *task = deque->tasks[deque->top];
+        deque->top = (deque->top + 1) % deque->size;
+        deque->count--;
+    }
+    sem_post(&(deque->lock));
+    return taken;
+}
+
+/* find_task()
+ * -----------
+ * Private helper function that takes the newest task in a thread's own
+ *      deque, or failing that steals the oldest from the nearest deque that
+ *      has any.
+ *
+ * returns: false if every deque was empty.
+ */
+static bool find_task(int home, Task* task)
+{
+    if (take_task(&(pool.deques[home]), true, NULL, task)) {
+        return true;
+    }
+    for (int i = 0; i < pool.numDeques - 1; i++) {
+        if (take_task(&(pool.deques[pool.deques[home].victims[i]]), false,
+                    NULL, task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* run_task()
+ * ----------
+ * Private helper function that runs a forked task and counts it finished,
+ *      waking its join if it was the last.
+ */
+static void run_task(Task task)
+{
+    Join* join = task.join;
+    join->run(join->job, task.index);
+    sem_wait(&(join->lock));
+    bool last = --join->pending == 0;
+    sem_post(&(join->lock));
+    if (last) {
+        sem_post(&(join->done));
+    }
+}
+
+/* work()
+ * ------
+ * Private thread function for a pool worker, running tasks from its own
+ *      deque and stealing when it runs out, sleeping while there are none.
+ *
+ * data: the worker's Worker.
+ *
+ * returns: never.
+ */
+static void* work(void* data)
+{
+    Worker* worker = (Worker*)data;
+    homeDeque = worker->index;
+    poolWorker = true;
+    if (worker->cpu >= 0) {
+        pin_thread(pool.topology, pool.deques[homeDeque].node,
+                pool.pinCores ? worker->cpu : -1);
+    }
+    while (1) {
+        Task task;
+        if (find_task(homeDeque, &task)) {
+            run_task(task);
+        } else {
+            sem_wait(&(pool.work));
+        }
+    }
+    return NULL;
+}
+
+/* order_victims()
+ * ---------------
+ * Private helper function that lists the deques a deque's thread steals
+ *      from, starting after its own and taking those on its node first.
+ */
+static void order_victims(int home)
+{
+    Deque* deque = &(pool.deques[home]);
+    deque->victims = malloc(sizeof(int) * pool.numDeques);
+    int numVictims = 0;
+    for (int sameNode = 1; sameNode >= 0; sameNode--) {
+        for (int i = 1; i < pool.numDeques; i++) {
+            int victim = (home + i) % pool.numDeques;
+            if ((pool.deques[victim].node == deque->node) == sameNode) {
+                deque->victims[numVictims++] = victim;
+            }
+        }
+    }
+}
+
+/* start_pool()
+ * ------------
+ * Private helper function that starts a worker for each CPU bar one, dealt
+ *      out node by node if the pool was placed. If a worker cannot be
+ *      started the pool makes do with fewer.
+ */
+static void start_pool(void)
+{
+    Topology* topology = pool.topology;
+    int numCpus = 0;
+    for (int i = 0; topology && i < topology->numNodes; i++) {
+        numCpus += topology->nodes[i].numCpus;
+    }
+    long cpus = topology ? numCpus : sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus > 1 ? cpus - 1 : 0;
+    Worker* workers = malloc(sizeof(Worker) * (wanted ? wanted : 1));
+    pool.numNodes = topology ? topology->numNodes : 1;
+    pool.numDeques = wanted + pool.numNodes;
+    pool.deques = calloc(pool.numDeques, sizeof(Deque));
+    int node = 0;
+    int nodeCpu = 0;
+    for (int i = 0; i < pool.numDeques; i++) {
+        pool.deques[i].size = initialDequeSize;
+        pool.deques[i].tasks = malloc(sizeof(Task) * initialDequeSize);
+        sem_init(&(pool.deques[i].lock), 0, 1);
+        if (i >= wanted) { // Outside threads' deques, one per node.
+            pool.deques[i].node = i - wanted;
+            continue;
+        }
+        Worker worker = {i, -1};
+        if (topology) {
+            while (nodeCpu == topology->nodes[node].numCpus) {
+                node++;
+                nodeCpu = 0;
+            }
+            worker.cpu = topology->nodes[node].cpus[nodeCpu++];
+            pool.deques[i].node = node;
+        }
+        workers[i] = worker;
+    }
+    for (int i = 0; i < pool.numDeques; i++) {
+        order_victims(i);
+    }
+    sem_init(&(pool.work), 0, 0);
+    sem_init(&(pool.homeLock), 0, 1);
+    pool.nextHome = calloc(pool.numNodes, sizeof(int));
+    for (int i = 0; i < wanted; i++) {
+        pthread_t workerID;
+        if (!pthread_create(&workerID, NULL, work, &workers[i])) {
+            pthread_detach(workerID);
+            pool.numWorkers++;
+        }
+    }
+}
+
+/* choose_home()
+ * -------------
+ * Private helper function that gives a thread outside the pool a deque on
+ *      its node to push to, taking turns between them.
+ */
+static int choose_home(void)
+{
+    int node = current_node(pool.topology);
+    sem_wait(&(pool.homeLock));
+    int home = -1;
+    for (int turn = 0; home == -1; turn++) {
+        int candidate = (pool.nextHome[node] + turn) % pool.numDeques;
+        if (pool.deques[candidate].node == node) {
+            home = candidate;
+        }
+    }
+    pool.nextHome[node] = (home + 1) % pool.numDeques;
+    sem_post(&(pool.homeLock));
+    return home;
+}
+
+void fork_join_place(Topology* topology, bool pinCores)
+{
+    pool.topology = topology;
+    pool.pinCores = pinCores;
+}
+
+void fork_join(int numTasks, void (*run)(void* job, int task), void* job)
+{
+    pthread_once(&poolOnce, start_pool);
+    if (numTasks <= 1 || !pool.numWorkers) {
+        for (int i = 0; i < numTasks; i++) {
+            run(job, i);
+        }
+        return;
+    }
+    if (homeDeque == -1) {
+        homeDeque = choose_home();
+    }
+
+    Join join = {.run = run, .job = job, .pending = numTasks - 1};
+    sem_init(&(join.lock), 0, 1);
+    sem_init(&(join.done), 0, 0);
+    // Pushed last first, so this thread takes them back in order.
+    for (int i = numTasks - 1; i > 0; i--) {
+        Task task = {&join, i};
+        push_task(&(pool.deques[homeDeque]), task);
+    }
+    for (int i = 1; i < numTasks && i <= pool.numWorkers; i++) {
+        sem_post(&(pool.work));
+    }
+    run(job, 0);
+
+    // Help until the tasks are all done or taken, then wait for the last to
+    // post done, which must happen before join leaves the stack. A thread
+    // outside the pool shares its deque, so helps only with its own tasks
+    // rather than run another request's while its own waits.
+    while (1) {
+        sem_wait(&(join.lock));
+        bool finished = !join.pending;
+        sem_post(&(join.lock));
+        Task task;
+        bool found = !finished
+                && (poolWorker ? find_task(homeDeque, &task)
+                               : take_task(&(pool.deques[homeDeque]), true,
+                                       &join, &task));
+        if (!found) {
+            sem_wait(&(join.done));
+            break;
+        }
+        run_task(task);
+    }
+    sem_destroy(&(join.done));
+    sem_destroy(&(join.lock));
+}
+
+int fork_join_threads(void)
+{
+    pthread_once(&poolOnce, start_pool);
+    return pool.numWorkers + 1;
+}
@@ -0,0 +1,61 @@
+#ifndef FORKJOIN_H
+#define FORKJOIN_H
+
+#include <stdbool.h>
+
+#include "topology.h"
+
+/* A work-stealing pool shared by every request in the process, so kernels
+ * split across cores never start threads of their own. There is one worker
+ * for each CPU bar one, the thread forking the work making up the last, and
+ * each worker has its own deque. Forked tasks go on the bottom of the
+ * forking thread's deque, where it takes them back most recent first, and
+ * idle workers steal the oldest from the top of any other. A request alone
+ * on the machine is spread over every core, while under load the workers
+ * are busy with their own and each request mostly runs its own tasks, on
+ * its own thread. Threads outside the pool, such as connection threads,
+ * are each given a deque to push to, shared round robin.
+ *
+ * Once placed on a topology, workers are pinned to their node or core and
+ * steal from deques on their own node before reaching across to another,
+ * and outside threads push to deques on the node they run on. Unplaced,
+ * the pool treats the machine as one node and leaves placement to the
+ * kernel.
+ *
+ * A worker joining its tasks runs any others it can find while it waits,
+ * so tasks may fork and join tasks of their own. An outside thread joining
+ * runs only the tasks of that join, so a connection thread never takes up
+ * another request's work. Tasks must not block on anything but the joins
+ * of their own forks. */
+
+/* fork_join()
+ * -----------
+ * Runs run(job, task) for each task in [0, numTasks), spread over the pool,
+ *      and returns once all have finished. Task 0 is run on this thread.
+ *
+ * numTasks: the number of tasks.
+ * run: the task body.
+ * job: passed on to run.
+ */
+void fork_join(int numTasks, void (*run)(void* job, int task), void* job);
+
+/* fork_join_place()
+ * -----------------
+ * Sets where the pool's workers run. Only has effect if called before the
+ *      pool is first used. Workers are dealt to the CPUs node by node, one
+ *      to each CPU bar one.
+ *
+ * topology: the machine's topology, kept for the life of the process.
+ * pinCores: whether each worker is pinned to a single CPU, rather than to
+ *      its node's.
+ */
+void fork_join_place(Topology* topology, bool pinCores);
+
+/* fork_join_threads()
+ * -------------------
+ * returns: the most threads a fork_join() can use at once, the pool's
+ *      workers and the thread forking.
+ */
+int fork_join_threads(void);
+
+#endif // FORKJOIN_H
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "ioutils.h"
+#include "pixelformat.h"
+#include "stringutils.h"
+
+/* formatbench
+ * -----------
+ * Benchmarks the kernels specialised to each canonical pixel layout against
+ * FreeImage, for bitmaps decoded in each common format. For every format the
+ * time to bring the bitmap into its canonical layout is printed, then for
+ * each operation the median time FreeImage takes on the bitmap as decoded
+ * and the median time the operation takes through the request's kernel
+ * table, with how many times faster the kernels were. A rotation followed
+ * by a scale is fused into one resample, timing the resampling kernels.
+ *
+ * Usage: formatbench [width height], defaulting to 3000 by 2000.
+ */
+
+const char* const formatUsageMessage = "Usage: formatbench [width height]\n";
+
+const char* const formatHeaderFormat = "%-8s %10s %-10s %10s %10s %8s\n";
+const char* const formatRowFormat
+        = "%-8s %10.2f %-10s %10.2f %10.2f %7.2fx\n";
+
+const int defaultFormatWidth = 3000;
+const int defaultFormatHeight = 2000;
+
+// Times each operation is repeated, the median being reported.
+#define FORMAT_REPEATS 5
+
+/* A format images are commonly decoded into */
+typedef struct BenchFormat {
+    const char* name;
+    int bitsPerPixel;
+    bool grey; // Of 8 bit formats, whether the palette is a ramp of greys.
+} BenchFormat;
+
+const BenchFormat benchFormats[] = {{"pal8", 8, false}, {"grey8", 8, true},
+        {"rgb565", 16, false}, {"bgr24", 24, false}, {"bgra32", 32, false}};
+const int numBenchFormats = sizeof(benchFormats) / sizeof(benchFormats[0]);
+
+/* Operations timed, and the address that asks for them */
+typedef struct BenchOperation {
+    const char* name;
+    const char* address;
+} BenchOperation;
+
+const BenchOperation benchOperations[] = {{"rotate", "/rotate,37"},
+        {"flip", "/flip,h"}, {"rot+scale", "/rotate,37/scale,1000,700"}};
+const int numBenchOperations
+        = sizeof(benchOperations) / sizeof(benchOperations[0]);
+
+/* make_format()
+ * -------------
+ * Private helper function that allocates a bitmap of a format filled with
+ *      a gradient, with a colourful or grey palette if it has one.
+ */
+static FIBITMAP* make_format(BenchFormat format, int width, int height)
+{
+    FIBITMAP* bitmap = format.bitsPerPixel == 16
+            ? FreeImage_Allocate(width, height, 16, FI16_565_RED_MASK,
+                    FI16_565_GREEN_MASK, FI16_565_BLUE_MASK)
+            : FreeImage_Allocate(width, height, format.bitsPerPixel,
+                    FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+    RGBQUAD* palette = FreeImage_GetPalette(bitmap);
+    for (int i = 0; palette && i < 256; i++) {
+        palette[i].rgbRed = i;
+        palette[i].rgbGreen = format.grey ? i : 255 - i;
+        palette[i].rgbBlue = format.grey ? i : (i * 7) & 0xFF;
+    }
+    int bytes = format.bitsPerPixel / 8;
+    for (int y = 0; y < height; y++) {
+        BYTE* row = FreeImage_GetScanLine(bitmap, y);
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < bytes; c++) {
+                row[x * bytes + c] = (x * (c + 1) + y * (3 - c)) & 0xFF;
+            }
+        }
+    }
+    return bitmap;
+}
+
+/* run_freeimage()
+ * ---------------
+ * Private helper function that does one of the benchmark's operations on a
+ *      copy of a bitmap with FreeImage alone, as before kernels were
+ *      specialised.
+ */
+static void run_freeimage(FIBITMAP* bitmap, CommandBuffer cmdBuffer)
+{
+    FIBITMAP* copy = FreeImage_Clone(bitmap);
+    if (cmdBuffer.buffer[0] == CMD_FLIP) {
+        FreeImage_FlipHorizontal(copy);
+    } else {
+        FIBITMAP* rotated = FreeImage_Rotate(copy, cmdBuffer.buffer[1], NULL);
+        if (cmdBuffer.numCmds > 2) {
+            FIBITMAP* scaled = FreeImage_Rescale(rotated, cmdBuffer.buffer[3],
+                    cmdBuffer.buffer[4], FILTER_BILINEAR);
+            FreeImage_Unload(rotated);
+            rotated = scaled;
+        }
+        FreeImage_Unload(rotated);
+    }
+    FreeImage_Unload(copy);
+}
+
+/* run_kernels()
+ * -------------
+ * Private helper function that does one operation on a copy of a
+ *      canonical bitmap through the kernel table, as requests now do.
+ */
+static void run_kernels(FIBITMAP* bitmap, CommandBuffer cmdBuffer)
+{
+    FIBITMAP* copy = FreeImage_Clone(bitmap);
+    apply_cmd_buffer_to_image(&copy, cmdBuffer, NULL, NULL);
+    FreeImage_Unload(copy);
+}
+
+/* compare_times()
+ * ---------------
+ * Private qsort comparison function for ascending doubles.
+ */
+static int compare_times(const void* a, const void* b)
+{
+    double difference = *(const double*)a - *(const double*)b;
+    return (difference > 0) - (difference < 0);
+}
+
+/* median_run_ms()
+ * ---------------
+ * Private helper function that times repeated runs of an operation.
+ *
+ * returns: the median time of one run in milliseconds.
+ */
+static double median_run_ms(void (*run)(FIBITMAP*, CommandBuffer),
+        FIBITMAP* bitmap, CommandBuffer cmdBuffer)
+{
+    double timesMs[FORMAT_REPEATS];
+    for (int i = 0; i < FORMAT_REPEATS; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        run(bitmap, cmdBuffer);
+        timesMs[i] = elapsed_ms(start);
+    }
+    qsort(timesMs, FORMAT_REPEATS, sizeof(double), compare_times);
+    return timesMs[FORMAT_REPEATS / 2];
+}
+
+/* Entry point for the pixel format benchmark */
+int main(int argc, char** argv)
+{
+    int width = defaultFormatWidth;
+    int height = defaultFormatHeight;
+    if (argc == 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if ((argc != 1 && argc != 3) || width <= 0 || height <= 0) {
+        fprintf(stderr, formatUsageMessage);
+        return 1;
+    }
+    printf("%ix%i, median of %i in ms\n", width, height, FORMAT_REPEATS);
+    printf(formatHeaderFormat, "format", "convert", "op", "FreeImage",
+            "kernels", "speedup");
+    for (int f = 0; f < numBenchFormats; f++) {
+        FIBITMAP* decoded = make_format(benchFormats[f], width, height);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        FIBITMAP* canonical = canonicalise_bitmap(FreeImage_Clone(decoded));
+        double convertMs = elapsed_ms(start);
+        for (int i = 0; i < numBenchOperations; i++) {
+            char* address = copy_string(benchOperations[i].address);
+            CommandBuffer cmdBuffer
+                    = create_image_processing_command_buffer(address);
+            double freeImageMs
+                    = median_run_ms(run_freeimage, decoded, cmdBuffer);
+            double kernelMs = median_run_ms(run_kernels, canonical, cmdBuffer);
+            printf(formatRowFormat, benchFormats[f].name, convertMs,
+                    benchOperations[i].name, freeImageMs, kernelMs,
+                    freeImageMs / kernelMs);
+            free(cmdBuffer.buffer);
+            free(address);
+        }
+        FreeImage_Unload(canonical);
+        FreeImage_Unload(decoded);
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "hashutils.h"
+
+// FNV-1a 64 bit parameters.
+const uint64_t hashInitialSeed = 14695981039346656037ULL;
+const uint64_t hashPrime = 1099511628211ULL;
+
+// Enough ring points per node to spread keys within a few percent.
+const int hashRingDefaultPoints = 64;
+
+// Room for a node name's point suffix.
+const int pointSuffixSize = 16;
+
+uint64_t hash_bytes(const void* data, long unsigned int length, uint64_t seed)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    uint64_t hash = seed;
+    for (long unsigned int i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= hashPrime;
+    }
+    return hash;
+}
+
+uint64_t hash_image_request(const char* operations, const unsigned char* image,
+        long unsigned int imageLen)
+{
+    return hash_bytes(image, imageLen,
+            hash_bytes(operations, strlen(operations), hashInitialSeed));
+}
+
+/* mix_hash()
+ * ----------
+ * Private helper function that scrambles the bits of an FNV hash so that
+ * similar names land far apart on the ring.
+ */
+static uint64_t mix_hash(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/* Private pairing of a ring point and its owner, used while sorting. */
+typedef struct RingPoint {
+    uint64_t point;
+    int owner;
+} RingPoint;
+
+/* compare_ring_points()
+ * ---------------------
+ * Private qsort comparator ordering ring points ascending.
+ */
+static int compare_ring_points(const void* a, const void* b)
+{
+    uint64_t pointA = ((const RingPoint*)a)->point;
+    uint64_t pointB = ((const RingPoint*)b)->point;
+    return (pointA > pointB) - (pointA < pointB);
+}
+
+HashRing create_hash_ring(
+        const char* const* names, int numNodes, int pointsPerNode)
+{
+    HashRing ring = {NULL, NULL, numNodes * pointsPerNode, numNodes};
+    RingPoint* sorted = malloc(sizeof(RingPoint) * ring.numPoints);
+    for (int node = 0; node < numNodes; node++) {
+        char* pointName = malloc(strlen(names[node]) + pointSuffixSize);
+        for (int i = 0; i < pointsPerNode; i++) {
+            sprintf(pointName, "%s#%i", names[node], i);
+            RingPoint ringPoint = {
+                    mix_hash(hash_bytes(pointName, strlen(pointName),
+                            hashInitialSeed)),
+                    node};
+            sorted[node * pointsPerNode + i] = ringPoint;
+        }
+        free(pointName);
+    }
+    qsort(sorted, ring.numPoints, sizeof(RingPoint), compare_ring_points);
+
+    ring.points = malloc(sizeof(uint64_t) * ring.numPoints);
+    ring.owners = malloc(sizeof(int) * ring.numPoints);
+    for (int i = 0; i < ring.numPoints; i++) {
+        ring.points[i] = sorted[i].point;
+        ring.owners[i] = sorted[i].owner;
+    }
+    free(sorted);
+    return ring;
+}
+
+void hash_ring_preference(HashRing* ring, uint64_t key, int* order)
+{
+    key = mix_hash(key);
+    // Binary search for the first point at or after the key.
+    int low = 0;
+    int high = ring->numPoints;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (ring->points[middle] < key) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    // Walk clockwise, wrapping past the end, collecting distinct owners.
+    bool* seen = calloc(ring->numNodes, sizeof(bool));
+    int found = 0;
+    for (int i = 0; i < ring->numPoints && found < ring->numNodes; i++) {
+        int owner = ring->owners[(low + i) % ring->numPoints];
+        if (!seen[owner]) {
+            seen[owner] = true;
+            order[found] = owner;
+            found++;
+        }
+    }
+    free(seen);
+}
+
+void free_hash_ring(HashRing* ring)
+{
+    free(ring->points);
+    free(ring->owners);
+    ring->points = NULL;
+    ring->owners = NULL;
+}
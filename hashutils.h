@@ -0,0 +1,82 @@
+#ifndef HASHUTILS_H
+#define HASHUTILS_H
+
+#include <stdint.h>
+
+/* hash_bytes()
+ * ------------
+ * Computes a 64 bit FNV-1a hash of a byte buffer. Hashes of several buffers
+ *      can be chained by passing the previous hash as seed.
+ *
+ * data: the bytes to hash.
+ * length: the number of bytes in data.
+ * seed: hashInitialSeed, or the hash of the preceding data.
+ *
+ * returns: the hash.
+ */
+uint64_t hash_bytes(const void* data, long unsigned int length, uint64_t seed);
+
+// Seed for the first buffer passed to hash_bytes().
+extern const uint64_t hashInitialSeed;
+
+/* hash_image_request()
+ * --------------------
+ * Computes the routing key for a transform request, so that clients and
+ *      client libraries all send the same request to the same server.
+ *
+ * operations: the '/' deliminated operation chain.
+ * image: the encoded image.
+ * imageLen: the number of bytes in image.
+ *
+ * returns: the hash of the operations followed by the image.
+ */
+uint64_t hash_image_request(const char* operations, const unsigned char* image,
+        long unsigned int imageLen);
+
+// Ring points given to each node by clients sharding over servers.
+extern const int hashRingDefaultPoints;
+
+/* A consistent hashing ring. Each node owns several points on the ring so
+ * keys spread evenly, and adding or removing a node only moves the keys
+ * that node owns. */
+typedef struct HashRing {
+    uint64_t* points;
+    int* owners; // Node index owning each point.
+    int numPoints;
+    int numNodes;
+} HashRing;
+
+/* create_hash_ring()
+ * ------------------
+ * Builds a ring for a set of named nodes.
+ *
+ * names: the node names. Each node's points are derived from its name, so
+ *      the same names always produce the same ring.
+ * numNodes: the number of names.
+ * pointsPerNode: the number of ring points given to each node.
+ *
+ * returns: the ring, freed with free_hash_ring().
+ */
+HashRing create_hash_ring(
+        const char* const* names, int numNodes, int pointsPerNode);
+
+/* hash_ring_preference()
+ * ----------------------
+ * Lists every node in the order a key should try them: the node owning the
+ *      key, followed by each next distinct node clockwise round the ring.
+ *
+ * ring: the ring to search.
+ * key: the key's hash.
+ * order: populated with ring.numNodes node indexes.
+ */
+void hash_ring_preference(HashRing* ring, uint64_t key, int* order);
+
+/* free_hash_ring()
+ * ----------------
+ * Releases the memory held by a ring.
+ *
+ * ring: the ring to release.
+ */
+void free_hash_ring(HashRing* ring);
+
+#endif // HASHUTILS_H
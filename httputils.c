@@ -1,10 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
 
 #include <csse2310a4.h>
 
@@ -12,7 +19,17 @@
 #include "ioutils.h"
 #include "argparsing.h"
 #include "socketutils.h"
+#include "shmutils.h"
 #include "httputils.h"
+#include "costmodel.h"
+#include "limiter.h"
+#include "singleflight.h"
+#include "diskcache.h"
+#include "imagestore.h"
+#include "hashutils.h"
+#include "packutils.h"
+#include "lossless.h"
+#include "bufferpool.h"
 
 // Error status constants.
 const char* const emptyImageMessage
@@ -23,8 +40,44 @@ const char* const noResponseMessage
         = "uqimageclient: server connection closed\n";
 const int noResponseCode = 8;
 
+const char* const deadlineHeaderName = "X-Deadline-Ms";
+
+// Retry-After is given in whole seconds.
+const long msPerRetrySecond = 1000;
+
+const char* const overloadedMessage
+        = "Server busy, too many transforms in flight\n";
+
+// Where images are uploaded, and the prefix of the addresses that
+// transform them.
+const char* const imagesAddress = "/images";
+
+// Separates the operation chains of a request for several renditions, and
+// the most chains one request may carry.
+const char renditionSeparator = ';';
+const int maxRenditions = 16;
+
+// Each part of a renditions response, and the close of the last.
+const char* const renditionPartFormat = "--%s\r\nContent-Type: %s\r\n"
+                                        "Content-Location: %s\r\n"
+                                        "X-Status: %i\r\n"
+                                        "Content-Length: %lu\r\n\r\n";
+const char* const renditionEndFormat = "--%s--\r\n";
+
+// Prefix of the addresses that transform packs of images, and bounds on
+// the images in a pack and its total size.
+const char* const batchAddress = "/batch";
+const int maxBatchImages = 4096;
+const long unsigned int maxBatchSize = 67108864;
+
+// Bodies are spooled and discarded this many bytes at a time.
+const size_t spoolChunkSize = 65536;
+
 const int invalidStatusCode = 9;
 
+const char* const malformedRenditionsMessage
+        = "uqimageclient: malformed renditions response\n";
+
 // Default size used in the initilization of some string and binary types.
 const int bufferSize = 100;
 
@@ -34,25 +87,7 @@ const int bufferSize = 100;
 // Default rotation to use if the user does not supply any options.
 const int defaultRotation = 0;
 
-// Maximum image size that the server can accept from a client;
-const unsigned int maxImageSize = 8388608;
-
-/* construct_operations_request()
- * ------------------------------
- * Private helper function for constructing a https request that encodes
- * an image manipulation technique and the image itself.
- *
- * args: the operations to apply to the image.
- * image: a binary buffer of the image to apply the operations to.
- *
- * returns: a binary buffer which corresponds to the constructed http
- *      request, as well as its size in bytes.
- *
- * REF: Mozzila http request structure was used as a guide for the
- * REF: structuring of the html requests.
- * REF: https://developer.mozilla.org/en-US/docs/Web/HTTP/Methods
- */
-BinaryData construct_operations_request(ClientInputs args, BinaryData image)
+char* construct_operations_address(ClientInputs args)
 {
     char* address = (char*)calloc(bufferSize, sizeof(char));
     char temp[ARRAY_BUFFER_SIZE_DEFAULT] = {0};
@@ -75,14 +110,32 @@ BinaryData construct_operations_request(ClientInputs args, BinaryData image)
         sprintf(temp, "/%s,%i", "rotate", defaultRotation);
         strcat(address, temp);
     }
+    return address;
+}
 
+/* construct_operations_request()
+ * ------------------------------
+ * Private helper function for constructing a https request that encodes
+ * an image manipulation technique and the image itself.
+ *
+ * address: the '/' deliminated operations to apply to the image.
+ * image: a binary buffer of the image to apply the operations to.
+ *
+ * returns: a binary buffer which corresponds to the constructed http
+ *      request, as well as its size in bytes.
+ *
+ * REF: Mozzila http request structure was used as a guide for the
+ * REF: structuring of the html requests.
+ * REF: https://developer.mozilla.org/en-US/docs/Web/HTTP/Methods
+ */
+BinaryData construct_operations_request(char* address, BinaryData image)
+{
     // Allocate a char array for the full request.
     char* httpRequest
             = (char*)malloc(sizeof(char) * (bufferSize + image.length));
     // Add HTTP header, address and image content into char array.
     sprintf(httpRequest, "POST %s HTTP/1.1\nContent-Length: %li\n\n", address,
             image.length);
-    free(address);
 
     // Fill the body of the html request with binary image data.
     int httpRequestLen = strlen(httpRequest);
@@ -96,25 +149,79 @@ BinaryData construct_operations_request(ClientInputs args, BinaryData image)
     return data;
 }
 
-int send_operations_request(FILE* socketPost, ClientInputs args, FILE* input)
+/* send_operations_request_memfd()
+ * -------------------------------
+ * Private helper function that sends an operations request whose image is
+ * read straight into a memfd and passed with the request, so the image
+ * bytes never travel through the socket.
+ *
+ * socketData: a unix domain connection with fd passing enabled.
+ * address: the '/' deliminated operations to apply to the image.
+ * input: a file stream to read the binary image off of.
+ *
+ * returns: 0 if succesfull, otherwise the error code.
+ */
+int send_operations_request_memfd(
+        SocketData socketData, char* address, FILE* input)
 {
+    long unsigned int imageLength;
+    int imageFd = create_memfd_from_stream(input, &imageLength);
+    if (imageFd == -1 || imageLength == 0) {
+        if (imageFd != -1) {
+            close(imageFd);
+        }
+        fprintf(stderr, emptyImageMessage);
+        return emptyImageCode;
+    }
+
+    char* httpRequest = (char*)malloc(
+            sizeof(char) * (bufferSize + strlen(address)));
+    sprintf(httpRequest, "POST %s HTTP/1.1\n%s: %s\nContent-Length: 0\n\n",
+            address, imageFdHeaderName, imageFdHeaderValue);
+
+    send_with_fd(socketData, (unsigned char*)httpRequest, strlen(httpRequest),
+            imageFd);
+    free(httpRequest);
+    close(imageFd);
+    return 0;
+}
+
+int send_image_request(SocketData socketData, char* address, FILE* input)
+{
+    if (passes_fds(socketData)) { // Local peer, hand the image over by memfd.
+        return send_operations_request_memfd(socketData, address, input);
+    }
+
     // Read image from specified input stream.
     BinaryData image = read_binary_file(input);
     if (image.length == 0) {
+        free(image.data);
         fprintf(stderr, emptyImageMessage);
         return emptyImageCode;
     }
 
     // Create http request to manipulate binary image
     // based on cmd args.
-    BinaryData request = construct_operations_request(args, image);
+    BinaryData request = construct_operations_request(address, image);
+    free(image.data);
     // Write request to server through given socket.
-    fwrite(request.data, sizeof(char), request.length, socketPost);
-    fflush(socketPost);
+    fwrite(request.data, sizeof(char), request.length, socketData.post);
+    fflush(socketData.post);
+    free(request.data);
     return 0;
 }
 
-int write_operations_response(FILE* socketGet, FILE* output)
+int send_operations_request(
+        SocketData socketData, ClientInputs args, FILE* input)
+{
+    char* address = construct_operations_address(args);
+    int error = send_image_request(socketData, address, input);
+    free(address);
+    return error;
+}
+
+int write_operations_response(
+        SocketData socketData, FILE* output, long* retryAfterMs)
 {
     // Recieve a response to the image manipulation http message.
     int httpStatus;
@@ -122,22 +229,207 @@ int write_operations_response(FILE* socketGet, FILE* output)
     HttpHeader** headers;
     unsigned char* bodyData;
     long unsigned int bodySize;
-    int error = !get_HTTP_response(socketGet, &httpStatus, &statusDescription,
-            &headers, &bodyData, &bodySize);
+    int error = !get_HTTP_response(socketData.get, &httpStatus,
+            &statusDescription, &headers, &bodyData, &bodySize);
     if (error) { // Ill-formed HTTP request.
         fprintf(stderr, noResponseMessage);
         return noResponseCode;
     }
+    if (retryAfterMs) {
+        *retryAfterMs = httpStatus == SERVICE_UNAVAILABLE
+                ? get_retry_after_ms(headers)
+                : -1;
+        if (*retryAfterMs >= 0) { // Busy, the caller will try again.
+            return invalidStatusCode;
+        }
+    }
     if (httpStatus != HTTP_OK) { // Coult not transform image.
         fwrite(bodyData, sizeof(char), bodySize, stderr);
         return invalidStatusCode;
     }
 
+    // The server hands large results back in a memfd when it can.
+    if (get_header_value(headers, imageFdHeaderName)) {
+        int imageFd = take_passed_fd(socketData);
+        BinaryData image = map_sealed_memfd(imageFd);
+        if (imageFd != -1) {
+            close(imageFd);
+        }
+        if (!image.data) {
+            fprintf(stderr, noResponseMessage);
+            return noResponseCode;
+        }
+        fwrite(image.data, sizeof(char), image.length, output);
+        unmap_binary_data(image);
+        return 0;
+    }
+
     // Write the transformed data to the specified output stream.
     fwrite(bodyData, sizeof(char), bodySize, output);
     return 0;
 }
 
+/* rendition_path()
+ * ----------------
+ * Private helper function that names the file a rendition is written to,
+ *      its chain with the leading '/' dropped and the rest swapped for '_',
+ *      so "/rotate,90/scale,80,60" becomes "rotate,90_scale,80,60.png".
+ *
+ * returns: the heap allocated path within outDir.
+ */
+static char* rendition_path(const char* outDir, const char* chain)
+{
+    char* path = malloc(strlen(outDir) + strlen(chain) + 6);
+    int length = sprintf(path, "%s/", outDir);
+    for (const char* c = chain[0] == '/' ? chain + 1 : chain; *c; c++) {
+        path[length++] = *c == '/' ? '_' : *c;
+    }
+    strcpy(path + length, ".png");
+    return path;
+}
+
+/* write_rendition_parts()
+ * -----------------------
+ * Private helper function that walks the parts of a multipart renditions
+ *      body, writing each image to its own file and reporting each failed
+ *      chain.
+ *
+ * body: the multipart body.
+ * length: the number of bytes in body.
+ * boundary: the boundary from the body's Content-Type.
+ * outDir: the directory to write renditions to.
+ *
+ * returns: 0 if every rendition was written, otherwise the error code.
+ */
+static int write_rendition_parts(const unsigned char* body,
+        long unsigned int length, const char* boundary, const char* outDir)
+{
+    const unsigned char* end = body + length;
+    long unsigned int boundaryLen = strlen(boundary);
+    int error = 0;
+    while (end - body >= (long)boundaryLen + 4 && !memcmp(body, "--", 2)
+            && !memcmp(body + 2, boundary, boundaryLen)) {
+        body += boundaryLen + 2;
+        if (!memcmp(body, "--", 2)) { // The closing delimiter.
+            return error;
+        }
+        // Part headers run to a blank line, each ending in CRLF.
+        char location[ARRAY_BUFFER_SIZE_DEFAULT] = {0};
+        int status = 0;
+        long unsigned int partLen = 0;
+        const unsigned char* line = body + 2;
+        const unsigned char* lineEnd;
+        while ((lineEnd = memmem(line, end - line, "\r\n", 2))
+                && lineEnd != line) {
+            char header[ARRAY_BUFFER_SIZE_DEFAULT * 2] = {0};
+            memcpy(header, line,
+                    lineEnd - line < (long)sizeof(header) - 1
+                            ? lineEnd - line
+                            : (long)sizeof(header) - 1);
+            sscanf(header, "Content-Location: %99s", location);
+            sscanf(header, "X-Status: %i", &status);
+            sscanf(header, "Content-Length: %lu", &partLen);
+            line = lineEnd + 2;
+        }
+        if (!lineEnd || (long unsigned int)(end - lineEnd - 2) < partLen) {
+            break;
+        }
+        const unsigned char* data = lineEnd + 2;
+        if (status != HTTP_OK) {
+            fwrite(data, sizeof(char), partLen, stderr);
+            error = invalidStatusCode;
+        } else {
+            char* path = rendition_path(outDir, location);
+            FILE* output = fopen(path, "w");
+            if (output) {
+                fwrite(data, sizeof(char), partLen, output);
+                fclose(output);
+            } else {
+                fprintf(stderr, invalidOutputFormat, path);
+                error = invalidOutputCode;
+            }
+            free(path);
+        }
+        body = data + partLen + 2; // Skip the CRLF ending the part.
+    }
+    fprintf(stderr, malformedRenditionsMessage);
+    return invalidStatusCode;
+}
+
+int write_renditions_response(SocketData socketData, const char* outDir)
+{
+    int httpStatus;
+    char* statusDescription;
+    HttpHeader** headers;
+    unsigned char* bodyData;
+    long unsigned int bodySize;
+    if (!get_HTTP_response(socketData.get, &httpStatus, &statusDescription,
+                &headers, &bodyData, &bodySize)) {
+        fprintf(stderr, noResponseMessage);
+        return noResponseCode;
+    }
+    int error = invalidStatusCode;
+    char* contentType = get_header_value(headers, "Content-Type");
+    char* boundary = contentType ? strstr(contentType, "boundary=") : NULL;
+    if (httpStatus != HTTP_OK) { // No renditions were made.
+        fwrite(bodyData, sizeof(char), bodySize, stderr);
+    } else if (!boundary) {
+        fprintf(stderr, malformedRenditionsMessage);
+    } else if (get_header_value(headers, imageFdHeaderName)) {
+        // The server hands large bodies back in a memfd when it can.
+        int bodyFd = take_passed_fd(socketData);
+        BinaryData body = map_sealed_memfd(bodyFd);
+        if (bodyFd != -1) {
+            close(bodyFd);
+        }
+        if (body.data) {
+            error = write_rendition_parts(body.data, body.length,
+                    boundary + strlen("boundary="), outDir);
+            unmap_binary_data(body);
+        } else {
+            fprintf(stderr, noResponseMessage);
+            error = noResponseCode;
+        }
+    } else {
+        error = write_rendition_parts(bodyData, bodySize,
+                boundary + strlen("boundary="), outDir);
+    }
+    free(statusDescription);
+    free_array_of_headers(headers);
+    free(bodyData);
+    return error;
+}
+
+char* get_header_value(HttpHeader** headers, const char* name)
+{
+    if (!headers) {
+        return NULL;
+    }
+    for (int i = 0; headers[i]; i++) {
+        // Header names are case insensitive.
+        if (!strcasecmp(headers[i]->name, name)) {
+            return headers[i]->value;
+        }
+    }
+    return NULL;
+}
+
+HttpHeader** add_header(HttpHeader** headers, const char* name,
+        const char* value)
+{
+    int numHeaders = 0;
+    while (headers && headers[numHeaders]) {
+        numHeaders++;
+    }
+    headers = realloc(headers, sizeof(HttpHeader*) * (numHeaders + 2));
+    HttpHeader* header = malloc(sizeof(HttpHeader));
+    header->name = copy_string(name);
+    header->value = copy_string(value);
+    headers[numHeaders] = header;
+    headers[numHeaders + 1] = NULL; // headers is NULL terminated.
+    return headers;
+}
+
 // The following are private constructors, mostly implementing
 // data specifications according to the supplied specification.
 // Detailed function documentation was not included as they are
@@ -146,10 +438,16 @@ int write_operations_response(FILE* socketGet, FILE* output)
 /* Constructor for HTTP response that returns a HTML home page. */
 HttpResponse create_home_post_request()
 {
-    HttpResponse outHttp = {0, NULL, malloc(sizeof(HttpHeader*) * 2), NULL, 0};
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
     FILE* homeFile
             = fopen("/local/courses/csse2310/resources/a4/home.html", "r");
-    BinaryData homeBinary = read_binary_file(homeFile);
+    // Polled by load balancer health checks, so a missing page must not
+    // crash the server and an open file must not leak.
+    BinaryData homeBinary = {NULL, 0};
+    if (homeFile) {
+        homeBinary = read_binary_file(homeFile);
+        fclose(homeFile);
+    }
     outHttp.status = HTTP_OK; // HTTP status.
     outHttp.statusDescription = copy_string("OK"); // Status explanation.
     HttpHeader* contentType = malloc(sizeof(HttpHeader));
@@ -166,7 +464,7 @@ HttpResponse create_home_post_request()
  * Only empty (HOME) get adresses are supported. */
 HttpResponse create_not_found_post_request()
 {
-    HttpResponse outHttp = {0, NULL, malloc(sizeof(HttpHeader*) * 2), NULL, 0};
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
     outHttp.status = ADDRESS_NOT_FOUND;
     outHttp.statusDescription = copy_string("Not Found");
     HttpHeader* contentType = malloc(sizeof(HttpHeader));
@@ -184,7 +482,7 @@ HttpResponse create_not_found_post_request()
  * or empty. */
 HttpResponse create_invalid_op_post_request()
 {
-    HttpResponse outHttp = {0, NULL, malloc(sizeof(HttpHeader*) * 2), NULL, 0};
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
     outHttp.status = INVALID_OPERATION;
     outHttp.statusDescription = copy_string("Bad Request");
     HttpHeader* contentType = malloc(sizeof(HttpHeader));
@@ -201,7 +499,7 @@ HttpResponse create_invalid_op_post_request()
 /* Constructor for HTTP response when the image size is too large. */
 HttpResponse create_payload_large_post_request(long unsigned int payloadSize)
 {
-    HttpResponse outHttp = {0, NULL, malloc(sizeof(HttpHeader*) * 2), NULL, 0};
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
     outHttp.status = IMAGE_TOO_LARGE;
     outHttp.statusDescription = copy_string("Payload Too Large");
     HttpHeader* contentType = malloc(sizeof(HttpHeader));
@@ -220,7 +518,7 @@ HttpResponse create_payload_large_post_request(long unsigned int payloadSize)
  * be laoded into bitmap */
 HttpResponse create_unprocessable_post_request()
 {
-    HttpResponse outHttp = {0, NULL, malloc(sizeof(HttpHeader*) * 2), NULL, 0};
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
     outHttp.status = UNPROCESSABLE_IMAGE;
     outHttp.statusDescription = copy_string("Unprocessable Content");
     HttpHeader* contentType = malloc(sizeof(HttpHeader));
@@ -238,7 +536,7 @@ HttpResponse create_unprocessable_post_request()
  * manipulation operations failed. */
 HttpResponse create_not_implemented_post_request(char* failCheck)
 {
-    HttpResponse outHttp = {0, NULL, malloc(sizeof(HttpHeader*) * 2), NULL, 0};
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
     outHttp.status = OPERATION_NOT_IMPLEMENTED;
     outHttp.statusDescription = copy_string("Not Implemented");
     HttpHeader* contentType = malloc(sizeof(HttpHeader));
@@ -254,10 +552,10 @@ HttpResponse create_not_implemented_post_request(char* failCheck)
 }
 
 /* Constructor for HTTP response when the HTTP method (E.G GET, POST) was
- * not supported. Only GET and POST methods are supported. */
+ * not supported. Only GET, PUT and POST methods are supported. */
 HttpResponse create_method_disallowed_post_request()
 {
-    HttpResponse outHttp = {0, NULL, malloc(sizeof(HttpHeader*) * 2), NULL, 0};
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
     outHttp.status = METHOD_NOT_ALLOWED;
     outHttp.statusDescription = copy_string("Method Not Allowed");
     HttpHeader* contentType = malloc(sizeof(HttpHeader));
@@ -273,9 +571,10 @@ HttpResponse create_method_disallowed_post_request()
 
 /* Constructor for HTTP response for when image was succesfully manipulated
  * and needs to be returned to the client. */
-HttpResponse create_image_return_post_request(FIBITMAP* bitmap)
+HttpResponse create_image_return_post_request(
+        unsigned char* data, unsigned long dataLen)
 {
-    HttpResponse outHttp = {0, NULL, malloc(sizeof(HttpHeader*) * 2), NULL, 0};
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
     outHttp.status = HTTP_OK;
     outHttp.statusDescription = copy_string("OK");
     HttpHeader* contentType = malloc(sizeof(HttpHeader));
@@ -283,15 +582,1005 @@ HttpResponse create_image_return_post_request(FIBITMAP* bitmap)
     contentType->value = copy_string("image/png");
     outHttp.headers[0] = contentType;
     outHttp.headers[1] = NULL;
+    outHttp.bodyData = data;
+    outHttp.bodyLen = dataLen;
+    return outHttp;
+}
 
-    unsigned long dataLen;
-    unsigned char* data = fi_save_png_image_to_buffer(bitmap, &dataLen);
+/* Constructor for HTTP response for when a JPEG was flipped or rotated
+ * without decoding it and is returned still a JPEG. */
+HttpResponse create_jpeg_return_post_request(
+        unsigned char* data, unsigned long dataLen)
+{
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
+    outHttp.status = HTTP_OK;
+    outHttp.statusDescription = copy_string("OK");
+    HttpHeader* contentType = malloc(sizeof(HttpHeader));
+    contentType->name = copy_string("Content-Type");
+    contentType->value = copy_string(jpegContentType);
+    outHttp.headers[0] = contentType;
+    outHttp.headers[1] = NULL;
     outHttp.bodyData = data;
     outHttp.bodyLen = dataLen;
     return outHttp;
 }
 
-HttpResponse respond_to_request(HttpRequest inHttp, Mutex* imageOps)
+/* Constructor for HTTP response when the request was abandoned because its
+ * deadline passed or its client hung up. */
+HttpResponse create_deadline_exceeded_post_request()
+{
+    HttpResponse outHttp = {.headers = malloc(sizeof(HttpHeader*) * 2)};
+    outHttp.status = DEADLINE_EXCEEDED;
+    outHttp.statusDescription = copy_string("Gateway Timeout");
+    HttpHeader* contentType = malloc(sizeof(HttpHeader));
+    contentType->name = copy_string("Content-Type");
+    contentType->value = copy_string("text/plain");
+    outHttp.headers[0] = contentType;
+    outHttp.headers[1] = NULL;
+    char* msg = copy_string(uqimage_status_message(UQIMAGE_CANCELLED));
+    outHttp.bodyData = (unsigned char*)msg;
+    outHttp.bodyLen = strlen(msg);
+    return outHttp;
+}
+
+long get_deadline_ms(HttpHeader** headers)
+{
+    char* value = get_header_value(headers, deadlineHeaderName);
+    if (!value) {
+        return -1;
+    }
+    char* endPtr;
+    long deadlineMs = strtol(value, &endPtr, 10);
+    if (endPtr == value || *endPtr != '\0' || deadlineMs < 0) {
+        return -1;
+    }
+    return deadlineMs;
+}
+
+/* read_http_line()
+ * ----------------
+ * Private helper function that reads one line of a request's head, without
+ *      its CRLF.
+ *
+ * returns: the heap allocated line, or NULL at the end of the stream.
+ */
+static char* read_http_line(FILE* stream)
+{
+    char* line = NULL;
+    size_t size = 0;
+    ssize_t length = getline(&line, &size, stream);
+    if (length <= 0) {
+        free(line);
+        return NULL;
+    }
+    while (length && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        line[--length] = '\0';
+    }
+    return line;
+}
+
+/* read_request_head()
+ * -------------------
+ * Private helper function that reads a request line and its headers.
+ *
+ * returns: false if the stream ended or the head was malformed.
+ */
+static bool read_request_head(FILE* stream, HttpRequest* inHttp)
+{
+    char* line = read_http_line(stream);
+    char* address = line ? strchr(line, ' ') : NULL;
+    char* version = address ? strchr(address + 1, ' ') : NULL;
+    if (!version) {
+        free(line);
+        return false;
+    }
+    *address = '\0';
+    *version = '\0';
+    inHttp->type = copy_string(line);
+    inHttp->address = copy_string(address + 1);
+    free(line);
+    inHttp->headers = calloc(1, sizeof(HttpHeader*));
+    while ((line = read_http_line(stream)) && *line) {
+        char* value = strchr(line, ':');
+        if (!value) {
+            free(line);
+            return false;
+        }
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        inHttp->headers = add_header(inHttp->headers, line, value);
+        free(line);
+    }
+    free(line);
+    return line != NULL;
+}
+
+/* spool_body()
+ * ------------
+ * Private helper function that copies a body from the stream into a
+ *      scratch file, a chunk at a time, and maps it.
+ *
+ * returns: the mapping, with a NULL data pointer if it failed.
+ */
+static BinaryData spool_body(FILE* stream, Tiling* tiling,
+        long unsigned int length)
+{
+    BinaryData spooled = {NULL, length};
+    int fd = create_scratch_file(tiling);
+    if (fd == -1) {
+        return spooled;
+    }
+    unsigned char* chunk = malloc(spoolChunkSize);
+    long unsigned int left = length;
+    while (left) {
+        size_t want = left < spoolChunkSize ? left : spoolChunkSize;
+        size_t got = fread(chunk, sizeof(unsigned char), want, stream);
+        if (!got || write(fd, chunk, got) != (ssize_t)got) {
+            break;
+        }
+        left -= got;
+    }
+    free(chunk);
+    if (!left) {
+        void* pages = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+        spooled.data = pages == MAP_FAILED ? NULL : pages;
+    }
+    close(fd); // The mapping keeps the file.
+    return spooled;
+}
+
+/* discard_body()
+ * --------------
+ * Private helper function that reads a body off the stream unkept.
+ *
+ * returns: false if the stream ended first.
+ */
+static bool discard_body(FILE* stream, long unsigned int length)
+{
+    unsigned char* chunk = malloc(spoolChunkSize);
+    while (length) {
+        size_t want = length < spoolChunkSize ? length : spoolChunkSize;
+        size_t got = fread(chunk, sizeof(unsigned char), want, stream);
+        if (!got) {
+            break;
+        }
+        length -= got;
+    }
+    free(chunk);
+    return !length;
+}
+
+/* is_batch_request()
+ * ------------------
+ * Private helper function that checks whether a request is a POST of a
+ *      pack of images to /batch/.
+ */
+static bool is_batch_request(const HttpRequest* inHttp)
+{
+    return !strcmp(inHttp->type, "POST")
+            && !strncmp(inHttp->address, batchAddress, strlen(batchAddress))
+            && inHttp->address[strlen(batchAddress)] == '/';
+}
+
+RequestRead get_spooled_request(FILE* stream, Tiling* tiling,
+        BufferPools* pools, HttpRequest* inHttp, BinaryData* spooled)
+{
+    HttpRequest read = {0};
+    BinaryData none = {NULL, 0};
+    *spooled = none;
+    *inHttp = read;
+    if (!read_request_head(stream, inHttp)) {
+        return REQUEST_FAILED;
+    }
+    char* value = get_header_value(inHttp->headers, "Content-Length");
+    char* endPtr = NULL;
+    inHttp->bodyLen = value ? strtoul(value, &endPtr, 10) : 0;
+    if (value && (endPtr == value || *endPtr != '\0')) {
+        return REQUEST_FAILED;
+    }
+
+    // Batches are unpacked in memory, so are kept up to their own limit.
+    // Anything else over the upload limit is never held.
+    long unsigned int limit = is_batch_request(inHttp)
+            ? maxBatchSize : tiling_upload_limit(tiling);
+    if (inHttp->bodyLen > limit) {
+        return discard_body(stream, inHttp->bodyLen)
+                ? REQUEST_TOO_LARGE : REQUEST_FAILED;
+    }
+    if (tiling && inHttp->bodyLen > maxImageSize) {
+        *spooled = spool_body(stream, tiling, inHttp->bodyLen);
+        inHttp->bodyData = spooled->data;
+        return spooled->data ? REQUEST_READ : REQUEST_FAILED;
+    }
+    inHttp->bodyData = take_buffer(pools, inHttp->bodyLen + 1);
+    if (fread(inHttp->bodyData, sizeof(unsigned char), inHttp->bodyLen,
+                stream) != inHttp->bodyLen) {
+        return REQUEST_FAILED;
+    }
+    return REQUEST_READ;
+}
+
+long get_retry_after_ms(HttpHeader** headers)
+{
+    char* value = get_header_value(headers, "Retry-After");
+    if (!value) {
+        return -1;
+    }
+    char* endPtr;
+    long seconds = strtol(value, &endPtr, 10);
+    if (endPtr == value || *endPtr != '\0' || seconds < 0) {
+        return -1;
+    }
+    return seconds * msPerRetrySecond;
+}
+
+/* Constructor for HTTP response when too many transforms are already in
+ * flight. retryAfter is the seconds the client should wait. */
+HttpResponse create_overloaded_post_request(int retryAfter)
+{
+    HttpResponse outHttp = {0};
+    outHttp.status = SERVICE_UNAVAILABLE;
+    outHttp.statusDescription = copy_string("Service Unavailable");
+    char seconds[ARRAY_BUFFER_SIZE_DEFAULT];
+    sprintf(seconds, "%i", retryAfter);
+    outHttp.headers = add_header(outHttp.headers, "Content-Type", "text/plain");
+    outHttp.headers = add_header(outHttp.headers, "Retry-After", seconds);
+    char* msg = copy_string(overloadedMessage);
+    outHttp.bodyData = (unsigned char*)msg;
+    outHttp.bodyLen = strlen(msg);
+    return outHttp;
+}
+
+/* Constructor for HTTP response when an image was stored. id is the ID it
+ * is transformed by. */
+HttpResponse create_image_stored_post_request(const char* id)
+{
+    HttpResponse outHttp = {0};
+    outHttp.status = IMAGE_CREATED;
+    outHttp.statusDescription = copy_string("Created");
+    char location[ARRAY_BUFFER_SIZE_DEFAULT];
+    sprintf(location, "%s/%s", imagesAddress, id);
+    outHttp.headers = add_header(outHttp.headers, "Content-Type", "text/plain");
+    outHttp.headers = add_header(outHttp.headers, "Location", location);
+    char* msg = malloc(sizeof(char) * bufferSize);
+    sprintf(msg, "%s\n", id);
+    outHttp.bodyData = (unsigned char*)msg;
+    outHttp.bodyLen = strlen(msg);
+    return outHttp;
+}
+
+/* Constructor for HTTP response when a transform names an image that is
+ * not stored, never having been uploaded or having expired. */
+HttpResponse create_unknown_image_post_request()
+{
+    HttpResponse outHttp = create_not_found_post_request();
+    free(outHttp.bodyData);
+    char* msg = copy_string("Image not stored or expired\n");
+    outHttp.bodyData = (unsigned char*)msg;
+    outHttp.bodyLen = strlen(msg);
+    return outHttp;
+}
+
+/* Constructor for HTTP response when a different image already holds the
+ * ID an upload hashed to. */
+HttpResponse create_id_conflict_post_request()
+{
+    HttpResponse outHttp = {0};
+    outHttp.status = IMAGE_ID_CONFLICT;
+    outHttp.statusDescription = copy_string("Conflict");
+    outHttp.headers = add_header(outHttp.headers, "Content-Type", "text/plain");
+    char* msg = copy_string("A different image is stored under this ID\n");
+    outHttp.bodyData = (unsigned char*)msg;
+    outHttp.bodyLen = strlen(msg);
+    return outHttp;
+}
+
+/* run_transform()
+ * ---------------
+ * Private helper function that does the work of a transform. It must first
+ *      be admitted by the concurrency limiter, then waits for a CPU, cheap
+ *      transforms ahead of costly ones, then is decoded, transformed and
+ *      encoded through the same pipeline libuqimage uses. Oversized images
+ *      skip both, as they are refused without decoding.
+ *
+ * inHttp: the request holding the image.
+ * cmdBuffers: the operation chains to apply, each giving one result.
+ * numChains: the number of chains. Several share a single decode.
+ * context: the statistics, cancellation, scheduling and limiting to use.
+ * results: populated with the outcome of each chain, cancelled if not
+ *      admitted.
+ *
+ * returns: false if the limiter refused the transform, otherwise true.
+ */
+static bool run_transform(HttpRequest inHttp, CommandBuffer* cmdBuffers,
+        int numChains, RequestContext* context, UqImageResult* results)
+{
+    bool fits = inHttp.bodyLen <= maxImageSize;
+    Limiter* limiter = fits ? context->limiter : NULL;
+    Scheduler* scheduler = fits ? context->scheduler : NULL;
+    if (!limiter_acquire(limiter)) { // Refuse fast rather than queue.
+        UqImageResult refused = {.status = UQIMAGE_CANCELLED};
+        for (int i = 0; i < numChains; i++) {
+            results[i] = refused;
+        }
+        return false;
+    }
+    struct timespec admitted;
+    clock_gettime(CLOCK_MONOTONIC, &admitted);
+    long unsigned int cost = 0;
+    for (int i = 0; i < numChains; i++) {
+        cost += estimate_request_cost(
+                inHttp.bodyData, inHttp.bodyLen, cmdBuffers[i]);
+    }
+    scheduler_acquire(scheduler, cost);
+    if (numChains == 1) {
+        process_image_buffer(inHttp.bodyData, inHttp.bodyLen, cmdBuffers[0],
+                context->imageOps, context->cancel, results);
+    } else {
+        process_image_renditions(inHttp.bodyData, inHttp.bodyLen, cmdBuffers,
+                numChains, context->imageOps, context->cancel, results);
+    }
+    scheduler_release(scheduler);
+    // Only overrunning the deadline says the server is overloaded. A client
+    // hanging up says nothing of it.
+    limiter_release(limiter, cost, elapsed_ms(admitted),
+            deadline_expired(context->cancel));
+    return true;
+}
+
+/* transform_tiled()
+ * -----------------
+ * Private helper function that applies a parsed operation chain to an
+ *      image too large to transform in memory, tile by tile. Tiled
+ *      transforms are admitted by the tiling's memory ceiling and the
+ *      scheduler, but neither cached nor coalesced, and kept out of the
+ *      limiter, whose latencies they would swamp.
+ *
+ * inHttp: the request holding the image, usually spooled.
+ * cmdBuffer: the operations to apply.
+ * context: the statistics, cancellation, scheduling and tiling to use.
+ *
+ * returns: the response to send, its body in a scratch file if successful.
+ */
+static HttpResponse transform_tiled(HttpRequest inHttp,
+        CommandBuffer cmdBuffer, RequestContext* context)
+{
+    scheduler_acquire(context->scheduler, estimate_request_cost(
+            inHttp.bodyData, inHttp.bodyLen, cmdBuffer));
+    UqImageResult result;
+    int encodedFd = -1;
+    process_image_tiled(context->tiling, inHttp.bodyData, inHttp.bodyLen,
+            cmdBuffer, context->imageOps, context->cancel, &result,
+            &encodedFd);
+    scheduler_release(context->scheduler);
+
+    HttpResponse outHttp;
+    if (result.status == UQIMAGE_IMAGE_TOO_LARGE) { // Return 413.
+        outHttp = create_payload_large_post_request(inHttp.bodyLen);
+    } else if (result.status == UQIMAGE_UNPROCESSABLE_IMAGE) {
+        outHttp = create_unprocessable_post_request();
+    } else if (result.status == UQIMAGE_CANCELLED) { // Return 504.
+        outHttp = create_deadline_exceeded_post_request();
+    } else {
+        outHttp = create_image_return_post_request(NULL, result.length);
+        outHttp.bodyFd = encodedFd;
+    }
+    return outHttp;
+}
+
+/* transform_image()
+ * -----------------
+ * Private helper function that applies a parsed operation chain to the
+ *      image in a request. Results cached on disk are sent from their file.
+ *      Images over maxImageSize are transformed tile by tile if the server
+ *      allows uploads that large.
+ *      If an identical transform is already in flight its result is waited
+ *      on and shared instead. Should that transform
+ *      be cancelled or refused on its own request's account, the wait
+ *      starts over, usually with this request doing the work.
+ *
+ * inHttp: the request holding the image.
+ * cmdBuffer: the operations to apply.
+ * context: the statistics, cancellation, scheduling, limiting, coalescing
+ *      and caching to use.
+ *
+ * returns: the response to send. Successful responses share their body
+ *      with the flight, released by free_http_response().
+ */
+static HttpResponse transform_image(HttpRequest inHttp,
+        CommandBuffer cmdBuffer, RequestContext* context)
+{
+    bool fits = inHttp.bodyLen <= maxImageSize;
+    if (!fits && context->tiling
+            && inHttp.bodyLen <= tiling_upload_limit(context->tiling)) {
+        return transform_tiled(inHttp, cmdBuffer, context);
+    }
+    long unsigned int cachedLen;
+    int cachedFd = disk_cache_lookup(fits ? context->cache : NULL,
+            inHttp.bodyData, inHttp.bodyLen, cmdBuffer, &cachedLen);
+    if (cachedFd != -1) {
+        HttpResponse outHttp
+                = create_image_return_post_request(NULL, cachedLen);
+        outHttp.bodyFd = cachedFd;
+        return outHttp;
+    }
+
+    FlightGroup* flights = fits ? context->flights : NULL;
+    Flight* flight = NULL;
+    const UqImageResult* result = NULL;
+    bool refused = false;
+    while (!result) {
+        bool leader;
+        flight = flight_join(
+                flights, inHttp.bodyData, inHttp.bodyLen, cmdBuffer, &leader);
+        if (leader) {
+            UqImageResult own;
+            refused = !run_transform(inHttp, &cmdBuffer, 1, context, &own);
+            flight_land(flights, flight, own);
+            if (own.status == UQIMAGE_OK) {
+                disk_cache_store(fits ? context->cache : NULL,
+                        inHttp.bodyData, inHttp.bodyLen, cmdBuffer,
+                        own.data, own.length);
+            }
+            result = flight_result(flight);
+            break;
+        }
+        result = flight_wait(flight, context->cancel);
+        if (!result) { // This request's deadline passed first.
+            flight_release(flight);
+            return create_deadline_exceeded_post_request();
+        }
+        if (result->status == UQIMAGE_CANCELLED) {
+            flight_release(flight);
+            result = NULL;
+        } else if (context->coalesced) {
+            modify_mutex(context->coalesced, 1);
+        }
+    }
+
+    HttpResponse outHttp;
+    if (refused) {
+        outHttp = create_overloaded_post_request(
+                limiter_retry_after(context->limiter));
+    } else if (result->status == UQIMAGE_IMAGE_TOO_LARGE) { // Return 413.
+        outHttp = create_payload_large_post_request(inHttp.bodyLen);
+    } else if (result->status == UQIMAGE_UNPROCESSABLE_IMAGE) {
+        // Failed to load image into bitmap.
+        outHttp = create_unprocessable_post_request();
+    } else if (result->status == UQIMAGE_OPERATION_FAILED) {
+        // One or more of the operations failed.
+        outHttp = create_not_implemented_post_request(
+                (char*)result->failedOperation);
+    } else if (result->status == UQIMAGE_CANCELLED) { // Return 504.
+        outHttp = create_deadline_exceeded_post_request();
+    } else { // All operations completed successfully.
+        outHttp = create_image_return_post_request(
+                result->data, result->length);
+        outHttp.flight = flight; // Keeps the shared body alive.
+        return outHttp;
+    }
+    flight_release(flight);
+    return outHttp;
+}
+
+/* accepts_jpeg()
+ * --------------
+ * Private helper function that checks whether a request's Accept header
+ *      names JPEG. Responses are otherwise always PNG.
+ */
+static bool accepts_jpeg(HttpRequest inHttp)
+{
+    char* accept = get_header_value(inHttp.headers, "Accept");
+    return accept && strcasestr(accept, jpegContentType);
+}
+
+/* transform_losslessly()
+ * ----------------------
+ * Private helper function that flips and rotates a JPEG by rearranging its
+ *      compressed blocks, which is cheap enough to skip scheduling, caching
+ *      and coalescing. JPEGs that cannot be transformed perfectly are
+ *      decoded and transformed as usual instead.
+ *
+ * inHttp: the request holding the JPEG.
+ * cmdBuffer: the operations, all flips and right angle rotations.
+ * operation: the single transform they compose to.
+ * numOps: the number of operations.
+ * context: the statistics, and what to transform with if decoding.
+ *
+ * returns: the response to send.
+ */
+static HttpResponse transform_losslessly(HttpRequest inHttp,
+        CommandBuffer cmdBuffer, FREE_IMAGE_JPEG_OPERATION operation,
+        int numOps, RequestContext* context)
+{
+    long unsigned int length;
+    unsigned char* jpeg = inHttp.bodyLen <= maxImageSize
+            ? transform_jpeg_losslessly(
+                    inHttp.bodyData, inHttp.bodyLen, operation, &length)
+            : NULL;
+    if (!jpeg) {
+        return transform_image(inHttp, cmdBuffer, context);
+    }
+    if (context->imageOps) {
+        modify_mutex(context->imageOps, numOps);
+    }
+    return create_jpeg_return_post_request(jpeg, length);
+}
+
+/* choose_boundary()
+ * -----------------
+ * Private helper function that picks a multipart boundary found in none of
+ *      the encoded renditions.
+ *
+ * boundary: populated with the boundary.
+ */
+static void choose_boundary(UqImageResult* results, int numRenditions,
+        char* boundary)
+{
+    uint64_t seed = hashInitialSeed;
+    bool clashes = true;
+    while (clashes) {
+        sprintf(boundary, "--uqimage-%016" PRIx64, seed);
+        clashes = false;
+        for (int i = 0; i < numRenditions && !clashes; i++) {
+            clashes = results[i].data
+                    && memmem(results[i].data, results[i].length, boundary,
+                            strlen(boundary));
+        }
+        seed = hash_bytes(boundary, strlen(boundary), seed);
+    }
+    // The delimiter is "--" followed by the boundary proper.
+    memmove(boundary, boundary + 2, strlen(boundary) - 1);
+}
+
+/* status_to_http()
+ * ----------------
+ * Private helper function that gives the HTTP status the server answers a
+ *      transform's outcome with.
+ */
+static int status_to_http(UqImageStatus status)
+{
+    switch (status) {
+    case UQIMAGE_OK:
+        return HTTP_OK;
+    case UQIMAGE_INVALID_OPERATION:
+        return INVALID_OPERATION;
+    case UQIMAGE_IMAGE_TOO_LARGE:
+        return IMAGE_TOO_LARGE;
+    case UQIMAGE_UNPROCESSABLE_IMAGE:
+        return UNPROCESSABLE_IMAGE;
+    case UQIMAGE_OPERATION_FAILED:
+        return OPERATION_NOT_IMPLEMENTED;
+    case UQIMAGE_CANCELLED:
+        return DEADLINE_EXCEEDED;
+    }
+    return OPERATION_NOT_IMPLEMENTED;
+}
+
+/* Constructor for HTTP response holding several renditions of one image as
+ * a multipart body, one part per chain in request order. Each part names
+ * its chain in Content-Location and gives its own status in X-Status, as
+ * one chain failing leaves the others good. */
+HttpResponse create_renditions_post_request(
+        UqImageResult* results, char** chains, int numRenditions)
+{
+    char boundary[ARRAY_BUFFER_SIZE_DEFAULT];
+    choose_boundary(results, numRenditions, boundary);
+    long unsigned int capacity = bufferSize;
+    for (int i = 0; i < numRenditions; i++) {
+        capacity += bufferSize * 2 + strlen(chains[i]) + results[i].length;
+    }
+    char* body = malloc(capacity);
+    long unsigned int bodyLen = 0;
+    for (int i = 0; i < numRenditions; i++) {
+        bool ok = results[i].status == UQIMAGE_OK;
+        char message[ARRAY_BUFFER_SIZE_DEFAULT];
+        if (results[i].status == UQIMAGE_OPERATION_FAILED) {
+            sprintf(message, "Operation failed: %s\n",
+                    results[i].failedOperation);
+        } else if (!ok) {
+            strcpy(message, uqimage_status_message(results[i].status));
+        }
+        const char* data = ok ? (char*)results[i].data : message;
+        long unsigned int dataLen = ok ? results[i].length : strlen(message);
+        bodyLen += sprintf(body + bodyLen, renditionPartFormat, boundary,
+                ok ? "image/png" : "text/plain", chains[i],
+                status_to_http(results[i].status), dataLen);
+        memcpy(body + bodyLen, data, dataLen);
+        bodyLen += dataLen;
+        bodyLen += sprintf(body + bodyLen, "\r\n");
+    }
+    bodyLen += sprintf(body + bodyLen, renditionEndFormat, boundary);
+
+    HttpResponse outHttp = {0};
+    outHttp.status = HTTP_OK;
+    outHttp.statusDescription = copy_string("OK");
+    // Room for the media type as well as a boundary of the most length.
+    char contentType[ARRAY_BUFFER_SIZE_DEFAULT * 2];
+    sprintf(contentType, "multipart/mixed; boundary=%s", boundary);
+    outHttp.headers = add_header(outHttp.headers, "Content-Type", contentType);
+    outHttp.bodyData = (unsigned char*)body;
+    outHttp.bodyLen = bodyLen;
+    return outHttp;
+}
+
+/* transform_renditions()
+ * ----------------------
+ * Private helper function that applies several ';' separated operation
+ *      chains to the image in a request, decoding it once. Renditions are
+ *      neither coalesced nor cached, as they are answered together.
+ *
+ * inHttp: the request holding the image.
+ * operations: the chains, e.g. "/scale,800,600;/rotate,90/scale,80,60".
+ *      Split in place.
+ * context: the statistics, cancellation, scheduling and limiting to use.
+ *
+ * returns: the response to send, a multipart body if the image decoded.
+ */
+static HttpResponse transform_renditions(HttpRequest inHttp,
+        char* operations, RequestContext* context)
+{
+    char** chains = split_by_char(operations, renditionSeparator, 0);
+    int numRenditions = 0;
+    while (chains[numRenditions]) {
+        numRenditions++;
+    }
+    if (numRenditions < 1 || numRenditions > maxRenditions) {
+        free(chains);
+        return create_invalid_op_post_request();
+    }
+    // The command parser splits in place, so keep each chain to name its
+    // part of the response.
+    char** names = malloc(sizeof(char*) * numRenditions);
+    CommandBuffer* cmdBuffers = malloc(sizeof(CommandBuffer) * numRenditions);
+    bool valid = true;
+    for (int i = 0; i < numRenditions; i++) {
+        names[i] = copy_string(chains[i]);
+        cmdBuffers[i] = create_image_processing_command_buffer(chains[i]);
+        valid = valid && !cmdBuffers[i].parseError
+                && cmdBuffers[i].numCmds;
+    }
+
+    HttpResponse outHttp;
+    UqImageResult* results = calloc(numRenditions, sizeof(UqImageResult));
+    if (!valid) {
+        outHttp = create_invalid_op_post_request();
+    } else if (!run_transform(
+                       inHttp, cmdBuffers, numRenditions, context, results)) {
+        outHttp = create_overloaded_post_request(
+                limiter_retry_after(context->limiter));
+    } else if (results[0].status == UQIMAGE_IMAGE_TOO_LARGE) {
+        outHttp = create_payload_large_post_request(inHttp.bodyLen);
+    } else if (results[0].status == UQIMAGE_UNPROCESSABLE_IMAGE) {
+        outHttp = create_unprocessable_post_request();
+    } else {
+        bool cancelled = false;
+        for (int i = 0; i < numRenditions; i++) {
+            cancelled = cancelled || results[i].status == UQIMAGE_CANCELLED;
+        }
+        outHttp = cancelled ? create_deadline_exceeded_post_request()
+                            : create_renditions_post_request(
+                                    results, names, numRenditions);
+    }
+    for (int i = 0; i < numRenditions; i++) {
+        uqimage_free_result(&results[i]);
+        free(cmdBuffers[i].buffer);
+        free(names[i]);
+    }
+    free(results);
+    free(cmdBuffers);
+    free(names);
+    free(chains);
+    return outHttp;
+}
+
+/* Constructor for HTTP response when a batch body is not a valid pack. */
+HttpResponse create_malformed_batch_post_request()
+{
+    HttpResponse outHttp = create_invalid_op_post_request();
+    free(outHttp.bodyData);
+    char* msg = copy_string("Malformed batch of images\n");
+    outHttp.bodyData = (unsigned char*)msg;
+    outHttp.bodyLen = strlen(msg);
+    return outHttp;
+}
+
+/* The images of one batch request, shared by the threads transforming
+ * them. Each thread takes the next untaken image until none are left. */
+typedef struct BatchWork {
+    PackedItem* images;
+    int numImages;
+    CommandBuffer cmdBuffer;
+    RequestContext* context;
+    long unsigned int* costs;
+    UqImageResult* results;
+    Mutex nextImage;
+} BatchWork;
+
+/* batch_worker()
+ * --------------
+ * Private thread function that transforms images of a batch until none are
+ *      left. Each image waits its turn for a CPU like any other transform,
+ *      so a large batch cannot crowd out single requests.
+ *
+ * data: the BatchWork to take images from.
+ *
+ * returns: NULL.
+ */
+static void* batch_worker(void* data)
+{
+    BatchWork* work = (BatchWork*)data;
+    while (1) {
+        sem_wait(&(work->nextImage.lock));
+        int image = work->nextImage.value++;
+        sem_post(&(work->nextImage.lock));
+        if (image >= work->numImages) {
+            return NULL;
+        }
+        PackedItem* item = &(work->images[image]);
+        Scheduler* scheduler = item->length <= maxImageSize
+                ? work->context->scheduler
+                : NULL;
+        scheduler_acquire(scheduler, work->costs[image]);
+        process_image_buffer(item->data, item->length, work->cmdBuffer,
+                work->context->imageOps, work->context->cancel,
+                &(work->results[image]));
+        scheduler_release(scheduler);
+    }
+}
+
+/* run_batch_workers()
+ * -------------------
+ * Private helper function that transforms every image of a batch, spread
+ *      over up to one thread per CPU, this one included.
+ */
+static void run_batch_workers(BatchWork* work)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int numThreads = work->numImages < cpus ? work->numImages : cpus;
+    pthread_t* threads = malloc(sizeof(pthread_t) * (numThreads + 1));
+    bool* started = calloc(numThreads + 1, sizeof(bool));
+    for (int i = 1; i < numThreads; i++) {
+        started[i] = !pthread_create(&threads[i], NULL, batch_worker, work);
+    }
+    batch_worker(work);
+    for (int i = 1; i < numThreads; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(started);
+    free(threads);
+}
+
+/* create_batch_post_request()
+ * ---------------------------
+ * Private helper function that packs the outcome of every image of a batch
+ *      into a response, error messages standing in for failed images.
+ */
+static HttpResponse create_batch_post_request(
+        UqImageResult* results, int numImages)
+{
+    PackedItem* items = malloc(sizeof(PackedItem) * (numImages + 1));
+    char** messages = calloc(numImages + 1, sizeof(char*));
+    for (int i = 0; i < numImages; i++) {
+        items[i].status = status_to_http(results[i].status);
+        if (results[i].status == UQIMAGE_OK) {
+            items[i].data = results[i].data;
+            items[i].length = results[i].length;
+            continue;
+        }
+        messages[i] = malloc(bufferSize);
+        if (results[i].status == UQIMAGE_OPERATION_FAILED) {
+            sprintf(messages[i], "Operation failed: %s\n",
+                    results[i].failedOperation);
+        } else {
+            strcpy(messages[i], uqimage_status_message(results[i].status));
+        }
+        items[i].data = (unsigned char*)messages[i];
+        items[i].length = strlen(messages[i]);
+    }
+    BinaryData packed = pack_items(items, numImages, true);
+    for (int i = 0; i < numImages; i++) {
+        free(messages[i]);
+    }
+    free(messages);
+    free(items);
+
+    HttpResponse outHttp = {0};
+    outHttp.status = HTTP_OK;
+    outHttp.statusDescription = copy_string("OK");
+    outHttp.headers
+            = add_header(outHttp.headers, "Content-Type", packContentType);
+    outHttp.bodyData = packed.data;
+    outHttp.bodyLen = packed.length;
+    return outHttp;
+}
+
+/* transform_batch()
+ * -----------------
+ * Private helper function that applies one operation chain to every image
+ *      in a packed request body, spreading them over the CPUs. The batch is
+ *      admitted by the concurrency limiter as a whole, then each image is
+ *      scheduled on its own.
+ *
+ * inHttp: the request holding the packed images.
+ * operations: the '/' deliminated operations. Split in place.
+ * context: the statistics, cancellation, scheduling and limiting to use.
+ *
+ * returns: the response to send, a packed body of every image's outcome if
+ *      the request was valid and not cancelled.
+ */
+static HttpResponse transform_batch(HttpRequest inHttp, char* operations,
+        RequestContext* context)
+{
+    if (inHttp.bodyLen > maxBatchSize) {
+        return create_payload_large_post_request(inHttp.bodyLen);
+    }
+    PackedItem* images;
+    int numImages = unpack_items(inHttp.bodyData, inHttp.bodyLen, false,
+            maxBatchImages, &images);
+    if (numImages < 0) {
+        return create_malformed_batch_post_request();
+    }
+    BatchWork work = {images, numImages,
+            create_image_processing_command_buffer(operations), context,
+            calloc(numImages + 1, sizeof(long unsigned int)),
+            calloc(numImages + 1, sizeof(UqImageResult)), {0}};
+    sem_init(&(work.nextImage.lock), 0, 1);
+
+    HttpResponse outHttp;
+    if (work.cmdBuffer.parseError || work.cmdBuffer.numCmds == 0) {
+        outHttp = create_invalid_op_post_request();
+    } else if (!limiter_acquire(context->limiter)) {
+        outHttp = create_overloaded_post_request(
+                limiter_retry_after(context->limiter));
+    } else {
+        long unsigned int cost = 0;
+        for (int i = 0; i < numImages; i++) {
+            work.costs[i] = estimate_request_cost(
+                    images[i].data, images[i].length, work.cmdBuffer);
+            cost += work.costs[i];
+        }
+        struct timespec admitted;
+        clock_gettime(CLOCK_MONOTONIC, &admitted);
+        run_batch_workers(&work);
+        bool cancelled = is_cancelled(context->cancel);
+        limiter_release(context->limiter, cost, elapsed_ms(admitted),
+                deadline_expired(context->cancel));
+        outHttp = cancelled
+                ? create_deadline_exceeded_post_request()
+                : create_batch_post_request(work.results, numImages);
+    }
+    for (int i = 0; i < numImages; i++) {
+        uqimage_free_result(&(work.results[i]));
+    }
+    sem_destroy(&(work.nextImage.lock));
+    free(work.results);
+    free(work.costs);
+    free(work.cmdBuffer.buffer);
+    free(images);
+    return outHttp;
+}
+
+/* transform_operations()
+ * ----------------------
+ * Private helper function that applies the operations in an address to the
+ *      image in a request, as one chain or as several renditions.
+ *
+ * inHttp: the request holding the image.
+ * operations: the '/' deliminated operations. Split in place.
+ * context: what to transform the image with.
+ *
+ * returns: the response to send.
+ */
+static HttpResponse transform_operations(HttpRequest inHttp,
+        char* operations, RequestContext* context)
+{
+    if (strchr(operations, renditionSeparator)) {
+        return transform_renditions(inHttp, operations, context);
+    }
+    // Parse the address as a '/' deliminated options list.
+    CommandBuffer cmdBuffer
+            = create_image_processing_command_buffer(operations);
+
+    // If no operations are specified, or a parsing error occured return 400.
+    HttpResponse outHttp;
+    FREE_IMAGE_JPEG_OPERATION operation;
+    int numOps;
+    if (cmdBuffer.parseError || cmdBuffer.numCmds == 0) {
+        outHttp = create_invalid_op_post_request();
+    } else if (accepts_jpeg(inHttp)
+            && (numOps = plan_lossless_transform(inHttp.bodyData,
+                        inHttp.bodyLen, cmdBuffer, &operation))) {
+        outHttp = transform_losslessly(
+                inHttp, cmdBuffer, operation, numOps, context);
+    } else { // Operations appear valid.
+        outHttp = transform_image(inHttp, cmdBuffer, context);
+    }
+    free(cmdBuffer.buffer);
+    return outHttp;
+}
+
+/* store_image()
+ * -------------
+ * Private helper function that stores the image uploaded in a request.
+ *
+ * inHttp: the request holding the image.
+ * context: holds the store to add it to.
+ *
+ * returns: the response to send, giving the image's ID if stored.
+ */
+static HttpResponse store_image(HttpRequest inHttp, RequestContext* context)
+{
+    if (!inHttp.bodyLen) {
+        return create_unprocessable_post_request();
+    }
+    char id[IMAGE_ID_LENGTH + 1];
+    StoreStatus status = STORE_TOO_LARGE;
+    if (context->store && inHttp.bodyLen <= maxImageSize) {
+        status = image_store_put(
+                context->store, inHttp.bodyData, inHttp.bodyLen, id);
+    }
+    if (status == STORE_CONFLICT) {
+        return create_id_conflict_post_request();
+    } else if (status == STORE_TOO_LARGE) {
+        return create_payload_large_post_request(inHttp.bodyLen);
+    }
+    return create_image_stored_post_request(id);
+}
+
+/* transform_stored_image()
+ * ------------------------
+ * Private helper function that applies the operations in an address of the
+ *      form "/images/<id>/<operations>" to the stored image it names. The
+ *      image is kept mapped until the transform is done, even if it expires
+ *      meanwhile.
+ *
+ * inHttp: the request naming the image.
+ * context: the store to look in, and what to transform the image with.
+ *
+ * returns: the response to send.
+ */
+static HttpResponse transform_stored_image(HttpRequest inHttp,
+        RequestContext* context)
+{
+    char* id = inHttp.address + strlen(imagesAddress) + 1;
+    char* operations = strchr(id, '/');
+    if (!operations) { // The image was named, but nothing to do with it.
+        return create_invalid_op_post_request();
+    }
+    *operations = '\0';
+    StoredImage* image = image_store_get(context->store, id);
+    *operations = '/';
+    if (!image) {
+        return create_unknown_image_post_request();
+    }
+
+    HttpRequest stored = inHttp;
+    stored.bodyData = (unsigned char*)stored_image_data(image, &stored.bodyLen);
+    HttpResponse outHttp = transform_operations(stored, operations, context);
+    stored_image_release(image);
+    return outHttp;
+}
+
+void free_http_response(HttpResponse outHttp)
+{
+    free(outHttp.statusDescription);
+    free_array_of_headers(outHttp.headers);
+    if (outHttp.bodyFd > 0) {
+        close(outHttp.bodyFd);
+    }
+    if (outHttp.flight) {
+        flight_release(outHttp.flight);
+    } else {
+        free(outHttp.bodyData);
+    }
+}
+
+HttpResponse respond_to_request(HttpRequest inHttp, RequestContext* context)
 {
     HttpResponse outHttp = {0};
     if (!strcmp(inHttp.type, "GET")) {
@@ -301,36 +1590,25 @@ HttpResponse respond_to_request(HttpRequest inHttp, Mutex* imageOps)
         } else { // No other GET requests supported.
             outHttp = create_not_found_post_request();
         }
-    } else if (!strcmp(inHttp.type, "POST")) {
-        // Parse POST request address as a '/' deliminated options list.
-        CommandBuffer cmdBuffer
-                = create_image_processing_command_buffer(inHttp.address);
-
-        // If no operations are specified, or a parsing error occured
-        // return 400.
-        if (cmdBuffer.parseError || cmdBuffer.numCmds == 0) {
-            outHttp = create_invalid_op_post_request();
-        } else if (inHttp.bodyLen > maxImageSize) { // Large image, return 413.
-            outHttp = create_payload_large_post_request(inHttp.bodyLen);
-        } else { // Operations appear valid.
-            // Attempt to load binary image data into a cross-platform
-            // bitmap format.
-            FIBITMAP* bitmap = fi_load_image_from_buffer(
-                    inHttp.bodyData, inHttp.bodyLen);
-            if (!bitmap) { // Failed to load image into bitmap.
-                outHttp = create_unprocessable_post_request();
-            } else {
-                // Bitmap was succesfully created. Attempt operations.
-                char* failCheck = apply_cmd_buffer_to_image(
-                        &bitmap, cmdBuffer, imageOps);
-                if (failCheck) { // One or more of the operations failed.
-                    outHttp = create_not_implemented_post_request(failCheck);
-                } else { // All operations completed successfully.
-                    outHttp = create_image_return_post_request(bitmap);
-                }
-            }
+    } else if (!strcmp(inHttp.type, "PUT")) {
+        // Images are only ever uploaded to the store.
+        if (!strcmp(inHttp.address, imagesAddress)) {
+            outHttp = store_image(inHttp, context);
+        } else {
+            outHttp = create_not_found_post_request();
         }
-    } else { // HTTP method was not GET or POST. No other methods supported.
+    } else if (!strcmp(inHttp.type, "POST")
+            && !strncmp(inHttp.address, imagesAddress, strlen(imagesAddress))
+            && inHttp.address[strlen(imagesAddress)] == '/') {
+        // Transform an image uploaded earlier.
+        outHttp = transform_stored_image(inHttp, context);
+    } else if (is_batch_request(&inHttp)) {
+        // Transform a pack of images with the same operations.
+        outHttp = transform_batch(
+                inHttp, inHttp.address + strlen(batchAddress), context);
+    } else if (!strcmp(inHttp.type, "POST")) {
+        outHttp = transform_operations(inHttp, inHttp.address, context);
+    } else { // No methods other than GET, PUT and POST are supported.
         outHttp = create_method_disallowed_post_request();
     }
 
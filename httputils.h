@@ -3,19 +3,42 @@
 
 #include <stdio.h>
 #include "ioutils.h"
+#include "socketutils.h"
+#include "scheduler.h"
+#include "limiter.h"
+#include "singleflight.h"
+#include "diskcache.h"
+#include "imagestore.h"
+#include "tiling.h"
+#include "bufferpool.h"
 
 /* Error codes in common use throughout both client and
  * server programs */
 enum HttpCode {
     HTTP_OK = 200,
+    IMAGE_CREATED = 201,
     METHOD_NOT_ALLOWED = 405,
     OPERATION_NOT_IMPLEMENTED = 501,
     UNPROCESSABLE_IMAGE = 422,
     IMAGE_TOO_LARGE = 413,
     INVALID_OPERATION = 400,
-    ADDRESS_NOT_FOUND = 404
+    ADDRESS_NOT_FOUND = 404,
+    IMAGE_ID_CONFLICT = 409,
+    SERVICE_UNAVAILABLE = 503,
+    DEADLINE_EXCEEDED = 504
 };
 
+// Request header giving the milliseconds the client will wait for a
+// response, after which the server abandons the work.
+extern const char* const deadlineHeaderName;
+
+// Client exit status when the server closes the connection without a
+// response.
+extern const int noResponseCode;
+
+// Address prefix of packed batch requests, followed by their operations.
+extern const char* const batchAddress;
+
 /* Typical parameters needed to construct a http request */
 typedef struct HttpRequest {
     char* type;
@@ -32,45 +55,218 @@ typedef struct HttpResponse {
     HttpHeader** headers;
     unsigned char* bodyData;
     long unsigned int bodyLen;
+    Flight* flight; // Owns bodyData when shared by coalesced requests.
+    int bodyFd; // If positive, bodyLen bytes of this file are the body.
 } HttpResponse;
 
+/* construct_operations_address()
+ * ------------------------------
+ * Encodes the image manipulation operations in args as a '/' deliminated
+ * address, as used in server requests and by libuqimage.
+ *
+ * args: the operations to apply to the image.
+ *
+ * returns: a heap allocated address string.
+ */
+char* construct_operations_address(ClientInputs args);
+
 /* send_operations_request()
  * -------------------------
- * Sends a request throught the open socket, socketPost, to do the operations
- *      specified in args, on the image written in input.
+ * Sends a request throught the open socket, socketData, to do the operations
+ *      specified in args, on the image written in input. Connections that
+ *      can pass file descriptors hand the image over in a memfd instead of
+ *      writing it to the socket.
  *
- * socketPost: a writable filestream to the server socket.
+ * socketData: an open connection to the server.
  * args: the inputs containing the drawing operations to conduct.
  * input: a file stream to read the binary image off of.
  *
  * returns: 0 if succesfull, otherwise the error code.
  */
-int send_operations_request(FILE* socketPost, ClientInputs args, FILE* input);
+int send_operations_request(
+        SocketData socketData, ClientInputs args, FILE* input);
+
+/* send_image_request()
+ * --------------------
+ * Sends a request to apply an already encoded operation address to the
+ *      image read from input, as per send_operations_request().
+ *
+ * socketData: an open connection to the server.
+ * address: the '/' deliminated operations to apply, e.g. "/rotate,90".
+ * input: a file stream to read the binary image off of.
+ *
+ * returns: 0 if succesfull, otherwise the error code.
+ */
+int send_image_request(SocketData socketData, char* address, FILE* input);
 
 /* write_operations_respnose()
  * ---------------------------
- * Writes the image located in response that originates in socketGet,
- * to the file stream output.
+ * Writes the image located in response that originates in socketData,
+ * to the file stream output. Images returned in a memfd are read from
+ * the mapped descriptor.
  *
- * socketGet: a readable filestream to the server socket.
+ * socketData: an open connection to the server.
  * output: the output file stream to write the retrieved image to.
+ * retryAfterMs: if not NULL, set to how long to wait before retrying when
+ *      the server was too busy to take the request, otherwise -1. The
+ *      server's message is then left for the caller to report.
  *
  * returns: 0 if successfull, otherwise the error code.
  */
-int write_operations_response(FILE* socketGet, FILE* output);
+int write_operations_response(
+        SocketData socketData, FILE* output, long* retryAfterMs);
+
+/* write_renditions_response()
+ * ---------------------------
+ * Reads the multipart response to a request for several renditions,
+ *      writing each rendition into outDir under a name derived from its
+ *      chain, e.g. "rotate,90_scale,80,60.png". Failed chains are reported
+ *      and the rest still written.
+ *
+ * socketData: an open connection to the server.
+ * outDir: the directory to write renditions to.
+ *
+ * returns: 0 if every rendition was written, otherwise the error code.
+ */
+int write_renditions_response(SocketData socketData, const char* outDir);
+
+/* get_header_value()
+ * ------------------
+ * Finds the value of a header by case insensitive name.
+ *
+ * headers: a NULL terminated array of headers. May be NULL.
+ * name: the header name to search for.
+ *
+ * returns: the value of the first matching header, or NULL if not present.
+ */
+char* get_header_value(HttpHeader** headers, const char* name);
+
+/* add_header()
+ * ------------
+ * Appends a copy of a header to a heap allocated, NULL terminated header
+ *      array, growing it as needed.
+ *
+ * headers: the array to append to. May be NULL.
+ * name: the header name.
+ * value: the header value.
+ *
+ * returns: the (possibly moved) header array.
+ */
+HttpHeader** add_header(HttpHeader** headers, const char* name,
+        const char* value);
+
+/* get_deadline_ms()
+ * -----------------
+ * Reads the deadline a request gives in its X-Deadline-Ms header.
+ *
+ * headers: the request headers. May be NULL.
+ *
+ * returns: the deadline in milliseconds, or -1 if the header is absent or
+ *      not a non-negative integer.
+ */
+long get_deadline_ms(HttpHeader** headers);
+
+/* How reading a request off a connection went */
+typedef enum RequestRead {
+    REQUEST_READ,
+    REQUEST_TOO_LARGE, // Its body was read and discarded unkept.
+    REQUEST_FAILED // The connection closed or the request was malformed.
+} RequestRead;
+
+/* get_spooled_request()
+ * ---------------------
+ * Reads a request as get_HTTP_request() does, but without ever holding a
+ *      large body in memory. Bodies up to maxImageSize are read into the
+ *      heap. Larger bodies, up to the tiling's upload limit or the largest
+ *      batch, are spooled to a scratch file and mapped, and anything larger
+ *      is read and thrown away, leaving bodyData NULL but bodyLen set so
+ *      the client can be told why.
+ *
+ * stream: the connection to read from.
+ * tiling: where to spool to. May be NULL, in which case nothing over
+ *      maxImageSize, or the largest batch, is kept.
+ * pools: where heap bodies are taken from. May be NULL.
+ * inHttp: populated with the request. Its type, address and headers are
+ *      the caller's to free, and a heap body, bodyLen + 1 bytes, the
+ *      caller's to give back to pools.
+ * spooled: populated with the mapping of a spooled body, which inHttp's
+ *      bodyData then points into, or a NULL data pointer. Release with
+ *      unmap_binary_data().
+ *
+ * returns: how the read went.
+ */
+RequestRead get_spooled_request(FILE* stream, Tiling* tiling,
+        BufferPools* pools, HttpRequest* inHttp, BinaryData* spooled);
+
+/* get_retry_after_ms()
+ * --------------------
+ * Reads the delay a response asks for in its Retry-After header, given in
+ *      whole seconds. HTTP dates are not understood.
+ *
+ * headers: the response headers. May be NULL.
+ *
+ * returns: the delay in milliseconds, or -1 if the header is absent or not
+ *      a number of seconds.
+ */
+long get_retry_after_ms(HttpHeader** headers);
+
+/* What the server lends respond_to_request() beyond the request itself.
+ * Any field may be NULL. */
+typedef struct RequestContext {
+    Mutex* imageOps; // Incremented for each successfull image operation.
+    CancelToken* cancel; // Abandons image processing once cancelled.
+    Scheduler* scheduler; // Admits transforms in order of estimated cost.
+    Limiter* limiter; // Refuses transforms beyond the adaptive limit.
+    FlightGroup* flights; // Coalesces identical transforms in flight.
+    Mutex* coalesced; // Incremented for each request served a shared result.
+    DiskCache* cache; // Results kept on disk across restarts.
+    ImageStore* store; // Images uploaded once to be transformed by ID.
+    Tiling* tiling; // Transforms images over maxImageSize out of core.
+} RequestContext;
 
 /* respond_to_request()
  * --------------------
  * Recieves the http request specified in inHTTP and returns a suitable
- * HTTP response.
+ * HTTP response. "PUT /images" stores the body and answers 201 with its ID,
+ * and "POST /images/<id>/<operations>" transforms a stored image as a POST
+ * of its bytes would, answering 404 once the image has expired. Operations
+ * given as several ';' separated chains, each starting with '/', are run
+ * on one decode of the image and answered with a multipart/mixed body
+ * holding one part per chain. "POST /batch/<operations>" applies one chain
+ * to every image in a packed body (see packutils.h) and answers with a
+ * pack of their outcomes.
  *
  * inHttp: a HttpRequest struct that holds the information for the request
- * imageOps: a shared mutex to increment for each successfull image operation
- *      used for statistics tracking.
+ * context: the statistics, cancellation, scheduling, limiting, coalescing
+ *      and caching to process it with. Cancelled requests are answered with
+ *      504, and requests over the concurrency limit with 503 and a
+ *      Retry-After. Cached results are answered with the cache file as
+ *      bodyFd rather than read into bodyData.
  *
  * returns: a HttpResponse containing the information associated with
- *      sending a http response over the network.
+ *      sending a http response over the network, to be released with
+ *      free_http_response().
+ */
+HttpResponse respond_to_request(HttpRequest inHttp, RequestContext* context);
+
+/* create_payload_large_post_request()
+ * ------------------------------------
+ * Constructs the 413 response refusing a body as too large.
+ *
+ * payloadSize: the size of the body refused, in bytes.
+ *
+ * returns: the response, to be released with free_http_response().
+ */
+HttpResponse create_payload_large_post_request(long unsigned int payloadSize);
+
+/* free_http_response()
+ * --------------------
+ * Releases a response built by respond_to_request(), dropping its share of
+ *      a coalesced result rather than freeing the body outright and closing
+ *      any body file.
+ *
+ * outHttp: the response to release.
  */
-HttpResponse respond_to_request(HttpRequest inHttp, Mutex* imageOps);
+void free_http_response(HttpResponse outHttp);
 
 #endif // HTTPUTILS_H
@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ctype.h>
+#include <semaphore.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "hashutils.h"
+#include "imagestore.h"
+
+#define STORE_BUCKETS 1024
+
+// Seed of the second hash in an ID, so two images must collide in both
+// halves to share one.
+const uint64_t storeCheckSeed = 0x6a09e667f3bcc908;
+
+const char* const imageIdFormat = "%016" PRIx64 "%016" PRIx64;
+
+struct StoredImage {
+    uint64_t key;
+    uint64_t check;
+    unsigned char* data; // Read only anonymous mapping.
+    long unsigned int length;
+    time_t lastUsed; // Monotonic seconds.
+    int refs; // One for the store while held, one per user.
+    struct ImageStore* store; // Whose lock guards refs.
+    struct StoredImage* next; // Next in the bucket.
+    struct StoredImage* newer; // Neighbours in order of use.
+    struct StoredImage* older;
+};
+
+struct ImageStore {
+    sem_t lock; // Guards everything, including each image's refs.
+    long unsigned int maxBytes;
+    long unsigned int bytes;
+    int count;
+    int ttlSeconds;
+    StoredImage* buckets[STORE_BUCKETS];
+    StoredImage* newest;
+    StoredImage* oldest; // Expires first, as every image has the same TTL.
+};
+
+/* now_seconds()
+ * -------------
+ * Private helper function that reads the monotonic clock in seconds.
+ */
+static time_t now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+/* parse_image_id()
+ * ----------------
+ * Private helper function that splits an ID back into its two hashes.
+ *
+ * returns: false if id is not IMAGE_ID_LENGTH hexadecimal digits.
+ */
+static bool parse_image_id(const char* id, uint64_t* key, uint64_t* check)
+{
+    for (int i = 0; i < IMAGE_ID_LENGTH; i++) {
+        if (!isxdigit((unsigned char)id[i])) {
+            return false;
+        }
+    }
+    if (id[IMAGE_ID_LENGTH] != '\0') {
+        return false;
+    }
+    char half[IMAGE_ID_LENGTH / 2 + 1] = {0};
+    memcpy(half, id, IMAGE_ID_LENGTH / 2);
+    *key = strtoull(half, NULL, 16);
+    *check = strtoull(id + IMAGE_ID_LENGTH / 2, NULL, 16);
+    return true;
+}
+
+/* find_image()
+ * ------------
+ * Private helper function that looks an image up by its hashes. The store
+ *      must be locked.
+ */
+static StoredImage* find_image(ImageStore* store, uint64_t key,
+        uint64_t check)
+{
+    StoredImage* image = store->buckets[key % STORE_BUCKETS];
+    while (image && (image->key != key || image->check != check)) {
+        image = image->next;
+    }
+    return image;
+}
+
+/* unlink_use()
+ * ------------
+ * Private helper function that takes an image out of the order of use. The
+ *      store must be locked.
+ */
+static void unlink_use(ImageStore* store, StoredImage* image)
+{
+    if (image->newer) {
+        image->newer->older = image->older;
+    } else {
+        store->newest = image->older;
+    }
+    if (image->older) {
+        image->older->newer = image->newer;
+    } else {
+        store->oldest = image->newer;
+    }
+    image->newer = NULL;
+    image->older = NULL;
+}
+
+/* mark_used()
+ * -----------
+ * Private helper function that moves an image to the newest end of the
+ *      order of use. The store must be locked.
+ */
+static void mark_used(ImageStore* store, StoredImage* image)
+{
+    unlink_use(store, image);
+    image->lastUsed = now_seconds();
+    image->older = store->newest;
+    if (store->newest) {
+        store->newest->newer = image;
+    } else {
+        store->oldest = image;
+    }
+    store->newest = image;
+}
+
+/* free_image()
+ * ------------
+ * Private helper function that unmaps an image nobody references.
+ */
+static void free_image(StoredImage* image)
+{
+    munmap(image->data, image->length);
+    free(image);
+}
+
+/* drop_image()
+ * ------------
+ * Private helper function that removes an image from the store, which
+ *      gives up its reference. The store must be locked.
+ *
+ * returns: the image if that was the last reference and it must be freed
+ *      once the store is unlocked, otherwise NULL.
+ */
+static StoredImage* drop_image(ImageStore* store, StoredImage* image)
+{
+    StoredImage** link = &(store->buckets[image->key % STORE_BUCKETS]);
+    while (*link != image) {
+        link = &((*link)->next);
+    }
+    *link = image->next;
+    unlink_use(store, image);
+    store->bytes -= image->length;
+    store->count--;
+    return --image->refs ? NULL : image;
+}
+
+/* make_room()
+ * -----------
+ * Private helper function that drops expired images, then the least
+ *      recently used until length more bytes fit. Dropped images are
+ *      chained through next to be freed once the store is unlocked. The
+ *      store must be locked.
+ *
+ * returns: the chain of images to free.
+ */
+static StoredImage* make_room(ImageStore* store, long unsigned int length)
+{
+    StoredImage* unused = NULL;
+    time_t now = now_seconds();
+    while (store->oldest
+            && (now - store->oldest->lastUsed >= store->ttlSeconds
+                    || store->bytes + length > store->maxBytes)) {
+        StoredImage* image = drop_image(store, store->oldest);
+        if (image) {
+            image->next = unused;
+            unused = image;
+        }
+    }
+    return unused;
+}
+
+/* free_images()
+ * -------------
+ * Private helper function that frees a chain built by make_room().
+ */
+static void free_images(StoredImage* unused)
+{
+    while (unused) {
+        StoredImage* next = unused->next;
+        free_image(unused);
+        unused = next;
+    }
+}
+
+ImageStore* create_image_store(long unsigned int maxBytes, int ttlSeconds)
+{
+    ImageStore* store = calloc(1, sizeof(ImageStore));
+    store->maxBytes = maxBytes;
+    store->ttlSeconds = ttlSeconds;
+    sem_init(&(store->lock), 0, 1);
+    return store;
+}
+
+StoreStatus image_store_put(ImageStore* store, const unsigned char* image,
+        long unsigned int length, char* id)
+{
+    if (!length || length > store->maxBytes) {
+        return STORE_TOO_LARGE;
+    }
+    uint64_t key = hash_bytes(image, length, hashInitialSeed);
+    uint64_t check = hash_bytes(image, length, storeCheckSeed);
+    sprintf(id, imageIdFormat, key, check);
+
+    sem_wait(&(store->lock));
+    StoredImage* unused = make_room(store, 0);
+    StoredImage* existing = find_image(store, key, check);
+    if (existing) {
+        // FNV is easily collided on purpose, so never hand one client's
+        // image to another on the strength of the hash alone.
+        bool same = existing->length == length
+                && !memcmp(existing->data, image, length);
+        if (same) {
+            mark_used(store, existing);
+        }
+        sem_post(&(store->lock));
+        free_images(unused);
+        return same ? STORE_OK : STORE_CONFLICT;
+    }
+    sem_post(&(store->lock));
+    free_images(unused);
+
+    // Copy outside the lock, as images may be megabytes.
+    unsigned char* data = mmap(NULL, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        return STORE_TOO_LARGE;
+    }
+    memcpy(data, image, length);
+    mprotect(data, length, PROT_READ);
+    StoredImage* stored = calloc(1, sizeof(StoredImage));
+    stored->key = key;
+    stored->check = check;
+    stored->data = data;
+    stored->length = length;
+    stored->refs = 1;
+    stored->store = store;
+
+    sem_wait(&(store->lock));
+    if (find_image(store, key, check)) { // Stored by another meanwhile.
+        sem_post(&(store->lock));
+        free_image(stored);
+        return image_store_put(store, image, length, id);
+    }
+    unused = make_room(store, length);
+    StoredImage** bucket = &(store->buckets[key % STORE_BUCKETS]);
+    stored->next = *bucket;
+    *bucket = stored;
+    mark_used(store, stored);
+    store->bytes += length;
+    store->count++;
+    sem_post(&(store->lock));
+    free_images(unused);
+    return STORE_OK;
+}
+
+StoredImage* image_store_get(ImageStore* store, const char* id)
+{
+    uint64_t key, check;
+    if (!store || !parse_image_id(id, &key, &check)) {
+        return NULL;
+    }
+    sem_wait(&(store->lock));
+    StoredImage* unused = make_room(store, 0);
+    StoredImage* image = find_image(store, key, check);
+    if (image) {
+        image->refs++;
+        mark_used(store, image);
+    }
+    sem_post(&(store->lock));
+    free_images(unused);
+    return image;
+}
+
+const unsigned char* stored_image_data(
+        StoredImage* image, long unsigned int* length)
+{
+    *length = image->length;
+    return image->data;
+}
+
+void stored_image_release(StoredImage* image)
+{
+    if (!image) {
+        return;
+    }
+    sem_wait(&(image->store->lock));
+    int refs = --image->refs;
+    sem_post(&(image->store->lock));
+    if (!refs) {
+        free_image(image);
+    }
+}
+
+void image_store_usage(
+        ImageStore* store, int* count, long unsigned int* bytes)
+{
+    *count = 0;
+    *bytes = 0;
+    if (!store) {
+        return;
+    }
+    sem_wait(&(store->lock));
+    StoredImage* unused = make_room(store, 0);
+    *count = store->count;
+    *bytes = store->bytes;
+    sem_post(&(store->lock));
+    free_images(unused);
+}
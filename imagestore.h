@@ -0,0 +1,95 @@
+#ifndef IMAGESTORE_H
+#define IMAGESTORE_H
+
+#include <stdbool.h>
+
+/* Holds source images uploaded once, so many transforms can be requested
+ * of one image without sending it again. Images are named by a hash of
+ * their bytes, so uploading the same image twice gives the same ID. Each
+ * image lives in its own read only anonymous mapping, whose pages go
+ * straight back to the system when the image is dropped. Images expire
+ * once unused for the store's time to live, and the least recently used
+ * are evicted early to keep the store within its size bound. Images in use
+ * by a transform stay mapped until it finishes, even if dropped. */
+
+typedef struct ImageStore ImageStore;
+typedef struct StoredImage StoredImage;
+
+// Characters in an image ID, not counting the terminator.
+#define IMAGE_ID_LENGTH 32
+
+/* Outcomes of storing an image */
+typedef enum StoreStatus {
+    STORE_OK,
+    STORE_TOO_LARGE, // Larger than the whole store, or unable to be mapped.
+    STORE_CONFLICT // A different image already holds the same ID.
+} StoreStatus;
+
+/* create_image_store()
+ * --------------------
+ * maxBytes: the most the stored images may take up.
+ * ttlSeconds: how long an image may go unused before it expires.
+ *
+ * returns: a new, empty store.
+ */
+ImageStore* create_image_store(long unsigned int maxBytes, int ttlSeconds);
+
+/* image_store_put()
+ * -----------------
+ * Stores a copy of an image, evicting expired and then least recently used
+ *      images to make room. Storing an image already present just marks
+ *      it used.
+ *
+ * store: the store to add to.
+ * image: the encoded image.
+ * length: the number of bytes in image.
+ * id: populated with the image's ID, IMAGE_ID_LENGTH characters and a
+ *      terminator.
+ *
+ * returns: STORE_OK if stored, otherwise why it was not.
+ */
+StoreStatus image_store_put(ImageStore* store, const unsigned char* image,
+        long unsigned int length, char* id);
+
+/* image_store_get()
+ * -----------------
+ * Finds a stored image and marks it used.
+ *
+ * store: the store to look in. May be NULL.
+ * id: the image's ID.
+ *
+ * returns: a reference to the image, to be dropped with
+ *      stored_image_release(), or NULL if no such image is stored.
+ */
+StoredImage* image_store_get(ImageStore* store, const char* id);
+
+/* stored_image_data()
+ * -------------------
+ * image: a referenced image.
+ * length: set to the number of bytes in the image.
+ *
+ * returns: the image's bytes, valid until the reference is dropped.
+ */
+const unsigned char* stored_image_data(
+        StoredImage* image, long unsigned int* length);
+
+/* stored_image_release()
+ * ----------------------
+ * Drops a reference to an image, unmapping it with the last.
+ *
+ * image: the image to release. May be NULL.
+ */
+void stored_image_release(StoredImage* image);
+
+/* image_store_usage()
+ * -------------------
+ * Reports what the store holds, after dropping expired images.
+ *
+ * store: the store to report on. May be NULL.
+ * count: set to the number of images stored.
+ * bytes: set to the bytes they take up.
+ */
+void image_store_usage(
+        ImageStore* store, int* count, long unsigned int* bytes);
+
+#endif // IMAGESTORE_H
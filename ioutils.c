@@ -1,6 +1,9 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <poll.h>
 
 #include <csse2310_freeimage.h>
 #include <FreeImage.h>
@@ -9,10 +12,22 @@
 #include "stringutils.h"
 #include "argparsing.h"
 #include "ioutils.h"
+#include "affine.h"
+#include "crop.h"
+#include "pixelformat.h"
+#include "rotate.h"
+#include "prescale.h"
+#include "forkjoin.h"
 
 // The amount to increase the binary buffer by in each reallocation.
 const long unsigned int sizeGuess = 10000;
 
+const unsigned int maxImageSize = 8388608;
+
+// Conversion factors for reporting stage timings in milliseconds.
+const double msPerSecond = 1000.0;
+const double nsPerMs = 1000000.0;
+
 BinaryData read_binary_file(FILE* binaryFile)
 {
     unsigned char* buffer = malloc(sizeof(unsigned char) * sizeGuess);
@@ -46,24 +61,140 @@ bool file_is_valid(char* filePath, char* accessMode)
     return true;
 }
 
-char* apply_cmd_buffer_to_image(
-        FIBITMAP** bitmap, CommandBuffer cmdBuffer, Mutex* imageOps)
+void init_cancel_token(CancelToken* cancel, long deadlineMs, int clientHandle)
+{
+    cancel->hasDeadline = deadlineMs >= 0;
+    cancel->deadline = ms_from_now(cancel->hasDeadline ? deadlineMs : 0);
+    cancel->clientHandle = clientHandle;
+    cancel->cancelled = false;
+    cancel->deadlineExpired = false;
+    sem_init(&(cancel->lock), 0, 1);
+}
+
+bool is_cancelled(CancelToken* cancel)
+{
+    if (!cancel) {
+        return false;
+    }
+    sem_wait(&(cancel->lock));
+    bool cancelled = cancel->cancelled;
+    sem_post(&(cancel->lock));
+    if (cancelled) {
+        return true;
+    }
+    // Time left before the deadline, which elapsed_ms() reports as negative.
+    bool expired = cancel->hasDeadline && elapsed_ms(cancel->deadline) >= 0;
+    // A peer that hung up can never read the result.
+    bool hungUp = false;
+    if (!expired && cancel->clientHandle != -1) {
+        struct pollfd peer = {cancel->clientHandle, POLLRDHUP, 0};
+        hungUp = poll(&peer, 1, 0) > 0
+                && (peer.revents & (POLLRDHUP | POLLHUP | POLLERR));
+    }
+    if (!expired && !hungUp) {
+        return false;
+    }
+    // Another thread may have got here first, and its cause stands.
+    sem_wait(&(cancel->lock));
+    if (!cancel->cancelled) {
+        cancel->cancelled = true;
+        cancel->deadlineExpired = expired;
+    }
+    sem_post(&(cancel->lock));
+    return true;
+}
+
+bool deadline_expired(CancelToken* cancel)
+{
+    if (!cancel) {
+        return false;
+    }
+    sem_wait(&(cancel->lock));
+    bool expired = cancel->deadlineExpired;
+    sem_post(&(cancel->lock));
+    return expired;
+}
+
+/* replace_bitmap()
+ * ----------------
+ * Private helper function that moves a chain on to the bitmap an operation
+ *      produced, unloading the one it was made from, and the bitmap that
+ *      one viewed if it was a crop.
+ */
+static void replace_bitmap(FIBITMAP** bitmap, FIBITMAP** viewed,
+        FIBITMAP* replacement)
+{
+    FreeImage_Unload(*bitmap);
+    if (*viewed) {
+        FreeImage_Unload(*viewed);
+        *viewed = NULL;
+    }
+    *bitmap = replacement;
+}
+
+char* apply_cmd_buffer_to_image(FIBITMAP** bitmap, CommandBuffer cmdBuffer,
+        Mutex* imageOps, CancelToken* cancel)
 {
     char* failCheck = NULL;
+    // Crop as early as possible, so the operations after only see the
+    // pixels kept. The reordered copy is freed at the end.
+    cmdBuffer = hoist_crops(cmdBuffer, FreeImage_GetWidth(*bitmap),
+            FreeImage_GetHeight(*bitmap));
+    // Kernels stop filling bands once cancelled. What they leave is never
+    // used, as the next check between operations catches it.
+    CancelToken* outerCancel = set_band_cancel(cancel);
+    FIBITMAP* viewed = NULL; // What *bitmap is a crop of, if anything.
+    // Pick the kernels for the image's layout once. Every operation keeps
+    // the layout, so they serve the whole chain.
+    PixelKernels specialised;
+    const PixelKernels* kernels
+            = select_kernels(*bitmap, &specialised) ? &specialised : NULL;
     // Loop through command array, dispatching FreeImage operations depening
     // on the recieved value.
     for (int i = 0; i < cmdBuffer.numCmds; i++) {
+        // Nobody wants the result any more, so stop before the next op.
+        if (is_cancelled(cancel)) {
+            break;
+        }
+        // Resample runs of rotations, flips and scales once, rather than
+        // through an intermediate bitmap for each.
+        AffinePlan plan;
+        FIBITMAP* fused = NULL;
+        if (plan_affine(cmdBuffer, i, FreeImage_GetWidth(*bitmap),
+                    FreeImage_GetHeight(*bitmap), &plan)) {
+            fused = apply_affine(*bitmap, &plan, kernels);
+        }
+        if (fused) {
+            replace_bitmap(bitmap, &viewed, fused);
+            if (imageOps) {
+                modify_mutex(imageOps, plan.numOps);
+            }
+            // Skip the fused commands, less the one the loop steps over.
+            i += plan.length - 1;
+            continue;
+        }
         if (cmdBuffer.buffer[i] == CMD_ROTATE) {
-            *bitmap = FreeImage_Rotate(
-                    *bitmap, (double)cmdBuffer.buffer[i + 1], NULL);
-            if (!(*bitmap)) { // Rotation operation not permitted.
+            // FreeImage handles right angles and formats the engine
+            // leaves to it.
+            FIBITMAP* rotated
+                    = rotate_bitmap(*bitmap, cmdBuffer.buffer[i + 1], kernels);
+            if (!rotated) {
+                rotated = FreeImage_Rotate(
+                        *bitmap, (double)cmdBuffer.buffer[i + 1], NULL);
+            }
+            if (!rotated) { // Rotation operation not permitted.
                 failCheck = "rotate";
                 break;
             }
+            replace_bitmap(bitmap, &viewed, rotated);
             // i + 1 was the parameter of rotation, so skip for next iteration.
             i++;
         } else if (cmdBuffer.buffer[i] == CMD_FLIP) {
-            if (cmdBuffer.buffer[i + 1] == FLIP_HORIZONTAL) {
+            if (cmdBuffer.buffer[i + 1] == FLIP_HORIZONTAL && kernels
+                    && layout_of(*bitmap) == kernels->layout) {
+                PixelBuffer pixels = pixel_buffer(*bitmap);
+                kernels->flipHorizontal(&pixels);
+            } else if (cmdBuffer.buffer[i + 1] == FLIP_HORIZONTAL) {
                 int32_t error = !FreeImage_FlipHorizontal(*bitmap);
                 if (error) { // Flip operation not permitted.
                     failCheck = "flip";
@@ -79,26 +210,243 @@ char* apply_cmd_buffer_to_image(
             // i + 1 was the parameter of flip axis so skip for next iteration.
             i++;
         } else if (cmdBuffer.buffer[i] == CMD_SCALE) {
-            *bitmap = FreeImage_Rescale((*bitmap), cmdBuffer.buffer[i + 1],
-                    cmdBuffer.buffer[i + 2], FILTER_BILINEAR);
-            if (!(*bitmap)) { // Scale operation not permitted.
+            FIBITMAP* scaled = FreeImage_Rescale((*bitmap),
+                    cmdBuffer.buffer[i + 1], cmdBuffer.buffer[i + 2],
+                    FILTER_BILINEAR);
+            if (!scaled) { // Scale operation not permitted.
                 failCheck = "scale";
                 break;
             }
+            replace_bitmap(bitmap, &viewed, scaled);
             // i + 1, i + 2 were the paramters of scaling, so skip over them
             // for the next iteration.
             i += 2;
+        } else if (cmdBuffer.buffer[i] == CMD_CROP) {
+            // A view of the pixels kept, not a copy of them.
+            FIBITMAP* cropped = crop_view(*bitmap, &(cmdBuffer.buffer[i]));
+            if (!cropped) { // Crop misses the image.
+                failCheck = "crop";
+                break;
+            }
+            // Views point straight into their parent's pixels, so a view
+            // of a view outlives it.
+            if (viewed) {
+                FreeImage_Unload(*bitmap);
+            } else {
+                viewed = *bitmap;
+            }
+            *bitmap = cropped;
+            // Skip the crop's position and size.
+            i += 4;
         }
         // Record as a successfull operation, as it would have brocken out
         // of the loop if it failed.
-        modify_mutex(imageOps, 1);
+        if (imageOps) {
+            modify_mutex(imageOps, 1);
+        }
     }
+    // A view cannot outlive what it crops, so the result keeps a copy of
+    // just the pixels cropped.
+    if (viewed) {
+        FIBITMAP* kept = failCheck ? NULL
+                                   : FreeImage_Copy(*bitmap, 0, 0,
+                                           FreeImage_GetWidth(*bitmap),
+                                           FreeImage_GetHeight(*bitmap));
+        FreeImage_Unload(*bitmap);
+        if (kept) {
+            FreeImage_Unload(viewed);
+            *bitmap = kept;
+        } else {
+            *bitmap = viewed;
+            failCheck = failCheck ? failCheck : "crop";
+        }
+    }
+    set_band_cancel(outerCancel);
+    free(cmdBuffer.buffer);
     return failCheck;
 }
 
+struct timespec ms_from_now(long ms)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    time.tv_sec += ms / (long)msPerSecond;
+    time.tv_nsec += (ms % (long)msPerSecond) * (long)nsPerMs;
+    if (time.tv_nsec >= (long)(msPerSecond * nsPerMs)) {
+        time.tv_sec++;
+        time.tv_nsec -= (long)(msPerSecond * nsPerMs);
+    }
+    return time;
+}
+
+double elapsed_ms(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * msPerSecond
+            + (now.tv_nsec - start.tv_nsec) / nsPerMs;
+}
+
+/* transform_and_encode()
+ * ----------------------
+ * Private helper function that runs the operations in cmdBuffer on a
+ *      decoded bitmap, then encodes the result unless an operation failed or
+ *      the work was cancelled. The bitmap is unloaded either way.
+ *
+ * processed: given the status, encoded image and transform and encode
+ *      timings.
+ */
+static void transform_and_encode(FIBITMAP* bitmap, CommandBuffer cmdBuffer,
+        Mutex* imageOps, CancelToken* cancel, UqImageResult* processed)
+{
+    struct timespec stageStart;
+    clock_gettime(CLOCK_MONOTONIC, &stageStart);
+    char* failCheck = apply_cmd_buffer_to_image(
+            &bitmap, cmdBuffer, imageOps, cancel);
+    processed->timing.transformMs = elapsed_ms(stageStart);
+    if (failCheck) {
+        processed->status = UQIMAGE_OPERATION_FAILED;
+        processed->failedOperation = failCheck;
+    } else if (is_cancelled(cancel)) { // Skip the encode, the costliest step.
+        processed->status = UQIMAGE_CANCELLED;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &stageStart);
+        processed->data
+                = fi_save_png_image_to_buffer(bitmap, &processed->length);
+        processed->timing.encodeMs = elapsed_ms(stageStart);
+        processed->status = UQIMAGE_OK;
+    }
+    FreeImage_Unload(bitmap);
+}
+
+/* decode_image()
+ * --------------
+ * Private helper function that checks and decodes an encoded image, the
+ *      stage shared by every transform of it.
+ *
+ * shrink: the factor from plan_decode_shrink() to decode at reduced size by.
+ * processed: given a failing status and decode timing.
+ *
+ * returns: the bitmap, or NULL if processed now holds why not.
+ */
+static FIBITMAP* decode_image(const unsigned char* image,
+        long unsigned int length, int shrink, CancelToken* cancel,
+        UqImageResult* processed)
+{
+    if (length > maxImageSize) {
+        processed->status = UQIMAGE_IMAGE_TOO_LARGE;
+        return NULL;
+    }
+    if (is_cancelled(cancel)) {
+        processed->status = UQIMAGE_CANCELLED;
+        return NULL;
+    }
+
+    // Attempt to load binary image data into a cross-platform bitmap format.
+    struct timespec stageStart;
+    clock_gettime(CLOCK_MONOTONIC, &stageStart);
+    FIBITMAP* bitmap = load_image_shrunk(image, length, shrink);
+    processed->timing.decodeMs = elapsed_ms(stageStart);
+    if (!bitmap) {
+        processed->status = UQIMAGE_UNPROCESSABLE_IMAGE;
+    }
+    return bitmap;
+}
+
+void process_image_buffer(const unsigned char* image, long unsigned int length,
+        CommandBuffer cmdBuffer, Mutex* imageOps, CancelToken* cancel,
+        UqImageResult* result)
+{
+    UqImageResult processed = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    FIBITMAP* bitmap = decode_image(image, length,
+            plan_decode_shrink(image, length, cmdBuffer), cancel, &processed);
+    if (bitmap) {
+        transform_and_encode(bitmap, cmdBuffer, imageOps, cancel, &processed);
+    }
+    processed.timing.totalMs = elapsed_ms(start);
+    *result = processed;
+}
+
+/* One rendition of a shared source bitmap, run as its own task */
+typedef struct Rendition {
+    FIBITMAP* source; // Only read, so shared by every rendition.
+    CommandBuffer cmdBuffer;
+    Mutex* imageOps;
+    CancelToken* cancel;
+    struct timespec start;
+    UqImageResult* result; // Holds the shared decode timing on entry.
+} Rendition;
+
+/* render()
+ * --------
+ * Private task function that transforms and encodes a copy of the source
+ *      bitmap for one rendition.
+ *
+ * data: the array of Renditions.
+ * index: the Rendition to produce.
+ */
+static void render(void* data, int index)
+{
+    Rendition* rendition = &((Rendition*)data)[index];
+    FIBITMAP* copy = FreeImage_Clone(rendition->source);
+    if (!copy) {
+        rendition->result->status = UQIMAGE_OPERATION_FAILED;
+        rendition->result->failedOperation = "copy";
+    } else {
+        transform_and_encode(copy, rendition->cmdBuffer, rendition->imageOps,
+                rendition->cancel, rendition->result);
+    }
+    rendition->result->timing.totalMs = elapsed_ms(rendition->start);
+}
+
+void process_image_renditions(const unsigned char* image,
+        long unsigned int length, CommandBuffer* cmdBuffers,
+        int numRenditions, Mutex* imageOps, CancelToken* cancel,
+        UqImageResult* results)
+{
+    UqImageResult processed = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    // Decode only as small as the rendition needing the most detail allows.
+    int shrink = plan_decode_shrink(image, length, cmdBuffers[0]);
+    for (int i = 1; i < numRenditions; i++) {
+        int renditionShrink = plan_decode_shrink(image, length, cmdBuffers[i]);
+        shrink = renditionShrink < shrink ? renditionShrink : shrink;
+    }
+    FIBITMAP* source = decode_image(image, length, shrink, cancel, &processed);
+    processed.timing.totalMs = elapsed_ms(start);
+    for (int i = 0; i < numRenditions; i++) {
+        results[i] = processed;
+    }
+    if (!source) {
+        return;
+    }
+
+    Rendition* renditions = malloc(sizeof(Rendition) * numRenditions);
+    for (int i = 0; i < numRenditions; i++) {
+        Rendition rendition
+                = {source, cmdBuffers[i], imageOps, cancel, start, &results[i]};
+        renditions[i] = rendition;
+    }
+    // Each rendition is a task, its kernels forking bands of their own.
+    fork_join(numRenditions, render, renditions);
+    free(renditions);
+    FreeImage_Unload(source);
+}
+
 void modify_mutex(Mutex* mutex, int change)
 {
     sem_wait(&(mutex->lock)); // Lock mutex.
     mutex->value += change; // Change value.
     sem_post(&(mutex->lock)); // Unlock mutex.
 }
+
+int read_mutex(Mutex* mutex)
+{
+    sem_wait(&(mutex->lock));
+    int value = mutex->value;
+    sem_post(&(mutex->lock));
+    return value;
+}
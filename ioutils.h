@@ -4,12 +4,17 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <semaphore.h>
+#include <time.h>
 
 #include <csse2310_freeimage.h>
 #include <FreeImage.h>
 #include <csse2310a4.h>
 
 #include "argparsing.h"
+#include "uqimage.h"
+
+// Maximum image size that the server can accept from a client.
+extern const unsigned int maxImageSize;
 
 /* Simple structure that holds a binary unsigned char array
  * and its length. */
@@ -51,21 +56,113 @@ typedef struct Mutex {
     sem_t lock;
 } Mutex;
 
+/* Decides whether in-progress image work should be abandoned: once its
+ * deadline passes or the client that asked for it hangs up. Checked between
+ * pipeline stages, between operations and before each band of rows, from
+ * whichever threads share the work. cancelled sticks once set. */
+typedef struct CancelToken {
+    bool hasDeadline;
+    struct timespec deadline; // CLOCK_MONOTONIC.
+    int clientHandle; // Connection whose hangup cancels the work, or -1.
+    bool cancelled;
+    bool deadlineExpired; // Why it was cancelled, if it was.
+    sem_t lock; // Guards cancelled and deadlineExpired.
+} CancelToken;
+
+/* init_cancel_token()
+ * -------------------
+ * Prepares a cancel token for work starting now.
+ *
+ * cancel: the token to initialise.
+ * deadlineMs: milliseconds from now until the work is abandoned, or -1 for
+ *      no deadline.
+ * clientHandle: the socket of the requesting client, or -1 to not watch for
+ *      hangups.
+ */
+void init_cancel_token(CancelToken* cancel, long deadlineMs, int clientHandle);
+
+/* is_cancelled()
+ * --------------
+ * Checks whether work should be abandoned. Cheap enough to call between
+ *      operations or bands of rows.
+ *
+ * cancel: the token to check. May be NULL, meaning never cancelled.
+ *
+ * returns: true if the deadline has passed or the client has hung up.
+ */
+bool is_cancelled(CancelToken* cancel);
+
+/* deadline_expired()
+ * ------------------
+ * Checks whether work was abandoned for running past its deadline, rather
+ *      than for its client hanging up.
+ *
+ * cancel: the token to check. May be NULL.
+ *
+ * returns: true if is_cancelled() found the deadline passed.
+ */
+bool deadline_expired(CancelToken* cancel);
+
 /* apply_cmd_buffer_to_image()
  * ---------------------------
  * Applies the commands specified in cmdBuffer, to the image specified in
  *      bitmap. On sucess returns NULL, on fail returns the operation that
  *      resulted in an error.
  *
- * bitmap: device independent FreeImage representation of an image.
+ * bitmap: device independent FreeImage representation of an image. Each
+ *      intermediate bitmap is unloaded once replaced.
  * cmdBuffer: a CommandBuffer object, holding a sequence of commands to
  *      perform.
+ * imageOps: a shared mutex to increment for each successfull operation.
+ *      May be NULL.
+ * cancel: checked before each operation, stopping early once cancelled.
+ *      May be NULL.
  *
- * Returns: NULL if all commands succeeded, the name of the failed command
- *      type otherwise.
+ * Returns: NULL if all commands succeeded or the work was cancelled, the
+ *      name of the failed command type otherwise.
  */
-char* apply_cmd_buffer_to_image(
-        FIBITMAP** bitmap, CommandBuffer cmdBuffer, Mutex* imageOps);
+char* apply_cmd_buffer_to_image(FIBITMAP** bitmap, CommandBuffer cmdBuffer,
+        Mutex* imageOps, CancelToken* cancel);
+
+/* process_image_buffer()
+ * ----------------------
+ * Runs the full transform pipeline on an encoded image: size check, decode,
+ *      the operations in cmdBuffer, then PNG encode. Shared by the server
+ *      and libuqimage so both produce identical output.
+ *
+ * image: the encoded source image.
+ * length: the number of bytes in image.
+ * cmdBuffer: a successfully parsed, non-empty CommandBuffer.
+ * imageOps: a shared mutex to increment for each successfull operation.
+ *      May be NULL.
+ * cancel: checked between stages and operations. Cancelled work is freed
+ *      and reported as UQIMAGE_CANCELLED. May be NULL.
+ * result: populated with the encoded PNG, status and stage timings.
+ */
+void process_image_buffer(const unsigned char* image, long unsigned int length,
+        CommandBuffer cmdBuffer, Mutex* imageOps, CancelToken* cancel,
+        UqImageResult* result);
+
+/* process_image_renditions()
+ * --------------------------
+ * Runs several operation chains on one encoded image, decoding it only
+ *      once. Each chain transforms and encodes its own copy of the decoded
+ *      bitmap as its own task on the shared work-stealing pool.
+ *
+ * image: the encoded source image.
+ * length: the number of bytes in image.
+ * cmdBuffers: successfully parsed, non-empty CommandBuffers, one per chain.
+ * numRenditions: the number of chains.
+ * imageOps: a shared mutex to increment for each successfull operation.
+ *      May be NULL.
+ * cancel: checked between stages and operations. May be NULL.
+ * results: populated with one result per chain, in order. Should the image
+ *      fail to decode, every result holds why.
+ */
+void process_image_renditions(const unsigned char* image,
+        long unsigned int length, CommandBuffer* cmdBuffers,
+        int numRenditions, Mutex* imageOps, CancelToken* cancel,
+        UqImageResult* results);
 
 /* modify_mutex()
  * --------------
@@ -78,4 +175,30 @@ char* apply_cmd_buffer_to_image(
  */
 void modify_mutex(Mutex* mutex, int change);
 
+/* read_mutex()
+ * ------------
+ * Reads the value held by the int mutex under its lock.
+ *
+ * mutex: a pointer to the mutex to read.
+ *
+ * returns: the held value.
+ */
+int read_mutex(Mutex* mutex);
+
+/* elapsed_ms()
+ * ------------
+ * Measures time passed since start.
+ *
+ * start: a CLOCK_MONOTONIC time point.
+ *
+ * returns: milliseconds elapsed since start.
+ */
+double elapsed_ms(struct timespec start);
+
+/* ms_from_now()
+ * -------------
+ * returns: the CLOCK_MONOTONIC time point the given milliseconds from now.
+ */
+struct timespec ms_from_now(long ms);
+
 #endif // IOUTILS_H
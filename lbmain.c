@@ -0,0 +1,651 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+
+#include "argparsing.h"
+#include "ioutils.h"
+#include "socketutils.h"
+
+const char* const invalidBalancerCmdMessage
+        = "Usage: uqimagelb [--port port] backend [backend ...]\n";
+const int invalidBalancerCmdCode = 14;
+
+const char* const invalidBalancerPortFormat
+        = "uqimagelb: unable to listen on port \"%s\"\n";
+const int invalidBalancerPortCode = 19;
+
+// Message formats for backend health changes.
+const char* const backendDownFormat = "uqimagelb: backend \"%s\" is down\n";
+const char* const backendUpFormat = "uqimagelb: backend \"%s\" is up\n";
+
+// Message formats for SIGHUP outputs.
+const char* const connectedFormat = "Currently connected clients: %i\n";
+const char* const rejectedFormat = "Requests without a backend: %i\n";
+const char* const backendFormat
+        = "Backend %s: %s, %i active, %lu outstanding bytes, %i completed, "
+          "%i failed\n";
+const char* const latencyFormat
+        = "Backend %s latency: mean %.1f ms, max %.1f ms, health check "
+          "%.1f ms\n";
+
+// Responses sent by the balancer itself. Both close the connection, as the
+// rest of the request may still be unread.
+const char* const unavailableResponse
+        = "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n"
+          "Content-Length: 0\r\n\r\n";
+const char* const badGatewayResponse
+        = "HTTP/1.1 502 Bad Gateway\r\nConnection: close\r\n"
+          "Content-Length: 0\r\n\r\n";
+
+// Health check sent to each backend, answered by the home page.
+const char* const healthCheckRequest = "GET / HTTP/1.1\r\n\r\n";
+const char* const healthyStatusLine = "HTTP/1.1 200";
+
+// Time between health check rounds, and the longest a check may take.
+const int healthCheckIntervalMs = 1000;
+const int healthCheckTimeoutMs = 2000;
+
+const int usPerMs = 1000;
+
+// Longest request or response head that is forwarded.
+#define HEAD_SIZE 8192
+
+// Outcomes of forwarding one request.
+const int exchangeOk = 0;
+const int exchangeClientFailed = 1; // Client went away, nothing to report.
+const int exchangeBackendFailed = 2; // Nothing forwarded back yet, send 502.
+const int exchangeAborted = 3; // Failed mid transfer, both ends unusable.
+// As exchangeBackendFailed, but on a reused connection the backend may
+// have dropped, so it is not marked down.
+const int exchangeStaleFailed = 4;
+
+/* A backend server and its load. lock guards every field but endpoint. */
+typedef struct Backend {
+    char* endpoint; // Port number, or unix socket path if it has a '/'.
+    sem_t lock;
+    bool healthy;
+    long unsigned int outstandingBytes;
+    int activeRequests;
+    int completedRequests;
+    int failedRequests;
+    double totalLatencyMs;
+    double maxLatencyMs;
+    double healthLatencyMs;
+} Backend;
+
+/* State shared by every thread of the balancer */
+typedef struct Balancer {
+    Backend* backends;
+    int numBackends;
+    Mutex nextBackend; // Rotates ties between equally loaded backends.
+    Mutex currentClients;
+    Mutex rejectedRequests;
+} Balancer;
+
+/* The data that a client thread recieves wrapped in a void pointer */
+typedef struct ClientData {
+    Balancer* balancer;
+    SocketData socketData;
+} ClientData;
+
+/* The head of a HTTP message: the start line and headers, exactly as
+ * received, and the length of the body that follows it. */
+typedef struct HttpHead {
+    char text[HEAD_SIZE + 1];
+    long unsigned int length;
+    long unsigned int contentLength;
+} HttpHead;
+
+/* find_head_end()
+ * ---------------
+ * Private helper function that finds the blank line ending a HTTP head,
+ *      accepting both "\r\n\r\n" and "\n\n".
+ *
+ * text: the bytes received so far.
+ * from: the first offset the blank line could end at or after.
+ * length: the number of bytes in text.
+ *
+ * returns: the offset just past the blank line, or -1 if not yet received.
+ */
+long find_head_end(const char* text, long unsigned int from,
+        long unsigned int length)
+{
+    for (long unsigned int i = from; i < length; i++) {
+        if (text[i] != '\n') {
+            continue;
+        }
+        if (i >= 1 && text[i - 1] == '\n') {
+            return i + 1;
+        }
+        if (i >= 3 && !strncmp(&text[i - 3], "\r\n\r\n", 4)) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+/* parse_content_length()
+ * ----------------------
+ * Private helper function that reads the Content-Length header of a head,
+ *      matching the header name case-insensitively.
+ *
+ * head: the head to parse. Its body length is set, or 0 if absent.
+ */
+void parse_content_length(HttpHead* head)
+{
+    const char* name = "content-length:";
+    head->contentLength = 0;
+    for (char* line = strchr(head->text, '\n'); line;
+            line = strchr(line, '\n')) {
+        line++;
+        if (!strncasecmp(line, name, strlen(name))) {
+            head->contentLength = strtoul(line + strlen(name), NULL, 10);
+            return;
+        }
+    }
+}
+
+/* read_http_head()
+ * ----------------
+ * Reads the head of the next HTTP message on a socket, leaving the body
+ *      unread so it can be spliced. The socket is peeked first so that no
+ *      byte past the head is consumed.
+ *
+ * handle: the socket fd to read from.
+ * head: populated with the head and its body length.
+ *
+ * returns: 0 if successfull, otherwise -1 if the socket closed, failed or
+ *      the head was too large.
+ */
+int read_http_head(int handle, HttpHead* head)
+{
+    head->length = 0;
+    while (head->length < HEAD_SIZE) {
+        ssize_t peeked = recv(handle, &head->text[head->length],
+                HEAD_SIZE - head->length, MSG_PEEK);
+        if (peeked <= 0) {
+            return -1;
+        }
+        // Only the tail of the previous read can start the blank line.
+        long unsigned int from = head->length < 3 ? 0 : head->length - 3;
+        long end = find_head_end(head->text, from, head->length + peeked);
+        long unsigned int take
+                = end == -1 ? (long unsigned int)peeked : end - head->length;
+        if (recv(handle, &head->text[head->length], take, 0)
+                != (ssize_t)take) {
+            return -1;
+        }
+        head->length += take;
+        if (end != -1) {
+            head->text[head->length] = '\0';
+            parse_content_length(head);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* write_all()
+ * -----------
+ * Private helper function that sends a whole buffer on a socket.
+ *
+ * handle: the socket fd to send on.
+ * data: the buffer to send.
+ * length: the number of bytes in data.
+ * more: whether a body follows, so the buffer is held to share its packets.
+ *
+ * returns: 0 if successfull, otherwise -1.
+ */
+int write_all(int handle, const char* data, long unsigned int length,
+        bool more)
+{
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+    while (length) {
+        ssize_t sent = send(handle, data, length, flags);
+        if (sent <= 0) {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+/* connect_backend()
+ * -----------------
+ * Private helper function that opens a raw connection to a backend.
+ *
+ * returns: the socket fd, or -1 upon error.
+ */
+int connect_backend(char* endpoint)
+{
+    SocketData socketData = connect_to_endpoint(endpoint);
+    if (socketData.handle != -1) { // Only the raw socket is used.
+        fclose(socketData.get);
+        fclose(socketData.post);
+    }
+    return socketData.handle;
+}
+
+/* choose_backend()
+ * ----------------
+ * Picks the healthy backend with the fewest outstanding request bytes and
+ *      reserves the given bytes on it. Ties are rotated so idle backends
+ *      share the load.
+ *
+ * balancer: the balancer to pick from.
+ * bytes: the size of the request about to be forwarded.
+ *
+ * returns: the chosen backend, or NULL if none are healthy.
+ */
+Backend* choose_backend(Balancer* balancer, long unsigned int bytes)
+{
+    sem_wait(&(balancer->nextBackend.lock));
+    int start = balancer->nextBackend.value++ % balancer->numBackends;
+    sem_post(&(balancer->nextBackend.lock));
+
+    Backend* chosen = NULL;
+    long unsigned int leastBytes = 0;
+    for (int i = 0; i < balancer->numBackends; i++) {
+        Backend* backend
+                = &(balancer->backends[(start + i) % balancer->numBackends]);
+        sem_wait(&(backend->lock));
+        if (backend->healthy
+                && (!chosen || backend->outstandingBytes < leastBytes)) {
+            chosen = backend;
+            leastBytes = backend->outstandingBytes;
+        }
+        sem_post(&(backend->lock));
+    }
+    if (chosen) {
+        sem_wait(&(chosen->lock));
+        chosen->outstandingBytes += bytes;
+        chosen->activeRequests++;
+        sem_post(&(chosen->lock));
+    }
+    return chosen;
+}
+
+/* release_backend()
+ * -----------------
+ * Returns the bytes reserved by choose_backend() and records the outcome.
+ *
+ * backend: the backend the request was forwarded to.
+ * bytes: the bytes reserved for the request.
+ * latencyMs: the time from forwarding the request to finishing the reply.
+ * outcome: the result of the exchange.
+ */
+void release_backend(Backend* backend, long unsigned int bytes,
+        double latencyMs, int outcome)
+{
+    sem_wait(&(backend->lock));
+    backend->outstandingBytes -= bytes;
+    backend->activeRequests--;
+    if (outcome == exchangeOk) {
+        backend->completedRequests++;
+        backend->totalLatencyMs += latencyMs;
+        if (latencyMs > backend->maxLatencyMs) {
+            backend->maxLatencyMs = latencyMs;
+        }
+    } else if (outcome != exchangeClientFailed) {
+        backend->failedRequests++;
+    }
+    // Stop routing to a backend that failed to answer until it passes a
+    // health check again.
+    bool wentDown = outcome == exchangeBackendFailed && backend->healthy;
+    if (wentDown) {
+        backend->healthy = false;
+    }
+    sem_post(&(backend->lock));
+    if (wentDown) {
+        fprintf(stderr, backendDownFormat, backend->endpoint);
+    }
+}
+
+/* connection_usable()
+ * -------------------
+ * Private helper function that checks, without blocking, that a cached
+ *      backend connection is idle and still open. Backends close idle
+ *      connections, which only shows as end of file here.
+ *
+ * handle: the socket fd of the cached connection.
+ *
+ * returns: true if the connection can carry another request.
+ */
+bool connection_usable(int handle)
+{
+    char byte;
+    ssize_t peeked = recv(handle, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    // Bytes nobody asked for would be taken for the next response.
+    return peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* forward_exchange()
+ * ------------------
+ * Forwards one request whose head has been read to a backend, splicing the
+ *      body through, then relays the backend's response the same way.
+ *
+ * clientHandle: the client socket fd, positioned at the request body.
+ * backendHandle: the cached connection to the backend, or -1 to open one.
+ *      Closed and reset to -1 unless the exchange succeeds.
+ * endpoint: the endpoint of the backend.
+ * pipeHandles: the pipe used to splice bodies.
+ * request: the request head.
+ *
+ * returns: the outcome of the exchange.
+ */
+int forward_exchange(int clientHandle, int* backendHandle, char* endpoint,
+        int pipeHandles[2], HttpHead* request)
+{
+    // A cached connection may have been closed by the backend since it was
+    // last used. One seen closed is replaced, and one that fails to take
+    // the request gets one reconnection.
+    if (*backendHandle != -1 && !connection_usable(*backendHandle)) {
+        close(*backendHandle);
+        *backendHandle = -1;
+    }
+    bool cached = *backendHandle != -1;
+    if (!cached) {
+        *backendHandle = connect_backend(endpoint);
+    }
+    bool sent = *backendHandle != -1
+            && !write_all(*backendHandle, request->text,
+                    request->length, request->contentLength > 0);
+    if (!sent && cached) {
+        close(*backendHandle);
+        cached = false;
+        *backendHandle = connect_backend(endpoint);
+        sent = *backendHandle != -1
+                && !write_all(*backendHandle, request->text,
+                    request->length, request->contentLength > 0);
+    }
+    if (!sent) {
+        if (*backendHandle != -1) {
+            close(*backendHandle);
+            *backendHandle = -1;
+        }
+        return exchangeBackendFailed;
+    }
+
+    int outcome;
+    HttpHead response;
+    if (splice_bytes(clientHandle, *backendHandle, pipeHandles,
+                request->contentLength)) {
+        outcome = exchangeAborted;
+    } else if (read_http_head(*backendHandle, &response)) {
+        // The backend may have closed a reused connection as the request
+        // went out, which says nothing of its health.
+        outcome = cached ? exchangeStaleFailed : exchangeBackendFailed;
+    } else if (write_all(clientHandle, response.text, response.length,
+                       response.contentLength > 0)) {
+        outcome = exchangeClientFailed;
+    } else if (splice_bytes(*backendHandle, clientHandle, pipeHandles,
+                       response.contentLength)) {
+        outcome = exchangeAborted;
+    } else {
+        return exchangeOk;
+    }
+    close(*backendHandle);
+    *backendHandle = -1;
+    return outcome;
+}
+
+/* handle_client()
+ * ---------------
+ * Runtime logic for a single client connection. Each request is forwarded
+ *      to the least loaded backend over a keep-alive connection owned by
+ *      this thread.
+ *
+ * data: a ClientData pointer holding the balancer and the client socket.
+ *
+ * returns: NULL upon exit.
+ */
+void* handle_client(void* data)
+{
+    ClientData clientData = *((ClientData*)data);
+    free(data);
+    Balancer* balancer = clientData.balancer;
+    SocketData socketData = clientData.socketData;
+    modify_mutex(&(balancer->currentClients), 1);
+
+    int* backendHandles = malloc(sizeof(int) * balancer->numBackends);
+    for (int i = 0; i < balancer->numBackends; i++) {
+        backendHandles[i] = -1;
+    }
+    int pipeHandles[2] = {-1, -1};
+    HttpHead* request = malloc(sizeof(HttpHead));
+    bool open = pipe(pipeHandles) != -1;
+
+    while (open && !read_http_head(socketData.handle, request)) {
+        long unsigned int bytes = request->length + request->contentLength;
+        Backend* backend = choose_backend(balancer, bytes);
+        if (!backend) {
+            modify_mutex(&(balancer->rejectedRequests), 1);
+            write_all(socketData.handle, unavailableResponse,
+                    strlen(unavailableResponse), false);
+            break;
+        }
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int index = backend - balancer->backends;
+        int outcome = forward_exchange(socketData.handle,
+                &backendHandles[index], backend->endpoint, pipeHandles,
+                request);
+        release_backend(backend, bytes, elapsed_ms(start), outcome);
+        if (outcome == exchangeBackendFailed
+                || outcome == exchangeStaleFailed) {
+            write_all(socketData.handle, badGatewayResponse,
+                    strlen(badGatewayResponse), false);
+        }
+        open = outcome == exchangeOk;
+    }
+
+    for (int i = 0; i < balancer->numBackends; i++) {
+        if (backendHandles[i] != -1) {
+            close(backendHandles[i]);
+        }
+    }
+    if (pipeHandles[0] != -1) {
+        close(pipeHandles[0]);
+        close(pipeHandles[1]);
+    }
+    free(backendHandles);
+    free(request);
+    fclose(socketData.get);
+    fclose(socketData.post);
+    close(socketData.handle);
+    modify_mutex(&(balancer->currentClients), -1);
+    return NULL;
+}
+
+/* probe_backend()
+ * ---------------
+ * Private helper function that sends a health check to a backend.
+ *
+ * returns: true if the backend answered the home page with 200 OK in time.
+ */
+bool probe_backend(char* endpoint)
+{
+    int handle = connect_backend(endpoint);
+    if (handle == -1) {
+        return false;
+    }
+    struct timeval timeout = {healthCheckTimeoutMs / usPerMs,
+            (healthCheckTimeoutMs % usPerMs) * usPerMs};
+    setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(handle, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    HttpHead* response = malloc(sizeof(HttpHead));
+    bool healthy = !write_all(handle, healthCheckRequest,
+                           strlen(healthCheckRequest), false)
+            && !read_http_head(handle, response)
+            && !strncmp(response->text, healthyStatusLine,
+                    strlen(healthyStatusLine));
+    free(response);
+    close(handle);
+    return healthy;
+}
+
+/* check_backends()
+ * ----------------
+ * Health checks every backend once, recording how long each check took and
+ *      reporting backends that change state.
+ *
+ * balancer: the balancer whose backends to check.
+ */
+void check_backends(Balancer* balancer)
+{
+    for (int i = 0; i < balancer->numBackends; i++) {
+        Backend* backend = &(balancer->backends[i]);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bool healthy = probe_backend(backend->endpoint);
+        double latencyMs = elapsed_ms(start);
+
+        sem_wait(&(backend->lock));
+        bool changed = backend->healthy != healthy;
+        backend->healthy = healthy;
+        backend->healthLatencyMs = latencyMs;
+        sem_post(&(backend->lock));
+        if (changed) {
+            fprintf(stderr, healthy ? backendUpFormat : backendDownFormat,
+                    backend->endpoint);
+        }
+    }
+}
+
+/* health_checker()
+ * ----------------
+ * Health checks the backends every healthCheckIntervalMs forever.
+ *
+ * data: the Balancer to check.
+ *
+ * returns: never returns.
+ */
+void* health_checker(void* data)
+{
+    Balancer* balancer = (Balancer*)data;
+    while (1) {
+        usleep(healthCheckIntervalMs * usPerMs);
+        check_backends(balancer);
+    }
+    return NULL;
+}
+
+/* Data needed for a signal handling thread */
+typedef struct SignalHandlerData {
+    Balancer* balancer;
+    sigset_t* maskSet;
+} SignalHandlerData;
+
+/* signal_handler()
+ * ----------------
+ * Prints the balancer statistics and per backend load and latency each time
+ *      a SIGHUP signal is received.
+ *
+ * data: a SignalHandlerData struct that holds a pointer to the balancer and
+ *      a pointer to the mask set of the parent thread.
+ *
+ * returns: never returns.
+ */
+static void* signal_handler(void* data)
+{
+    SignalHandlerData* sigData = (SignalHandlerData*)data;
+    Balancer* balancer = sigData->balancer;
+    int signal;
+    while (!sigwait(sigData->maskSet, &signal)) {
+        fprintf(stderr, connectedFormat,
+                read_mutex(&(balancer->currentClients)));
+        fprintf(stderr, rejectedFormat,
+                read_mutex(&(balancer->rejectedRequests)));
+        for (int i = 0; i < balancer->numBackends; i++) {
+            Backend* backend = &(balancer->backends[i]);
+            sem_wait(&(backend->lock));
+            Backend snapshot = *backend;
+            sem_post(&(backend->lock));
+            double meanMs = snapshot.completedRequests
+                    ? snapshot.totalLatencyMs / snapshot.completedRequests
+                    : 0;
+            fprintf(stderr, backendFormat, snapshot.endpoint,
+                    snapshot.healthy ? "up" : "down", snapshot.activeRequests,
+                    snapshot.outstandingBytes, snapshot.completedRequests,
+                    snapshot.failedRequests);
+            fprintf(stderr, latencyFormat, snapshot.endpoint, meanMs,
+                    snapshot.maxLatencyMs, snapshot.healthLatencyMs);
+        }
+        fflush(stderr);
+    }
+    return NULL;
+}
+
+/* Entry point for the load balancer */
+int main(int argc, char** argv)
+{
+    BalancerInputs args = parse_balancer_inputs(argc, argv);
+    if (args.error) {
+        fprintf(stderr, invalidBalancerCmdMessage);
+        return invalidBalancerCmdCode;
+    }
+    if (!args.port) {
+        args.port = "0"; // Use ephemeral port if non specified.
+    }
+
+    Balancer balancer = {0};
+    balancer.numBackends = args.numBackends;
+    balancer.backends = calloc(args.numBackends, sizeof(Backend));
+    for (int i = 0; i < args.numBackends; i++) {
+        balancer.backends[i].endpoint = args.backends[i];
+        balancer.backends[i].healthy = true; // Reported if the check fails.
+        sem_init(&(balancer.backends[i].lock), 0, 1);
+    }
+    sem_init(&(balancer.nextBackend.lock), 0, 1);
+    sem_init(&(balancer.currentClients.lock), 0, 1);
+    sem_init(&(balancer.rejectedRequests.lock), 0, 1);
+
+    int socketHandle = open_port(args.port);
+    if (socketHandle == -1) {
+        fprintf(stderr, invalidBalancerPortFormat, args.port);
+        return invalidBalancerPortCode;
+    }
+
+    // Writes to closed connections must fail the request, not the balancer.
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    pthread_t sigHandlerID;
+    SignalHandlerData sigHandlerData = {&balancer, &set};
+    pthread_create(&sigHandlerID, NULL, signal_handler, &sigHandlerData);
+    pthread_detach(sigHandlerID);
+
+    // Find the healthy backends before taking any traffic.
+    check_backends(&balancer);
+    pthread_t healthCheckerID;
+    pthread_create(&healthCheckerID, NULL, health_checker, &balancer);
+    pthread_detach(healthCheckerID);
+
+    while (1) {
+        SocketData clientSocketData = block_for_connection(socketHandle);
+        if (clientSocketData.handle == -1) { // Accept failed, keep serving.
+            continue;
+        }
+        ClientData* clientData = malloc(sizeof(ClientData));
+        clientData->balancer = &balancer;
+        clientData->socketData = clientSocketData;
+        pthread_t threadID;
+        pthread_create(&threadID, NULL, handle_client, clientData);
+        pthread_detach(threadID);
+    }
+    return 0;
+}
@@ -0,0 +1,186 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <semaphore.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "ioutils.h"
+#include "limiter.h"
+
+// Bounds on the limit. The ceiling applies when no --max is given.
+const double limiterMinLimit = 1.0;
+const double limiterDefaultMax = 1000.0;
+
+// Transforms admitted per CPU before any latency has been measured.
+const int initialLimitPerCpu = 2;
+
+// A window of samples closes once it holds enough and has lasted long
+// enough, and the limit is only adjusted at the close of a window.
+const int windowMinSamples = 10;
+const double windowMinMs = 100.0;
+
+// Windows averaged into the long term baseline.
+const double baselineWindows = 20.0;
+
+// Recent latency may reach this multiple of the baseline before the limit
+// shrinks, as batches of large images legitimately run slower.
+const double latencyTolerance = 1.5;
+
+// Bounds on how far one window may shrink the limit.
+const double minGradient = 0.5;
+const double maxGradient = 1.0;
+
+// Weight of each new limit against the old, damping oscillation.
+const double limitSmoothing = 0.2;
+
+// Factor applied to the limit whenever a transform misses its deadline.
+const double dropBackoff = 0.9;
+
+// Costs below this are treated as this, as small images spend most of
+// their time in fixed per request overhead.
+const long unsigned int costFloor = 100000;
+const double costUnit = 1000000.0;
+
+// Weight of each transform in the recent latency used for Retry-After.
+const double retrySmoothing = 0.1;
+const double retryAfterUnitMs = 1000.0; // Retry-After is in seconds.
+
+struct Limiter {
+    sem_t lock;
+    double limit;
+    double maxLimit;
+    int inFlight;
+    double recentLatencyMs; // Unnormalised, for Retry-After.
+    double baseline; // Long term latency per cost unit.
+
+    // Samples of the current window.
+    struct timespec windowStart;
+    int windowSamples;
+    double windowSum;
+    int windowMaxInFlight;
+};
+
+/* clamp()
+ * -------
+ * Private helper function that bounds a value.
+ */
+static double clamp(double value, double low, double high)
+{
+    return value < low ? low : (value > high ? high : value);
+}
+
+/* close_window()
+ * --------------
+ * Private helper function that adjusts the limit from a full window of
+ *      samples. The limit is scaled by the ratio of the baseline to the
+ *      window's latency, then grown by its square root, so it settles where
+ *      queueing adds little latency. Windows that never came close to the
+ *      limit say nothing about it, so only move the baseline. The limiter
+ *      must be locked.
+ */
+static void close_window(Limiter* limiter)
+{
+    double recent = limiter->windowSum / limiter->windowSamples;
+    if (limiter->baseline == 0) {
+        limiter->baseline = recent;
+    } else {
+        limiter->baseline += (recent - limiter->baseline) / baselineWindows;
+    }
+    // Let the baseline fall quickly once load eases after a slow spell.
+    if (limiter->baseline > 2 * recent) {
+        limiter->baseline = (limiter->baseline + recent) / 2;
+    }
+
+    if (limiter->windowMaxInFlight >= limiter->limit / 2) {
+        double gradient = clamp(latencyTolerance * limiter->baseline / recent,
+                minGradient, maxGradient);
+        double target = limiter->limit * gradient + sqrt(limiter->limit);
+        limiter->limit = clamp(limiter->limit * (1 - limitSmoothing)
+                        + target * limitSmoothing,
+                limiterMinLimit, limiter->maxLimit);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &(limiter->windowStart));
+    limiter->windowSamples = 0;
+    limiter->windowSum = 0;
+    limiter->windowMaxInFlight = limiter->inFlight;
+}
+
+Limiter* create_limiter(int maxLimit)
+{
+    Limiter* limiter = calloc(1, sizeof(Limiter));
+    limiter->maxLimit = maxLimit > 0 ? maxLimit : limiterDefaultMax;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    limiter->limit = clamp(initialLimitPerCpu * (cpus > 0 ? cpus : 1),
+            limiterMinLimit, limiter->maxLimit);
+    clock_gettime(CLOCK_MONOTONIC, &(limiter->windowStart));
+    sem_init(&(limiter->lock), 0, 1);
+    return limiter;
+}
+
+bool limiter_acquire(Limiter* limiter)
+{
+    if (!limiter) {
+        return true;
+    }
+    sem_wait(&(limiter->lock));
+    bool admitted = limiter->inFlight < (int)limiter->limit;
+    if (admitted) {
+        limiter->inFlight++;
+        if (limiter->inFlight > limiter->windowMaxInFlight) {
+            limiter->windowMaxInFlight = limiter->inFlight;
+        }
+    }
+    sem_post(&(limiter->lock));
+    return admitted;
+}
+
+void limiter_release(Limiter* limiter, long unsigned int cost,
+        double latencyMs, bool dropped)
+{
+    if (!limiter) {
+        return;
+    }
+    sem_wait(&(limiter->lock));
+    limiter->inFlight--;
+    if (dropped) { // Too slow to be of use, back off straight away.
+        limiter->limit = clamp(limiter->limit * dropBackoff, limiterMinLimit,
+                limiter->maxLimit);
+    } else {
+        limiter->recentLatencyMs
+                += (latencyMs - limiter->recentLatencyMs) * retrySmoothing;
+        // Compare latency per unit of work, or a run of large images would
+        // look like overload.
+        limiter->windowSum += latencyMs * costUnit
+                / (cost > costFloor ? cost : costFloor);
+        limiter->windowSamples++;
+        if (limiter->windowSamples >= windowMinSamples
+                && elapsed_ms(limiter->windowStart) >= windowMinMs) {
+            close_window(limiter);
+        }
+    }
+    sem_post(&(limiter->lock));
+}
+
+int limiter_limit(Limiter* limiter)
+{
+    if (!limiter) {
+        return 0;
+    }
+    sem_wait(&(limiter->lock));
+    int limit = limiter->limit;
+    sem_post(&(limiter->lock));
+    return limit;
+}
+
+int limiter_retry_after(Limiter* limiter)
+{
+    if (!limiter) {
+        return 1;
+    }
+    sem_wait(&(limiter->lock));
+    int seconds = ceil(limiter->recentLatencyMs / retryAfterUnitMs);
+    sem_post(&(limiter->lock));
+    return seconds > 1 ? seconds : 1;
+}
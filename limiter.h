@@ -0,0 +1,64 @@
+#ifndef LIMITER_H
+#define LIMITER_H
+
+#include <stdbool.h>
+
+/* Adaptive limit on the number of transforms admitted at once, in the
+ * manner of a gradient concurrency limiter. Each finished transform reports
+ * its latency, queueing included, per unit of estimated cost. The limit
+ * grows while recent latency stays close to the long term baseline, and
+ * shrinks in proportion as queueing or memory pressure pushes it above.
+ * Transforms that miss their deadline back the limit off multiplicatively.
+ * Requests over the limit are refused at once rather than queued. */
+
+typedef struct Limiter Limiter;
+
+/* create_limiter()
+ * ----------------
+ * Creates a limiter.
+ *
+ * maxLimit: the highest the limit may grow to, or 0 or less for the
+ *      default ceiling.
+ *
+ * returns: the new limiter.
+ */
+Limiter* create_limiter(int maxLimit);
+
+/* limiter_acquire()
+ * -----------------
+ * Admits a transform if fewer than the current limit are in flight. An
+ *      admitted transform must be paired with limiter_release().
+ *
+ * limiter: the limiter to admit through. May be NULL, admitting everything.
+ *
+ * returns: true if admitted, false if the request should be refused.
+ */
+bool limiter_acquire(Limiter* limiter);
+
+/* limiter_release()
+ * -----------------
+ * Marks an admitted transform finished and adjusts the limit from its
+ *      latency.
+ *
+ * limiter: the limiter it was admitted by. May be NULL.
+ * cost: the estimated cost of the transform, see estimate_request_cost().
+ * latencyMs: the time from admission to completion, queueing included.
+ * dropped: whether the transform was abandoned at its deadline.
+ */
+void limiter_release(Limiter* limiter, long unsigned int cost,
+        double latencyMs, bool dropped);
+
+/* limiter_limit()
+ * ---------------
+ * returns: the current limit.
+ */
+int limiter_limit(Limiter* limiter);
+
+/* limiter_retry_after()
+ * ---------------------
+ * returns: the seconds a refused client should wait before retrying, about
+ *      as long as recent transforms have taken and at least one.
+ */
+int limiter_retry_after(Limiter* limiter);
+
+#endif // LIMITER_H
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "lossless.h"
+
+const char* const jpegContentType = "image/jpeg";
+
+const int quarterTurn = 90;
+
+/* Where the x and y axes of an image end up after some flips and right
+ * angle rotations, with y pointing up as FreeImage rotates anticlockwise */
+typedef struct Orientation {
+    int xx, xy; // New x is xx * x + xy * y.
+    int yx, yy; // New y is yx * x + yy * y.
+} Orientation;
+
+/* An orientation and the JPEG transform that produces it */
+typedef struct LosslessOperation {
+    Orientation orientation;
+    FREE_IMAGE_JPEG_OPERATION operation;
+} LosslessOperation;
+
+// jpegtran rotates clockwise and its diagonals are taken with y pointing
+// down, so each orientation is matched to its transform here.
+const LosslessOperation losslessOperations[] = {
+        {{1, 0, 0, 1}, FIJPEG_OP_NONE},
+        {{-1, 0, 0, 1}, FIJPEG_OP_FLIP_H},
+        {{1, 0, 0, -1}, FIJPEG_OP_FLIP_V},
+        {{0, -1, -1, 0}, FIJPEG_OP_TRANSPOSE},
+        {{0, 1, 1, 0}, FIJPEG_OP_TRANSVERSE},
+        {{0, 1, -1, 0}, FIJPEG_OP_ROTATE_90},
+        {{-1, 0, 0, -1}, FIJPEG_OP_ROTATE_180},
+        {{0, -1, 1, 0}, FIJPEG_OP_ROTATE_270}};
+const int numLosslessOperations = 8;
+
+/* then()
+ * ------
+ * Private helper function that follows an orientation by another.
+ */
+static Orientation then(Orientation first, Orientation next)
+{
+    Orientation composed = {next.xx * first.xx + next.xy * first.yx,
+            next.xx * first.xy + next.xy * first.yy,
+            next.yx * first.xx + next.yy * first.yx,
+            next.yx * first.xy + next.yy * first.yy};
+    return composed;
+}
+
+int plan_lossless_transform(const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer,
+        FREE_IMAGE_JPEG_OPERATION* operation)
+{
+    if (length < 2 || image[0] != 0xFF || image[1] != 0xD8) {
+        return 0;
+    }
+    Orientation orientation = {1, 0, 0, 1};
+    Orientation anticlockwise = {0, -1, 1, 0};
+    int numOps = 0;
+    for (int i = 0; i < cmdBuffer.numCmds; i += 2, numOps++) {
+        int* cmd = &(cmdBuffer.buffer[i]);
+        if (cmd[0] == CMD_ROTATE && cmd[1] % quarterTurn == 0) {
+            int turns = (cmd[1] / quarterTurn % 4 + 4) % 4;
+            for (int turn = 0; turn < turns; turn++) {
+                orientation = then(orientation, anticlockwise);
+            }
+        } else if (cmd[0] == CMD_FLIP) {
+            bool horizontal = cmd[1] == FLIP_HORIZONTAL;
+            Orientation flip = {horizontal ? -1 : 1, 0, 0,
+                    horizontal ? 1 : -1};
+            orientation = then(orientation, flip);
+        } else {
+            // Scales and other rotations resample, and crops need not fall
+            // on the blocks a JPEG is coded in.
+            return 0;
+        }
+    }
+    for (int i = 0; i < numLosslessOperations; i++) {
+        if (!memcmp(&losslessOperations[i].orientation, &orientation,
+                    sizeof(Orientation))) {
+            *operation = losslessOperations[i].operation;
+        }
+    }
+    return numOps;
+}
+
+/* read_stream()
+ * -------------
+ * Private FreeImageIO function that reads from a stdio stream.
+ */
+static unsigned read_stream(void* buffer, unsigned size, unsigned count,
+        fi_handle handle)
+{
+    return fread(buffer, size, count, (FILE*)handle);
+}
+
+/* write_stream()
+ * --------------
+ * Private FreeImageIO function that writes to a stdio stream.
+ */
+static unsigned write_stream(void* buffer, unsigned size, unsigned count,
+        fi_handle handle)
+{
+    return fwrite(buffer, size, count, (FILE*)handle);
+}
+
+/* seek_stream()
+ * -------------
+ * Private FreeImageIO function that seeks in a stdio stream.
+ */
+static int seek_stream(fi_handle handle, long offset, int origin)
+{
+    return fseek((FILE*)handle, offset, origin);
+}
+
+/* tell_stream()
+ * -------------
+ * Private FreeImageIO function that reports a stdio stream's position.
+ */
+static long tell_stream(fi_handle handle)
+{
+    return ftell((FILE*)handle);
+}
+
+unsigned char* transform_jpeg_losslessly(const unsigned char* image,
+        long unsigned int length, FREE_IMAGE_JPEG_OPERATION operation,
+        long unsigned int* outLength)
+{
+    if (operation == FIJPEG_OP_NONE) { // The chain undid itself.
+        unsigned char* copy = malloc(length);
+        memcpy(copy, image, length);
+        *outLength = length;
+        return copy;
+    }
+    // FreeImage reads and writes through callbacks, so give it memory
+    // backed streams rather than files.
+    FreeImageIO io = {read_stream, write_stream, seek_stream, tell_stream};
+    FILE* source = fmemopen((void*)image, length, "rb");
+    char* output = NULL;
+    size_t outputLength = 0;
+    FILE* destination = open_memstream(&output, &outputLength);
+    if (!source || !destination) {
+        if (source) {
+            fclose(source);
+        }
+        if (destination) {
+            fclose(destination);
+        }
+        free(output);
+        return NULL;
+    }
+    // Only a perfect transform is lossless. Otherwise libjpeg would trim
+    // the partial blocks along the moved edges, changing the image's size.
+    bool transformed = FreeImage_JPEGTransformFromHandle(&io, source, &io,
+            destination, operation, NULL, NULL, NULL, NULL, true);
+    fclose(source);
+    fclose(destination);
+    if (!transformed) {
+        free(output);
+        return NULL;
+    }
+    *outLength = outputLength;
+    return (unsigned char*)output;
+}
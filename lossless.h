@@ -0,0 +1,52 @@
+#ifndef LOSSLESS_H
+#define LOSSLESS_H
+
+#include <FreeImage.h>
+
+#include "argparsing.h"
+
+/* Flips and rotates JPEGs by right angles without decoding them. Any chain
+ * of flips and right angle rotations leaves the image in one of eight
+ * orientations, so the whole chain is a single rearrangement of the
+ * compressed DCT blocks, as jpegtran does. No pixel is decoded or
+ * re-encoded, so nothing is lost and the result stays a small JPEG. */
+
+// Content-Type of JPEG responses, and what a client's Accept header must
+// name to be sent them.
+extern const char* const jpegContentType;
+
+/* plan_lossless_transform()
+ * -------------------------
+ * Decides whether an image's operations can be done losslessly, and if so
+ *      composes them into one.
+ *
+ * image: the encoded image.
+ * length: the number of bytes in image.
+ * cmdBuffer: the parsed operations.
+ * operation: populated with the single equivalent JPEG transform.
+ *
+ * returns: the number of operations composed, or 0 if the image is not a
+ *      JPEG or some operation is neither a flip nor a right angle rotation.
+ */
+int plan_lossless_transform(const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer,
+        FREE_IMAGE_JPEG_OPERATION* operation);
+
+/* transform_jpeg_losslessly()
+ * ---------------------------
+ * Rearranges a JPEG's compressed blocks.
+ *
+ * image: the JPEG.
+ * length: the number of bytes in image.
+ * operation: the transform from plan_lossless_transform().
+ * outLength: populated with the length of the transformed JPEG.
+ *
+ * returns: the heap allocated JPEG, or NULL if the transform cannot be done
+ *      perfectly, as when the image is not a whole number of blocks along
+ *      an edge that would move.
+ */
+unsigned char* transform_jpeg_losslessly(const unsigned char* image,
+        long unsigned int length, FREE_IMAGE_JPEG_OPERATION operation,
+        long unsigned int* outLength);
+
+#endif // LOSSLESS_H
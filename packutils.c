@@ -0,0 +1,102 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ioutils.h"
+#include "packutils.h"
+
+const char* const packContentType = "application/x-uqimage-pack";
+
+// Bytes in each number of a pack.
+const int packNumberSize = 4;
+
+/* put_number()
+ * ------------
+ * Private helper function that writes a big-endian pack number.
+ *
+ * returns: the position after it.
+ */
+static unsigned char* put_number(unsigned char* at, uint32_t value)
+{
+    at[0] = value >> 24;
+    at[1] = value >> 16;
+    at[2] = value >> 8;
+    at[3] = value;
+    return at + packNumberSize;
+}
+
+/* get_number()
+ * ------------
+ * Private helper function that reads a big-endian pack number, if enough
+ *      bytes remain.
+ *
+ * returns: false if the pack ends first.
+ */
+static bool get_number(const unsigned char** at, const unsigned char* end,
+        uint32_t* value)
+{
+    if (end - *at < packNumberSize) {
+        return false;
+    }
+    const unsigned char* bytes = *at;
+    *value = ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16)
+            | ((uint32_t)bytes[2] << 8) | bytes[3];
+    *at += packNumberSize;
+    return true;
+}
+
+BinaryData pack_items(PackedItem* items, int numItems, bool withStatus)
+{
+    int numbersPerItem = withStatus ? 2 : 1;
+    long unsigned int length = packNumberSize;
+    for (int i = 0; i < numItems; i++) {
+        length += packNumberSize * numbersPerItem + items[i].length;
+    }
+    unsigned char* data = malloc(length);
+    unsigned char* at = put_number(data, numItems);
+    for (int i = 0; i < numItems; i++) {
+        if (withStatus) {
+            at = put_number(at, items[i].status);
+        }
+        at = put_number(at, items[i].length);
+        memcpy(at, items[i].data, items[i].length);
+        at += items[i].length;
+    }
+    BinaryData packed = {data, length};
+    return packed;
+}
+
+int unpack_items(const unsigned char* data, long unsigned int length,
+        bool withStatus, int maxItems, PackedItem** items)
+{
+    const unsigned char* at = data;
+    const unsigned char* end = data + length;
+    uint32_t numItems;
+    // Each item takes at least one number, which bounds a sane count, but
+    // a large body could still ask for far more items than are allowed.
+    if (!get_number(&at, end, &numItems)
+            || numItems > (length - packNumberSize) / packNumberSize
+            || maxItems < 0 || numItems > (uint32_t)maxItems) {
+        return -1;
+    }
+    *items = calloc(numItems ? numItems : 1, sizeof(PackedItem));
+    for (uint32_t i = 0; i < numItems; i++) {
+        uint32_t status = 0;
+        uint32_t itemLength;
+        if ((withStatus && !get_number(&at, end, &status))
+                || !get_number(&at, end, &itemLength)
+                || (long unsigned int)(end - at) < itemLength) {
+            free(*items);
+            return -1;
+        }
+        PackedItem item = {status, at, itemLength};
+        (*items)[i] = item;
+        at += itemLength;
+    }
+    if (at != end) { // Trailing bytes mean the counts are wrong.
+        free(*items);
+        return -1;
+    }
+    return numItems;
+}
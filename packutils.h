@@ -0,0 +1,53 @@
+#ifndef PACKUTILS_H
+#define PACKUTILS_H
+
+#include <stdbool.h>
+
+#include "ioutils.h"
+
+/* Packs many small images into one request or response body, so their
+ * transforms share one round trip. A pack is a 4 byte count followed by
+ * that many items, each a 4 byte length and then its bytes. Items in a
+ * response are preceded by a 4 byte HTTP status as well, the bytes being
+ * the encoded image if it is 200 and the error message otherwise. Every
+ * number is unsigned and big-endian. */
+
+// Content-Type of packed bodies.
+extern const char* const packContentType;
+
+/* One image, or the outcome of transforming one, in a pack */
+typedef struct PackedItem {
+    int status; // Only in responses.
+    const unsigned char* data;
+    long unsigned int length;
+} PackedItem;
+
+/* pack_items()
+ * ------------
+ * Packs items into a single body.
+ *
+ * items: the items to pack.
+ * numItems: the number of items.
+ * withStatus: whether to include each item's status, as responses do.
+ *
+ * returns: the heap allocated body.
+ */
+BinaryData pack_items(PackedItem* items, int numItems, bool withStatus);
+
+/* unpack_items()
+ * --------------
+ * Splits a packed body back into its items, without copying them.
+ *
+ * data: the packed body.
+ * length: the number of bytes in data.
+ * withStatus: whether each item carries a status, as in responses.
+ * maxItems: the most items accepted, checked before anything is allocated.
+ * items: set to a heap allocated array of items pointing into data.
+ *
+ * returns: the number of items, or -1 if the body is not a valid pack or
+ *      holds more than maxItems.
+ */
+int unpack_items(const unsigned char* data, long unsigned int length,
+        bool withStatus, int maxItems, PackedItem** items);
+
+#endif // PACKUTILS_H
@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include <FreeImage.h>
+
+#include "affine.h"
+#include "forkjoin.h"
+#include "ioutils.h"
+#include "pixelformat.h"
+#include "prescale.h"
+#include "rotate.h"
+
+// Fewest output rows worth giving a thread of their own.
+const int minRowsPerBand = 32;
+
+// Bands an output is split into for each thread that could fill them, so
+// threads finishing early have bands left to steal.
+const int bandsPerThread = 4;
+
+// Levels in an 8 bit channel, and so entries in a greyscale palette.
+const int greyLevels = 256;
+
+/* The rows of an output, split into bands filled as separate tasks */
+typedef struct Bands {
+    void (*fill)(void* job, int firstRow, int endRow);
+    void* job;
+    int height;
+    int numBands;
+    CancelToken* cancel; // Checked before each band. May be NULL.
+} Bands;
+
+// The token bands split by this thread check, NULL if none.
+static __thread CancelToken* bandCancel = NULL;
+
+PixelLayout layout_of(FIBITMAP* bitmap)
+{
+    if (FreeImage_GetImageType(bitmap) != FIT_BITMAP
+            || !FreeImage_HasPixels(bitmap)) {
+        return LAYOUT_NONE;
+    }
+    switch (FreeImage_GetBPP(bitmap)) {
+    case 8:
+        // Only a plain ramp of greys is grey8. Other palettes, and grey
+        // with a transparent level, are colour.
+        return FreeImage_GetColorType(bitmap) == FIC_MINISBLACK
+                        && !FreeImage_IsTransparent(bitmap)
+                ? LAYOUT_GREY8 : LAYOUT_NONE;
+    case 24:
+        return LAYOUT_BGR24;
+    case 32:
+        return LAYOUT_BGRA32;
+    default:
+        return LAYOUT_NONE;
+    }
+}
+
+FIBITMAP* canonicalise_bitmap(FIBITMAP* bitmap)
+{
+    int bitsPerPixel = FreeImage_GetBPP(bitmap);
+    if (layout_of(bitmap) != LAYOUT_NONE
+            || FreeImage_GetImageType(bitmap) != FIT_BITMAP
+            || !FreeImage_HasPixels(bitmap) || bitsPerPixel > 16) {
+        return bitmap;
+    }
+    FREE_IMAGE_COLOR_TYPE colorType = FreeImage_GetColorType(bitmap);
+    FIBITMAP* converted;
+    if (FreeImage_IsTransparent(bitmap)) {
+        converted = FreeImage_ConvertTo32Bits(bitmap);
+    } else if (colorType == FIC_MINISBLACK || colorType == FIC_MINISWHITE) {
+        converted = FreeImage_ConvertToGreyscale(bitmap);
+    } else {
+        converted = FreeImage_ConvertTo24Bits(bitmap);
+    }
+    if (!converted) { // FreeImage can still work on the original.
+        return bitmap;
+    }
+    FreeImage_Unload(bitmap);
+    return converted;
+}
+
+/* flip_rows()
+ * -----------
+ * Private helper function that mirrors each row of pixels in place,
+ *      swapping pixels from both ends inwards. Inlined once per layout so
+ *      the channel loops are unrolled.
+ */
+static inline void flip_rows(const PixelBuffer* pixels, const int channels)
+{
+    for (int y = 0; y < pixels->height; y++) {
+        BYTE* left = pixels->bits + (long)y * pixels->pitch;
+        BYTE* right = left + (pixels->width - 1) * channels;
+        while (left < right) {
+            for (int c = 0; c < channels; c++) {
+                BYTE swap = left[c];
+                left[c] = right[c];
+                right[c] = swap;
+            }
+            left += channels;
+            right -= channels;
+        }
+    }
+}
+
+// One horizontal flip kernel per layout.
+#define FLIP_KERNEL(layout, channels) \
+    static void flip_##layout(const PixelBuffer* pixels) \
+    { \
+        flip_rows(pixels, channels); \
+    }
+FOR_EACH_LAYOUT(FLIP_KERNEL)
+
+#define FLIP_ENTRY(layout, channels) flip_##layout,
+const FlipKernel flipKernels[NUM_LAYOUTS] = {FOR_EACH_LAYOUT(FLIP_ENTRY)};
+
+bool select_kernels(FIBITMAP* bitmap, PixelKernels* kernels)
+{
+    PixelLayout layout = layout_of(bitmap);
+    if (layout == LAYOUT_NONE) {
+        return false;
+    }
+    PixelKernels selected = {layout, resampleKernels[layout],
+            rotateKernels[layout], shrinkKernels[layout], flipKernels[layout]};
+    *kernels = selected;
+    return true;
+}
+
+PixelBuffer pixel_buffer(FIBITMAP* bitmap)
+{
+    PixelBuffer pixels = {FreeImage_GetBits(bitmap),
+            FreeImage_GetPitch(bitmap), FreeImage_GetWidth(bitmap),
+            FreeImage_GetHeight(bitmap)};
+    return pixels;
+}
+
+FIBITMAP* allocate_layout(PixelLayout layout, int width, int height)
+{
+    int bitsPerPixel = layout == LAYOUT_GREY8 ? 8
+            : (layout == LAYOUT_BGR24 ? 24 : 32);
+    FIBITMAP* bitmap = FreeImage_Allocate(width, height, bitsPerPixel,
+            FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+    if (bitmap && layout == LAYOUT_GREY8) {
+        RGBQUAD* palette = FreeImage_GetPalette(bitmap);
+        for (int level = 0; level < greyLevels; level++) {
+            palette[level].rgbRed = level;
+            palette[level].rgbGreen = level;
+            palette[level].rgbBlue = level;
+        }
+    }
+    return bitmap;
+}
+
+/* fill_band()
+ * -----------
+ * Private task function that fills one band of rows.
+ *
+ * data: the Bands being filled.
+ * band: the index of the band to fill.
+ */
+static void fill_band(void* data, int band)
+{
+    Bands* bands = (Bands*)data;
+    if (is_cancelled(bands->cancel)) {
+        return;
+    }
+    bands->fill(bands->job, (long)bands->height * band / bands->numBands,
+            (long)bands->height * (band + 1) / bands->numBands);
+}
+
+void run_in_bands(int height, void (*fill)(void* job, int firstRow,
+        int endRow), void* job)
+{
+    int numBands = height / minRowsPerBand;
+    int most = fork_join_threads() * bandsPerThread;
+    numBands = numBands < 1 ? 1 : (numBands < most ? numBands : most);
+    Bands bands = {fill, job, height, numBands, bandCancel};
+    fork_join(numBands, fill_band, &bands);
+}
+
+CancelToken* set_band_cancel(CancelToken* cancel)
+{
+    CancelToken* replaced = bandCancel;
+    bandCancel = cancel;
+    return replaced;
+}
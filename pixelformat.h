@@ -0,0 +1,148 @@
+#ifndef PIXELFORMAT_H
+#define PIXELFORMAT_H
+
+#include <stdbool.h>
+
+#include <FreeImage.h>
+
+/* Decoded images come in many layouts: palettes of 1, 4 or 8 bits, 16 bit
+ * 555 and 565 colour, 8 bit grey, and 24 and 32 bit colour. Each is
+ * normalised once after decoding into one of a few canonical layouts. Every
+ * kernel is then generated once per layout, so it never branches on format
+ * per pixel. A request picks the kernels for its image's layout once, as a
+ * table of function pointers, and the operations run through that table.
+ * Images with more than 8 bits per channel keep their precision and are
+ * left to FreeImage. */
+
+/* Generates something once per canonical layout, X being given the layout's
+ * name and its bytes per pixel. */
+#define FOR_EACH_LAYOUT(X) X(grey8, 1) X(bgr24, 3) X(bgra32, 4)
+
+/* The canonical layouts, in the order of FOR_EACH_LAYOUT */
+typedef enum PixelLayout {
+    LAYOUT_NONE = -1, // Not canonical, so only FreeImage handles it.
+    LAYOUT_GREY8,
+    LAYOUT_BGR24,
+    LAYOUT_BGRA32,
+    NUM_LAYOUTS
+} PixelLayout;
+
+/* A bitmap's pixels as kernels read and write them */
+typedef struct PixelBuffer {
+    BYTE* bits;
+    int pitch; // Bytes from one scanline to the next.
+    int width;
+    int height;
+} PixelBuffer;
+
+struct AffinePlan;
+struct RotateSteps;
+struct CancelToken;
+
+/* Resamples rows [firstRow, endRow) of output through an affine plan */
+typedef void (*ResampleKernel)(const struct AffinePlan* plan,
+        const PixelBuffer* source, const PixelBuffer* output, int firstRow,
+        int endRow);
+
+/* Rotates rows [firstRow, endRow) of output by fixed point steps */
+typedef void (*RotateKernel)(const struct RotateSteps* steps,
+        const PixelBuffer* source, const PixelBuffer* output, int firstRow,
+        int endRow);
+
+/* Box filters source into output, factor times smaller along each side */
+typedef void (*ShrinkKernel)(const PixelBuffer* source,
+        const PixelBuffer* output, int factor);
+
+/* Mirrors each row of pixels in place */
+typedef void (*FlipKernel)(const PixelBuffer* pixels);
+
+/* The kernels for one layout, chosen once per request */
+typedef struct PixelKernels {
+    PixelLayout layout;
+    ResampleKernel resample;
+    RotateKernel rotate;
+    ShrinkKernel shrink;
+    FlipKernel flipHorizontal;
+} PixelKernels;
+
+/* layout_of()
+ * -----------
+ * bitmap: the bitmap to inspect.
+ *
+ * returns: the bitmap's canonical layout, or LAYOUT_NONE if it has none.
+ */
+PixelLayout layout_of(FIBITMAP* bitmap);
+
+/* canonicalise_bitmap()
+ * ---------------------
+ * Converts a freshly decoded bitmap into a canonical layout. Palettes and
+ *      16 bit colour become 24 bit colour, or 32 bit if transparent, and
+ *      8 bit greyscale is kept as it is.
+ *
+ * bitmap: the bitmap, unloaded if it is replaced.
+ *
+ * returns: the canonical bitmap, or bitmap itself if it is already
+ *      canonical or has more than 8 bits per channel.
+ */
+FIBITMAP* canonicalise_bitmap(FIBITMAP* bitmap);
+
+/* select_kernels()
+ * ----------------
+ * Looks up the kernels specialised to a bitmap's layout.
+ *
+ * bitmap: the bitmap the operations will start from.
+ * kernels: populated with the kernels.
+ *
+ * returns: false if the bitmap is not canonical, leaving it to FreeImage.
+ */
+bool select_kernels(FIBITMAP* bitmap, PixelKernels* kernels);
+
+/* pixel_buffer()
+ * --------------
+ * bitmap: a bitmap with pixels.
+ *
+ * returns: a description of its pixels.
+ */
+PixelBuffer pixel_buffer(FIBITMAP* bitmap);
+
+/* allocate_layout()
+ * -----------------
+ * Allocates a bitmap in a canonical layout, with a greyscale palette if it
+ *      is grey8.
+ *
+ * layout: the layout.
+ * width: the width in pixels.
+ * height: the height in pixels.
+ *
+ * returns: the new bitmap, or NULL if it could not be allocated.
+ */
+FIBITMAP* allocate_layout(PixelLayout layout, int width, int height);
+
+/* run_in_bands()
+ * --------------
+ * Splits the rows of an output into bands and fills each with fill(),
+ *      forked onto the shared work-stealing pool (see forkjoin.h) with this
+ *      thread joining in. There are a few bands per thread so idle threads
+ *      can steal, but no fewer than a minimum number of rows to each, so
+ *      small outputs use fewer threads.
+ *
+ * height: the rows to fill.
+ * fill: fills rows [firstRow, endRow), given job.
+ * job: passed on to fill.
+ */
+void run_in_bands(int height, void (*fill)(void* job, int firstRow,
+        int endRow), void* job);
+
+/* set_band_cancel()
+ * -----------------
+ * Sets the token run_in_bands() checks before filling each band of the
+ *      outputs this thread splits, so a long kernel stops soon after its
+ *      request is cancelled, leaving the rest of its output unfilled.
+ *
+ * cancel: the token to check, or NULL to fill every band.
+ *
+ * returns: the token it replaces, to be set back once the work is done.
+ */
+struct CancelToken* set_band_cancel(struct CancelToken* cancel);
+
+#endif // PIXELFORMAT_H
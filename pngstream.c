@@ -0,0 +1,256 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#include <FreeImage.h>
+
+#include "pixelformat.h"
+#include "pngstream.h"
+
+const unsigned char pngSignature[] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+
+// PNG colour types of the canonical layouts, indexed by PixelLayout.
+const BYTE pngColourTypes[] = {0, 2, 6};
+
+// Bytes of deflated data gathered into each IDAT chunk.
+#define IDAT_SIZE 65536
+
+// The row filters, in the order PNG numbers them.
+enum RowFilter {
+    FILTER_NONE,
+    FILTER_SUB,
+    FILTER_UP,
+    FILTER_AVERAGE,
+    FILTER_PAETH,
+    NUM_FILTERS
+};
+
+struct PngStream {
+    int fd;
+    int width;
+    int height;
+    int channels;
+    int rowsLeft;
+    bool failed;
+    z_stream deflater;
+    BYTE* previous; // Last row in PNG channel order, zeros before the first.
+    BYTE* current;
+    BYTE* filtered[NUM_FILTERS]; // Each preceded by its filter byte.
+    BYTE idat[IDAT_SIZE];
+};
+
+/* write_all()
+ * -----------
+ * Private helper function that writes a whole buffer, retrying partial
+ *      writes.
+ *
+ * returns: false if the buffer could not all be written.
+ */
+static bool write_all(int fd, const void* data, size_t length)
+{
+    const BYTE* bytes = (const BYTE*)data;
+    while (length) {
+        ssize_t written = write(fd, bytes, length);
+        if (written <= 0) {
+            return false;
+        }
+        bytes += written;
+        length -= written;
+    }
+    return true;
+}
+
+/* put_be32()
+ * ----------
+ * Private helper function that stores a big-endian 32 bit value.
+ */
+static void put_be32(BYTE* out, uint32_t value)
+{
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+/* write_chunk()
+ * -------------
+ * Private helper function that writes one PNG chunk with its length and
+ *      CRC.
+ */
+static void write_chunk(PngStream* png, const char* type, const BYTE* data,
+        uint32_t length)
+{
+    BYTE head[8];
+    BYTE tail[4];
+    put_be32(head, length);
+    memcpy(head + 4, type, 4);
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+    if (length) { // zlib restarts the CRC if given no data.
+        crc = crc32(crc, data, length);
+    }
+    put_be32(tail, crc);
+    if (!write_all(png->fd, head, sizeof(head))
+            || !write_all(png->fd, data, length)
+            || !write_all(png->fd, tail, sizeof(tail))) {
+        png->failed = true;
+    }
+}
+
+/* deflate_into_chunks()
+ * ---------------------
+ * Private helper function that feeds bytes to zlib, writing an IDAT chunk
+ *      each time its output fills, or until zlib is done if finishing.
+ */
+static void deflate_into_chunks(PngStream* png, BYTE* data, size_t length,
+        bool finish)
+{
+    png->deflater.next_in = data;
+    png->deflater.avail_in = length;
+    int status;
+    do {
+        status = deflate(&(png->deflater), finish ? Z_FINISH : Z_NO_FLUSH);
+        if (status == Z_STREAM_ERROR) {
+            png->failed = true;
+            return;
+        }
+        if (!png->deflater.avail_out || (finish && status == Z_STREAM_END)) {
+            write_chunk(png, "IDAT", png->idat,
+                    IDAT_SIZE - png->deflater.avail_out);
+            png->deflater.next_out = png->idat;
+            png->deflater.avail_out = IDAT_SIZE;
+        }
+    } while (png->deflater.avail_in || (finish && status != Z_STREAM_END));
+}
+
+PngStream* png_stream_open(int fd, int width, int height, PixelLayout layout)
+{
+    if (layout == LAYOUT_NONE || width <= 0 || height <= 0) {
+        return NULL;
+    }
+    PngStream* png = calloc(1, sizeof(PngStream));
+    png->fd = fd;
+    png->width = width;
+    png->height = height;
+    png->channels = layout == LAYOUT_GREY8 ? 1
+            : (layout == LAYOUT_BGR24 ? 3 : 4);
+    png->rowsLeft = height;
+    if (deflateInit(&(png->deflater), Z_DEFAULT_COMPRESSION) != Z_OK) {
+        free(png);
+        return NULL;
+    }
+    png->deflater.next_out = png->idat;
+    png->deflater.avail_out = IDAT_SIZE;
+    size_t rowBytes = (size_t)width * png->channels;
+    png->previous = calloc(rowBytes, 1);
+    png->current = malloc(rowBytes);
+    for (int f = 0; f < NUM_FILTERS; f++) {
+        png->filtered[f] = malloc(rowBytes + 1);
+        png->filtered[f][0] = f;
+    }
+
+    BYTE header[13];
+    put_be32(header, width);
+    put_be32(header + 4, height);
+    header[8] = 8; // Bits per channel.
+    header[9] = pngColourTypes[layout];
+    header[10] = 0; // Deflate.
+    header[11] = 0; // Adaptive filtering.
+    header[12] = 0; // Not interlaced.
+    png->failed = !write_all(fd, pngSignature, sizeof(pngSignature));
+    write_chunk(png, "IHDR", header, sizeof(header));
+    return png;
+}
+
+/* paeth()
+ * -------
+ * Private helper function that predicts a byte from its left, upper and
+ *      upper left neighbours, whichever is nearest their gradient.
+ */
+static inline BYTE paeth(BYTE left, BYTE up, BYTE upLeft)
+{
+    int estimate = left + up - upLeft;
+    int toLeft = abs(estimate - left);
+    int toUp = abs(estimate - up);
+    int toUpLeft = abs(estimate - upLeft);
+    if (toLeft <= toUp && toLeft <= toUpLeft) {
+        return left;
+    }
+    return toUp <= toUpLeft ? up : upLeft;
+}
+
+/* filter_row()
+ * ------------
+ * Private helper function that filters the current row every way.
+ *
+ * returns: the filter whose output, taken as signed bytes, sums smallest.
+ */
+static int filter_row(PngStream* png)
+{
+    size_t rowBytes = (size_t)png->width * png->channels;
+    int step = png->channels;
+    const BYTE* row = png->current;
+    const BYTE* above = png->previous;
+    long sums[NUM_FILTERS] = {0};
+    for (size_t i = 0; i < rowBytes; i++) {
+        BYTE left = i >= (size_t)step ? row[i - step] : 0;
+        BYTE upLeft = i >= (size_t)step ? above[i - step] : 0;
+        BYTE predictions[NUM_FILTERS] = {0, left, above[i],
+                (left + above[i]) / 2, paeth(left, above[i], upLeft)};
+        for (int f = 0; f < NUM_FILTERS; f++) {
+            BYTE value = row[i] - predictions[f];
+            png->filtered[f][i + 1] = value;
+            sums[f] += value < 128 ? value : 256 - value;
+        }
+    }
+    int best = FILTER_NONE;
+    for (int f = 1; f < NUM_FILTERS; f++) {
+        best = sums[f] < sums[best] ? f : best;
+    }
+    return best;
+}
+
+bool png_stream_write_row(PngStream* png, const BYTE* row)
+{
+    if (png->failed || !png->rowsLeft) {
+        return false;
+    }
+    // FreeImage keeps colour as BGR, where PNG wants RGB.
+    memcpy(png->current, row, (size_t)png->width * png->channels);
+    if (png->channels > 1) {
+        for (int x = 0; x < png->width; x++) {
+            BYTE* pixel = png->current + x * png->channels;
+            BYTE blue = pixel[FI_RGBA_BLUE];
+            pixel[FI_RGBA_BLUE] = pixel[FI_RGBA_RED];
+            pixel[FI_RGBA_RED] = blue;
+        }
+    }
+    int filter = filter_row(png);
+    deflate_into_chunks(png, png->filtered[filter],
+            (size_t)png->width * png->channels + 1, false);
+    BYTE* swap = png->previous;
+    png->previous = png->current;
+    png->current = swap;
+    png->rowsLeft--;
+    return !png->failed;
+}
+
+bool png_stream_close(PngStream* png)
+{
+    bool complete = !png->rowsLeft;
+    if (complete && !png->failed) {
+        deflate_into_chunks(png, NULL, 0, true);
+        write_chunk(png, "IEND", NULL, 0);
+    }
+    complete = complete && !png->failed;
+    deflateEnd(&(png->deflater));
+    for (int f = 0; f < NUM_FILTERS; f++) {
+        free(png->filtered[f]);
+    }
+    free(png->current);
+    free(png->previous);
+    free(png);
+    return complete;
+}
@@ -0,0 +1,52 @@
+#ifndef PNGSTREAM_H
+#define PNGSTREAM_H
+
+#include <stdbool.h>
+
+#include <FreeImage.h>
+
+#include "pixelformat.h"
+
+/* Encodes a PNG a row at a time straight to a file, so an image never has
+ * to be held whole to be encoded. Each row is filtered as libpng does by
+ * default, trying every filter and keeping the one whose bytes sum
+ * smallest, then deflated by zlib into IDAT chunks as the output fills. */
+
+typedef struct PngStream PngStream;
+
+/* png_stream_open()
+ * -----------------
+ * Starts a PNG, writing its signature and header.
+ *
+ * fd: the file to write to, which is left open.
+ * width: the image's width in pixels.
+ * height: its height.
+ * layout: the layout rows will be given in, which decides whether the PNG
+ *      is grey, colour or colour with alpha.
+ *
+ * returns: the stream, or NULL if it could not be started.
+ */
+PngStream* png_stream_open(int fd, int width, int height, PixelLayout layout);
+
+/* png_stream_write_row()
+ * ----------------------
+ * Encodes the next row, the top row coming first.
+ *
+ * png: the stream.
+ * row: the row's pixels, in the stream's layout.
+ *
+ * returns: false if the row could not be written.
+ */
+bool png_stream_write_row(PngStream* png, const BYTE* row);
+
+/* png_stream_close()
+ * ------------------
+ * Finishes the PNG and frees the stream.
+ *
+ * png: the stream, which must have been given every row.
+ *
+ * returns: false if the PNG is incomplete or could not be written.
+ */
+bool png_stream_close(PngStream* png);
+
+#endif // PNGSTREAM_H
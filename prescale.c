@@ -0,0 +1,166 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <csse2310_freeimage.h>
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "costmodel.h"
+#include "pixelformat.h"
+#include "rotate.h"
+#include "prescale.h"
+
+// Largest factor libjpeg can shrink by while decoding. Box filtering other
+// formats is held to the same powers of two.
+const int maxDecodeShrink = 8;
+
+int plan_decode_shrink(const unsigned char* image, long unsigned int length,
+        CommandBuffer cmdBuffer)
+{
+    long width;
+    long height;
+    if (!peek_image_dimensions(image, length, &width, &height)) {
+        return 1;
+    }
+    // Only operations up to the first scale matter. Rotations and flips
+    // carry a smaller bitmap through in proportion, and the scale then fixes
+    // the size for everything after it. Crops before it are placed in
+    // full-size pixels, so they rule shrinking out.
+    for (int i = 0; i < cmdBuffer.numCmds; i++) {
+        int* cmd = &(cmdBuffer.buffer[i]);
+        if (cmd[0] == CMD_ROTATE) {
+            double sine, cosine;
+            angle_sine_cosine(cmd[1], &sine, &cosine);
+            long rotatedWidth
+                    = floor(width * fabs(cosine) + height * fabs(sine) + 0.5);
+            height = floor(width * fabs(sine) + height * fabs(cosine) + 0.5);
+            width = rotatedWidth;
+            i++;
+        } else if (cmd[0] == CMD_FLIP) {
+            i++;
+        } else if (cmd[0] == CMD_CROP) {
+            return 1;
+        } else if (cmd[0] == CMD_SCALE) {
+            int shrink = 1;
+            while (shrink < maxDecodeShrink
+                    && width >= 2L * shrink * cmd[1]
+                    && height >= 2L * shrink * cmd[2]) {
+                shrink *= 2;
+            }
+            return shrink;
+        }
+    }
+    return 1;
+}
+
+/* shrink_rows()
+ * -------------
+ * Private helper function that divides each side of a bitmap by a factor,
+ *      each output pixel the average of the block of source pixels it
+ *      covers. Blocks along the right and top edges may be partial. Inlined
+ *      once per layout so the channel loops are unrolled.
+ */
+static inline void shrink_rows(const PixelBuffer* source,
+        const PixelBuffer* output, int factor, const int channels)
+{
+    // Sum a row of blocks at a time, reading each source row once in order.
+    uint32_t* sums = malloc(sizeof(uint32_t) * output->width * channels);
+    for (int y = 0; y < output->height; y++) {
+        memset(sums, 0, sizeof(uint32_t) * output->width * channels);
+        int firstRow = y * factor;
+        int endRow = firstRow + factor < source->height
+                ? firstRow + factor : source->height;
+        for (int row = firstRow; row < endRow; row++) {
+            const BYTE* pixel = source->bits + (long)row * source->pitch;
+            for (int x = 0; x < source->width; x++) {
+                uint32_t* sum = &sums[(x / factor) * channels];
+                for (int c = 0; c < channels; c++) {
+                    sum[c] += pixel[c];
+                }
+                pixel += channels;
+            }
+        }
+        BYTE* out = output->bits + (long)y * output->pitch;
+        for (int x = 0; x < output->width; x++) {
+            int columns = source->width - x * factor < factor
+                    ? source->width - x * factor : factor;
+            uint32_t count = (endRow - firstRow) * columns;
+            for (int c = 0; c < channels; c++) {
+                out[x * channels + c]
+                        = (sums[x * channels + c] + count / 2) / count;
+            }
+        }
+    }
+    free(sums);
+}
+
+// One box filtering kernel per layout.
+#define SHRINK_KERNEL(layout, channels) \
+    static void shrink_##layout(const PixelBuffer* source, \
+            const PixelBuffer* output, int factor) \
+    { \
+        shrink_rows(source, output, factor, channels); \
+    }
+FOR_EACH_LAYOUT(SHRINK_KERNEL)
+
+#define SHRINK_ENTRY(layout, channels) shrink_##layout,
+const ShrinkKernel shrinkKernels[NUM_LAYOUTS]
+        = {FOR_EACH_LAYOUT(SHRINK_ENTRY)};
+
+/* box_shrink()
+ * ------------
+ * Private helper function that box filters a canonical bitmap to a factor
+ *      of its size, rounding each side up.
+ *
+ * returns: the shrunk bitmap, or NULL if the bitmap is not canonical.
+ */
+static FIBITMAP* box_shrink(FIBITMAP* source, int factor)
+{
+    PixelKernels kernels;
+    if (!select_kernels(source, &kernels)) {
+        return NULL;
+    }
+    int newWidth = (FreeImage_GetWidth(source) + factor - 1) / factor;
+    int newHeight = (FreeImage_GetHeight(source) + factor - 1) / factor;
+    FIBITMAP* output = allocate_layout(kernels.layout, newWidth, newHeight);
+    if (!output) {
+        return NULL;
+    }
+    PixelBuffer sourcePixels = pixel_buffer(source);
+    PixelBuffer outputPixels = pixel_buffer(output);
+    kernels.shrink(&sourcePixels, &outputPixels, factor);
+    return output;
+}
+
+FIBITMAP* load_image_shrunk(const unsigned char* image,
+        long unsigned int length, int shrink)
+{
+    long width;
+    long height;
+    if (shrink > 1 && length >= 2 && image[0] == 0xFF && image[1] == 0xD8
+            && peek_image_dimensions(image, length, &width, &height)) {
+        // FreeImage passes a size in the upper bits of the flags on to
+        // libjpeg, which scales by the largest power of two, up to 8, that
+        // keeps the longer side at least that size.
+        long longer = width > height ? width : height;
+        FIMEMORY* memory = FreeImage_OpenMemory((BYTE*)image, length);
+        FIBITMAP* bitmap = FreeImage_LoadFromMemory(
+                FIF_JPEG, memory, JPEG_DEFAULT | (int)(longer / shrink) << 16);
+        FreeImage_CloseMemory(memory);
+        return bitmap ? canonicalise_bitmap(bitmap) : NULL;
+    }
+    FIBITMAP* bitmap
+            = fi_load_image_from_buffer((unsigned char*)image, length);
+    bitmap = bitmap ? canonicalise_bitmap(bitmap) : NULL;
+    if (bitmap && shrink > 1) {
+        FIBITMAP* shrunk = box_shrink(bitmap, shrink);
+        if (shrunk) {
+            FreeImage_Unload(bitmap);
+            bitmap = shrunk;
+        }
+    }
+    return bitmap;
+}
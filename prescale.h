@@ -0,0 +1,51 @@
+#ifndef PRESCALE_H
+#define PRESCALE_H
+
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "pixelformat.h"
+
+/* Decodes images at reduced resolution when the operations go on to shrink
+ * them anyway, so a 6000x4000 photo bound for 300x200 is never held or
+ * rotated at full size. JPEGs are scaled by libjpeg while decoding, which
+ * skips most of the inverse DCT. Other formats are decoded in full and then
+ * box filtered down before any operation runs. The operations' own scale
+ * still produces the exact size asked for, from the smaller bitmap. */
+
+/* plan_decode_shrink()
+ * --------------------
+ * Works out how far an image can be shrunk as it is decoded without any
+ *      later scale having to enlarge it. Dimensions are read from the
+ *      image header and followed through the operations up to the first
+ *      scale.
+ *
+ * image: the encoded image.
+ * length: the number of bytes in image.
+ * cmdBuffer: the parsed operations.
+ *
+ * returns: 1, 2, 4 or 8, the factor each side may be divided by.
+ */
+int plan_decode_shrink(const unsigned char* image, long unsigned int length,
+        CommandBuffer cmdBuffer);
+
+/* load_image_shrunk()
+ * -------------------
+ * Decodes an image with each side divided by up to a factor, and brings it
+ *      into a canonical pixel layout. The factor is not reached if the
+ *      image is in a format that cannot be shrunk, so callers must go by
+ *      the bitmap's own size.
+ *
+ * image: the encoded image.
+ * length: the number of bytes in image.
+ * shrink: the factor from plan_decode_shrink(), 1 to decode in full.
+ *
+ * returns: the bitmap, or NULL if the image could not be decoded.
+ */
+FIBITMAP* load_image_shrunk(const unsigned char* image,
+        long unsigned int length, int shrink);
+
+// The box filtering kernels, indexed by PixelLayout.
+extern const ShrinkKernel shrinkKernels[];
+
+#endif // PRESCALE_H
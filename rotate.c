@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <FreeImage.h>
+
+#include "pixelformat.h"
+#include "rotate.h"
+
+// Sines of 0 to 90 degrees, scaled by 2^30. Every other angle's sine and
+// cosine is one of these by symmetry.
+const int32_t quarterSines[] = {
+    0, 18739379, 37473049, 56195305, 74900443, 93582766, 112236583, 130856211,
+    149435979, 167970228, 186453311, 204879599, 223243478, 241539355,
+    259761657, 277904834, 295963357, 313931728, 331804471, 349576144,
+    367241333, 384794656, 402230767, 419544355, 436730145, 453782903,
+    470697435, 487468587, 504091252, 520560366, 536870912, 553017922,
+    568996477, 584801711, 600428808, 615873009, 631129609, 646193961,
+    661061475, 675727625, 690187940, 704438018, 718473518, 732290163,
+    745883746, 759250125, 772385229, 785285058, 797945680, 810363241,
+    822533958, 834454122, 846120104, 857528349, 868675383, 879557810,
+    890172315, 900515665, 910584710, 920376381, 929887697, 939115760,
+    948057759, 956710970, 965072759, 973140576, 980911966, 988384560,
+    995556083, 1002424350, 1008987269, 1015242840, 1021189159, 1026824413,
+    1032146887, 1037154959, 1041847103, 1046221891, 1050277989, 1054014162,
+    1057429273, 1060522280, 1063292242, 1065738315, 1067859754, 1069655912,
+    1071126243, 1072270298, 1073087729, 1073578288, 1073741824};
+const double quarterSineScale = 1073741824.0;
+
+const int degreesPerTurn = 360;
+const int degreesPerRightAngle = 90;
+
+// Coordinates are stepped in 16.16 fixed point, and blended with 8 bit
+// weights taken from the top of the fraction.
+#define FIXED_SHIFT 16
+#define WEIGHT_SHIFT 8
+#define WEIGHT_ONE 256
+const double fixedOne = 65536.0;
+
+// Largest source width plus height whose coordinates, and those of the
+// rotated canvas around it, fit in 16.16 fixed point.
+const int maxFixedExtent = 16384;
+
+// Output pixels whose coordinates are stepped together.
+#define LANES 4
+
+/* The channels of one pixel, or the coordinates of a run of pixels */
+typedef int32_t Lanes __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+/* How a rotation steps through its source */
+typedef struct RotateSteps {
+    int32_t stepX; // Source step per output pixel along a row, 16.16.
+    int32_t stepY;
+    double startX; // Source point of the first pixel's centre.
+    double startY;
+    double rowX; // Source step per output row.
+    double rowY;
+} RotateSteps;
+
+/* A rotation shared out in bands of rows */
+typedef struct RotateJob {
+    const RotateSteps* steps;
+    RotateKernel kernel;
+    PixelBuffer source;
+    PixelBuffer output;
+} RotateJob;
+
+void angle_sine_cosine(int degrees, double* sine, double* cosine)
+{
+    int angle = degrees % degreesPerTurn;
+    angle += angle < 0 ? degreesPerTurn : 0;
+    int quarter = angle / degreesPerRightAngle;
+    int within = angle % degreesPerRightAngle;
+    int32_t sineOf = quarterSines[quarter % 2 ? 90 - within : within];
+    int32_t cosineOf = quarterSines[quarter % 2 ? within : 90 - within];
+    *sine = (quarter < 2 ? sineOf : -sineOf) / quarterSineScale;
+    *cosine = (quarter == 0 || quarter == 3 ? cosineOf : -cosineOf)
+            / quarterSineScale;
+}
+
+/* read_pixel()
+ * ------------
+ * Private helper function that widens one source pixel's channels into
+ *      lanes.
+ */
+static inline Lanes read_pixel(const PixelBuffer* source, int x, int y,
+        const int channels)
+{
+    const BYTE* pixel = source->bits + (long)y * source->pitch + x * channels;
+    Lanes channelsOf = {pixel[0], channels > 1 ? pixel[1] : 0,
+            channels > 2 ? pixel[2] : 0, channels > 3 ? pixel[3] : 0};
+    return channelsOf;
+}
+
+/* load_pixel()
+ * ------------
+ * Private helper function that widens one source pixel's channels into
+ *      lanes, or gives black if it lies outside the source.
+ */
+static inline Lanes load_pixel(const PixelBuffer* source, int x, int y,
+        const int channels)
+{
+    if (x < 0 || y < 0 || x >= source->width || y >= source->height) {
+        Lanes black = {0, 0, 0, 0};
+        return black;
+    }
+    return read_pixel(source, x, y, channels);
+}
+
+/* blend_pixel()
+ * -------------
+ * Private helper function that writes one output pixel, blending the four
+ *      source pixels around its source point, all channels at once. Only
+ *      points along the source's edges need each pixel checked.
+ */
+static inline void blend_pixel(const PixelBuffer* source, int left,
+        int bottom, int weightX, int weightY, BYTE* out, const int channels)
+{
+    Lanes value = {0, 0, 0, 0};
+    Lanes lowerLeft, lowerRight, upperLeft, upperRight;
+    bool blended = true;
+    if (left >= 0 && bottom >= 0 && left + 1 < source->width
+            && bottom + 1 < source->height) {
+        lowerLeft = read_pixel(source, left, bottom, channels);
+        lowerRight = read_pixel(source, left + 1, bottom, channels);
+        upperLeft = read_pixel(source, left, bottom + 1, channels);
+        upperRight = read_pixel(source, left + 1, bottom + 1, channels);
+    } else if (left >= -1 && bottom >= -1 && left < source->width
+            && bottom < source->height) {
+        lowerLeft = load_pixel(source, left, bottom, channels);
+        lowerRight = load_pixel(source, left + 1, bottom, channels);
+        upperLeft = load_pixel(source, left, bottom + 1, channels);
+        upperRight = load_pixel(source, left + 1, bottom + 1, channels);
+    } else {
+        blended = false;
+    }
+    if (blended) {
+        Lanes below = lowerLeft * (WEIGHT_ONE - weightX)
+                + lowerRight * weightX;
+        Lanes above = upperLeft * (WEIGHT_ONE - weightX)
+                + upperRight * weightX;
+        value = (below * (WEIGHT_ONE - weightY) + above * weightY
+                        + (1 << (2 * WEIGHT_SHIFT - 1)))
+                >> (2 * WEIGHT_SHIFT);
+    }
+    for (int c = 0; c < channels; c++) {
+        out[c] = value[c];
+    }
+}
+
+/* rotate_rows()
+ * -------------
+ * Private helper function that fills a band of output rows. Source points
+ *      for LANES pixels at a time are stepped together, then split into
+ *      whole pixels and blending weights together. Inlined once per layout
+ *      so the channel loops are unrolled.
+ */
+static inline void rotate_rows(const RotateSteps* steps,
+        const PixelBuffer* source, const PixelBuffer* output, int firstRow,
+        int endRow, const int channels)
+{
+    Lanes offsets = {0, 1, 2, 3};
+    Lanes stepsX = offsets * steps->stepX;
+    Lanes stepsY = offsets * steps->stepY;
+    int32_t runX = LANES * steps->stepX;
+    int32_t runY = LANES * steps->stepY;
+    for (int y = firstRow; y < endRow; y++) {
+        BYTE* out = output->bits + (long)y * output->pitch;
+        // Each row starts afresh from the exact point, so rounding in the
+        // steps never builds up over the image.
+        Lanes pointsX = stepsX
+                + (int32_t)lround((steps->startX + y * steps->rowX) * fixedOne);
+        Lanes pointsY = stepsY
+                + (int32_t)lround((steps->startY + y * steps->rowY) * fixedOne);
+        for (int x = 0; x < output->width; x += LANES) {
+            Lanes lefts = pointsX >> FIXED_SHIFT;
+            Lanes bottoms = pointsY >> FIXED_SHIFT;
+            Lanes weightsX = (pointsX >> WEIGHT_SHIFT) & (WEIGHT_ONE - 1);
+            Lanes weightsY = (pointsY >> WEIGHT_SHIFT) & (WEIGHT_ONE - 1);
+            int run = output->width - x < LANES ? output->width - x : LANES;
+            for (int i = 0; i < run; i++) {
+                blend_pixel(source, lefts[i], bottoms[i], weightsX[i],
+                        weightsY[i], out + (x + i) * channels, channels);
+            }
+            pointsX += runX;
+            pointsY += runY;
+        }
+    }
+}
+
+// One rotation kernel per layout.
+#define ROTATE_KERNEL(layout, channels) \
+    static void rotate_##layout(const RotateSteps* steps, \
+            const PixelBuffer* source, const PixelBuffer* output, \
+            int firstRow, int endRow) \
+    { \
+        rotate_rows(steps, source, output, firstRow, endRow, channels); \
+    }
+FOR_EACH_LAYOUT(ROTATE_KERNEL)
+
+#define ROTATE_ENTRY(layout, channels) rotate_##layout,
+const RotateKernel rotateKernels[NUM_LAYOUTS]
+        = {FOR_EACH_LAYOUT(ROTATE_ENTRY)};
+
+/* rotate_band()
+ * -------------
+ * Private helper function that rotates one band of a RotateJob's rows.
+ */
+static void rotate_band(void* job, int firstRow, int endRow)
+{
+    RotateJob* rotate = (RotateJob*)job;
+    rotate->kernel(rotate->steps, &(rotate->source), &(rotate->output),
+            firstRow, endRow);
+}
+
+FIBITMAP* rotate_bitmap(FIBITMAP* source, int degrees,
+        const PixelKernels* kernels)
+{
+    int width = FreeImage_GetWidth(source);
+    int height = FreeImage_GetHeight(source);
+    if (degrees % degreesPerRightAngle == 0 || !kernels
+            || layout_of(source) != kernels->layout
+            || width + height > maxFixedExtent) {
+        return NULL;
+    }
+    double sine, cosine;
+    angle_sine_cosine(degrees, &sine, &cosine);
+    int newWidth = floor(width * fabs(cosine) + height * fabs(sine) + 0.5);
+    int newHeight = floor(width * fabs(sine) + height * fabs(cosine) + 0.5);
+    newWidth = newWidth > 0 ? newWidth : 1;
+    newHeight = newHeight > 0 ? newHeight : 1;
+    FIBITMAP* output = allocate_layout(kernels->layout, newWidth, newHeight);
+    if (!output) {
+        return NULL;
+    }
+
+    // Output point (x, y) shows the source point found by turning it back
+    // about the new centre onto the old one.
+    double centreX = newWidth / 2.0;
+    double centreY = newHeight / 2.0;
+    RotateSteps steps = {lround(cosine * fixedOne), lround(-sine * fixedOne),
+            0, 0, sine, cosine};
+    // Points are taken at pixel centres, half a pixel in from their
+    // corners, on both the output and source sides.
+    steps.startX = width / 2.0 + cosine * (0.5 - centreX)
+            + sine * (0.5 - centreY) - 0.5;
+    steps.startY = height / 2.0 - sine * (0.5 - centreX)
+            + cosine * (0.5 - centreY) - 0.5;
+    RotateJob job = {&steps, kernels->rotate, pixel_buffer(source),
+            pixel_buffer(output)};
+    run_in_bands(newHeight, rotate_band, &job);
+    return output;
+}
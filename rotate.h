@@ -0,0 +1,44 @@
+#ifndef ROTATE_H
+#define ROTATE_H
+
+#include <FreeImage.h>
+
+#include "pixelformat.h"
+
+/* Rotates bitmaps by the whole numbers of degrees operations allow, without
+ * any trigonometry per image or per pixel. Sines and cosines come from a
+ * table, and each output row steps through the source in fixed point,
+ * blending the four nearest source pixels. The canvas grows to fit and the
+ * uncovered corners are left black, as FreeImage_Rotate() does. */
+
+/* angle_sine_cosine()
+ * -------------------
+ * Looks up the sine and cosine of a whole number of degrees. Right angles
+ *      are exact.
+ *
+ * degrees: the angle, of any sign or size.
+ * sine: populated with its sine.
+ * cosine: populated with its cosine.
+ */
+void angle_sine_cosine(int degrees, double* sine, double* cosine);
+
+/* rotate_bitmap()
+ * ---------------
+ * Rotates a bitmap anticlockwise, the rows of the output shared between up
+ *      to one thread per CPU.
+ *
+ * source: the bitmap to rotate, which is left untouched.
+ * degrees: the angle of rotation.
+ * kernels: the request's kernels, or NULL if its image is not canonical.
+ *
+ * returns: the rotated bitmap, or NULL if the angle is a right angle,
+ *      which FreeImage_Rotate() does exactly, or the source is not in the
+ *      kernels' layout or too large for fixed point coordinates.
+ */
+FIBITMAP* rotate_bitmap(FIBITMAP* source, int degrees,
+        const PixelKernels* kernels);
+
+// The rotation kernels, indexed by PixelLayout.
+extern const RotateKernel rotateKernels[];
+
+#endif // ROTATE_H
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <FreeImage.h>
+
+#include "ioutils.h"
+#include "pixelformat.h"
+#include "rotate.h"
+
+/* rotatebench
+ * -----------
+ * Benchmarks the table driven rotation engine against FreeImage_Rotate()
+ * on 24 and 32 bit bitmaps of a pattern, over a spread of angles. Each
+ * rotation is repeated and the median time of each is printed, with how
+ * many times faster the engine was.
+ *
+ * Usage: rotatebench [width height], defaulting to 3000 by 2000.
+ */
+
+const char* const rotateUsageMessage = "Usage: rotatebench [width height]\n";
+
+const char* const rotateHeaderFormat = "%-4s %6s %12s %12s %8s\n";
+const char* const rotateRowFormat = "%-4i %6i %12.2f %12.2f %7.2fx\n";
+
+const int defaultBenchWidth = 3000;
+const int defaultBenchHeight = 2000;
+
+// Angles timed, chosen to fall in every quadrant.
+const int benchAngles[] = {1, 37, 45, 123, -200, 299};
+const int numBenchAngles = sizeof(benchAngles) / sizeof(benchAngles[0]);
+
+// Times each rotation is repeated, the median being reported.
+#define BENCH_REPEATS 5
+
+/* make_pattern()
+ * --------------
+ * Private helper function that allocates a bitmap filled with a gradient,
+ *      so no two neighbouring pixels are alike.
+ */
+static FIBITMAP* make_pattern(int width, int height, int bitsPerPixel)
+{
+    FIBITMAP* bitmap = FreeImage_Allocate(width, height, bitsPerPixel,
+            FI_RGBA_RED_MASK, FI_RGBA_GREEN_MASK, FI_RGBA_BLUE_MASK);
+    int channels = bitsPerPixel / 8;
+    for (int y = 0; y < height; y++) {
+        BYTE* row = FreeImage_GetScanLine(bitmap, y);
+        for (int x = 0; x < width; x++) {
+            for (int c = 0; c < channels; c++) {
+                row[x * channels + c] = (x * (c + 1) + y * (3 - c)) & 0xFF;
+            }
+        }
+    }
+    return bitmap;
+}
+
+/* compare_doubles()
+ * -----------------
+ * Private qsort comparison function for ascending doubles.
+ */
+static int compare_doubles(const void* a, const void* b)
+{
+    double difference = *(const double*)a - *(const double*)b;
+    return (difference > 0) - (difference < 0);
+}
+
+/* median_ms()
+ * -----------
+ * Private helper function that times repeated rotations of a bitmap, by
+ *      the engine or by FreeImage.
+ *
+ * returns: the median time of one rotation in milliseconds.
+ */
+static double median_ms(FIBITMAP* bitmap, int angle, bool engine)
+{
+    PixelKernels kernels;
+    select_kernels(bitmap, &kernels);
+    double timesMs[BENCH_REPEATS];
+    for (int i = 0; i < BENCH_REPEATS; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        FIBITMAP* rotated = engine ? rotate_bitmap(bitmap, angle, &kernels)
+                                   : FreeImage_Rotate(bitmap, angle, NULL);
+        timesMs[i] = elapsed_ms(start);
+        FreeImage_Unload(rotated);
+    }
+    qsort(timesMs, BENCH_REPEATS, sizeof(double), compare_doubles);
+    return timesMs[BENCH_REPEATS / 2];
+}
+
+/* Entry point for the rotation benchmark */
+int main(int argc, char** argv)
+{
+    int width = defaultBenchWidth;
+    int height = defaultBenchHeight;
+    if (argc == 3) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+    }
+    if ((argc != 1 && argc != 3) || width <= 0 || height <= 0) {
+        fprintf(stderr, rotateUsageMessage);
+        return 1;
+    }
+    printf("%ix%i, median of %i in ms\n", width, height, BENCH_REPEATS);
+    printf(rotateHeaderFormat, "bpp", "angle", "FreeImage", "engine",
+            "speedup");
+    int depths[] = {24, 32};
+    for (int d = 0; d < 2; d++) {
+        FIBITMAP* bitmap = make_pattern(width, height, depths[d]);
+        for (int i = 0; i < numBenchAngles; i++) {
+            double freeImageMs = median_ms(bitmap, benchAngles[i], false);
+            double engineMs = median_ms(bitmap, benchAngles[i], true);
+            printf(rotateRowFormat, depths[d], benchAngles[i], freeImageMs,
+                    engineMs, freeImageMs / engineMs);
+        }
+        FreeImage_Unload(bitmap);
+    }
+    return 0;
+}
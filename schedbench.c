@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ioutils.h"
+#include "scheduler.h"
+
+/* schedbench
+ * ----------
+ * Benchmarks the transform scheduler on a synthetic mix of thumbnail sized
+ * and photo sized jobs, each simulated by spinning a CPU for a time in
+ * proportion to its cost. Every client thread submits its jobs back to
+ * back, as a connection does, and the time from submission to completion
+ * is recorded. The same mix is run with every job in one lane, which is
+ * first come first served, then with lanes chosen by cost, and the median
+ * and tail latency of each job size is printed for both.
+ *
+ * Usage: schedbench [slots], slots defaulting to one per CPU.
+ */
+
+const char* const benchUsageMessage = "Usage: schedbench [slots]\n";
+
+const char* const benchHeaderFormat = "%-16s %-6s %8s %8s %8s\n";
+const char* const benchRowFormat = "%-16s %-6s %8.1f %8.1f %8.1f\n";
+
+// Simulated work of each job size and the costs they would be estimated at.
+const double smallJobMs = 2.0;
+const double largeJobMs = 60.0;
+const long unsigned int smallJobCost = 500000;
+const long unsigned int largeJobCost = 200000000;
+
+// Clients submitting each job size, and the jobs each submits.
+const int smallClients = 12;
+const int largeClients = 4;
+const int smallJobsPerClient = 150;
+const int largeJobsPerClient = 12;
+
+/* One client's jobs and their recorded latencies */
+typedef struct BenchClient {
+    Scheduler* scheduler;
+    bool costAware;
+    bool large;
+    int numJobs;
+    double* latenciesMs;
+} BenchClient;
+
+/* spin_for()
+ * ----------
+ * Private helper function that keeps a CPU busy for the given time.
+ */
+static void spin_for(double ms)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (elapsed_ms(start) < ms) {
+    }
+}
+
+/* run_client()
+ * ------------
+ * Private thread function that submits a client's jobs one after another.
+ */
+static void* run_client(void* data)
+{
+    BenchClient* client = (BenchClient*)data;
+    long unsigned int cost = client->large ? largeJobCost : smallJobCost;
+    for (int i = 0; i < client->numJobs; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        scheduler_acquire(client->scheduler, client->costAware ? cost : 0);
+        spin_for(client->large ? largeJobMs : smallJobMs);
+        scheduler_release(client->scheduler);
+        client->latenciesMs[i] = elapsed_ms(start);
+    }
+    return NULL;
+}
+
+/* compare_doubles()
+ * -----------------
+ * Private qsort comparison function for ascending doubles.
+ */
+static int compare_doubles(const void* a, const void* b)
+{
+    double difference = *(const double*)a - *(const double*)b;
+    return (difference > 0) - (difference < 0);
+}
+
+/* report_latencies()
+ * ------------------
+ * Private helper function that prints the median, 99th percentile and
+ * maximum of the latencies recorded by a set of clients.
+ */
+static void report_latencies(const char* mode, const char* size,
+        BenchClient* clients, int numClients)
+{
+    int total = 0;
+    for (int i = 0; i < numClients; i++) {
+        total += clients[i].numJobs;
+    }
+    double* latenciesMs = malloc(sizeof(double) * total);
+    int filled = 0;
+    for (int i = 0; i < numClients; i++) {
+        for (int j = 0; j < clients[i].numJobs; j++) {
+            latenciesMs[filled++] = clients[i].latenciesMs[j];
+        }
+    }
+    qsort(latenciesMs, total, sizeof(double), compare_doubles);
+    printf(benchRowFormat, mode, size, latenciesMs[total / 2],
+            latenciesMs[total * 99 / 100], latenciesMs[total - 1]);
+    free(latenciesMs);
+}
+
+/* run_mix()
+ * ---------
+ * Private helper function that runs the whole job mix through a fresh
+ * scheduler and reports its latencies.
+ */
+static void run_mix(int slots, bool costAware)
+{
+    Scheduler* scheduler = create_scheduler(slots);
+    int numClients = smallClients + largeClients;
+    BenchClient* clients = calloc(numClients, sizeof(BenchClient));
+    pthread_t* threadIDs = malloc(sizeof(pthread_t) * numClients);
+    for (int i = 0; i < numClients; i++) {
+        clients[i].scheduler = scheduler;
+        clients[i].costAware = costAware;
+        clients[i].large = i >= smallClients;
+        clients[i].numJobs
+                = clients[i].large ? largeJobsPerClient : smallJobsPerClient;
+        clients[i].latenciesMs = malloc(sizeof(double) * clients[i].numJobs);
+        pthread_create(&threadIDs[i], NULL, run_client, &clients[i]);
+    }
+    for (int i = 0; i < numClients; i++) {
+        pthread_join(threadIDs[i], NULL);
+    }
+    const char* mode = costAware ? "cost lanes" : "first come";
+    report_latencies(mode, "small", clients, smallClients);
+    report_latencies(mode, "large", &clients[smallClients], largeClients);
+    for (int i = 0; i < numClients; i++) {
+        free(clients[i].latenciesMs);
+    }
+    free(clients);
+    free(threadIDs);
+}
+
+/* Entry point for the scheduler benchmark */
+int main(int argc, char** argv)
+{
+    int slots = sysconf(_SC_NPROCESSORS_ONLN); // One per CPU by default.
+    if (argc > 2 || (argc == 2 && (slots = atoi(argv[1])) <= 0)) {
+        fprintf(stderr, benchUsageMessage);
+        return 1;
+    }
+    printf("%i slots, latency in ms\n", slots);
+    printf(benchHeaderFormat, "scheduling", "jobs", "p50", "p99", "max");
+    run_mix(slots, false);
+    run_mix(slots, true);
+    return 0;
+}
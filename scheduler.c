@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ioutils.h"
+#include "scheduler.h"
+
+#define SCHEDULER_LANES 3
+
+// Highest cost admitted to each lane but the last. A 512x512 thumbnail
+// costs about 1.3 million, a 12 megapixel photo about 50 million.
+const long unsigned int laneCostLimits[SCHEDULER_LANES - 1]
+        = {4000000, 64000000};
+
+// Share of slots given to each lane while all are busy.
+const int laneWeights[SCHEDULER_LANES] = {8, 3, 1};
+
+// Time a waiter spends in a lane before being promoted to the next.
+const double agingStepMs = 500.0;
+
+/* A transform waiting for a slot. Lives on its waiting thread's stack. */
+typedef struct Waiter {
+    int lane;
+    struct timespec promotedAt; // When it entered its current lane.
+    sem_t wake; // Posted once the waiter has been handed a slot.
+    struct Waiter* next;
+} Waiter;
+
+/* FIFO queue of waiters */
+typedef struct Lane {
+    Waiter* head;
+    Waiter* tail;
+    int credit; // Smooth weighted round robin credit.
+} Lane;
+
+struct Scheduler {
+    sem_t lock;
+    int freeSlots;
+    int waiting;
+    Lane lanes[SCHEDULER_LANES];
+};
+
+/* push_waiter()
+ * -------------
+ * Private helper function that appends a waiter to a lane.
+ */
+static void push_waiter(Scheduler* scheduler, Waiter* waiter)
+{
+    Lane* lane = &(scheduler->lanes[waiter->lane]);
+    waiter->next = NULL;
+    if (lane->tail) {
+        lane->tail->next = waiter;
+    } else {
+        lane->head = waiter;
+    }
+    lane->tail = waiter;
+}
+
+/* pop_waiter()
+ * ------------
+ * Private helper function that removes the oldest waiter from a lane.
+ */
+static Waiter* pop_waiter(Scheduler* scheduler, int laneIndex)
+{
+    Lane* lane = &(scheduler->lanes[laneIndex]);
+    Waiter* waiter = lane->head;
+    lane->head = waiter->next;
+    if (!lane->head) {
+        lane->tail = NULL;
+    }
+    return waiter;
+}
+
+/* promote_aged_waiters()
+ * ----------------------
+ * Private helper function that moves every waiter that has sat in its lane
+ * for agingStepMs up to the next cheaper lane. Lanes are FIFO, so only
+ * their heads need checking. The scheduler must be locked.
+ */
+static void promote_aged_waiters(Scheduler* scheduler)
+{
+    for (int lane = 1; lane < SCHEDULER_LANES; lane++) {
+        while (scheduler->lanes[lane].head
+                && elapsed_ms(scheduler->lanes[lane].head->promotedAt)
+                        >= agingStepMs) {
+            Waiter* waiter = pop_waiter(scheduler, lane);
+            waiter->lane = lane - 1;
+            clock_gettime(CLOCK_MONOTONIC, &(waiter->promotedAt));
+            push_waiter(scheduler, waiter);
+        }
+    }
+}
+
+/* next_waiter()
+ * -------------
+ * Private helper function that picks the waiter to hand a free slot to,
+ * by smooth weighted round robin over the non-empty lanes. The scheduler
+ * must be locked.
+ *
+ * returns: the dequeued waiter, or NULL if none are waiting.
+ */
+static Waiter* next_waiter(Scheduler* scheduler)
+{
+    promote_aged_waiters(scheduler);
+    int best = -1;
+    int totalWeight = 0;
+    for (int i = 0; i < SCHEDULER_LANES; i++) {
+        Lane* lane = &(scheduler->lanes[i]);
+        if (!lane->head) {
+            continue;
+        }
+        lane->credit += laneWeights[i];
+        totalWeight += laneWeights[i];
+        if (best == -1 || lane->credit > scheduler->lanes[best].credit) {
+            best = i;
+        }
+    }
+    if (best == -1) {
+        return NULL;
+    }
+    scheduler->lanes[best].credit -= totalWeight;
+    return pop_waiter(scheduler, best);
+}
+
+Scheduler* create_scheduler(int slots)
+{
+    Scheduler* scheduler = calloc(1, sizeof(Scheduler));
+    if (slots <= 0) {
+        slots = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    scheduler->freeSlots = slots > 0 ? slots : 1;
+    sem_init(&(scheduler->lock), 0, 1);
+    return scheduler;
+}
+
+int scheduler_acquire(Scheduler* scheduler, long unsigned int cost)
+{
+    int lane = 0;
+    while (lane < SCHEDULER_LANES - 1 && cost > laneCostLimits[lane]) {
+        lane++;
+    }
+    if (!scheduler) {
+        return lane;
+    }
+    sem_wait(&(scheduler->lock));
+    // Queued transforms go first, even cheap ones must not overtake them.
+    if (scheduler->freeSlots > 0 && !scheduler->waiting) {
+        scheduler->freeSlots--;
+        sem_post(&(scheduler->lock));
+        return lane;
+    }
+    Waiter waiter = {.lane = lane};
+    clock_gettime(CLOCK_MONOTONIC, &(waiter.promotedAt));
+    sem_init(&(waiter.wake), 0, 0);
+    push_waiter(scheduler, &waiter);
+    scheduler->waiting++;
+    sem_post(&(scheduler->lock));
+
+    // The releasing thread hands its slot straight over.
+    sem_wait(&(waiter.wake));
+    sem_destroy(&(waiter.wake));
+    return lane;
+}
+
+void scheduler_release(Scheduler* scheduler)
+{
+    if (!scheduler) {
+        return;
+    }
+    sem_wait(&(scheduler->lock));
+    Waiter* waiter = next_waiter(scheduler);
+    if (waiter) {
+        scheduler->waiting--;
+        sem_post(&(waiter->wake));
+    } else {
+        scheduler->freeSlots++;
+    }
+    sem_post(&(scheduler->lock));
+}
+
+int scheduler_waiting(Scheduler* scheduler)
+{
+    if (!scheduler) {
+        return 0;
+    }
+    sem_wait(&(scheduler->lock));
+    int waiting = scheduler->waiting;
+    sem_post(&(scheduler->lock));
+    return waiting;
+}
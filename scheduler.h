@@ -0,0 +1,50 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/* Admission scheduler for image transforms. A fixed number of transforms
+ * run at once, normally one per CPU, and the rest wait in priority lanes
+ * chosen by estimated cost, so cheap requests are not stuck behind
+ * expensive ones. Lanes are served by weighted round robin, favouring the
+ * cheap lanes without shutting out the expensive one, and waiters are
+ * promoted a lane each time they have waited agingStepMs so none starve. */
+
+typedef struct Scheduler Scheduler;
+
+/* create_scheduler()
+ * ------------------
+ * Creates a scheduler.
+ *
+ * slots: the number of transforms that may run at once, or 0 or less for
+ *      one per online CPU.
+ *
+ * returns: the new scheduler.
+ */
+Scheduler* create_scheduler(int slots);
+
+/* scheduler_acquire()
+ * -------------------
+ * Blocks until a transform of the given cost may run. Must be paired with
+ *      scheduler_release().
+ *
+ * scheduler: the scheduler to wait on. May be NULL, meaning no waiting.
+ * cost: the estimated cost of the transform, see estimate_request_cost().
+ *
+ * returns: the lane the transform was queued in, 0 being the cheapest.
+ */
+int scheduler_acquire(Scheduler* scheduler, long unsigned int cost);
+
+/* scheduler_release()
+ * -------------------
+ * Marks a transform finished, handing its slot to the next waiter.
+ *
+ * scheduler: the scheduler it was acquired from. May be NULL.
+ */
+void scheduler_release(Scheduler* scheduler);
+
+/* scheduler_waiting()
+ * -------------------
+ * returns: the number of transforms waiting for a slot.
+ */
+int scheduler_waiting(Scheduler* scheduler);
+
+#endif // SCHEDULER_H
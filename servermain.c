@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
 #include <netdb.h>
@@ -9,6 +10,9 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 
 #include <csse2310_freeimage.h>
 #include <FreeImage.h>
@@ -17,16 +21,60 @@
 #include "stringutils.h"
 #include "ioutils.h"
 #include "socketutils.h"
+#include "shmutils.h"
 #include "httputils.h"
+#include "timerwheel.h"
+#include "scheduler.h"
+#include "limiter.h"
+#include "singleflight.h"
+#include "diskcache.h"
+#include "imagestore.h"
+#include "tiling.h"
+#include "topology.h"
+#include "bufferpool.h"
+#include "forkjoin.h"
 
 const char* const invalidServerCmdMessage
-        = "Usage: uqimageproc [--max n] [--port port]\n";
+        = "Usage: uqimageproc [--max n] [--port port] [--socket path] "
+          "[--header-timeout ms] [--body-timeout ms] [--idle-timeout ms] "
+          "[--write-timeout ms] [--cache-dir path] [--cache-size MiB] "
+          "[--store-size MiB] [--store-ttl seconds] [--max-upload MiB] "
+          "[--memory-ceiling MiB] [--scratch-dir path] "
+          "[--affinity off|node|core] [--numa-nodes n]\n";
 const int invalidServerCmdCode = 14;
 
 const char* const invalidServerPortFormat
         = "uqimageproc: unable to listen on port \"%s\"\n";
 const int invalidServerPortCode = 19;
 
+const char* const invalidServerSocketFormat
+        = "uqimageproc: unable to listen on socket \"%s\"\n";
+const int invalidServerSocketCode = 19;
+
+const char* const invalidCacheDirFormat
+        = "uqimageproc: unable to use cache directory \"%s\"\n";
+const int invalidCacheDirCode = 20;
+
+const char* const invalidScratchDirFormat
+        = "uqimageproc: unable to use scratch directory \"%s\"\n";
+const int invalidScratchDirCode = 21;
+
+// Not fatal, as the listeners still work, just without regard to node.
+const char* const unsteeredPortFormat
+        = "uqimageproc: unable to steer connections on port \"%s\" by "
+          "node, sharing them by hash\n";
+
+// Bytes in a MiB, the unit of --cache-size, --store-size, --max-upload and
+// --memory-ceiling.
+const long unsigned int bytesPerMb = 1024 * 1024;
+
+// Most each NUMA node's buffer pool keeps while unused, enough for a tiled
+// transform's working buffers and a few request bodies.
+const long unsigned int poolBytesPerNode = 128 * 1024 * 1024;
+
+// Room for the status line and headers of a response sent from a file.
+#define RESPONSE_HEAD_SIZE 1024
+
 // Message formats for SIGHUP outputs.
 const char* const connectedFormat = "Currently connected clients: %i\n";
 const char* const completedFormat = "Completed clients: %i\n";
@@ -34,6 +82,16 @@ const char* const successfullFormat
         = "Successfully processed HTTP requests: %i\n";
 const char* const erroredFormat = "HTTP requests unsuccessful: %i\n";
 const char* const operationsFormat = "Operations on images completed: %i\n";
+const char* const timedOutFormat = "Connections timed out: %i\n";
+const char* const cancelledFormat = "HTTP requests cancelled: %i\n";
+const char* const waitingFormat = "Transforms waiting for a CPU: %i\n";
+const char* const limitFormat = "Transform concurrency limit: %i\n";
+const char* const coalescedFormat = "HTTP requests coalesced: %i\n";
+const char* const rejectedFormat = "HTTP requests rejected as overloaded: %i\n";
+const char* const storedFormat = "Images stored: %i (%lu bytes)\n";
+
+// Resolution of the connection timeout wheel.
+const int timeoutTickMs = 50;
 
 /* Thread shared statistics structure. Mutexes are spread over
  * reach struct field to reduce overall time spent waiting. */
@@ -43,14 +101,295 @@ typedef struct SharedStats {
     Mutex okResponses;
     Mutex errorResponses;
     Mutex operationCompletions;
+    Mutex timedOutClients;
+    Mutex cancelledResponses; // Deadline passed or client gone, not errors.
+    Mutex rejectedResponses; // Over the concurrency limit, not errors.
+    Mutex coalescedResponses; // Served a result shared with another.
 } SharedStats;
 
+/* Server wide machinery shared by every connection */
+typedef struct ServerContext {
+    ServerInputs* args;
+    TimerWheel* timerWheel; // Connection timeouts.
+    Scheduler* scheduler; // Orders transforms by estimated cost.
+    Limiter* limiter; // Bounds transforms in flight by observed latency.
+    FlightGroup* flights; // Identical transforms in flight, done once.
+    DiskCache* cache; // Results kept across restarts, NULL if disabled.
+    ImageStore* store; // Images uploaded once to be transformed by ID.
+    Tiling* tiling; // Large uploads spooled and transformed out of core.
+    Topology* topology; // The NUMA nodes connections are placed on.
+    BufferPools* pools; // Request bodies and tiling buffers, per node.
+} ServerContext;
+
 /* The data that a single thread should recieve wrapped in a void pointer */
 typedef struct ThreadData {
     SharedStats* sharedStats;
     SocketData socketData;
+    ServerContext* context;
+    int node; // The node to run on, -1 to leave it to the kernel.
 } ThreadData;
 
+/* What a connection is waiting on, which decides its timeout. */
+typedef enum ConnectionStage {
+    STAGE_IDLE, // Waiting for the first byte of a request.
+    STAGE_HEADER, // Reading the request line and headers.
+    STAGE_BODY, // Reading the request body.
+    STAGE_PROCESSING, // Transforming the image, not timed.
+    STAGE_WRITE // Sending the response.
+} ConnectionStage;
+
+/* Timeout state of one connection. stage and blankLineRun are only touched
+ * by the connection's own thread; the timer callback only sets expired. */
+typedef struct ConnectionTimer {
+    Timer timer;
+    TimerWheel* timerWheel;
+    ServerInputs* timeouts;
+    int handle;
+    ConnectionStage stage;
+    int blankLineRun; // Consecutive newlines seen, ignoring '\r'.
+    bool expired;
+} ConnectionTimer;
+
+/* expire_connection()
+ * -------------------
+ * Private timer callback that shuts down a connection that ran out of time,
+ *      which fails its blocked read or write so its thread cleans up.
+ *
+ * data: the ConnectionTimer that expired.
+ */
+void expire_connection(void* data)
+{
+    ConnectionTimer* connectionTimer = (ConnectionTimer*)data;
+    connectionTimer->expired = true;
+    shutdown(connectionTimer->handle, SHUT_RDWR);
+}
+
+/* set_connection_stage()
+ * ----------------------
+ * Private helper function that moves a connection to a new stage, arming
+ *      the timeout for it.
+ *
+ * connectionTimer: the connection's timeout state.
+ * stage: the stage it is now in.
+ */
+void set_connection_stage(ConnectionTimer* connectionTimer,
+        ConnectionStage stage)
+{
+    ServerInputs* timeouts = connectionTimer->timeouts;
+    int timeoutsMs[] = {timeouts->idleTimeoutMs, timeouts->headerTimeoutMs,
+            timeouts->bodyTimeoutMs, 0, timeouts->writeTimeoutMs};
+    connectionTimer->stage = stage;
+    connectionTimer->blankLineRun = 0;
+    timer_arm(connectionTimer->timerWheel, &(connectionTimer->timer),
+            timeoutsMs[stage]);
+}
+
+/* observe_connection_read()
+ * -------------------------
+ * Private read observer that follows a request through its stages: the
+ *      first byte starts the header timeout, the blank line after the
+ *      headers starts the body timeout, and every later read of the body
+ *      restarts it.
+ *
+ * data: the connection's ConnectionTimer.
+ * bytes: the bytes just read.
+ * length: the number of bytes read.
+ */
+void observe_connection_read(void* data, const char* bytes, long int length)
+{
+    ConnectionTimer* connectionTimer = (ConnectionTimer*)data;
+    if (connectionTimer->stage == STAGE_IDLE) {
+        set_connection_stage(connectionTimer, STAGE_HEADER);
+    }
+    for (long int i = 0;
+            i < length && connectionTimer->stage == STAGE_HEADER; i++) {
+        if (bytes[i] == '\n') {
+            connectionTimer->blankLineRun++;
+        } else if (bytes[i] != '\r') {
+            connectionTimer->blankLineRun = 0;
+        }
+        if (connectionTimer->blankLineRun == 2) {
+            set_connection_stage(connectionTimer, STAGE_BODY);
+            return;
+        }
+    }
+    if (connectionTimer->stage == STAGE_BODY) {
+        set_connection_stage(connectionTimer, STAGE_BODY);
+    }
+}
+
+/* receive_passed_image()
+ * ----------------------
+ * Private helper function that swaps the body of a request that announced a
+ *      memfd image for a read-only mapping of the passed descriptor, so the
+ *      image is decoded straight from the client's pages.
+ *
+ * socketData: the connection the request arrived on.
+ * inHttp: the request to update.
+ * pools: where its heap body was taken from.
+ *
+ * returns: the mapping now referenced by inHttp, or a NULL data pointer if
+ *      the request carried no usable descriptor.
+ */
+BinaryData receive_passed_image(SocketData socketData, HttpRequest* inHttp,
+        BufferPools* pools)
+{
+    BinaryData mapped = {NULL, 0};
+    if (!passes_fds(socketData)
+            || !get_header_value(inHttp->headers, imageFdHeaderName)) {
+        return mapped;
+    }
+    int imageFd = take_passed_fd(socketData);
+    if (imageFd == -1) { // Leaves the empty body to fail as unprocessable.
+        return mapped;
+    }
+    mapped = map_sealed_memfd(imageFd);
+    close(imageFd);
+    if (mapped.data) {
+        give_buffer(pools, inHttp->bodyData, inHttp->bodyLen + 1);
+        inHttp->bodyData = mapped.data;
+        inHttp->bodyLen = mapped.length;
+    }
+    return mapped;
+}
+
+/* release_request()
+ * -----------------
+ * Private helper function that frees what get_spooled_request() gave a
+ *      request, bar its headers, which are freed before the next is read.
+ *
+ * inHttp: the request, whose body may already have been released.
+ * spooled: the mapping of its spooled body, if any.
+ * pools: where its heap body was taken from.
+ */
+void release_request(HttpRequest* inHttp, BinaryData spooled,
+        BufferPools* pools)
+{
+    if (spooled.data) {
+        unmap_binary_data(spooled);
+    } else {
+        give_buffer(pools, inHttp->bodyData, inHttp->bodyLen + 1);
+    }
+    free(inHttp->type);
+    free(inHttp->address);
+    inHttp->bodyData = NULL;
+    inHttp->type = NULL;
+    inHttp->address = NULL;
+}
+
+/* append_to_head()
+ * ----------------
+ * Private helper function that formats text onto the end of a response
+ *      head of RESPONSE_HEAD_SIZE bytes, as snprintf() would.
+ *
+ * head: the head so far.
+ * headLen: the length of head, advanced past the text.
+ * format: the printf() style format of the text, then its arguments.
+ *
+ * returns: false if the text did not fit, leaving head unusable.
+ */
+static bool append_to_head(char* head, int* headLen, const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(head + *headLen, RESPONSE_HEAD_SIZE - *headLen,
+            format, args);
+    va_end(args);
+    if (written < 0 || written >= RESPONSE_HEAD_SIZE - *headLen) {
+        return false;
+    }
+    *headLen += written;
+    return true;
+}
+
+/* send_file_response()
+ * --------------------
+ * Private helper function that writes a response whose body is a file,
+ *      sending the head then having the kernel copy the file straight to
+ *      the socket with sendfile().
+ *
+ * socketData: the connection to respond on.
+ * outHttp: the response to send, with its body in bodyFd.
+ */
+void send_file_response(SocketData socketData, HttpResponse* outHttp)
+{
+    char head[RESPONSE_HEAD_SIZE];
+    int headLen = 0;
+    bool fits = append_to_head(head, &headLen, "HTTP/1.1 %i %s\r\n",
+            outHttp->status, outHttp->statusDescription);
+    for (int i = 0; fits && outHttp->headers && outHttp->headers[i]; i++) {
+        fits = append_to_head(head, &headLen, "%s: %s\r\n",
+                outHttp->headers[i]->name, outHttp->headers[i]->value);
+    }
+    fits = fits
+            && append_to_head(head, &headLen, "Content-Length: %lu\r\n\r\n",
+                    outHttp->bodyLen);
+    if (!fits) { // Hang up rather than send a head cut short.
+        shutdown(socketData.handle, SHUT_RDWR);
+        return;
+    }
+    // Hold the head back to go out with the start of the body.
+    if (send(socketData.handle, head, headLen, MSG_MORE) != headLen) {
+        return;
+    }
+    off_t offset = 0;
+    while (offset < (off_t)outHttp->bodyLen) {
+        if (sendfile(socketData.handle, outHttp->bodyFd, &offset,
+                    outHttp->bodyLen - offset)
+                <= 0) {
+            return;
+        }
+    }
+}
+
+/* send_response()
+ * ---------------
+ * Private helper function that writes a response to the client. Successful
+ *      responses to memfd requests return the encoded image in a memfd too.
+ *
+ * socketData: the connection to respond on.
+ * outHttp: the response to send. Headers added to it are kept there, to be
+ *      freed with the response.
+ * viaMemfd: whether the request image arrived in a memfd.
+ */
+void send_response(
+        SocketData socketData, HttpResponse* outHttp, bool viaMemfd)
+{
+    int resultFd = -1;
+    if (viaMemfd && outHttp->status == HTTP_OK && outHttp->bodyFd > 0) {
+        void* cached = mmap(NULL, outHttp->bodyLen, PROT_READ, MAP_PRIVATE,
+                outHttp->bodyFd, 0);
+        if (cached != MAP_FAILED) {
+            resultFd = create_memfd_from_buffer(cached, outHttp->bodyLen);
+            munmap(cached, outHttp->bodyLen);
+        }
+    } else if (viaMemfd && outHttp->status == HTTP_OK) {
+        resultFd = create_memfd_from_buffer(
+                outHttp->bodyData, outHttp->bodyLen);
+    }
+    long unsigned int responseLen;
+    unsigned char* response;
+    if (resultFd != -1) {
+        outHttp->headers = add_header(
+                outHttp->headers, imageFdHeaderName, imageFdHeaderValue);
+        response = construct_HTTP_response(outHttp->status,
+                outHttp->statusDescription, outHttp->headers, NULL, 0,
+                &responseLen);
+        send_with_fd(socketData, response, responseLen, resultFd);
+        close(resultFd);
+    } else if (outHttp->bodyFd > 0) {
+        send_file_response(socketData, outHttp);
+        return;
+    } else {
+        response = construct_HTTP_response(outHttp->status,
+                outHttp->statusDescription, outHttp->headers,
+                outHttp->bodyData, outHttp->bodyLen, &responseLen);
+        fwrite(response, sizeof(unsigned char), responseLen, socketData.post);
+        fflush(socketData.post);
+    }
+    free(response);
+}
+
 /* handle_connection()
  * -------------------
  * Runtime logic for a single thread on the server. Each client interacts
@@ -72,42 +411,96 @@ void* handle_connection(void* data)
     HttpRequest inHttp = {0};
     modify_mutex(&(threadData.sharedStats->currentClients), 1);
 
+    // Track how long the client takes over each stage of every request, so
+    // clients that stall cannot hold this thread forever.
+    ServerContext* context = threadData.context;
+    if (threadData.node >= 0) {
+        pin_thread(context->topology, threadData.node, -1);
+    }
+    ConnectionTimer connectionTimer = {.timerWheel = context->timerWheel,
+            .timeouts = context->args, .handle = socketData.handle};
+    timer_init(&(connectionTimer.timer), expire_connection, &connectionTimer);
+    observe_reads(&socketData, observe_connection_read, &connectionTimer);
+
     while (1) { // Loop until interuputed.
         free_array_of_headers(inHttp.headers);
         // Block until a http request is recieved on the input filestream.
-        int error = !get_HTTP_request(socketData.get, &inHttp.type,
-                &inHttp.address, &inHttp.headers, &inHttp.bodyData,
-                &inHttp.bodyLen);
+        set_connection_stage(&connectionTimer, STAGE_IDLE);
+        BinaryData spooled;
+        RequestRead read = get_spooled_request(socketData.get,
+                context->tiling, context->pools, &inHttp, &spooled);
 
         // If HTTP requst is invalid, terminate the thread.
-        if (error) {
+        if (read == REQUEST_FAILED) {
+            release_request(&inHttp, spooled, context->pools);
+            timer_cancel(context->timerWheel, &(connectionTimer.timer));
+            if (connectionTimer.expired) {
+                modify_mutex(&(threadData.sharedStats->timedOutClients), 1);
+            }
             fclose(socketData.get);
             fclose(socketData.post);
+            close(socketData.handle);
             modify_mutex(&(threadData.sharedStats->finishedClients), 1);
             modify_mutex(&(threadData.sharedStats->currentClients), -1);
             return NULL;
         }
+        set_connection_stage(&connectionTimer, STAGE_PROCESSING);
+
+        // Bodies too large to keep were drained, and are only refused.
+        if (read == REQUEST_TOO_LARGE) {
+            HttpResponse outHttp
+                    = create_payload_large_post_request(inHttp.bodyLen);
+            modify_mutex(&(threadData.sharedStats->errorResponses), 1);
+            set_connection_stage(&connectionTimer, STAGE_WRITE);
+            send_response(socketData, &outHttp, false);
+            free_http_response(outHttp);
+            release_request(&inHttp, spooled, context->pools);
+            continue;
+        }
+
+        // Local clients may pass the image in a memfd instead of the body.
+        BinaryData passedImage = {NULL, 0};
+        if (!spooled.data) {
+            passedImage = receive_passed_image(
+                    socketData, &inHttp, context->pools);
+        }
+
+        // Abandon the work if the client's deadline passes or it hangs up.
+        CancelToken cancel;
+        init_cancel_token(
+                &cancel, get_deadline_ms(inHttp.headers), socketData.handle);
 
         // Respond to request forwarding the operation counter mutex.
-        HttpResponse outHttp = respond_to_request(
-                inHttp, &(threadData.sharedStats->operationCompletions));
-        if (outHttp.status == HTTP_OK) {
+        RequestContext requestContext = {
+                &(threadData.sharedStats->operationCompletions), &cancel,
+                context->scheduler, context->limiter, context->flights,
+                &(threadData.sharedStats->coalescedResponses),
+                context->cache, context->store, context->tiling};
+        HttpResponse outHttp = respond_to_request(inHttp, &requestContext);
+        if (outHttp.status == HTTP_OK || outHttp.status == IMAGE_CREATED) {
             // Succesfful responses.
             modify_mutex(&(threadData.sharedStats->okResponses), 1);
+        } else if (outHttp.status == DEADLINE_EXCEEDED) {
+            // Cancelled work is not an error on the server's part.
+            modify_mutex(&(threadData.sharedStats->cancelledResponses), 1);
+        } else if (outHttp.status == SERVICE_UNAVAILABLE) {
+            // Shed load, the client is told when to retry.
+            modify_mutex(&(threadData.sharedStats->rejectedResponses), 1);
         } else {
             // Error based responses.
             modify_mutex(&(threadData.sharedStats->errorResponses), 1);
         }
 
         // Construct HTTP response binary, writing to output filestream.
-        long unsigned int responseLen;
-        unsigned char* response = construct_HTTP_response(outHttp.status,
-                outHttp.statusDescription, outHttp.headers, outHttp.bodyData,
-                outHttp.bodyLen, &responseLen);
         fflush(stderr);
-        fwrite(response, sizeof(unsigned char), responseLen, socketData.post);
-        fflush(socketData.post);
-        free(response);
+        set_connection_stage(&connectionTimer, STAGE_WRITE);
+        send_response(socketData, &outHttp, passedImage.data != NULL);
+        free_http_response(outHttp);
+        if (passedImage.data) {
+            unmap_binary_data(passedImage);
+            inHttp.bodyData = NULL;
+        }
+        release_request(&inHttp, spooled, context->pools);
     }
     modify_mutex(&(threadData.sharedStats->finishedClients), 1);
     modify_mutex(&(threadData.sharedStats->currentClients), -1);
@@ -118,6 +511,7 @@ void* handle_connection(void* data)
 typedef struct SignalHandlerData {
     SharedStats* sharedStats;
     sigset_t* maskSet;
+    ServerContext* context;
 } SignalHandlerData;
 
 /* signal_handler()
@@ -163,6 +557,30 @@ static void* signal_handler(void* data)
     sem_wait(&(sharedStats->operationCompletions.lock));
     fprintf(stderr, operationsFormat, sharedStats->operationCompletions.value);
     sem_post(&(sharedStats->operationCompletions.lock));
+
+    sem_wait(&(sharedStats->timedOutClients.lock));
+    fprintf(stderr, timedOutFormat, sharedStats->timedOutClients.value);
+    sem_post(&(sharedStats->timedOutClients.lock));
+
+    sem_wait(&(sharedStats->cancelledResponses.lock));
+    fprintf(stderr, cancelledFormat, sharedStats->cancelledResponses.value);
+    sem_post(&(sharedStats->cancelledResponses.lock));
+
+    sem_wait(&(sharedStats->coalescedResponses.lock));
+    fprintf(stderr, coalescedFormat, sharedStats->coalescedResponses.value);
+    sem_post(&(sharedStats->coalescedResponses.lock));
+
+    sem_wait(&(sharedStats->rejectedResponses.lock));
+    fprintf(stderr, rejectedFormat, sharedStats->rejectedResponses.value);
+    sem_post(&(sharedStats->rejectedResponses.lock));
+
+    fprintf(stderr, waitingFormat,
+            scheduler_waiting(sigData->context->scheduler));
+    fprintf(stderr, limitFormat, limiter_limit(sigData->context->limiter));
+    int storedImages;
+    long unsigned int storedBytes;
+    image_store_usage(sigData->context->store, &storedImages, &storedBytes);
+    fprintf(stderr, storedFormat, storedImages, storedBytes);
     fflush(stderr);
     return NULL;
 }
@@ -183,6 +601,60 @@ void initilize_shared_stats(SharedStats* sharedStats)
     sem_init(&(sharedStats->okResponses.lock), 0, 1);
     sem_init(&(sharedStats->errorResponses.lock), 0, 1);
     sem_init(&(sharedStats->operationCompletions.lock), 0, 1);
+    sem_init(&(sharedStats->timedOutClients.lock), 0, 1);
+    sem_init(&(sharedStats->cancelledResponses.lock), 0, 1);
+    sem_init(&(sharedStats->rejectedResponses.lock), 0, 1);
+    sem_init(&(sharedStats->coalescedResponses.lock), 0, 1);
+}
+
+/* Data needed for a thread that accepts connections on one listener */
+typedef struct ListenerData {
+    SharedStats* sharedStats;
+    int socketHandle;
+    bool passesFds; // Unix domain listeners accept memfd images.
+    ServerContext* context;
+    int node; // The node its connections run on, -1 to leave it unplaced.
+} ListenerData;
+
+/* accept_connections()
+ * --------------------
+ * Blocks on a listening socket forever, launching a handle_connection thread
+ *      for every client accepted on it. Placed listeners run on their node,
+ *      as do the connections they accept.
+ *
+ * data: a ListenerData pointer holding the shared statistics and the
+ *      listening socket handle.
+ *
+ * returns: never returns.
+ *
+ * REF: Thread handling inspired by moss
+ * REF: week10 server-multithreaded example code.
+ */
+void* accept_connections(void* data)
+{
+    ListenerData* listenerData = (ListenerData*)data;
+    if (listenerData->node >= 0) {
+        pin_thread(listenerData->context->topology, listenerData->node, -1);
+    }
+    while (1) {
+        // Block the thread until a new connection is recieved.
+        SocketData clientSocketData
+                = block_for_connection(listenerData->socketHandle);
+        if (clientSocketData.handle == -1) { // Accept failed, keep serving.
+            continue;
+        }
+        if (listenerData->passesFds) {
+            enable_fd_passing(&clientSocketData);
+        }
+        ThreadData threadData = {listenerData->sharedStats, clientSocketData,
+                listenerData->context, listenerData->node};
+        ThreadData* threadArg = malloc(sizeof(ThreadData));
+        *threadArg = threadData;
+        pthread_t threadID;
+        pthread_create(&threadID, NULL, handle_connection, threadArg);
+        pthread_detach(threadID);
+    }
+    return NULL;
 }
 
 /* Entry point for server application */
@@ -197,15 +669,49 @@ int main(int argc, char** argv)
         fprintf(stderr, invalidServerCmdMessage);
         return invalidServerCmdCode;
     }
-    if (!args.port) {
+    if (!args.port && !args.socketPath) {
         args.port = "0"; // Use ephemeral port if non specified.
     }
 
-    // Attempt to open the user supplied port for listening.
-    int socketHandle = open_port(args.port);
-    if (socketHandle == -1) {
-        fprintf(stderr, invalidServerPortFormat, args.port);
-        return invalidServerPortCode;
+    // The machine's NUMA nodes. Once placed, the shared pool's workers are
+    // dealt out over them, and each node gets its own listener.
+    Topology* topology = discover_topology(sysfsNodeDir, args.numaNodes);
+    int numTcpListeners = 1;
+    if (args.affinity != AFFINITY_OFF) {
+        fork_join_place(topology, args.affinity == AFFINITY_CORE);
+        numTcpListeners = topology->numNodes;
+    }
+
+    // Attempt to open the user supplied port for listening. Placed servers
+    // listen once per node, the kernel steering each connection to the
+    // listener on the node of the CPU that received it.
+    int* socketHandles = malloc(sizeof(int) * numTcpListeners);
+    socketHandles[0] = -1;
+    if (args.port) {
+        if (numTcpListeners == 1) {
+            socketHandles[0] = open_port(args.port);
+        } else if (open_port_group(
+                           args.port, numTcpListeners, socketHandles)) {
+            socketHandles[0] = -1;
+        } else if (!steer_port_group(socketHandles[0], topology->nodeOfCpu,
+                           topology->numCpuSlots)) {
+            fprintf(stderr, unsteeredPortFormat, args.port);
+        }
+        if (socketHandles[0] == -1) {
+            fprintf(stderr, invalidServerPortFormat, args.port);
+            return invalidServerPortCode;
+        }
+    }
+
+    // Co-located clients may connect through a unix domain socket instead,
+    // skipping the loopback TCP stack.
+    int unixSocketHandle = -1;
+    if (args.socketPath) {
+        unixSocketHandle = open_unix_socket(args.socketPath);
+        if (unixSocketHandle == -1) {
+            fprintf(stderr, invalidServerSocketFormat, args.socketPath);
+            return invalidServerSocketCode;
+        }
     }
 
     // REF: signal masking code is inspired by the man page
@@ -218,22 +724,68 @@ int main(int argc, char** argv)
     sigaddset(&set, SIGHUP);
     pthread_sigmask(SIG_BLOCK, &set, NULL);
 
+    // A client that disconnects or times out mid response must only end
+    // its own connection.
+    signal(SIGPIPE, SIG_IGN);
+
+    // Connection timeouts, transform scheduling, the concurrency limit,
+    // which --max caps, coalescing, the result cache, uploaded images,
+    // out-of-core processing and buffers kept per node, shared by every
+    // thread. Created after masking SIGHUP, as the timer wheel and cache
+    // start threads.
+    BufferPools* pools = create_buffer_pools(topology, poolBytesPerNode);
+    ServerContext context = {&args, timer_wheel_create(timeoutTickMs),
+            create_scheduler(0), create_limiter(args.maxConnections),
+            create_flight_group(), NULL,
+            create_image_store(args.storeSizeMb * bytesPerMb,
+                    args.storeTtlSeconds),
+            create_tiling(args.scratchDir, args.maxUploadMb * bytesPerMb,
+                    args.memoryCeilingMb * bytesPerMb, pools),
+            topology, pools};
+    if (!context.tiling) {
+        fprintf(stderr, invalidScratchDirFormat, args.scratchDir);
+        return invalidScratchDirCode;
+    }
+    if (args.cacheDir) {
+        context.cache = open_disk_cache(
+                args.cacheDir, args.cacheSizeMb * bytesPerMb);
+        if (!context.cache) {
+            fprintf(stderr, invalidCacheDirFormat, args.cacheDir);
+            return invalidCacheDirCode;
+        }
+    }
+
     // Launch signal handler in a new thread.
     pthread_t sigHandlerID;
-    SignalHandlerData sigHandlerData = {&sharedStats, &set};
+    SignalHandlerData sigHandlerData = {&sharedStats, &set, &context};
     pthread_create(&sigHandlerID, NULL, signal_handler, &sigHandlerData);
     pthread_detach(sigHandlerID);
-    while (1) {
-        // Block the mean thread until a new connection is recieved.
-        SocketData clientSocketData = block_for_connection(socketHandle);
-        ThreadData threadData = {&sharedStats, clientSocketData};
-        // REF: Thread handling inspired by moss
-        // RED: week10 server-multithreaded example code.
-        ThreadData* data = malloc(sizeof(ThreadData));
-        *data = threadData;
-        pthread_t threadID;
-        pthread_create(&threadID, NULL, handle_connection, data);
-        pthread_detach(threadID);
+
+    // Serve the unix socket, and the listeners of every node bar the
+    // first, from their own threads, the main thread accepting on the
+    // first TCP listener if there is one.
+    ListenerData unixListener
+            = {&sharedStats, unixSocketHandle, true, &context, -1};
+    if (socketHandles[0] == -1) {
+        accept_connections(&unixListener);
+    } else if (unixSocketHandle != -1) {
+        pthread_t unixListenerID;
+        pthread_create(
+                &unixListenerID, NULL, accept_connections, &unixListener);
+        pthread_detach(unixListenerID);
+    }
+    ListenerData* tcpListeners = malloc(sizeof(ListenerData) * numTcpListeners);
+    for (int i = numTcpListeners - 1; i >= 0; i--) {
+        ListenerData tcpListener = {&sharedStats, socketHandles[i], false,
+                &context, args.affinity == AFFINITY_OFF ? -1 : i};
+        tcpListeners[i] = tcpListener;
+        if (i) {
+            pthread_t tcpListenerID;
+            pthread_create(&tcpListenerID, NULL, accept_connections,
+                    &tcpListeners[i]);
+            pthread_detach(tcpListenerID);
+        }
     }
+    accept_connections(&tcpListeners[0]);
     return 0;
 }
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ioutils.h"
+#include "socketutils.h"
+#include "shmutils.h"
+
+const char* const imageFdHeaderName = "X-Image-Fd";
+const char* const imageFdHeaderValue = "memfd";
+
+// Maximum number of received descriptors held per connection before new
+// ones are closed on arrival.
+#define FD_QUEUE_SIZE 64
+
+// Maximum number of descriptors accepted in one ancillary message.
+#define MAX_FDS_PER_MESSAGE 4
+
+// Size of the chunks used when copying a stream into a memfd.
+const long unsigned int memfdChunkSize = 65536;
+
+/* Input side of a connection read through recvmsg(). Received descriptors
+ * are held in a ring buffer in arrival order when the connection passes
+ * them. observer, if set, sees every chunk of bytes read. */
+struct FdStream {
+    int handle;
+    bool passesFds;
+    int fds[FD_QUEUE_SIZE];
+    int head;
+    int count;
+    ReadObserver observer;
+    void* observerData;
+};
+
+/* fd_stream_read()
+ * ----------------
+ * Private stdio cookie read function that pulls bytes with recvmsg() and
+ *      queues any SCM_RIGHTS descriptors that arrive with them.
+ *
+ * cookie: the FdStream being read.
+ * buffer: destination for received bytes.
+ * size: capacity of buffer.
+ *
+ * returns: the number of bytes read, 0 on EOF or -1 on error.
+ */
+static ssize_t fd_stream_read(void* cookie, char* buffer, size_t size)
+{
+    struct FdStream* stream = (struct FdStream*)cookie;
+    char control[CMSG_SPACE(sizeof(int) * MAX_FDS_PER_MESSAGE)];
+    struct iovec iov = {buffer, size};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received = recvmsg(stream->handle, &message, MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        return -1;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg;
+            cmsg = CMSG_NXTHDR(&message, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int* fds = (int*)CMSG_DATA(cmsg);
+        for (int i = 0; i < numFds; i++) {
+            // Peer is flooding us, or sent descriptors where none belong.
+            if (!stream->passesFds || stream->count == FD_QUEUE_SIZE) {
+                close(fds[i]);
+                continue;
+            }
+            stream->fds[(stream->head + stream->count) % FD_QUEUE_SIZE]
+                    = fds[i];
+            stream->count++;
+        }
+    }
+    if (received > 0 && stream->observer) {
+        stream->observer(stream->observerData, buffer, received);
+    }
+    return received;
+}
+
+/* fd_stream_close()
+ * -----------------
+ * Private stdio cookie close function. Closes the socket duplicate and any
+ *      descriptors that were received but never taken.
+ *
+ * cookie: the FdStream being closed.
+ *
+ * returns: 0.
+ */
+static int fd_stream_close(void* cookie)
+{
+    struct FdStream* stream = (struct FdStream*)cookie;
+    for (int i = 0; i < stream->count; i++) {
+        close(stream->fds[(stream->head + i) % FD_QUEUE_SIZE]);
+    }
+    close(stream->handle);
+    free(stream);
+    return 0;
+}
+
+/* open_fd_stream()
+ * ----------------
+ * Private helper function that replaces the input stream of a connection
+ * with one read through recvmsg().
+ *
+ * socketData: the connection to upgrade.
+ * passesFds: whether descriptors received on it are queued.
+ *
+ * returns: 0 if successfull, otherwise -1.
+ */
+static int open_fd_stream(SocketData* socketData, bool passesFds)
+{
+    struct FdStream* stream = calloc(1, sizeof(struct FdStream));
+    stream->handle = dup(socketData->handle);
+    stream->passesFds = passesFds;
+    cookie_io_functions_t functions = {fd_stream_read, NULL, NULL,
+            fd_stream_close};
+    FILE* get = fopencookie(stream, "r", functions);
+    if (!get) {
+        close(stream->handle);
+        free(stream);
+        return -1;
+    }
+    if (socketData->get) {
+        fclose(socketData->get);
+    }
+    socketData->get = get;
+    socketData->fdStream = stream;
+    return 0;
+}
+
+int enable_fd_passing(SocketData* socketData)
+{
+    if (socketData->fdStream) {
+        socketData->fdStream->passesFds = true;
+        return 0;
+    }
+    return open_fd_stream(socketData, true);
+}
+
+bool passes_fds(SocketData socketData)
+{
+    return socketData.fdStream && socketData.fdStream->passesFds;
+}
+
+int observe_reads(SocketData* socketData, ReadObserver observer, void* data)
+{
+    if (!socketData->fdStream && open_fd_stream(socketData, false)) {
+        return -1;
+    }
+    socketData->fdStream->observer = observer;
+    socketData->fdStream->observerData = data;
+    return 0;
+}
+
+int take_passed_fd(SocketData socketData)
+{
+    struct FdStream* stream = socketData.fdStream;
+    if (!stream || stream->count == 0) {
+        return -1;
+    }
+    int fd = stream->fds[stream->head];
+    stream->head = (stream->head + 1) % FD_QUEUE_SIZE;
+    stream->count--;
+    return fd;
+}
+
+int send_with_fd(SocketData socketData, const unsigned char* data,
+        long unsigned int length, int fd)
+{
+    fflush(socketData.post);
+    char control[CMSG_SPACE(sizeof(int))] = {0};
+    struct iovec iov = {(void*)data, length};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    // The descriptor rides on the first byte, so only the first send
+    // carries ancillary data.
+    ssize_t sent = sendmsg(socketData.handle, &message, MSG_NOSIGNAL);
+    if (sent < 0) {
+        return -1;
+    }
+    long unsigned int total = sent;
+    while (total < length) {
+        sent = send(socketData.handle, data + total, length - total,
+                MSG_NOSIGNAL);
+        if (sent < 0) {
+            return -1;
+        }
+        total += sent;
+    }
+    return 0;
+}
+
+/* seal_memfd()
+ * ------------
+ * Private helper function that seals a memfd against any further changes,
+ *      rewinding it so the receiver starts at the beginning.
+ *
+ * fd: the memfd to seal. Closed upon error.
+ *
+ * returns: fd if successfull, otherwise -1.
+ */
+static int seal_memfd(int fd)
+{
+    int error = fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    if (error) {
+        close(fd);
+        return -1;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+int create_memfd_from_buffer(const unsigned char* data,
+        long unsigned int length)
+{
+    int fd = memfd_create("uqimage", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return -1;
+    }
+    long unsigned int total = 0;
+    while (total < length) {
+        ssize_t written = write(fd, data + total, length - total);
+        if (written < 0) {
+            close(fd);
+            return -1;
+        }
+        total += written;
+    }
+    return seal_memfd(fd);
+}
+
+int create_memfd_from_stream(FILE* input, long unsigned int* length)
+{
+    *length = 0;
+    int fd = memfd_create("uqimage", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return -1;
+    }
+    unsigned char* chunk = malloc(sizeof(unsigned char) * memfdChunkSize);
+    size_t numRead;
+    while ((numRead = fread(chunk, sizeof(unsigned char), memfdChunkSize,
+                    input))
+            > 0) {
+        if (write(fd, chunk, numRead) != (ssize_t)numRead) {
+            free(chunk);
+            close(fd);
+            return -1;
+        }
+        *length += numRead;
+    }
+    free(chunk);
+    return seal_memfd(fd);
+}
+
+BinaryData map_sealed_memfd(int fd)
+{
+    BinaryData mapped = {NULL, 0};
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals == -1 || !(seals & F_SEAL_SHRINK)) {
+        return mapped;
+    }
+    struct stat fileInfo;
+    if (fstat(fd, &fileInfo) || fileInfo.st_size == 0) {
+        return mapped;
+    }
+    void* pages = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (pages == MAP_FAILED) {
+        return mapped;
+    }
+    mapped.data = (unsigned char*)pages;
+    mapped.length = fileInfo.st_size;
+    return mapped;
+}
+
+void unmap_binary_data(BinaryData data)
+{
+    if (data.data) {
+        munmap(data.data, data.length);
+    }
+}
@@ -0,0 +1,125 @@
+#ifndef SHMUTILS_H
+#define SHMUTILS_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "ioutils.h"
+#include "socketutils.h"
+
+/* Name and value of the HTTP header that marks a message whose body travels
+ * in a memfd passed alongside it, rather than in the socket stream. */
+extern const char* const imageFdHeaderName;
+extern const char* const imageFdHeaderValue;
+
+/* enable_fd_passing()
+ * -------------------
+ * Replaces the input stream of a unix domain socket connection with one that
+ *      reads through recvmsg(), queueing any file descriptors that arrive
+ *      as SCM_RIGHTS ancillary data in the order they were sent.
+ *
+ * socketData: the connection to upgrade. Its get stream is replaced.
+ *
+ * returns: 0 if successfull, otherwise -1.
+ */
+int enable_fd_passing(SocketData* socketData);
+
+/* passes_fds()
+ * ------------
+ * returns: true if the connection was upgraded by enable_fd_passing().
+ */
+bool passes_fds(SocketData socketData);
+
+/* Called with each chunk of bytes read from an observed connection, before
+ * stdio buffers it. */
+typedef void (*ReadObserver)(void* data, const char* bytes, long int length);
+
+/* observe_reads()
+ * ---------------
+ * Reports every read from a connection's input stream to an observer, so
+ *      callers can follow the progress of a peer through a message even
+ *      while blocked reading it with stdio. The input stream is replaced as
+ *      per enable_fd_passing() if it has not been already, but descriptors
+ *      are only queued if fd passing is enabled.
+ *
+ * socketData: the connection to observe. Its get stream may be replaced.
+ * observer: called from within reads of the get stream.
+ * data: passed to observer.
+ *
+ * returns: 0 if successfull, otherwise -1.
+ */
+int observe_reads(SocketData* socketData, ReadObserver observer, void* data);
+
+/* take_passed_fd()
+ * ----------------
+ * Removes the oldest file descriptor received on a connection.
+ *
+ * socketData: a connection previously upgraded by enable_fd_passing().
+ *
+ * returns: the received file descriptor, or -1 if none are queued.
+ */
+int take_passed_fd(SocketData socketData);
+
+/* send_with_fd()
+ * --------------
+ * Writes a message to a unix domain socket with a file descriptor attached
+ *      to its first byte. Anything still buffered in the post stream is
+ *      flushed first so message ordering is preserved.
+ *
+ * socketData: the connection to write to.
+ * data: the message bytes to send.
+ * length: the number of bytes in data.
+ * fd: the file descriptor to pass to the peer.
+ *
+ * returns: 0 if successfull, otherwise -1.
+ */
+int send_with_fd(SocketData socketData, const unsigned char* data,
+        long unsigned int length, int fd);
+
+/* create_memfd_from_buffer()
+ * --------------------------
+ * Copies a buffer into a new anonymous memory file and seals it so the
+ *      receiver can map it without it changing size underneath them.
+ *
+ * data: the bytes to store.
+ * length: the number of bytes in data.
+ *
+ * returns: the sealed memfd if successfull, otherwise -1.
+ */
+int create_memfd_from_buffer(const unsigned char* data,
+        long unsigned int length);
+
+/* create_memfd_from_stream()
+ * --------------------------
+ * Reads a stream until EOF straight into a new anonymous memory file, sealed
+ *      as per create_memfd_from_buffer().
+ *
+ * input: the stream to read.
+ * length: set to the number of bytes read.
+ *
+ * returns: the sealed memfd if successfull, otherwise -1.
+ */
+int create_memfd_from_stream(FILE* input, long unsigned int* length);
+
+/* map_sealed_memfd()
+ * ------------------
+ * Maps a memfd received from a peer read-only. Descriptors that are not
+ *      sealed against shrinking are refused, as the peer could otherwise
+ *      truncate them while mapped.
+ *
+ * fd: the memfd to map. It is not closed.
+ *
+ * returns: the mapped pages and their length, or a NULL data pointer upon
+ *      error. Release with unmap_binary_data().
+ */
+BinaryData map_sealed_memfd(int fd);
+
+/* unmap_binary_data()
+ * -------------------
+ * Releases pages mapped by map_sealed_memfd().
+ *
+ * data: the mapping to release.
+ */
+void unmap_binary_data(BinaryData data);
+
+#endif // SHMUTILS_H
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <semaphore.h>
+#include <time.h>
+#include <errno.h>
+
+#include "hashutils.h"
+#include "singleflight.h"
+
+#define FLIGHT_BUCKETS 256
+
+// How often a waiter checks whether its own request has been cancelled.
+const long flightPollNs = 50000000;
+const long flightNsPerSecond = 1000000000;
+
+struct Flight {
+    uint64_t key;
+    const unsigned char* image; // The leader's, valid until landing.
+    long unsigned int length;
+    CommandBuffer cmdBuffer; // The leader's, valid until landing.
+    int waiters; // Joined after the leader, guarded by the group lock.
+    sem_t landed; // Posted once per waiter on landing.
+    UqImageResult result;
+    sem_t lock; // Guards refs.
+    int refs;
+    struct Flight* next;
+};
+
+struct FlightGroup {
+    sem_t lock;
+    Flight* buckets[FLIGHT_BUCKETS];
+};
+
+/* flight_key()
+ * ------------
+ * Private helper function that hashes a transform's parsed operations and
+ * image into the key its flight is found by.
+ */
+static uint64_t flight_key(const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer)
+{
+    uint64_t key = hash_bytes(
+            cmdBuffer.buffer, sizeof(int) * cmdBuffer.numCmds, hashInitialSeed);
+    return hash_bytes(image, length, key);
+}
+
+/* same_transform()
+ * ----------------
+ * Private helper function that checks a flight is for exactly the given
+ * transform, so a hash collision can never hand out the wrong image.
+ */
+static bool same_transform(Flight* flight, uint64_t key,
+        const unsigned char* image, long unsigned int length,
+        CommandBuffer cmdBuffer)
+{
+    return flight->key == key && flight->length == length
+            && flight->cmdBuffer.numCmds == cmdBuffer.numCmds
+            && !memcmp(flight->cmdBuffer.buffer, cmdBuffer.buffer,
+                    sizeof(int) * cmdBuffer.numCmds)
+            && !memcmp(flight->image, image, length);
+}
+
+FlightGroup* create_flight_group(void)
+{
+    FlightGroup* group = calloc(1, sizeof(FlightGroup));
+    sem_init(&(group->lock), 0, 1);
+    return group;
+}
+
+Flight* flight_join(FlightGroup* group, const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer, bool* leader)
+{
+    uint64_t key = group ? flight_key(image, length, cmdBuffer) : 0;
+    Flight** bucket = group ? &(group->buckets[key % FLIGHT_BUCKETS]) : NULL;
+    if (group) {
+        sem_wait(&(group->lock));
+        for (Flight* flight = *bucket; flight; flight = flight->next) {
+            if (same_transform(flight, key, image, length, cmdBuffer)) {
+                flight->waiters++;
+                sem_wait(&(flight->lock));
+                flight->refs++;
+                sem_post(&(flight->lock));
+                sem_post(&(group->lock));
+                *leader = false;
+                return flight;
+            }
+        }
+    }
+
+    Flight* flight = calloc(1, sizeof(Flight));
+    flight->key = key;
+    flight->image = image;
+    flight->length = length;
+    flight->cmdBuffer = cmdBuffer;
+    flight->refs = 1;
+    sem_init(&(flight->landed), 0, 0);
+    sem_init(&(flight->lock), 0, 1);
+    if (group) {
+        flight->next = *bucket;
+        *bucket = flight;
+        sem_post(&(group->lock));
+    }
+    *leader = true;
+    return flight;
+}
+
+void flight_land(FlightGroup* group, Flight* flight, UqImageResult result)
+{
+    flight->result = result;
+    int waiters = 0;
+    if (group) {
+        sem_wait(&(group->lock));
+        Flight** link = &(group->buckets[flight->key % FLIGHT_BUCKETS]);
+        while (*link != flight) {
+            link = &((*link)->next);
+        }
+        *link = flight->next;
+        waiters = flight->waiters;
+        sem_post(&(group->lock));
+    }
+    // The leader's image and operations may be freed from here on.
+    flight->image = NULL;
+    flight->cmdBuffer.buffer = NULL;
+    for (int i = 0; i < waiters; i++) {
+        sem_post(&(flight->landed));
+    }
+}
+
+const UqImageResult* flight_wait(Flight* flight, CancelToken* cancel)
+{
+    while (1) {
+        struct timespec wakeAt;
+        clock_gettime(CLOCK_REALTIME, &wakeAt);
+        wakeAt.tv_nsec += flightPollNs;
+        if (wakeAt.tv_nsec >= flightNsPerSecond) {
+            wakeAt.tv_sec++;
+            wakeAt.tv_nsec -= flightNsPerSecond;
+        }
+        if (!sem_timedwait(&(flight->landed), &wakeAt)) {
+            return &(flight->result);
+        }
+        // A waiter that gives up leaves its post behind, which is harmless
+        // as nobody else waits for it.
+        if (errno != EINTR && is_cancelled(cancel)) {
+            return NULL;
+        }
+    }
+}
+
+const UqImageResult* flight_result(Flight* flight)
+{
+    return &(flight->result);
+}
+
+void flight_release(Flight* flight)
+{
+    if (!flight) {
+        return;
+    }
+    sem_wait(&(flight->lock));
+    int refs = --flight->refs;
+    sem_post(&(flight->lock));
+    if (!refs) {
+        free(flight->result.data);
+        sem_destroy(&(flight->landed));
+        sem_destroy(&(flight->lock));
+        free(flight);
+    }
+}
@@ -0,0 +1,82 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <stdbool.h>
+
+#include "argparsing.h"
+#include "ioutils.h"
+#include "uqimage.h"
+
+/* Coalesces identical transforms that are in flight at the same time. The
+ * first request for an image and operation chain leads a flight and does
+ * the work; identical requests arriving before it lands join the flight
+ * and share its result rather than decoding the same bytes again. Requests
+ * are identical when their bodies and parsed operations are, so spellings
+ * such as "rotate,090" and "rotate,90" coalesce. A flight leaves the group
+ * as it lands, so results are shared, never cached. */
+
+typedef struct FlightGroup FlightGroup;
+typedef struct Flight Flight;
+
+/* create_flight_group()
+ * ---------------------
+ * returns: a new, empty group of flights.
+ */
+FlightGroup* create_flight_group(void);
+
+/* flight_join()
+ * -------------
+ * Joins the flight for a transform, starting one if none is in flight.
+ *      Every flight returned holds a reference that must be dropped with
+ *      flight_release().
+ *
+ * group: the group to look in. May be NULL, in which case every caller
+ *      leads its own flight.
+ * image: the encoded image. Must stay valid until the flight lands.
+ * length: the number of bytes in image.
+ * cmdBuffer: the parsed operations. Must stay valid until the flight lands.
+ * leader: set to true if the caller started the flight and must land it.
+ *
+ * returns: the flight.
+ */
+Flight* flight_join(FlightGroup* group, const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer, bool* leader);
+
+/* flight_land()
+ * -------------
+ * Publishes the leader's result to everyone waiting on the flight and
+ *      removes it from its group. The flight takes ownership of the result.
+ *
+ * group: the group the flight was joined through.
+ * flight: the flight being led.
+ * result: the outcome of the transform.
+ */
+void flight_land(FlightGroup* group, Flight* flight, UqImageResult result);
+
+/* flight_wait()
+ * -------------
+ * Blocks until a joined flight lands, or until the waiter's own request is
+ *      cancelled.
+ *
+ * flight: the flight joined.
+ * cancel: the waiting request's cancellation. May be NULL.
+ *
+ * returns: the shared result, owned by the flight, or NULL if cancelled.
+ */
+const UqImageResult* flight_wait(Flight* flight, CancelToken* cancel);
+
+/* flight_result()
+ * ---------------
+ * returns: the result of a flight that has landed, owned by the flight.
+ */
+const UqImageResult* flight_result(Flight* flight);
+
+/* flight_release()
+ * ----------------
+ * Drops a reference to a flight, freeing it and its result with the last.
+ *
+ * flight: the flight to release. May be NULL.
+ */
+void flight_release(Flight* flight);
+
+#endif // SINGLEFLIGHT_H
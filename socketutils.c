@@ -1,10 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdbool.h>
+#include <linux/filter.h>
 
 #include "socketutils.h"
 
@@ -12,9 +19,12 @@
 // Irrelevent on current configuration.
 const int listenQueueSize = 10;
 
+// Room for a port number written out in decimal.
+#define PORT_STRING_SIZE 8
+
 SocketData connect_to_port(char* portNumber)
 {
-    SocketData socketData = {-1, NULL, NULL};
+    SocketData socketData = {-1, NULL, NULL, NULL};
     struct addrinfo* addInfoList = NULL; // Can be a linked list.
     struct addrinfo description = {0};
     description.ai_family = AF_INET; // IPv4.
@@ -40,7 +50,99 @@ SocketData connect_to_port(char* portNumber)
     return socketData;
 }
 
-int open_port(char* portNumber)
+SocketData connect_to_unix_socket(char* socketPath)
+{
+    SocketData socketData = {-1, NULL, NULL, NULL};
+    struct sockaddr_un address = {0};
+    // Path must fit in sun_path including its null terminator.
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        return socketData;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+
+    socketData.handle = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketData.handle == -1) {
+        return socketData;
+    }
+    int error = connect(socketData.handle, (struct sockaddr*)&address,
+            sizeof(struct sockaddr_un));
+    if (error) { // Nothing listening on socketPath.
+        close(socketData.handle);
+        socketData.handle = -1;
+        return socketData;
+    }
+
+    socketData.get = fdopen(dup(socketData.handle), "r");
+    socketData.post = fdopen(dup(socketData.handle), "w");
+    return socketData;
+}
+
+SocketData connect_to_endpoint(char* endpoint)
+{
+    // Port numbers and service names never contain a path separator.
+    if (strchr(endpoint, '/')) {
+        return connect_to_unix_socket(endpoint);
+    }
+    return connect_to_port(endpoint);
+}
+
+int resolve_endpoint(char* endpoint, struct sockaddr_storage* address,
+        socklen_t* addressLength)
+{
+    memset(address, 0, sizeof(struct sockaddr_storage));
+    if (strchr(endpoint, '/')) { // Unix domain socket path.
+        struct sockaddr_un* unixAddress = (struct sockaddr_un*)address;
+        if (strlen(endpoint) >= sizeof(unixAddress->sun_path)) {
+            return -1;
+        }
+        unixAddress->sun_family = AF_UNIX;
+        strcpy(unixAddress->sun_path, endpoint);
+        *addressLength = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    struct addrinfo* addInfoList = NULL;
+    struct addrinfo description = {0};
+    description.ai_family = AF_INET; // IPv4.
+    description.ai_socktype = SOCK_STREAM; // Two way connections.
+    int error = getaddrinfo("localhost", endpoint, &description, &addInfoList);
+    if (error) {
+        return -1;
+    }
+    memcpy(address, addInfoList->ai_addr, addInfoList->ai_addrlen);
+    *addressLength = addInfoList->ai_addrlen;
+    freeaddrinfo(addInfoList);
+    return 0;
+}
+
+int connect_nonblocking(
+        struct sockaddr_storage* address, socklen_t addressLength)
+{
+    int handle = socket(address->ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (handle == -1) {
+        return -1;
+    }
+    int error = connect(handle, (struct sockaddr*)address, addressLength);
+    if (error && errno != EINPROGRESS) {
+        close(handle);
+        return -1;
+    }
+    return handle;
+}
+
+/* listen_on_port()
+ * ----------------
+ * Private helper function that opens a port for listening, as open_port()
+ *      does but without reporting it.
+ *
+ * portNumber: the service identifier for the port to listen to.
+ * reusePort: whether other sockets may listen on the port too, the kernel
+ *      sharing connections out between them.
+ *
+ * return: socket handle for the port if successfull, otherwise -1.
+ */
+static int listen_on_port(char* portNumber, bool reusePort)
 {
     struct addrinfo* addressInfoList = NULL;
     struct addrinfo description = {0};
@@ -60,6 +162,10 @@ int open_port(char* portNumber)
     int shouldReuse = 1;
     error = setsockopt(
             socketHandle, SOL_SOCKET, SO_REUSEADDR, &shouldReuse, sizeof(int));
+    if (!error && reusePort) {
+        error = setsockopt(socketHandle, SOL_SOCKET, SO_REUSEPORT,
+                &shouldReuse, sizeof(int));
+    }
     if (error) {
         return -1;
     }
@@ -76,7 +182,17 @@ int open_port(char* portNumber)
     if (error) {
         return -1;
     }
+    return socketHandle;
+}
 
+/* bound_port()
+ * ------------
+ * Private helper function that finds the port a socket was bound to.
+ *
+ * returns: the port number, in host byte order.
+ */
+static int bound_port(int socketHandle)
+{
     // REF: getting a a port from the service
     // REF: name is based on moss week8 net4.c code.
     struct sockaddr_in addressBuffer;
@@ -84,17 +200,117 @@ int open_port(char* portNumber)
     getsockname(socketHandle, (struct sockaddr*)&addressBuffer, &bufferLength);
     // ntohs converts network byte order (big-endian) to x86 byte order
     // (little-endian).
-    fprintf(stderr, "%i\n", ntohs(addressBuffer.sin_port));
+    return ntohs(addressBuffer.sin_port);
+}
+
+int open_port(char* portNumber)
+{
+    int socketHandle = listen_on_port(portNumber, false);
+    if (socketHandle == -1) {
+        return -1;
+    }
+    fprintf(stderr, "%i\n", bound_port(socketHandle));
     fflush(stderr);
 
     return socketHandle;
 }
 
+int open_port_group(char* portNumber, int count, int* socketHandles)
+{
+    socketHandles[0] = listen_on_port(portNumber, true);
+    if (socketHandles[0] == -1) {
+        return -1;
+    }
+    // The rest join whichever port the first was given.
+    char boundPort[PORT_STRING_SIZE];
+    snprintf(boundPort, sizeof(boundPort), "%i", bound_port(socketHandles[0]));
+    for (int i = 1; i < count; i++) {
+        socketHandles[i] = listen_on_port(boundPort, true);
+        if (socketHandles[i] == -1) {
+            return -1;
+        }
+    }
+    fprintf(stderr, "%s\n", boundPort);
+    fflush(stderr);
+    return 0;
+}
+
+bool steer_port_group(int socketHandle, const int* memberOfCpu, int numCpus)
+{
+    // Load the CPU the connection arrived on, then compare it against each
+    // CPU not steered to the first member.
+    struct sock_filter* program
+            = malloc(sizeof(struct sock_filter) * (2 * numCpus + 2));
+    int length = 0;
+    struct sock_filter loadCpu
+            = BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    program[length++] = loadCpu;
+    for (int cpu = 0; cpu < numCpus; cpu++) {
+        if (memberOfCpu[cpu] > 0) {
+            struct sock_filter isCpu
+                    = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, 1);
+            struct sock_filter toMember
+                    = BPF_STMT(BPF_RET | BPF_K, memberOfCpu[cpu]);
+            program[length++] = isCpu;
+            program[length++] = toMember;
+        }
+    }
+    struct sock_filter toFirst = BPF_STMT(BPF_RET | BPF_K, 0);
+    program[length++] = toFirst;
+
+    bool steered = false;
+    if (length <= BPF_MAXINSNS) {
+        struct sock_fprog filter = {length, program};
+        steered = !setsockopt(socketHandle, SOL_SOCKET,
+                SO_ATTACH_REUSEPORT_CBPF, &filter, sizeof(filter));
+    }
+    free(program);
+    return steered;
+}
+
+int open_unix_socket(char* socketPath)
+{
+    struct sockaddr_un address = {0};
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketPath);
+
+    // Remove a socket file left behind by a previous server, but never
+    // clobber a regular file that happens to live at the path.
+    struct stat pathInfo;
+    if (!lstat(socketPath, &pathInfo)) {
+        if (!S_ISSOCK(pathInfo.st_mode)) {
+            return -1;
+        }
+        unlink(socketPath);
+    }
+
+    int socketHandle = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketHandle == -1) {
+        return -1;
+    }
+    int error = bind(socketHandle, (struct sockaddr*)&address,
+            sizeof(struct sockaddr_un));
+    if (error) {
+        close(socketHandle);
+        return -1;
+    }
+    error = listen(socketHandle, listenQueueSize);
+    if (error) {
+        close(socketHandle);
+        return -1;
+    }
+    return socketHandle;
+}
+
 SocketData block_for_connection(int socketHandle)
 {
-    SocketData socketData = {-1, NULL, NULL};
-    struct sockaddr_in clientSockAddress;
-    socklen_t clientSockAddressSize = sizeof(struct sockaddr_in);
+    SocketData socketData = {-1, NULL, NULL, NULL};
+    // Large enough for both IPv4 and unix domain peer addresses.
+    struct sockaddr_storage clientSockAddress;
+    socklen_t clientSockAddressSize = sizeof(struct sockaddr_storage);
 
     // The following will block, waiting for a new connection to accept.
     socketData.handle = accept(socketHandle,
@@ -106,3 +322,28 @@ SocketData block_for_connection(int socketHandle)
     socketData.post = fdopen(dup(socketData.handle), "w");
     return socketData;
 }
+
+int splice_bytes(int fromHandle, int toHandle, int pipeHandles[2],
+        long unsigned int length)
+{
+    while (length) {
+        ssize_t filled = splice(fromHandle, NULL, pipeHandles[1], NULL,
+                length, SPLICE_F_MOVE);
+        if (filled <= 0) { // Source closed or failed mid transfer.
+            return -1;
+        }
+        length -= filled;
+        // Hint that more is coming so partial segments are held back, but
+        // not on the final chunk or it would sit waiting for a flush.
+        unsigned int flags = SPLICE_F_MOVE | (length ? SPLICE_F_MORE : 0);
+        while (filled) {
+            ssize_t drained = splice(
+                    pipeHandles[0], NULL, toHandle, NULL, filled, flags);
+            if (drained <= 0) {
+                return -1;
+            }
+            filled -= drained;
+        }
+    }
+    return 0;
+}
@@ -2,14 +2,19 @@
 #define SOCKETUTILS_H
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <sys/socket.h>
 
 /* Holds a handle to an open socket and two file streams to its
    inpupt and output. The file streams are based on duplicates
-   of the socket file descriptor. */
+   of the socket file descriptor. fdStream is only set on connections read
+   through recvmsg(), such as unix domain connections that can receive
+   file descriptors (see shmutils.h). */
 typedef struct SocketData {
     int handle;
     FILE* post;
     FILE* get;
+    struct FdStream* fdStream;
 } SocketData;
 
 /* connect_to_port()
@@ -27,6 +32,58 @@ typedef struct SocketData {
  */
 SocketData connect_to_port(char* portNumber);
 
+/* connect_to_unix_socket()
+ * ------------------------
+ * Attempts to establish a connection with a unix domain stream socket
+ *      being listened to at a filesystem path.
+ *
+ * socketPath: the filesystem path of the socket to connect to.
+ *
+ * return: a SocketData struct holding the file descriptor and open
+ *      input/output streams for the socket. Returns a socket fd of -1 upon
+ *      error.
+ */
+SocketData connect_to_unix_socket(char* socketPath);
+
+/* connect_to_endpoint()
+ * ---------------------
+ * Connects to either a TCP port or a unix domain socket. Endpoints that
+ *      contain a '/' are treated as socket paths, anything else as a port.
+ *
+ * endpoint: the port number or socket path to connect to.
+ *
+ * return: a SocketData struct as per connect_to_port().
+ */
+SocketData connect_to_endpoint(char* endpoint);
+
+/* resolve_endpoint()
+ * ------------------
+ * Resolves a port number or unix socket path (as per connect_to_endpoint())
+ *      into a socket address once, so it can be reused for many connections.
+ *
+ * endpoint: the port number or socket path to resolve.
+ * address: populated with the resolved address.
+ * addressLength: populated with the length of address.
+ *
+ * return: 0 if successfull, otherwise -1.
+ */
+int resolve_endpoint(char* endpoint, struct sockaddr_storage* address,
+        socklen_t* addressLength);
+
+/* connect_nonblocking()
+ * ---------------------
+ * Starts a non-blocking connection to a resolved address. The connection may
+ *      still be in progress on return; it is complete once the socket is
+ *      writable and SO_ERROR reads 0.
+ *
+ * address: the address to connect to.
+ * addressLength: the length of address.
+ *
+ * return: the non-blocking socket fd if successfull, otherwise -1.
+ */
+int connect_nonblocking(
+        struct sockaddr_storage* address, socklen_t addressLength);
+
 /* open_port()
  * -----------
  * Attempts to open a port for listening.
@@ -40,6 +97,49 @@ SocketData connect_to_port(char* portNumber);
  */
 int open_port(char* portNumber);
 
+/* open_port_group()
+ * -----------------
+ * Opens several sockets listening on the same port with SO_REUSEPORT, the
+ *      kernel sharing incoming connections out between them. The port is
+ *      reported once, as open_port() does.
+ *
+ * portNumber: the service identifier for the port to listen to. If it is
+ *      0, the group shares whichever port the first socket is given.
+ * count: the number of sockets to open.
+ * socketHandles: populated with the count socket handles, in the order
+ *      they joined the group.
+ *
+ * return: 0 if successfull, otherwise -1.
+ */
+int open_port_group(char* portNumber, int count, int* socketHandles);
+
+/* steer_port_group()
+ * ------------------
+ * Attaches a classic BPF program to a group opened with open_port_group()
+ *      that hands each connection to a group member chosen by the CPU the
+ *      connection arrived on, rather than by a hash of its addresses.
+ *
+ * socketHandle: any socket in the group.
+ * memberOfCpu: for each CPU, the index of the member its connections go
+ *      to. CPUs past numCpus, or with a negative index, go to the first.
+ * numCpus: the number of entries in memberOfCpu.
+ *
+ * return: false if the kernel refused the program, or there were too many
+ *      CPUs to fit in one, in which case connections are shared by hash.
+ */
+bool steer_port_group(int socketHandle, const int* memberOfCpu, int numCpus);
+
+/* open_unix_socket()
+ * ------------------
+ * Attempts to open a unix domain stream socket for listening at the given
+ *      filesystem path. A stale socket file left at the path is replaced.
+ *
+ * socketPath: the filesystem path to bind the socket to.
+ *
+ * return: socket handle for the path if successfull, otherwise -1.
+ */
+int open_unix_socket(char* socketPath);
+
 /* block_for_connection()
  * ----------------------
  * Blocks the current thread until a connection is recieved on a socket.
@@ -55,4 +155,20 @@ int open_port(char* portNumber);
  */
 SocketData block_for_connection(int socketHandle);
 
+/* splice_bytes()
+ * --------------
+ * Moves exactly length bytes from one socket to another through a pipe with
+ *      splice(2), so the data never leaves the kernel.
+ *
+ * fromHandle: the socket fd to read from.
+ * toHandle: the socket fd to write to.
+ * pipeHandles: an empty pipe, as created by pipe(2), used as the buffer.
+ * length: the number of bytes to move.
+ *
+ * return: 0 if successfull, otherwise -1. On failure the pipe may still
+ *      hold data and must not be reused.
+ */
+int splice_bytes(int fromHandle, int toHandle, int pipeHandles[2],
+        long unsigned int length);
+
 #endif // SOCKETUTILS_H
@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <csse2310_freeimage.h>
+#include <FreeImage.h>
+
+#include "argparsing.h"
+#include "affine.h"
+#include "costmodel.h"
+#include "crop.h"
+#include "ioutils.h"
+#include "pixelformat.h"
+#include "pngstream.h"
+#include "tiling.h"
+
+// Pixels along each side of a tile.
+const int tileEdge = 256;
+
+// Memory one tiled transform works in beyond its decoded bitmap, half for
+// the source window of a block and half for a band of output rows.
+const long unsigned int tiledWorkingSet = 64 * 1024 * 1024;
+
+// Source pixels kept around a block's footprint, enough for the widest
+// filter to never reach past the window where the image goes on.
+const int windowMargin = 3;
+
+// Bytes in the widest pixel FreeImage decodes to, four 32 bit floats.
+const long unsigned int widestPixelBytes = 16;
+
+// How often a transform waiting for memory checks for cancellation.
+const long reservePollNs = 50000000;
+const long reserveNsPerSecond = 1000000000;
+
+// Names of scratch files, briefly, before they are unlinked.
+const char* const scratchTemplate = "%s/uqimage-XXXXXX";
+
+struct Tiling {
+    char* scratchDir;
+    long unsigned int uploadLimit;
+    long unsigned int capacity; // The memory ceiling, in bytes.
+    long unsigned int reserved; // Held by tiled transforms in progress.
+    pthread_mutex_t lock;
+    pthread_cond_t released; // Broadcast whenever memory is given back.
+    BufferPools* pools; // Block windows and bands, reused on their node.
+};
+
+/* A decoded image kept in tiles in a mapped scratch file. Each tile is
+ * stored whole, its rows one after another, and tiles go in rows. */
+typedef struct TiledImage {
+    BYTE* map;
+    size_t mapLength;
+    int width;
+    int height;
+    int channels; // Bytes per pixel.
+    int tilesAcross;
+    size_t tileBytes;
+} TiledImage;
+
+/* A block of output rows being resampled from a window of the source */
+typedef struct BlockJob {
+    const AffinePlan* plan;
+    ResampleKernel kernel;
+    PixelBuffer window;
+    PixelBuffer output;
+} BlockJob;
+
+Tiling* create_tiling(const char* scratchDir, long unsigned int uploadLimit,
+        long unsigned int memoryCeiling, BufferPools* pools)
+{
+    Tiling* tiling = calloc(1, sizeof(Tiling));
+    tiling->scratchDir = strdup(scratchDir);
+    tiling->uploadLimit = uploadLimit;
+    tiling->capacity = memoryCeiling;
+    tiling->pools = pools;
+    int probe = create_scratch_file(tiling);
+    if (probe == -1) {
+        free(tiling->scratchDir);
+        free(tiling);
+        return NULL;
+    }
+    close(probe);
+    pthread_mutex_init(&(tiling->lock), NULL);
+    pthread_cond_init(&(tiling->released), NULL);
+    return tiling;
+}
+
+long unsigned int tiling_upload_limit(Tiling* tiling)
+{
+    return tiling ? tiling->uploadLimit : maxImageSize;
+}
+
+int create_scratch_file(Tiling* tiling)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), scratchTemplate, tiling->scratchDir);
+    int fd = mkstemp(path);
+    if (fd != -1) {
+        unlink(path);
+    }
+    return fd;
+}
+
+/* reserve_memory()
+ * ----------------
+ * Private helper function that takes bytes from under the memory ceiling,
+ *      waiting until enough is given back by other transforms.
+ *
+ * returns: UQIMAGE_OK once reserved, UQIMAGE_IMAGE_TOO_LARGE if the
+ *      ceiling could never hold it, or UQIMAGE_CANCELLED if the work was
+ *      abandoned while waiting.
+ */
+static UqImageStatus reserve_memory(Tiling* tiling, long unsigned int bytes,
+        CancelToken* cancel)
+{
+    if (bytes > tiling->capacity) {
+        return UQIMAGE_IMAGE_TOO_LARGE;
+    }
+    UqImageStatus status = UQIMAGE_OK;
+    pthread_mutex_lock(&(tiling->lock));
+    while (tiling->reserved + bytes > tiling->capacity) {
+        if (is_cancelled(cancel)) {
+            status = UQIMAGE_CANCELLED;
+            break;
+        }
+        struct timespec wakeAt;
+        clock_gettime(CLOCK_REALTIME, &wakeAt);
+        wakeAt.tv_nsec += reservePollNs;
+        if (wakeAt.tv_nsec >= reserveNsPerSecond) {
+            wakeAt.tv_sec++;
+            wakeAt.tv_nsec -= reserveNsPerSecond;
+        }
+        // Woken by releases, and on the poll so deadlines and hang-ups are
+        // seen while nothing is released.
+        pthread_cond_timedwait(&(tiling->released), &(tiling->lock), &wakeAt);
+    }
+    if (status == UQIMAGE_OK) {
+        tiling->reserved += bytes;
+    }
+    pthread_mutex_unlock(&(tiling->lock));
+    return status;
+}
+
+/* release_memory()
+ * ----------------
+ * Private helper function that gives reserved bytes back to the ceiling.
+ */
+static void release_memory(Tiling* tiling, long unsigned int bytes)
+{
+    pthread_mutex_lock(&(tiling->lock));
+    tiling->reserved -= bytes;
+    // Every waiter checks, as several smaller ones may now fit.
+    pthread_cond_broadcast(&(tiling->released));
+    pthread_mutex_unlock(&(tiling->lock));
+}
+
+/* tile_pixel()
+ * ------------
+ * Private helper function that locates a pixel in its tile.
+ */
+static inline BYTE* tile_pixel(const TiledImage* tiled, int x, int y)
+{
+    size_t tile = (size_t)(y / tileEdge) * tiled->tilesAcross + x / tileEdge;
+    return tiled->map + tile * tiled->tileBytes
+            + ((size_t)(y % tileEdge) * tileEdge + x % tileEdge)
+            * tiled->channels;
+}
+
+/* create_tiled()
+ * --------------
+ * Private helper function that maps an empty tiled image in a new scratch
+ *      file.
+ *
+ * returns: the tiled image, with a NULL map if it could not be made.
+ */
+static TiledImage create_tiled(Tiling* tiling, int width, int height,
+        int channels)
+{
+    TiledImage tiled = {NULL, 0, width, height, channels,
+            (width + tileEdge - 1) / tileEdge, 0};
+    tiled.tileBytes = (size_t)tileEdge * tileEdge * tiled.channels;
+    int tilesDown = (height + tileEdge - 1) / tileEdge;
+    tiled.mapLength = tiled.tileBytes * tiled.tilesAcross * tilesDown;
+    int fd = create_scratch_file(tiling);
+    if (fd == -1 || ftruncate(fd, tiled.mapLength)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return tiled;
+    }
+    BYTE* map = mmap(NULL, tiled.mapLength, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    close(fd); // The mapping keeps the file.
+    if (map != MAP_FAILED) {
+        tiled.map = map;
+    }
+    return tiled;
+}
+
+/* store_row()
+ * -----------
+ * Private helper function that copies a row of pixels into its tiles.
+ */
+static void store_row(const TiledImage* tiled, int y, const BYTE* row)
+{
+    for (int x = 0; x < tiled->width; x += tileEdge) {
+        int run = tiled->width - x < tileEdge ? tiled->width - x : tileEdge;
+        memcpy(tile_pixel(tiled, x, y), row + (long)x * tiled->channels,
+                (size_t)run * tiled->channels);
+    }
+}
+
+/* tile_bitmap()
+ * -------------
+ * Private helper function that copies a canonical bitmap into tiles in a
+ *      new mapped scratch file.
+ *
+ * returns: the tiled image, with a NULL map if it could not be made.
+ */
+static TiledImage tile_bitmap(Tiling* tiling, FIBITMAP* bitmap)
+{
+    PixelBuffer pixels = pixel_buffer(bitmap);
+    TiledImage tiled = create_tiled(tiling, pixels.width, pixels.height,
+            FreeImage_GetBPP(bitmap) / 8);
+    for (int y = 0; tiled.map && y < pixels.height; y++) {
+        store_row(&tiled, y, pixels.bits + (long)y * pixels.pitch);
+    }
+    return tiled;
+}
+
+/* trim_pages()
+ * ------------
+ * Private helper function that drops a mapped scratch file's pages from
+ *      this process, so they count against the page cache, which the
+ *      kernel writes back and reclaims, rather than the transform.
+ */
+static void trim_pages(BYTE* map, size_t length)
+{
+    madvise(map, length, MADV_DONTNEED);
+}
+
+/* copy_window()
+ * -------------
+ * Private helper function that gathers a rectangle of a tiled image into
+ *      a contiguous buffer, a tile's width of each row at a time.
+ */
+static void copy_window(const TiledImage* tiled, int left, int bottom,
+        const PixelBuffer* window)
+{
+    for (int y = 0; y < window->height; y++) {
+        BYTE* out = window->bits + (long)y * window->pitch;
+        int x = left;
+        while (x < left + window->width) {
+            int tileEnd = (x / tileEdge + 1) * tileEdge;
+            int end = tileEnd < left + window->width
+                    ? tileEnd : left + window->width;
+            memcpy(out, tile_pixel(tiled, x, bottom + y),
+                    (size_t)(end - x) * tiled->channels);
+            out += (size_t)(end - x) * tiled->channels;
+            x = end;
+        }
+    }
+}
+
+/* resample_block_rows()
+ * ---------------------
+ * Private helper function that resamples one band of a BlockJob's rows.
+ */
+static void resample_block_rows(void* job, int firstRow, int endRow)
+{
+    BlockJob* block = (BlockJob*)job;
+    block->kernel(block->plan, &(block->window), &(block->output), firstRow,
+            endRow);
+}
+
+/* block_edge()
+ * ------------
+ * Private helper function that picks the side of the square output blocks
+ *      to work in, the largest power of two up to a tile whose source
+ *      window and band of output rows each fit in half the working set.
+ */
+static int block_edge(const AffinePlan* plan, int channels)
+{
+    double spanPerPixelX = fabs(plan->map.xx) + fabs(plan->map.xy);
+    double spanPerPixelY = fabs(plan->map.yx) + fabs(plan->map.yy);
+    long unsigned int budget = tiledWorkingSet / 2;
+    int edge = tileEdge;
+    while (edge > 1) {
+        double windowWidth = edge * spanPerPixelX + 2 * windowMargin + 2;
+        double windowHeight = edge * spanPerPixelY + 2 * windowMargin + 2;
+        if (windowWidth * windowHeight * channels <= budget
+                && (long unsigned int)edge * plan->width * channels
+                        <= budget) {
+            break;
+        }
+        edge /= 2;
+    }
+    return edge;
+}
+
+/* resample_block()
+ * ----------------
+ * Private helper function that resamples one output block into a band of
+ *      rows. The block's footprint in the source, with a margin, is copied
+ *      out of the tiles, and the plan shifted to match, so the layout's
+ *      resampling kernel sees exactly the pixels the whole image would give
+ *      it. Blocks wholly outside the source are black.
+ */
+static void resample_block(const TiledImage* source, const AffinePlan* plan,
+        ResampleKernel kernel, int blockX, int blockY,
+        const PixelBuffer* output, BYTE* windowBits)
+{
+    const AffineMap* map = &(plan->map);
+    double minX = INFINITY, maxX = -INFINITY;
+    double minY = INFINITY, maxY = -INFINITY;
+    for (int corner = 0; corner < 4; corner++) {
+        double x = blockX + (corner & 1 ? output->width : 0);
+        double y = blockY + (corner & 2 ? output->height : 0);
+        double sourceX = map->xx * x + map->xy * y + map->x0;
+        double sourceY = map->yx * x + map->yy * y + map->y0;
+        minX = sourceX < minX ? sourceX : minX;
+        maxX = sourceX > maxX ? sourceX : maxX;
+        minY = sourceY < minY ? sourceY : minY;
+        maxY = sourceY > maxY ? sourceY : maxY;
+    }
+    double left = floor(minX) - windowMargin;
+    double bottom = floor(minY) - windowMargin;
+    double right = ceil(maxX) + windowMargin;
+    double top = ceil(maxY) + windowMargin;
+    left = left < 0 ? 0 : left;
+    bottom = bottom < 0 ? 0 : bottom;
+    right = right > source->width ? source->width : right;
+    top = top > source->height ? source->height : top;
+    if (left >= right || bottom >= top) {
+        for (int y = 0; y < output->height; y++) {
+            memset(output->bits + (long)y * output->pitch, 0,
+                    (size_t)output->width * source->channels);
+        }
+        return;
+    }
+    PixelBuffer window = {windowBits, (int)(right - left) * source->channels,
+            (int)(right - left), (int)(top - bottom)};
+    copy_window(source, left, bottom, &window);
+
+    // Points of the block map to the window as they did to the image.
+    AffinePlan shifted = *plan;
+    shifted.map.x0 += map->xx * blockX + map->xy * blockY - left;
+    shifted.map.y0 += map->yx * blockX + map->yy * blockY - bottom;
+    BlockJob job = {&shifted, kernel, window, *output};
+    run_in_bands(output->height, resample_block_rows, &job);
+}
+
+/* resample_tiled()
+ * ----------------
+ * Private helper function that resamples a tiled image through a plan,
+ *      a band of output rows at a time from the top down, encoding each
+ *      band as it is finished, or storing it in the tiles of into if the
+ *      chain goes on past the plan.
+ *
+ * returns: UQIMAGE_OK, or UQIMAGE_CANCELLED if abandoned part way.
+ */
+static UqImageStatus resample_tiled(Tiling* tiling,
+        const TiledImage* source, const AffinePlan* plan,
+        const PixelKernels* kernels, const TiledImage* into, PngStream* png,
+        CancelToken* cancel)
+{
+    int channels = source->channels;
+    int edge = block_edge(plan, channels);
+    size_t bandBytes = (size_t)edge * plan->width * channels;
+    BYTE* bandBits = take_buffer(tiling->pools, bandBytes);
+    BYTE* windowBits = take_buffer(tiling->pools, tiledWorkingSet / 2);
+    UqImageStatus status = UQIMAGE_OK;
+    // PNG starts from the top row, the last FreeImage stores.
+    for (int top = plan->height; top > 0 && status == UQIMAGE_OK;
+            top -= edge) {
+        if (is_cancelled(cancel)) {
+            status = UQIMAGE_CANCELLED;
+            break;
+        }
+        int bottom = top - edge > 0 ? top - edge : 0;
+        for (int x = 0; x < plan->width; x += edge) {
+            PixelBuffer block = {bandBits + (size_t)x * channels,
+                    plan->width * channels,
+                    plan->width - x < edge ? plan->width - x : edge,
+                    top - bottom};
+            resample_block(source, plan, kernels->resample, x, bottom,
+                    &block, windowBits);
+        }
+        for (int y = top - bottom - 1; y >= 0; y--) {
+            BYTE* row = bandBits + (size_t)y * plan->width * channels;
+            if (into) {
+                store_row(into, bottom + y, row);
+            } else if (!png_stream_write_row(png, row)) {
+                status = UQIMAGE_UNPROCESSABLE_IMAGE;
+                break;
+            }
+        }
+        trim_pages(source->map, source->mapLength);
+        if (into) {
+            trim_pages(into->map, into->mapLength);
+        }
+    }
+    give_buffer(tiling->pools, windowBits, tiledWorkingSet / 2);
+    give_buffer(tiling->pools, bandBits, bandBytes);
+    return status;
+}
+
+/* decoded_bytes()
+ * ---------------
+ * Private helper function that reads an image's header to find the memory
+ *      its decoded bitmap will take, and that of bringing it into a
+ *      canonical layout should it need converting. Formats FreeImage cannot
+ *      load header-only are sized from the dimensions alone, at the widest
+ *      pixel, as loading them here would decode them whole.
+ *
+ * returns: the bytes, 0 if the image cannot be read, or ULONG_MAX if it
+ *      cannot be sized without decoding it.
+ */
+static long unsigned int decoded_bytes(const unsigned char* image,
+        long unsigned int length)
+{
+    FIMEMORY* memory = FreeImage_OpenMemory((BYTE*)image, length);
+    FREE_IMAGE_FORMAT format = FreeImage_GetFileTypeFromMemory(memory, 0);
+    bool headerOnly
+            = format != FIF_UNKNOWN && FreeImage_FIFSupportsNoPixels(format);
+    FIBITMAP* header = headerOnly
+            ? FreeImage_LoadFromMemory(format, memory, FIF_LOAD_NOPIXELS)
+            : NULL;
+    FreeImage_CloseMemory(memory);
+    if (format != FIF_UNKNOWN && !headerOnly) {
+        long peekedWidth;
+        long peekedHeight;
+        if (!peek_image_dimensions(
+                    image, length, &peekedWidth, &peekedHeight)) {
+            return ULONG_MAX;
+        }
+        return (long unsigned int)peekedWidth * peekedHeight
+                * (widestPixelBytes + 4);
+    }
+    if (!header) {
+        return 0;
+    }
+    long unsigned int width = FreeImage_GetWidth(header);
+    long unsigned int height = FreeImage_GetHeight(header);
+    long unsigned int bytes = FreeImage_GetPitch(header) * height;
+    int bitsPerPixel = FreeImage_GetBPP(header);
+    if (FreeImage_GetImageType(header) != FIT_BITMAP
+            || (bitsPerPixel != 24 && bitsPerPixel != 32)) {
+        bytes += width * height * 4; // Room for the widest canonical copy.
+    }
+    FreeImage_Unload(header);
+    return bytes;
+}
+
+/* decode_canonical()
+ * ------------------
+ * Private helper function that decodes an image into a canonical layout.
+ *      Images deeper than 8 bits per channel, left alone elsewhere, are
+ *      brought down to 8 as the tiles only hold canonical layouts.
+ *
+ * returns: the bitmap, or NULL if it could not be decoded.
+ */
+static FIBITMAP* decode_canonical(const unsigned char* image,
+        long unsigned int length)
+{
+    FIBITMAP* bitmap
+            = fi_load_image_from_buffer((unsigned char*)image, length);
+    if (!bitmap) {
+        return NULL;
+    }
+    bitmap = canonicalise_bitmap(bitmap);
+    if (layout_of(bitmap) == LAYOUT_NONE) {
+        FIBITMAP* converted = FreeImage_GetImageType(bitmap) == FIT_RGBA16
+                        || FreeImage_IsTransparent(bitmap)
+                ? FreeImage_ConvertTo32Bits(bitmap)
+                : FreeImage_ConvertTo24Bits(bitmap);
+        FreeImage_Unload(bitmap);
+        bitmap = converted;
+    }
+    return bitmap && layout_of(bitmap) != LAYOUT_NONE ? bitmap : NULL;
+}
+
+void process_image_tiled(Tiling* tiling, const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer, Mutex* imageOps,
+        CancelToken* cancel, UqImageResult* result, int* encodedFd)
+{
+    UqImageResult processed = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long unsigned int decodeBytes = decoded_bytes(image, length);
+    if (!decodeBytes) {
+        processed.status = UQIMAGE_UNPROCESSABLE_IMAGE;
+    } else if (decodeBytes == ULONG_MAX) { // Could never be bounded.
+        processed.status = UQIMAGE_IMAGE_TOO_LARGE;
+    } else {
+        processed.status = reserve_memory(
+                tiling, decodeBytes + tiledWorkingSet, cancel);
+    }
+    if (processed.status != UQIMAGE_OK) {
+        processed.timing.totalMs = elapsed_ms(start);
+        *result = processed;
+        return;
+    }
+
+    // Only the tiles outlive the decode, and they are mapped from disk.
+    // Crops are hoisted first, and one leading the chain is taken as a view
+    // of the decoded bitmap, so only the pixels it keeps are tiled.
+    struct timespec stageStart;
+    clock_gettime(CLOCK_MONOTONIC, &stageStart);
+    FIBITMAP* bitmap = decode_canonical(image, length);
+    TiledImage tiled = {0};
+    PixelKernels kernels;
+    CommandBuffer ordered = {false, NULL, 0};
+    int runStart = 0;
+    if (bitmap) {
+        select_kernels(bitmap, &kernels);
+        ordered = hoist_crops(cmdBuffer, FreeImage_GetWidth(bitmap),
+                FreeImage_GetHeight(bitmap));
+        FIBITMAP* cropped = NULL;
+        if (ordered.numCmds && ordered.buffer[0] == CMD_CROP) {
+            cropped = crop_view(bitmap, ordered.buffer);
+            runStart = command_length(ordered.buffer);
+            processed.failedOperation = cropped ? NULL : "crop";
+        }
+        if (!processed.failedOperation) {
+            tiled = tile_bitmap(tiling, cropped ? cropped : bitmap);
+            trim_pages(tiled.map, tiled.mapLength);
+        }
+        if (cropped) {
+            FreeImage_Unload(cropped);
+        }
+        FreeImage_Unload(bitmap);
+    }
+    release_memory(tiling, decodeBytes);
+    processed.timing.decodeMs = elapsed_ms(stageStart);
+
+    // Runs of operations are resampled whole, each ending at a crop or the
+    // end of the chain. Runs before the last are stored in tiles of their
+    // own, and the last is encoded.
+    int numOps = runStart ? 1 : 0;
+    int fd = -1;
+    PngStream* png = NULL;
+    if (processed.failedOperation) {
+        processed.status = UQIMAGE_OPERATION_FAILED;
+    } else if (!tiled.map) {
+        processed.status = UQIMAGE_UNPROCESSABLE_IMAGE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stageStart);
+    while (processed.status == UQIMAGE_OK) {
+        AffinePlan plan;
+        plan_affine(ordered, runStart, tiled.width, tiled.height, &plan);
+        runStart += plan.length;
+        numOps += plan.numOps;
+        if (runStart < ordered.numCmds && !plan.length) {
+            // Only a crop that misses can stop a run before it starts.
+            processed.status = UQIMAGE_OPERATION_FAILED;
+            processed.failedOperation = "crop";
+        } else if (runStart < ordered.numCmds) {
+            TiledImage next = create_tiled(
+                    tiling, plan.width, plan.height, tiled.channels);
+            processed.status = next.map
+                    ? resample_tiled(tiling, &tiled, &plan, &kernels, &next,
+                            NULL, cancel)
+                    : UQIMAGE_UNPROCESSABLE_IMAGE;
+            munmap(tiled.map, tiled.mapLength);
+            tiled = next;
+        } else {
+            fd = create_scratch_file(tiling);
+            png = fd == -1 ? NULL
+                    : png_stream_open(
+                            fd, plan.width, plan.height, kernels.layout);
+            processed.status = png
+                    ? resample_tiled(tiling, &tiled, &plan, &kernels, NULL,
+                            png, cancel)
+                    : UQIMAGE_UNPROCESSABLE_IMAGE;
+            break;
+        }
+    }
+    processed.timing.transformMs = elapsed_ms(stageStart);
+    free(ordered.buffer);
+    if (png && !png_stream_close(png) && processed.status == UQIMAGE_OK) {
+        processed.status = UQIMAGE_UNPROCESSABLE_IMAGE;
+    }
+    if (processed.status == UQIMAGE_OK) {
+        processed.length = lseek(fd, 0, SEEK_END);
+        *encodedFd = fd;
+        if (imageOps) {
+            modify_mutex(imageOps, numOps);
+        }
+    } else if (fd != -1) {
+        close(fd);
+    }
+    if (tiled.map) {
+        munmap(tiled.map, tiled.mapLength);
+    }
+    release_memory(tiling, tiledWorkingSet);
+    processed.timing.totalMs = elapsed_ms(start);
+    *result = processed;
+}
@@ -0,0 +1,84 @@
+#ifndef TILING_H
+#define TILING_H
+
+#include <stdbool.h>
+
+#include "argparsing.h"
+#include "ioutils.h"
+#include "uqimage.h"
+#include "bufferpool.h"
+
+/* Processes images too large to hold in memory more than once. Uploads over
+ * the in-memory limit are spooled to a scratch file and mapped. The decoded
+ * image is moved into tiles in another mapped scratch file as soon as it is
+ * decoded, and the operation chain, composed into affine maps that each end
+ * at a crop, is resampled from those tiles a block at a time. Runs before
+ * the last go into tiles of their own. Finished rows are encoded straight
+ * into a PNG scratch file, which is sent from disk. Pages of the mapped
+ * files are dropped as the work moves on, so working memory stays bounded
+ * by the block size whatever the image's size.
+ *
+ * FreeImage cannot decode a row at a time, so the decoded bitmap still
+ * exists whole in memory, once and briefly. All memory a tiled transform
+ * needs, decoded bitmap included, is reserved under a shared ceiling before
+ * it starts. Transforms wait for room, and images that could never fit are
+ * refused as too large. */
+
+typedef struct Tiling Tiling;
+
+/* create_tiling()
+ * ---------------
+ * Sets up out-of-core processing.
+ *
+ * scratchDir: where scratch files are made, each unlinked at once.
+ * uploadLimit: the largest request body accepted, in bytes. Bodies over
+ *      maxImageSize are spooled to scratch files.
+ * memoryCeiling: the bytes all tiled transforms together may use.
+ * pools: where working buffers are taken from. May be NULL.
+ *
+ * returns: the new tiling, or NULL if the scratch directory is unusable.
+ */
+Tiling* create_tiling(const char* scratchDir, long unsigned int uploadLimit,
+        long unsigned int memoryCeiling, BufferPools* pools);
+
+/* tiling_upload_limit()
+ * ---------------------
+ * tiling: the tiling, or NULL if there is none.
+ *
+ * returns: the largest request body accepted, maxImageSize if tiling is
+ *      NULL.
+ */
+long unsigned int tiling_upload_limit(Tiling* tiling);
+
+/* create_scratch_file()
+ * ---------------------
+ * Creates an empty, already unlinked file in the tiling's scratch
+ *      directory, gone once its descriptor is closed.
+ *
+ * tiling: the tiling.
+ *
+ * returns: the file's descriptor, or -1 if it could not be created.
+ */
+int create_scratch_file(Tiling* tiling);
+
+/* process_image_tiled()
+ * ---------------------
+ * Decodes an image, applies a chain of operations to it and encodes the
+ *      result as a PNG, tile by tile within the memory ceiling.
+ *
+ * tiling: the tiling.
+ * image: the encoded source image, typically spooled.
+ * length: the number of bytes in image.
+ * cmdBuffer: the parsed operations.
+ * imageOps: a shared mutex to increment for each operation. May be NULL.
+ * cancel: checked while waiting for memory and between blocks of rows.
+ *      May be NULL.
+ * result: populated with the status, length and timings. data is left
+ *      NULL, the PNG being in encodedFd.
+ * encodedFd: populated with a scratch file holding the PNG if successful.
+ */
+void process_image_tiled(Tiling* tiling, const unsigned char* image,
+        long unsigned int length, CommandBuffer cmdBuffer, Mutex* imageOps,
+        CancelToken* cancel, UqImageResult* result, int* encodedFd);
+
+#endif // TILING_H
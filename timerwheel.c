@@ -0,0 +1,200 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ioutils.h"
+#include "timerwheel.h"
+
+// Each level has 64 slots, so with 4 levels a wheel spans 2^24 ticks.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+// Timers further out than the wheel spans are clamped to its last tick.
+const long unsigned int maxTimerTicks
+        = (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+const int wheelUsPerMs = 1000;
+
+/* The wheel itself. Each slot is a circular list headed by a sentinel
+ * timer. lock guards every timer armed on the wheel. */
+struct TimerWheel {
+    Timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    long unsigned int currentTick;
+    int tickMs;
+    struct timespec start;
+    sem_t lock;
+};
+
+/* unlink_timer()
+ * --------------
+ * Private helper function that removes an armed timer from its slot.
+ */
+static void unlink_timer(Timer* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+    timer->armed = false;
+}
+
+/* place_timer()
+ * -------------
+ * Private helper function that files a timer into the slot of the lowest
+ * level whose lap covers its remaining delay. The wheel must be locked.
+ */
+static void place_timer(TimerWheel* wheel, Timer* timer)
+{
+    long unsigned int delay = timer->expiresTick - wheel->currentTick;
+    if (timer->expiresTick < wheel->currentTick) { // Overdue, fire next tick.
+        delay = 0;
+        timer->expiresTick = wheel->currentTick;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1
+            && delay >= (1UL << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    int slot = (timer->expiresTick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    Timer* head = &(wheel->slots[level][slot]);
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+    timer->armed = true;
+}
+
+/* cascade()
+ * ---------
+ * Private helper function that refiles every timer in a higher level slot,
+ * moving each down to the level that now covers its remaining delay.
+ *
+ * returns: the index of the slot that was cascaded.
+ */
+static int cascade(TimerWheel* wheel, int level)
+{
+    int slot = (wheel->currentTick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    Timer* head = &(wheel->slots[level][slot]);
+    Timer pending = {0};
+    pending.next = pending.prev = &pending;
+    // Detach the whole slot first, as refiled timers may land back in it.
+    if (head->next != head) {
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        head->next = head->prev = head;
+    }
+    while (pending.next != &pending) {
+        Timer* timer = pending.next;
+        unlink_timer(timer);
+        place_timer(wheel, timer);
+    }
+    return slot;
+}
+
+/* advance_wheel()
+ * ---------------
+ * Private helper function that moves the wheel on by one tick, cascading
+ * higher levels at the end of each lap and firing the timers now due. The
+ * wheel must be locked.
+ */
+static void advance_wheel(TimerWheel* wheel)
+{
+    wheel->currentTick++;
+    // A new lap of one level brings the next slot of the level above down.
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        long unsigned int lapMask = (1UL << (WHEEL_BITS * level)) - 1;
+        if (wheel->currentTick & lapMask) {
+            break;
+        }
+        cascade(wheel, level);
+    }
+    Timer* head = &(wheel->slots[0][wheel->currentTick & WHEEL_MASK]);
+    while (head->next != head) {
+        Timer* timer = head->next;
+        unlink_timer(timer);
+        timer->callback(timer->data);
+    }
+}
+
+/* run_wheel()
+ * -----------
+ * Private thread function that advances the wheel in step with the
+ * monotonic clock, catching up on any ticks missed while asleep.
+ *
+ * data: the TimerWheel to drive.
+ *
+ * returns: never returns.
+ */
+static void* run_wheel(void* data)
+{
+    TimerWheel* wheel = (TimerWheel*)data;
+    while (1) {
+        usleep(wheel->tickMs * wheelUsPerMs);
+        long unsigned int dueTick = elapsed_ms(wheel->start) / wheel->tickMs;
+        sem_wait(&(wheel->lock));
+        while (wheel->currentTick < dueTick) {
+            advance_wheel(wheel);
+        }
+        sem_post(&(wheel->lock));
+    }
+    return NULL;
+}
+
+TimerWheel* timer_wheel_create(int tickMs)
+{
+    TimerWheel* wheel = calloc(1, sizeof(TimerWheel));
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) {
+            Timer* head = &(wheel->slots[level][slot]);
+            head->next = head->prev = head;
+        }
+    }
+    wheel->tickMs = tickMs;
+    clock_gettime(CLOCK_MONOTONIC, &(wheel->start));
+    sem_init(&(wheel->lock), 0, 1);
+    pthread_t threadID;
+    if (pthread_create(&threadID, NULL, run_wheel, wheel)) {
+        free(wheel);
+        return NULL;
+    }
+    pthread_detach(threadID);
+    return wheel;
+}
+
+void timer_init(Timer* timer, TimerCallback callback, void* data)
+{
+    timer->next = timer->prev = NULL;
+    timer->expiresTick = 0;
+    timer->callback = callback;
+    timer->data = data;
+    timer->armed = false;
+}
+
+void timer_arm(TimerWheel* wheel, Timer* timer, long timeoutMs)
+{
+    sem_wait(&(wheel->lock));
+    if (timer->armed) {
+        unlink_timer(timer);
+    }
+    if (timeoutMs > 0) {
+        long unsigned int ticks = (timeoutMs + wheel->tickMs - 1)
+                / wheel->tickMs;
+        if (ticks > maxTimerTicks) {
+            ticks = maxTimerTicks;
+        }
+        timer->expiresTick = wheel->currentTick + ticks;
+        place_timer(wheel, timer);
+    }
+    sem_post(&(wheel->lock));
+}
+
+void timer_cancel(TimerWheel* wheel, Timer* timer)
+{
+    timer_arm(wheel, timer, 0);
+}
@@ -0,0 +1,71 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdbool.h>
+
+/* A hierarchical timer wheel. Timers are kept in per-level rings of slots,
+ * the first level one tick per slot and each higher level covering a whole
+ * lap of the level below it. Arming, cancelling and each tick are O(1) no
+ * matter how many timers are armed; timers on higher levels are cascaded
+ * down once per lap of the level below. A background thread advances the
+ * wheel and fires callbacks. */
+
+/* Called on the wheel's thread when a timer expires. The wheel's lock is
+ * held, so callbacks must be short and must not arm or cancel timers. */
+typedef void (*TimerCallback)(void* data);
+
+/* A timer, embedded by the caller so arming never allocates. Its fields are
+ * managed by the wheel. */
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer* prev;
+    long unsigned int expiresTick;
+    TimerCallback callback;
+    void* data;
+    bool armed;
+} Timer;
+
+typedef struct TimerWheel TimerWheel;
+
+/* timer_wheel_create()
+ * --------------------
+ * Creates a timer wheel and starts the thread that advances it.
+ *
+ * tickMs: the resolution of the wheel in milliseconds.
+ *
+ * returns: the new wheel, or NULL upon error.
+ */
+TimerWheel* timer_wheel_create(int tickMs);
+
+/* timer_init()
+ * ------------
+ * Prepares a timer for use. The timer starts disarmed.
+ *
+ * timer: the timer to initialise.
+ * callback: called when the timer expires.
+ * data: passed to callback.
+ */
+void timer_init(Timer* timer, TimerCallback callback, void* data);
+
+/* timer_arm()
+ * -----------
+ * Arms a timer to expire after timeoutMs, replacing any earlier expiry.
+ *      Timeouts are rounded up to whole ticks.
+ *
+ * wheel: the wheel to arm the timer on.
+ * timer: the timer to arm.
+ * timeoutMs: the delay before expiry, or 0 or less to disarm the timer.
+ */
+void timer_arm(TimerWheel* wheel, Timer* timer, long timeoutMs);
+
+/* timer_cancel()
+ * --------------
+ * Disarms a timer. Once this returns the timer's callback will not run
+ *      until it is armed again.
+ *
+ * wheel: the wheel the timer was armed on.
+ * timer: the timer to disarm.
+ */
+void timer_cancel(TimerWheel* wheel, Timer* timer);
+
+#endif // TIMERWHEEL_H
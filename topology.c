@@ -0,0 +1,211 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "topology.h"
+
+const char* const sysfsNodeDir = "/sys/devices/system/node";
+
+// Longest CPU list read from a node's cpulist file.
+#define CPULIST_SIZE 4096
+
+// The node a thread was pinned to, -1 if it has not been.
+static __thread int pinnedNode = -1;
+
+/* read_cpu_list()
+ * ---------------
+ * Private helper function that reads a kernel CPU list such as "0-3,8-11"
+ *      from a file, keeping only CPUs in allowed.
+ *
+ * returns: the number of CPUs read into cpus, which has room for
+ *      CPU_SETSIZE, or -1 if the file could not be read.
+ */
+static int read_cpu_list(const char* path, const cpu_set_t* allowed,
+        int* cpus)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char list[CPULIST_SIZE] = {0};
+    bool read = fgets(list, sizeof(list), file) != NULL;
+    fclose(file);
+    if (!read) {
+        return -1;
+    }
+    int numCpus = 0;
+    char* range = list;
+    while (*range && *range != '\n') {
+        char* end;
+        long first = strtol(range, &end, 10);
+        long last = *end == '-' ? strtol(end + 1, &end, 10) : first;
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (cpu >= 0 && CPU_ISSET(cpu, allowed)) {
+                cpus[numCpus++] = cpu;
+            }
+        }
+        if (*end != ',') {
+            break;
+        }
+        range = end + 1;
+    }
+    return numCpus;
+}
+
+/* add_node()
+ * ----------
+ * Private helper function that appends a node with a copy of its CPUs.
+ */
+static void add_node(Topology* topology, int id, const int* cpus,
+        int numCpus)
+{
+    topology->nodes = realloc(
+            topology->nodes, sizeof(NumaNode) * (topology->numNodes + 1));
+    NumaNode node = {id, numCpus, malloc(sizeof(int) * numCpus)};
+    memcpy(node.cpus, cpus, sizeof(int) * numCpus);
+    topology->nodes[topology->numNodes++] = node;
+}
+
+/* compare_nodes()
+ * ---------------
+ * Private qsort comparison function ordering nodes by id.
+ */
+static int compare_nodes(const void* a, const void* b)
+{
+    return ((const NumaNode*)a)->id - ((const NumaNode*)b)->id;
+}
+
+/* read_sysfs_nodes()
+ * ------------------
+ * Private helper function that adds a node for each node<n> directory with
+ *      allowed CPUs.
+ */
+static void read_sysfs_nodes(Topology* topology, const char* nodeDir,
+        const cpu_set_t* allowed, int* cpus)
+{
+    DIR* dir = opendir(nodeDir);
+    if (!dir) {
+        return;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+        int id;
+        char extra;
+        if (sscanf(entry->d_name, "node%d%c", &id, &extra) != 1) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s/cpulist", nodeDir, entry->d_name);
+        int numCpus = read_cpu_list(path, allowed, cpus);
+        if (numCpus > 0) { // Memory-only nodes run nothing.
+            add_node(topology, id, cpus, numCpus);
+        }
+    }
+    closedir(dir);
+    qsort(topology->nodes, topology->numNodes, sizeof(NumaNode),
+            compare_nodes);
+}
+
+/* split_into_nodes()
+ * ------------------
+ * Private helper function that adds fake nodes, dealing the allowed CPUs
+ *      out evenly in order, each node getting at least one.
+ */
+static void split_into_nodes(Topology* topology, int fakeNodes,
+        const int* allowedCpus, int numAllowed, int* cpus)
+{
+    for (int node = 0; node < fakeNodes; node++) {
+        int first = (long)numAllowed * node / fakeNodes;
+        int end = (long)numAllowed * (node + 1) / fakeNodes;
+        int numCpus = 0;
+        for (int i = first; i < end; i++) {
+            cpus[numCpus++] = allowedCpus[i];
+        }
+        if (!numCpus) {
+            cpus[numCpus++] = allowedCpus[node % numAllowed];
+        }
+        add_node(topology, node, cpus, numCpus);
+    }
+}
+
+Topology* discover_topology(const char* nodeDir, int fakeNodes)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        CPU_ZERO(&allowed);
+        CPU_SET(0, &allowed);
+    }
+    int* allowedCpus = malloc(sizeof(int) * CPU_SETSIZE);
+    int numAllowed = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            allowedCpus[numAllowed++] = cpu;
+        }
+    }
+    int* cpus = malloc(sizeof(int) * CPU_SETSIZE);
+    Topology* topology = calloc(1, sizeof(Topology));
+    if (fakeNodes > 0) {
+        split_into_nodes(topology, fakeNodes, allowedCpus, numAllowed, cpus);
+    } else {
+        read_sysfs_nodes(topology, nodeDir, &allowed, cpus);
+    }
+    if (!topology->numNodes) {
+        add_node(topology, 0, allowedCpus, numAllowed);
+    }
+    free(cpus);
+    free(allowedCpus);
+
+    for (int i = 0; i < topology->numNodes; i++) {
+        for (int j = 0; j < topology->nodes[i].numCpus; j++) {
+            int cpu = topology->nodes[i].cpus[j];
+            topology->numCpuSlots = cpu >= topology->numCpuSlots
+                    ? cpu + 1 : topology->numCpuSlots;
+        }
+    }
+    topology->nodeOfCpu = malloc(sizeof(int) * topology->numCpuSlots);
+    for (int cpu = 0; cpu < topology->numCpuSlots; cpu++) {
+        topology->nodeOfCpu[cpu] = -1;
+    }
+    // A CPU shared by fake nodes counts as the first's.
+    for (int i = topology->numNodes - 1; i >= 0; i--) {
+        for (int j = 0; j < topology->nodes[i].numCpus; j++) {
+            topology->nodeOfCpu[topology->nodes[i].cpus[j]] = i;
+        }
+    }
+    return topology;
+}
+
+bool pin_thread(Topology* topology, int node, int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (cpu >= 0) {
+        CPU_SET(cpu, &set);
+    } else {
+        for (int i = 0; i < topology->nodes[node].numCpus; i++) {
+            CPU_SET(topology->nodes[node].cpus[i], &set);
+        }
+    }
+    pinnedNode = node;
+    return !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+int current_node(Topology* topology)
+{
+    if (!topology) {
+        return 0;
+    }
+    if (pinnedNode >= 0) {
+        return pinnedNode;
+    }
+    int cpu = sched_getcpu();
+    int node = cpu >= 0 && cpu < topology->numCpuSlots
+            ? topology->nodeOfCpu[cpu] : -1;
+    return node >= 0 ? node : 0;
+}
@@ -0,0 +1,67 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <stdbool.h>
+
+/* The machine's NUMA nodes and the CPUs in each, as far as this process may
+ * use them. Threads pinned to a node's CPUs touch the memory they allocate
+ * first, so the kernel places it on that node, and pixel buffers then stay
+ * local for as long as the thread works on them. */
+
+// Where the kernel lists NUMA nodes.
+extern const char* const sysfsNodeDir;
+
+/* A NUMA node */
+typedef struct NumaNode {
+    int id; // As the kernel numbers it.
+    int numCpus;
+    int* cpus;
+} NumaNode;
+
+typedef struct Topology {
+    int numNodes;
+    NumaNode* nodes;
+    int numCpuSlots; // One past the highest CPU in any node.
+    int* nodeOfCpu; // Index into nodes for each CPU, -1 if unusable.
+} Topology;
+
+/* discover_topology()
+ * -------------------
+ * Reads which CPUs belong to which NUMA node from sysfs, keeping only the
+ *      CPUs this process is allowed to run on and the nodes left with any.
+ *      Without sysfs, every allowed CPU is taken to be one node.
+ *
+ * nodeDir: the directory holding the node<n> directories, usually
+ *      sysfsNodeDir.
+ * fakeNodes: if positive, the allowed CPUs are instead split evenly into
+ *      this many nodes, emulating a larger machine for testing. Nodes share
+ *      CPUs if there are fewer CPUs than nodes.
+ *
+ * returns: the topology, which always has at least one node.
+ */
+Topology* discover_topology(const char* nodeDir, int fakeNodes);
+
+/* pin_thread()
+ * ------------
+ * Restricts the calling thread to one CPU, or to a node's CPUs, and
+ *      records the node as the thread's own.
+ *
+ * topology: the machine's topology.
+ * node: the index of the node in topology.
+ * cpu: the CPU to pin to, or -1 for any of the node's.
+ *
+ * returns: false if the kernel refused the affinity, in which case the
+ *      thread still counts as the node's.
+ */
+bool pin_thread(Topology* topology, int node, int cpu);
+
+/* current_node()
+ * --------------
+ * topology: the machine's topology. May be NULL.
+ *
+ * returns: the index of the calling thread's node, the one it was pinned
+ *      to, or else that of the CPU it is running on. 0 if topology is NULL.
+ */
+int current_node(Topology* topology);
+
+#endif // TOPOLOGY_H
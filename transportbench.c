@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "socketutils.h"
+
+/* transportbench
+ * --------------
+ * Benchmarks the two transports a co-located client can reach the server
+ * over, loopback TCP and a unix domain socket. For each payload size, from
+ * a small request head to a large image, a client sends the payload and an
+ * echoing peer sends it back, round trip after round trip. The median and
+ * tail round trip latency and the throughput of the bytes echoed are
+ * printed for each transport. Only the sockets are timed, so no images are
+ * involved.
+ *
+ * Usage: transportbench [round trips], defaulting to 2000 per size.
+ */
+
+const char* const transportUsageMessage
+        = "Usage: transportbench [round trips]\n";
+const char* const transportListenMessage
+        = "transportbench: unable to listen\n";
+const char* const transportConnectFormat
+        = "transportbench: unable to connect to %s\n";
+const char* const transportHungUpFormat
+        = "transportbench: %s peer hung up\n";
+
+const char* const transportHeaderFormat = "%-6s %10s %10s %10s %10s\n";
+const char* const transportRowFormat = "%-6s %10lu %10.1f %10.1f %10.1f\n";
+
+const int defaultRoundTrips = 2000;
+
+// Payloads timed, in bytes: a request head, a thumbnail, a photo and a
+// large image.
+const long unsigned int payloadSizes[]
+        = {64, 4 * 1024, 64 * 1024, 1024 * 1024, 8 * 1024 * 1024};
+const int numPayloadSizes = sizeof(payloadSizes) / sizeof(payloadSizes[0]);
+
+// Most bytes sent each way for one payload size, so large payloads make
+// fewer round trips, and round trips made untimed first.
+const long unsigned int maxBytesPerSize = 512 * 1024 * 1024;
+const int warmupRoundTrips = 10;
+
+const char* const benchSocketFormat = "/tmp/transportbench.%i.sock";
+
+// Room for the unix socket path and a port number written out in decimal.
+#define BENCH_PATH_SIZE 64
+#define BENCH_PORT_SIZE 8
+
+/* The peer echoing one connection's payloads */
+typedef struct EchoPeer {
+    int listenHandle;
+    long unsigned int payloadSize;
+} EchoPeer;
+
+/* since_ms()
+ * ----------
+ * Private helper function that finds the time since start, in ms.
+ */
+static double since_ms(struct timespec start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000.0
+            + (now.tv_nsec - start.tv_nsec) / 1000000.0;
+}
+
+/* move_bytes()
+ * ------------
+ * Private helper function that reads or writes exactly length bytes,
+ *      carrying on through short transfers.
+ *
+ * returns: false if the peer hung up or the transfer failed.
+ */
+static bool move_bytes(int handle, char* buffer, long unsigned int length,
+        bool writing)
+{
+    while (length) {
+        ssize_t moved = writing ? write(handle, buffer, length)
+                                : read(handle, buffer, length);
+        if (moved <= 0) {
+            return false;
+        }
+        buffer += moved;
+        length -= moved;
+    }
+    return true;
+}
+
+/* echo_payloads()
+ * ---------------
+ * Private thread function that accepts one connection and sends back each
+ *      payload it receives until the client hangs up.
+ *
+ * data: the EchoPeer.
+ *
+ * returns: NULL.
+ */
+static void* echo_payloads(void* data)
+{
+    EchoPeer* peer = (EchoPeer*)data;
+    SocketData connection = block_for_connection(peer->listenHandle);
+    fclose(connection.get);
+    fclose(connection.post);
+    char* buffer = malloc(peer->payloadSize);
+    while (move_bytes(connection.handle, buffer, peer->payloadSize, false)
+            && move_bytes(
+                    connection.handle, buffer, peer->payloadSize, true)) {
+    }
+    free(buffer);
+    close(connection.handle);
+    return NULL;
+}
+
+/* compare_doubles()
+ * -----------------
+ * Private qsort comparison function for ascending doubles.
+ */
+static int compare_doubles(const void* a, const void* b)
+{
+    double difference = *(const double*)a - *(const double*)b;
+    return (difference > 0) - (difference < 0);
+}
+
+/* time_transport()
+ * ----------------
+ * Private helper function that echoes payloads of one size over one
+ *      transport and prints their latency and throughput.
+ *
+ * name: the transport's name, as printed.
+ * listenHandle: the listening socket the echoing peer accepts from.
+ * endpoint: the port number or socket path connected to.
+ * payloadSize: the bytes sent each way in a round trip.
+ * roundTrips: the round trips timed, at most.
+ */
+static void time_transport(const char* name, int listenHandle,
+        char* endpoint, long unsigned int payloadSize, int roundTrips)
+{
+    if ((long unsigned int)roundTrips * payloadSize > maxBytesPerSize) {
+        roundTrips = maxBytesPerSize / payloadSize;
+    }
+    EchoPeer peer = {listenHandle, payloadSize};
+    pthread_t peerID;
+    pthread_create(&peerID, NULL, echo_payloads, &peer);
+    SocketData connection = connect_to_endpoint(endpoint);
+    if (connection.handle == -1) {
+        fprintf(stderr, transportConnectFormat, endpoint);
+        exit(1);
+    }
+    fclose(connection.get);
+    fclose(connection.post);
+
+    char* payload = malloc(payloadSize);
+    memset(payload, 'x', payloadSize);
+    double* latenciesMs = malloc(sizeof(double) * roundTrips);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = -warmupRoundTrips; i < roundTrips; i++) {
+        if (!i) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        struct timespec sent;
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        if (!move_bytes(connection.handle, payload, payloadSize, true)
+                || !move_bytes(
+                        connection.handle, payload, payloadSize, false)) {
+            fprintf(stderr, transportHungUpFormat, name);
+            exit(1);
+        }
+        if (i >= 0) {
+            latenciesMs[i] = since_ms(sent);
+        }
+    }
+    double totalMs = since_ms(start);
+    close(connection.handle);
+    pthread_join(peerID, NULL);
+
+    qsort(latenciesMs, roundTrips, sizeof(double), compare_doubles);
+    double bytesEchoed = 2.0 * payloadSize * roundTrips;
+    printf(transportRowFormat, name, payloadSize,
+            latenciesMs[roundTrips / 2] * 1000.0,
+            latenciesMs[roundTrips * 99 / 100] * 1000.0,
+            bytesEchoed / (totalMs / 1000.0) / (1024 * 1024));
+    free(latenciesMs);
+    free(payload);
+}
+
+/* Entry point for the transport benchmark */
+int main(int argc, char** argv)
+{
+    int roundTrips = argc == 2 ? atoi(argv[1]) : defaultRoundTrips;
+    if (argc > 2 || roundTrips <= 0) {
+        fprintf(stderr, transportUsageMessage);
+        return 1;
+    }
+
+    // open_port() reports the port it was given on stderr, as the server's
+    // does.
+    int tcpHandle = open_port("0");
+    char socketPath[BENCH_PATH_SIZE];
+    snprintf(socketPath, sizeof(socketPath), benchSocketFormat, getpid());
+    int unixHandle = open_unix_socket(socketPath);
+    if (tcpHandle == -1 || unixHandle == -1) {
+        fprintf(stderr, transportListenMessage);
+        return 1;
+    }
+    struct sockaddr_in tcpAddress;
+    socklen_t tcpAddressLength = sizeof(tcpAddress);
+    getsockname(tcpHandle, (struct sockaddr*)&tcpAddress, &tcpAddressLength);
+    char port[BENCH_PORT_SIZE];
+    snprintf(port, sizeof(port), "%i", ntohs(tcpAddress.sin_port));
+
+    printf("up to %i round trips per size, latency in us, throughput in "
+           "MiB/s echoed\n",
+            roundTrips);
+    printf(transportHeaderFormat, "kind", "bytes", "p50", "p99", "MiB/s");
+    for (int i = 0; i < numPayloadSizes; i++) {
+        time_transport("tcp", tcpHandle, port, payloadSizes[i], roundTrips);
+        time_transport(
+                "unix", unixHandle, socketPath, payloadSizes[i], roundTrips);
+    }
+    close(tcpHandle);
+    close(unixHandle);
+    unlink(socketPath);
+    return 0;
+}
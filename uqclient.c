@@ -0,0 +1,895 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "stringutils.h"
+#include "socketutils.h"
+#include "hashutils.h"
+#include "uqclient.h"
+
+// Maximum number of socket events handled per poll.
+#define MAX_POLL_EVENTS 64
+
+// Smallest amount of free space kept in a read buffer before reading.
+static const unsigned long minReadSpace = 65536;
+
+// Number of extra endpoints a request is sent to after the first one
+// fails it. Transforms are pure, so resending a request is always safe.
+static const int extraSendAttempts = 1;
+
+// An endpoint takes a request only while its outstanding requests stay
+// within this factor of the average, so hot keys spill to the next
+// endpoint on the ring instead of overloading one server.
+static const double loadFactor = 1.25;
+
+// Bounds of the exponential backoff applied to failed or slow endpoints.
+static const long initialBackoffMs = 500;
+static const long maxBackoffMs = 30000;
+
+// Times a request is resent after a server answers 503 with Retry-After.
+static const int maxBusyRetries = 30;
+
+// Default time a connection may go without a response before its endpoint
+// is treated as slow.
+static const long defaultSlowThresholdMs = 10000;
+
+// Longest the event loop waits between checks for slow endpoints.
+static const int slowCheckIntervalMs = 100;
+
+// Conversion factors for millisecond timekeeping.
+static const long msPerSecond = 1000;
+static const long nsPerMs = 1000000;
+
+// Room for the request line and headers of a request.
+static const int requestHeaderSize = 100;
+
+/* A submitted request, linked into either the client's pending queue or a
+ * connection's in-flight queue. */
+struct UqRequest {
+    char* header;
+    unsigned long headerLen;
+    const unsigned char* image;
+    unsigned long imageLen;
+    unsigned long sent; // Bytes of header then image written so far.
+    int attempts;
+    int busyRetries;
+    struct timespec notBefore; // Held back until then by a Retry-After.
+    UqCompletionCallback callback;
+    void* userData;
+    UqClientResult result;
+    bool done;
+    bool detached; // Freed by the caller before completing.
+    uint64_t hash; // Routing key, from the image and operations.
+    UqRequest* next;
+};
+
+typedef struct UqEndpoint UqEndpoint;
+
+/* One pooled connection. Requests in [head, sendCursor) have been fully
+ * written and await responses, in order; [sendCursor, tail] are still
+ * being written. */
+typedef struct UqConnection {
+    UqEndpoint* endpoint;
+    int handle; // -1 while the pool slot is unused.
+    bool connecting;
+    bool watchingWrites;
+    UqRequest* head;
+    UqRequest* tail;
+    UqRequest* sendCursor;
+    int inFlight;
+    unsigned char* readBuffer;
+    unsigned long readLen;
+    unsigned long readCapacity;
+    struct timespec lastProgress; // Last dispatch to idle, or response.
+} UqConnection;
+
+/* One server and its pool of connections. An endpoint that fails or stalls
+ * is skipped until downUntil, with the backoff doubling each time. */
+struct UqEndpoint {
+    struct sockaddr_storage address;
+    socklen_t addressLength;
+    UqConnection* connections;
+    int assigned; // Requests on its connections awaiting responses.
+    long backoffMs; // 0 while healthy.
+    struct timespec downUntil;
+};
+
+struct UqClient {
+    UqEndpoint* endpoints;
+    int numEndpoints;
+    HashRing ring;
+    int* preference; // Scratch space for ring lookups.
+    int epollHandle;
+    int maxConnections;
+    int pipelineDepth;
+    int maxAttempts;
+    long slowThresholdMs;
+    bool dispatching;
+    UqRequest* pendingHead;
+    UqRequest* pendingTail;
+    int outstanding;
+    int completed; // Completions since the current poll began.
+};
+
+UqClient* uqclient_create_multi(const char* const* endpoints,
+        int numEndpoints, int maxConnections, int pipelineDepth)
+{
+    if (numEndpoints < 1 || maxConnections < 1 || pipelineDepth < 1) {
+        return NULL;
+    }
+    UqClient* client = calloc(1, sizeof(UqClient));
+    client->endpoints = calloc(numEndpoints, sizeof(UqEndpoint));
+    client->numEndpoints = numEndpoints;
+    for (int i = 0; i < numEndpoints; i++) {
+        UqEndpoint* endpoint = &(client->endpoints[i]);
+        char* endpointCopy = copy_string(endpoints[i]);
+        int error = resolve_endpoint(
+                endpointCopy, &endpoint->address, &endpoint->addressLength);
+        free(endpointCopy);
+        if (error) {
+            for (int j = 0; j <= i; j++) {
+                free(client->endpoints[j].connections);
+            }
+            free(client->endpoints);
+            free(client);
+            return NULL;
+        }
+        endpoint->connections = calloc(maxConnections, sizeof(UqConnection));
+        for (int j = 0; j < maxConnections; j++) {
+            endpoint->connections[j].endpoint = endpoint;
+            endpoint->connections[j].handle = -1;
+        }
+    }
+    client->ring = create_hash_ring(
+            endpoints, numEndpoints, hashRingDefaultPoints);
+    client->preference = malloc(sizeof(int) * numEndpoints);
+    client->epollHandle = epoll_create1(EPOLL_CLOEXEC);
+    client->maxConnections = maxConnections;
+    client->pipelineDepth = pipelineDepth;
+    client->maxAttempts = numEndpoints + extraSendAttempts;
+    client->slowThresholdMs = defaultSlowThresholdMs;
+    return client;
+}
+
+UqClient* uqclient_create(
+        const char* endpoint, int maxConnections, int pipelineDepth)
+{
+    return uqclient_create_multi(
+            &endpoint, 1, maxConnections, pipelineDepth);
+}
+
+void uqclient_set_slow_threshold(UqClient* client, long thresholdMs)
+{
+    client->slowThresholdMs = thresholdMs;
+}
+
+/* ms_since()
+ * ----------
+ * Private helper function that measures time passed since a time point.
+ *
+ * then: a CLOCK_MONOTONIC time point.
+ *
+ * returns: milliseconds elapsed since then, negative if then is ahead.
+ */
+static long ms_since(struct timespec then)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then.tv_sec) * msPerSecond
+            + (now.tv_nsec - then.tv_nsec) / nsPerMs;
+}
+
+/* ms_from_now()
+ * -------------
+ * Private helper function that finds the time point a number of
+ * milliseconds from now.
+ */
+static struct timespec ms_from_now(long ms)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    time.tv_sec += ms / msPerSecond;
+    time.tv_nsec += (ms % msPerSecond) * nsPerMs;
+    if (time.tv_nsec >= msPerSecond * nsPerMs) {
+        time.tv_sec++;
+        time.tv_nsec -= msPerSecond * nsPerMs;
+    }
+    return time;
+}
+
+/* endpoint_is_up()
+ * ----------------
+ * Private helper function that checks whether an endpoint's backoff, if
+ * any, has expired.
+ */
+static bool endpoint_is_up(UqEndpoint* endpoint)
+{
+    return !endpoint->backoffMs || ms_since(endpoint->downUntil) >= 0;
+}
+
+/* mark_endpoint_down()
+ * --------------------
+ * Private helper function that backs off from a failed or slow endpoint,
+ * doubling the backoff each consecutive time.
+ */
+static void mark_endpoint_down(UqEndpoint* endpoint)
+{
+    endpoint->backoffMs = endpoint->backoffMs
+            ? endpoint->backoffMs * 2
+            : initialBackoffMs;
+    if (endpoint->backoffMs > maxBackoffMs) {
+        endpoint->backoffMs = maxBackoffMs;
+    }
+    endpoint->downUntil = ms_from_now(endpoint->backoffMs);
+}
+
+/* free_request()
+ * --------------
+ * Private helper function that releases a request and its result.
+ */
+static void free_request(UqRequest* request)
+{
+    free(request->header);
+    free(request->result.body);
+    free(request);
+}
+
+/* complete_request()
+ * ------------------
+ * Private helper function that records a request's result and reports it.
+ */
+static void complete_request(UqClient* client, UqRequest* request,
+        UqClientResult result)
+{
+    request->result = result;
+    request->done = true;
+    request->next = NULL;
+    client->outstanding--;
+    client->completed++;
+    if (request->detached) {
+        free_request(request);
+    } else if (request->callback) {
+        // Last use of request, as the callback may free it.
+        request->callback(request, request->userData);
+    }
+}
+
+/* enqueue_pending()
+ * -----------------
+ * Private helper function that appends a request to the client's queue of
+ * requests not yet assigned to a connection.
+ */
+static void enqueue_pending(UqClient* client, UqRequest* request)
+{
+    request->next = NULL;
+    if (client->pendingTail) {
+        client->pendingTail->next = request;
+    } else {
+        client->pendingHead = request;
+    }
+    client->pendingTail = request;
+}
+
+/* watch_writes()
+ * --------------
+ * Private helper function that turns write readiness notifications for a
+ * connection on or off.
+ */
+static void watch_writes(
+        UqClient* client, UqConnection* connection, bool watch)
+{
+    if (connection->watchingWrites == watch) {
+        return;
+    }
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | (watch ? EPOLLOUT : 0);
+    event.data.ptr = connection;
+    epoll_ctl(client->epollHandle, EPOLL_CTL_MOD, connection->handle, &event);
+    connection->watchingWrites = watch;
+}
+
+/* open_connection()
+ * -----------------
+ * Private helper function that starts a connection in an unused pool slot.
+ *
+ * returns: 0 if successfull, otherwise -1.
+ */
+static int open_connection(UqClient* client, UqConnection* connection)
+{
+    connection->handle = connect_nonblocking(&connection->endpoint->address,
+            connection->endpoint->addressLength);
+    if (connection->handle == -1) {
+        return -1;
+    }
+    connection->connecting = true;
+    connection->watchingWrites = true;
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLOUT;
+    event.data.ptr = connection;
+    epoll_ctl(client->epollHandle, EPOLL_CTL_ADD, connection->handle, &event);
+    return 0;
+}
+
+/* fail_connection()
+ * -----------------
+ * Private helper function that closes a broken or stalled connection and
+ * backs off from its endpoint. Its requests are queued to be routed again,
+ * or failed once out of attempts. A connection with no requests on it was
+ * only closed idle by the server, which is no reason to back off.
+ */
+static void fail_connection(UqClient* client, UqConnection* connection)
+{
+    if (connection->inFlight) {
+        mark_endpoint_down(connection->endpoint);
+    }
+    connection->endpoint->assigned -= connection->inFlight;
+    close(connection->handle);
+    connection->handle = -1;
+    connection->connecting = false;
+    connection->watchingWrites = false;
+    connection->readLen = 0;
+    UqRequest* request = connection->head;
+    connection->head = NULL;
+    connection->tail = NULL;
+    connection->sendCursor = NULL;
+    connection->inFlight = 0;
+    while (request) {
+        UqRequest* next = request->next;
+        request->sent = 0;
+        request->attempts++;
+        if (request->attempts < client->maxAttempts) {
+            enqueue_pending(client, request);
+        } else {
+            UqClientResult undelivered = {0, NULL, 0};
+            complete_request(client, request, undelivered);
+        }
+        request = next;
+    }
+}
+
+/* flush_connection()
+ * ------------------
+ * Private helper function that writes as much unsent request data as the
+ * socket will take without blocking.
+ *
+ * returns: 0 if the connection is healthy, otherwise -1.
+ */
+static int flush_connection(UqClient* client, UqConnection* connection)
+{
+    while (connection->sendCursor) {
+        UqRequest* request = connection->sendCursor;
+        // Gather whatever remains of the header and image into one send.
+        struct iovec iov[2];
+        int iovCount = 0;
+        if (request->sent < request->headerLen) {
+            iov[iovCount].iov_base = request->header + request->sent;
+            iov[iovCount].iov_len = request->headerLen - request->sent;
+            iovCount++;
+        }
+        unsigned long imageSent = request->sent > request->headerLen
+                ? request->sent - request->headerLen
+                : 0;
+        iov[iovCount].iov_base = (void*)(request->image + imageSent);
+        iov[iovCount].iov_len = request->imageLen - imageSent;
+        iovCount++;
+
+        struct msghdr message = {0};
+        message.msg_iov = iov;
+        message.msg_iovlen = iovCount;
+        ssize_t sent = sendmsg(
+                connection->handle, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                watch_writes(client, connection, true);
+                return 0;
+            }
+            return -1;
+        }
+        request->sent += sent;
+        if (request->sent == request->headerLen + request->imageLen) {
+            connection->sendCursor = request->next;
+        }
+    }
+    watch_writes(client, connection, false);
+    return 0;
+}
+
+/* find_header_end()
+ * -----------------
+ * Private helper function that finds the blank line ending a response's
+ * headers, accepting either "\r\n" or "\n" line endings.
+ *
+ * returns: the offset of the first body byte, or 0 if not yet received.
+ */
+static unsigned long find_header_end(
+        const unsigned char* data, unsigned long length)
+{
+    for (unsigned long i = 0; i + 1 < length; i++) {
+        if (data[i] != '\n') {
+            continue;
+        }
+        if (data[i + 1] == '\n') {
+            return i + 2;
+        }
+        if (i + 2 < length && data[i + 1] == '\r' && data[i + 2] == '\n') {
+            return i + 3;
+        }
+    }
+    return 0;
+}
+
+/* parse_response()
+ * ----------------
+ * Private helper function that extracts one complete response from the
+ * front of a connection's read buffer.
+ *
+ * result: populated with the response status and a copy of its body.
+ * retryAfterMs: set to the delay asked for by a Retry-After header in
+ *      seconds, or -1 if there is none.
+ * consumed: set to the number of buffered bytes the response occupied.
+ *
+ * returns: 1 if a response was parsed, 0 if more data is needed, or -1 if
+ *      the data is not a valid response.
+ */
+static int parse_response(UqConnection* connection, UqClientResult* result,
+        long* retryAfterMs, unsigned long* consumed)
+{
+    unsigned long headerEnd
+            = find_header_end(connection->readBuffer, connection->readLen);
+    if (!headerEnd) {
+        return 0;
+    }
+    // Terminate the header block so it can be read as a string. The byte
+    // replaced is the final newline, already accounted for in headerEnd.
+    unsigned char saved = connection->readBuffer[headerEnd - 1];
+    connection->readBuffer[headerEnd - 1] = '\0';
+    char* headers = (char*)connection->readBuffer;
+
+    int status = 0;
+    long contentLength = -1;
+    *retryAfterMs = -1;
+    char* statusSpace = strchr(headers, ' ');
+    if (statusSpace) {
+        status = strtol(statusSpace + 1, NULL, 10);
+    }
+    for (char* line = strchr(headers, '\n'); line; line = strchr(line, '\n')) {
+        line++;
+        if (!strncasecmp(line, "Content-Length:", strlen("Content-Length:"))) {
+            contentLength = strtol(
+                    line + strlen("Content-Length:"), NULL, 10);
+        } else if (!strncasecmp(
+                           line, "Retry-After:", strlen("Retry-After:"))) {
+            *retryAfterMs = strtol(line + strlen("Retry-After:"), NULL, 10)
+                    * msPerSecond;
+        }
+    }
+    connection->readBuffer[headerEnd - 1] = saved;
+    if (status == 0 || contentLength < 0) {
+        return -1;
+    }
+    if (connection->readLen < headerEnd + contentLength) {
+        return 0;
+    }
+
+    result->status = status;
+    result->bodyLen = contentLength;
+    result->body = malloc(contentLength + 1);
+    memcpy(result->body, connection->readBuffer + headerEnd, contentLength);
+    *consumed = headerEnd + contentLength;
+    return 1;
+}
+
+/* read_connection()
+ * -----------------
+ * Private helper function that reads everything available on a connection
+ * and completes the in-flight requests whose responses have arrived.
+ * Requests the server was too busy for go back to the pending queue, held
+ * back for as long as its Retry-After asks.
+ *
+ * returns: 0 if the connection is healthy, otherwise -1.
+ */
+static int read_connection(UqClient* client, UqConnection* connection)
+{
+    bool closed = false;
+    while (!closed) {
+        if (connection->readCapacity - connection->readLen < minReadSpace) {
+            connection->readCapacity = connection->readCapacity * 2
+                    + minReadSpace;
+            connection->readBuffer = realloc(
+                    connection->readBuffer, connection->readCapacity);
+        }
+        ssize_t received = recv(connection->handle,
+                connection->readBuffer + connection->readLen,
+                connection->readCapacity - connection->readLen, MSG_DONTWAIT);
+        if (received < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        closed = received == 0;
+        connection->readLen += received;
+    }
+
+    // Responses arrive in request order, so each completes the oldest
+    // request still in flight.
+    while (connection->head && connection->head != connection->sendCursor) {
+        UqClientResult result;
+        long retryAfterMs;
+        unsigned long consumed;
+        int parsed = parse_response(
+                connection, &result, &retryAfterMs, &consumed);
+        if (parsed == -1) {
+            return -1;
+        }
+        if (parsed == 0) {
+            break;
+        }
+        memmove(connection->readBuffer, connection->readBuffer + consumed,
+                connection->readLen - consumed);
+        connection->readLen -= consumed;
+        UqRequest* request = connection->head;
+        connection->head = request->next;
+        if (!connection->head) {
+            connection->tail = NULL;
+        }
+        connection->inFlight--;
+        connection->endpoint->assigned--;
+        connection->endpoint->backoffMs = 0; // Responding, so healthy.
+        clock_gettime(CLOCK_MONOTONIC, &connection->lastProgress);
+        if (result.status == 503 && retryAfterMs >= 0
+                && request->busyRetries < maxBusyRetries) {
+            request->busyRetries++;
+            request->notBefore = ms_from_now(retryAfterMs);
+            request->sent = 0;
+            free(result.body);
+            enqueue_pending(client, request);
+            continue;
+        }
+        complete_request(client, request, result);
+    }
+    return closed ? -1 : 0;
+}
+
+/* choose_endpoint()
+ * -----------------
+ * Private helper function that routes a request by consistent hashing with
+ * bounded loads: the first endpoint clockwise from the request's hash that
+ * is up and whose outstanding requests are within loadFactor of the
+ * average. If every endpoint is down, the one due back soonest is probed.
+ *
+ * returns: the chosen endpoint.
+ */
+static UqEndpoint* choose_endpoint(UqClient* client, UqRequest* request)
+{
+    int totalAssigned = 0;
+    int numUp = 0;
+    UqEndpoint* soonestUp = &(client->endpoints[0]);
+    for (int i = 0; i < client->numEndpoints; i++) {
+        UqEndpoint* endpoint = &(client->endpoints[i]);
+        totalAssigned += endpoint->assigned;
+        numUp += endpoint_is_up(endpoint);
+        if (ms_since(endpoint->downUntil) > ms_since(soonestUp->downUntil)) {
+            soonestUp = endpoint;
+        }
+    }
+    if (!numUp) {
+        return soonestUp;
+    }
+    double capacity = (totalAssigned + 1) * loadFactor / numUp;
+    hash_ring_preference(&client->ring, request->hash, client->preference);
+    UqEndpoint* fallback = NULL;
+    for (int i = 0; i < client->numEndpoints; i++) {
+        UqEndpoint* endpoint = &(client->endpoints[client->preference[i]]);
+        if (!endpoint_is_up(endpoint)) {
+            continue;
+        }
+        if (endpoint->assigned < capacity) {
+            return endpoint;
+        }
+        fallback = fallback ? fallback : endpoint;
+    }
+    return fallback;
+}
+
+/* choose_connection()
+ * -------------------
+ * Private helper function that picks the least busy connection to an
+ * endpoint with room for another request, opening a pooled connection
+ * rather than deepening an existing pipeline where possible.
+ *
+ * unreachable: set to whether a new connection was needed but failed.
+ *
+ * returns: the connection, or NULL if the endpoint is full or cannot be
+ *      connected to.
+ */
+static UqConnection* choose_connection(
+        UqClient* client, UqEndpoint* endpoint, bool* unreachable)
+{
+    *unreachable = false;
+    UqConnection* target = NULL;
+    UqConnection* unused = NULL;
+    for (int i = 0; i < client->maxConnections; i++) {
+        UqConnection* connection = &(endpoint->connections[i]);
+        if (connection->handle == -1) {
+            unused = unused ? unused : connection;
+        } else if (connection->inFlight < client->pipelineDepth
+                && (!target || connection->inFlight < target->inFlight)) {
+            target = connection;
+        }
+    }
+    if ((!target || target->inFlight > 0) && unused) {
+        if (!open_connection(client, unused)) {
+            return unused;
+        }
+        mark_endpoint_down(endpoint);
+        *unreachable = !target;
+    }
+    return target;
+}
+
+/* assign_request()
+ * ----------------
+ * Private helper function that appends a request to a connection's
+ * in-flight queue and starts writing it.
+ */
+static void assign_request(
+        UqClient* client, UqConnection* connection, UqRequest* request)
+{
+    request->next = NULL;
+    if (connection->tail) {
+        connection->tail->next = request;
+    } else {
+        connection->head = request;
+        clock_gettime(CLOCK_MONOTONIC, &connection->lastProgress);
+    }
+    connection->tail = request;
+    if (!connection->sendCursor) {
+        connection->sendCursor = request;
+    }
+    connection->inFlight++;
+    connection->endpoint->assigned++;
+    if (!connection->connecting && flush_connection(client, connection)) {
+        fail_connection(client, connection);
+    }
+}
+
+/* dispatch_pending()
+ * ------------------
+ * Private helper function that routes pending requests to their endpoints.
+ * Requests whose endpoint is full stay pending without holding up the rest.
+ * A pass in which no endpoint could be connected to counts as a send
+ * attempt, so requests fail once every endpoint has been unreachable for
+ * long enough. Not reentrant: requests submitted from callbacks during a
+ * pass wait for the next one.
+ */
+static void dispatch_pending(UqClient* client)
+{
+    if (client->dispatching) {
+        return;
+    }
+    client->dispatching = true;
+    UqRequest* previous = NULL;
+    UqRequest* request = client->pendingHead;
+    while (request) {
+        UqRequest* next = request->next;
+        if (ms_since(request->notBefore) < 0) { // Waiting out Retry-After.
+            previous = request;
+            request = next;
+            continue;
+        }
+        UqConnection* connection = NULL;
+        bool full = false;
+        // Each failed connection attempt backs its endpoint off, so every
+        // endpoint is tried at most once.
+        for (int i = 0; i < client->numEndpoints && !connection && !full;
+                i++) {
+            bool unreachable;
+            UqEndpoint* endpoint = choose_endpoint(client, request);
+            connection = choose_connection(client, endpoint, &unreachable);
+            full = !connection && !unreachable;
+        }
+        if (!connection && !full) {
+            request->attempts++;
+        }
+        if (!connection && (full || request->attempts < client->maxAttempts)) {
+            previous = request;
+            request = next;
+            continue;
+        }
+
+        // Unlink from the pending queue.
+        if (previous) {
+            previous->next = next;
+        } else {
+            client->pendingHead = next;
+        }
+        if (client->pendingTail == request) {
+            client->pendingTail = previous;
+        }
+        if (connection) {
+            assign_request(client, connection, request);
+        } else { // No endpoint could be reached.
+            UqClientResult undelivered = {0, NULL, 0};
+            complete_request(client, request, undelivered);
+        }
+        request = next;
+    }
+    client->dispatching = false;
+}
+
+UqRequest* uqclient_submit(UqClient* client, const unsigned char* image,
+        unsigned long imageLen, const char* operations,
+        UqCompletionCallback callback, void* userData)
+{
+    UqRequest* request = calloc(1, sizeof(UqRequest));
+    request->header = malloc(requestHeaderSize + strlen(operations));
+    sprintf(request->header, "POST %s HTTP/1.1\r\nContent-Length: %lu\r\n\r\n",
+            operations, imageLen);
+    request->headerLen = strlen(request->header);
+    request->image = image;
+    request->imageLen = imageLen;
+    request->callback = callback;
+    request->userData = userData;
+    // Identical images with identical operations always route to the same
+    // endpoint, keeping that server's caches hot.
+    request->hash = hash_image_request(operations, image, imageLen);
+    client->outstanding++;
+    enqueue_pending(client, request);
+    dispatch_pending(client);
+    return request;
+}
+
+/* handle_event()
+ * --------------
+ * Private helper function that services socket readiness on a connection.
+ */
+static void handle_event(
+        UqClient* client, UqConnection* connection, uint32_t events)
+{
+    if (connection->connecting && (events & (EPOLLOUT | EPOLLERR))) {
+        int socketError = 0;
+        socklen_t errorLength = sizeof(int);
+        getsockopt(connection->handle, SOL_SOCKET, SO_ERROR, &socketError,
+                &errorLength);
+        if (socketError) {
+            fail_connection(client, connection);
+            return;
+        }
+        connection->connecting = false;
+    }
+    if (connection->connecting) {
+        return;
+    }
+    if ((events & EPOLLOUT) && flush_connection(client, connection)) {
+        fail_connection(client, connection);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            && read_connection(client, connection)) {
+        fail_connection(client, connection);
+    }
+}
+
+/* check_slow_connections()
+ * ------------------------
+ * Private helper function that abandons connections that have gone longer
+ * than the slow threshold without a response, so their requests are
+ * retried on another endpoint.
+ */
+static void check_slow_connections(UqClient* client)
+{
+    for (int i = 0; i < client->numEndpoints; i++) {
+        for (int j = 0; j < client->maxConnections; j++) {
+            UqConnection* connection
+                    = &(client->endpoints[i].connections[j]);
+            if (connection->handle != -1 && connection->inFlight
+                    && ms_since(connection->lastProgress)
+                            > client->slowThresholdMs) {
+                fail_connection(client, connection);
+            }
+        }
+    }
+}
+
+int uqclient_poll(UqClient* client, int timeoutMs)
+{
+    client->completed = 0;
+    dispatch_pending(client);
+    // Wake regularly while requests are outstanding to spot slow endpoints
+    // and retry requests waiting on endpoints that are backing off.
+    if (client->outstanding
+            && (timeoutMs < 0 || timeoutMs > slowCheckIntervalMs)) {
+        timeoutMs = slowCheckIntervalMs;
+    }
+    struct epoll_event events[MAX_POLL_EVENTS];
+    int numEvents = epoll_wait(
+            client->epollHandle, events, MAX_POLL_EVENTS, timeoutMs);
+    if (numEvents < 0 && errno != EINTR) {
+        return -1;
+    }
+    for (int i = 0; i < numEvents; i++) {
+        handle_event(client, (UqConnection*)events[i].data.ptr,
+                events[i].events);
+    }
+    check_slow_connections(client);
+    dispatch_pending(client);
+    return client->completed;
+}
+
+void uqclient_wait(UqClient* client, UqRequest* request)
+{
+    while (!request->done) {
+        if (uqclient_poll(client, -1) < 0) {
+            return;
+        }
+    }
+}
+
+int uqclient_outstanding(UqClient* client)
+{
+    return client->outstanding;
+}
+
+bool uqclient_request_done(UqRequest* request)
+{
+    return request->done;
+}
+
+const UqClientResult* uqclient_request_result(UqRequest* request)
+{
+    return request->done ? &(request->result) : NULL;
+}
+
+void uqclient_request_free(UqRequest* request)
+{
+    if (!request->done) {
+        request->detached = true;
+        return;
+    }
+    free_request(request);
+}
+
+/* free_request_list()
+ * -------------------
+ * Private helper function that frees a linked list of requests.
+ */
+static void free_request_list(UqRequest* request)
+{
+    while (request) {
+        UqRequest* next = request->next;
+        free_request(request);
+        request = next;
+    }
+}
+
+void uqclient_destroy(UqClient* client)
+{
+    for (int i = 0; i < client->numEndpoints; i++) {
+        UqEndpoint* endpoint = &(client->endpoints[i]);
+        for (int j = 0; j < client->maxConnections; j++) {
+            UqConnection* connection = &(endpoint->connections[j]);
+            if (connection->handle != -1) {
+                close(connection->handle);
+            }
+            free_request_list(connection->head);
+            free(connection->readBuffer);
+        }
+        free(endpoint->connections);
+    }
+    free_request_list(client->pendingHead);
+    close(client->epollHandle);
+    free_hash_ring(&client->ring);
+    free(client->preference);
+    free(client->endpoints);
+    free(client);
+}
@@ -0,0 +1,159 @@
+#ifndef UQCLIENT_H
+#define UQCLIENT_H
+
+#include <stdbool.h>
+
+/* libuqclient
+ * -----------
+ * Asynchronous client for uqimageproc servers. Requests are submitted
+ * without blocking and spread over a pool of keep-alive connections, with
+ * several pipelined on each. An internal epoll event loop, driven by
+ * uqclient_poll(), performs all socket I/O and reports completions through
+ * callbacks or by marking the request done so it can be polled.
+ *
+ * A client may shard over several servers. Each request is routed by
+ * consistent hashing of its image and operations, so repeats reach the same
+ * server, unless that server already holds well over its share of the
+ * outstanding requests. Servers that refuse connections, drop them or stop
+ * responding are backed off from, and their requests are resent to the
+ * next server on the ring.
+ * Requests a server is too busy for, answered 503 with a Retry-After, are
+ * resent once that time has passed.
+ *
+ * A client and its requests must only be used from one thread at a time.
+ */
+
+typedef struct UqClient UqClient;
+typedef struct UqRequest UqRequest;
+
+/* Outcome of a completed request. status is the HTTP status returned by
+ * the server, or 0 if the request could not be delivered. On HTTP 200 body
+ * holds the encoded image, otherwise the server's error message. body is
+ * owned by the request. */
+typedef struct UqClientResult {
+    int status;
+    unsigned char* body;
+    unsigned long bodyLen;
+} UqClientResult;
+
+/* Called from within uqclient_poll() when a request completes. The request
+ * may be freed from inside the callback. */
+typedef void (*UqCompletionCallback)(UqRequest* request, void* userData);
+
+/* uqclient_create()
+ * -----------------
+ * Creates a client for one server endpoint.
+ *
+ * endpoint: a port number, or a unix socket path (anything with a '/').
+ * maxConnections: the most connections the pool may open to the endpoint.
+ * pipelineDepth: the most requests in flight on one connection.
+ *
+ * returns: the new client, or NULL if the endpoint cannot be resolved.
+ */
+UqClient* uqclient_create(
+        const char* endpoint, int maxConnections, int pipelineDepth);
+
+/* uqclient_create_multi()
+ * -----------------------
+ * Creates a client that shards requests over several server endpoints.
+ *
+ * endpoints: the port numbers or unix socket paths of the servers.
+ * numEndpoints: the number of endpoints.
+ * maxConnections: the most connections the pool may open to each endpoint.
+ * pipelineDepth: the most requests in flight on one connection.
+ *
+ * returns: the new client, or NULL if any endpoint cannot be resolved.
+ */
+UqClient* uqclient_create_multi(const char* const* endpoints,
+        int numEndpoints, int maxConnections, int pipelineDepth);
+
+/* uqclient_set_slow_threshold()
+ * -----------------------------
+ * Sets how long a connection may wait for a response before its endpoint
+ *      is considered slow and its requests are retried elsewhere. Defaults
+ *      to 10 seconds.
+ *
+ * client: the client to configure.
+ * thresholdMs: the threshold in milliseconds.
+ */
+void uqclient_set_slow_threshold(UqClient* client, long thresholdMs);
+
+/* uqclient_submit()
+ * -----------------
+ * Queues a request without blocking. It is sent the next time a pooled
+ *      connection has room, from within uqclient_submit() or uqclient_poll().
+ *
+ * client: the client to submit to.
+ * image: the encoded image. Not copied, so it must stay valid until the
+ *      request completes.
+ * imageLen: the number of bytes in image.
+ * operations: a '/' deliminated operation chain, e.g. "/rotate,90".
+ * callback: called upon completion. May be NULL.
+ * userData: passed to callback.
+ *
+ * returns: a handle for the request, freed with uqclient_request_free().
+ */
+UqRequest* uqclient_submit(UqClient* client, const unsigned char* image,
+        unsigned long imageLen, const char* operations,
+        UqCompletionCallback callback, void* userData);
+
+/* uqclient_poll()
+ * ---------------
+ * Runs the event loop once: waits up to timeoutMs for socket activity,
+ *      performs any pending reads and writes and fires completion callbacks.
+ *
+ * client: the client to drive.
+ * timeoutMs: the longest to wait, 0 to not wait, or -1 to wait for
+ *      activity.
+ *
+ * returns: the number of requests completed, or -1 upon error.
+ */
+int uqclient_poll(UqClient* client, int timeoutMs);
+
+/* uqclient_wait()
+ * ---------------
+ * Drives the event loop until a request has completed.
+ *
+ * client: the client the request was submitted to.
+ * request: the request to wait for.
+ */
+void uqclient_wait(UqClient* client, UqRequest* request);
+
+/* uqclient_outstanding()
+ * ----------------------
+ * returns: the number of submitted requests that have not completed.
+ */
+int uqclient_outstanding(UqClient* client);
+
+/* uqclient_request_done()
+ * -----------------------
+ * returns: true once the request has completed.
+ */
+bool uqclient_request_done(UqRequest* request);
+
+/* uqclient_request_result()
+ * -------------------------
+ * returns: the result of a completed request, or NULL if it has not
+ *      completed yet.
+ */
+const UqClientResult* uqclient_request_result(UqRequest* request);
+
+/* uqclient_request_free()
+ * -----------------------
+ * Releases a request and its result. Requests still outstanding are
+ *      detached instead: they complete silently and are freed then.
+ *
+ * request: the request to release.
+ */
+void uqclient_request_free(UqRequest* request);
+
+/* uqclient_destroy()
+ * ------------------
+ * Closes every connection and releases the client. Outstanding requests
+ *      are freed without completing.
+ *
+ * client: the client to destroy.
+ */
+void uqclient_destroy(UqClient* client);
+
+#endif // UQCLIENT_H
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "stringutils.h"
+#include "argparsing.h"
+#include "ioutils.h"
+#include "uqimage.h"
+
+// Operation counter shared by every caller in the process, initilized on
+// first use.
+static Mutex libraryImageOps;
+static pthread_once_t libraryInitOnce = PTHREAD_ONCE_INIT;
+
+/* initilize_library()
+ * -------------------
+ * Private helper function run exactly once to set up library wide state.
+ */
+static void initilize_library(void)
+{
+    libraryImageOps.value = 0;
+    sem_init(&(libraryImageOps.lock), 0, 1);
+}
+
+UqImageStatus uqimage_process(const unsigned char* image, unsigned long length,
+        const char* operations, UqImageResult* result)
+{
+    pthread_once(&libraryInitOnce, initilize_library);
+    UqImageResult empty = {0};
+    *result = empty;
+
+    // The command parser splits its input in place, so work on a copy to
+    // leave the caller's string untouched.
+    char* address = copy_string(operations);
+    CommandBuffer cmdBuffer = create_image_processing_command_buffer(address);
+    if (cmdBuffer.parseError || cmdBuffer.numCmds == 0) {
+        result->status = UQIMAGE_INVALID_OPERATION;
+    } else {
+        process_image_buffer(
+                image, length, cmdBuffer, &libraryImageOps, NULL, result);
+    }
+    free(cmdBuffer.buffer);
+    free(address);
+    return result->status;
+}
+
+void uqimage_free_result(UqImageResult* result)
+{
+    free(result->data);
+    result->data = NULL;
+    result->length = 0;
+}
+
+const char* uqimage_status_message(UqImageStatus status)
+{
+    switch (status) {
+    case UQIMAGE_OK:
+        return "OK\n";
+    case UQIMAGE_INVALID_OPERATION:
+        return "Invalid operation requested\n";
+    case UQIMAGE_IMAGE_TOO_LARGE:
+        return "Image received is too large\n";
+    case UQIMAGE_UNPROCESSABLE_IMAGE:
+        return "Request contains invalid image\n";
+    case UQIMAGE_OPERATION_FAILED:
+        return "Operation failed\n";
+    case UQIMAGE_CANCELLED:
+        return "Request deadline exceeded\n";
+    }
+    return "Unknown status\n";
+}
+
+unsigned long uqimage_max_image_size(void)
+{
+    return maxImageSize;
+}
+
+int uqimage_operations_completed(void)
+{
+    pthread_once(&libraryInitOnce, initilize_library);
+    sem_wait(&(libraryImageOps.lock));
+    int completed = libraryImageOps.value;
+    sem_post(&(libraryImageOps.lock));
+    return completed;
+}
@@ -0,0 +1,95 @@
+#ifndef UQIMAGE_H
+#define UQIMAGE_H
+
+/* libuqimage
+ * ----------
+ * In-process access to the uqimageproc transform pipeline. Callers on the
+ * same machine as their images can decode, transform and encode without a
+ * server, sockets or HTTP. The library runs the exact pipeline the server
+ * uses, so results are byte-for-byte identical.
+ *
+ * All functions are thread-safe. Concurrent calls share no mutable state
+ * beyond the operation counter reported by uqimage_operations_completed().
+ */
+
+/* Outcome of a uqimage_process() call. Each non-OK status corresponds to an
+ * error response the server would have sent for the same input. */
+typedef enum UqImageStatus {
+    UQIMAGE_OK = 0,
+    UQIMAGE_INVALID_OPERATION, // Op string empty or malformed (HTTP 400).
+    UQIMAGE_IMAGE_TOO_LARGE, // Image larger than the size limit (HTTP 413).
+    UQIMAGE_UNPROCESSABLE_IMAGE, // Image could not be decoded (HTTP 422).
+    UQIMAGE_OPERATION_FAILED, // An operation could not be applied (HTTP 501).
+    UQIMAGE_CANCELLED // Deadline passed or client hung up (HTTP 504).
+} UqImageStatus;
+
+/* Wall clock time spent in each stage of processing, in milliseconds.
+ * Stages that were not reached are left at 0. */
+typedef struct UqImageTiming {
+    double decodeMs;
+    double transformMs;
+    double encodeMs;
+    double totalMs;
+} UqImageTiming;
+
+/* Result of processing one image. data is a heap allocated PNG owned by the
+ * caller and released with uqimage_free_result(). failedOperation names the
+ * operation that failed when status is UQIMAGE_OPERATION_FAILED. */
+typedef struct UqImageResult {
+    UqImageStatus status;
+    unsigned char* data;
+    unsigned long length;
+    const char* failedOperation;
+    UqImageTiming timing;
+} UqImageResult;
+
+/* uqimage_process()
+ * -----------------
+ * Decodes an image, applies a chain of operations to it and encodes the
+ *      result as a PNG.
+ *
+ * image: the encoded source image, in any format FreeImage can read. It is
+ *      not modified.
+ * length: the number of bytes in image.
+ * operations: a '/' deliminated operation chain in the same form as a server
+ *      request address, e.g. "/rotate,90/scale,300,200".
+ * result: populated with the encoded image, status and timings.
+ *
+ * returns: result->status.
+ */
+UqImageStatus uqimage_process(const unsigned char* image, unsigned long length,
+        const char* operations, UqImageResult* result);
+
+/* uqimage_free_result()
+ * ---------------------
+ * Releases the encoded image held by a result. Safe to call on results that
+ * hold no image, and more than once.
+ *
+ * result: the result to release.
+ */
+void uqimage_free_result(UqImageResult* result);
+
+/* uqimage_status_message()
+ * ------------------------
+ * Describes a status in the same words the server uses in its error bodies.
+ *
+ * status: the status to describe.
+ *
+ * returns: a static, newline terminated message.
+ */
+const char* uqimage_status_message(UqImageStatus status);
+
+/* uqimage_max_image_size()
+ * ------------------------
+ * returns: the largest source image, in bytes, that will be processed.
+ */
+unsigned long uqimage_max_image_size(void);
+
+/* uqimage_operations_completed()
+ * ------------------------------
+ * returns: the number of individual image operations the library has
+ *      completed in this process.
+ */
+int uqimage_operations_completed(void);
+
+#endif // UQIMAGE_H